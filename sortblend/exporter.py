@@ -85,6 +85,8 @@ def export_sort_file(scene, force_debug):
     sampler_type = scene.sampler_type_prop
     sampler_count = scene.sampler_count_prop
     ET.SubElement(root, 'Sampler', type=sampler_type, round='%s'%sampler_count)
+    if scene.filter_type_prop != 'none':
+        ET.SubElement(root, 'Filter', type=scene.filter_type_prop, radius='%f'%scene.filter_radius_prop)
     # camera node
     camera = next(cam for cam in scene.objects if cam.type == 'CAMERA' )
     if camera is None:
@@ -119,6 +121,13 @@ def export_sort_file(scene, force_debug):
     # output thread num
     thread_num = scene.thread_num_prop
     ET.SubElement( root , 'ThreadNum', name='%s'%thread_num)
+    ET.SubElement( root , 'NumaAware', name='%d'%scene.numa_aware_prop)
+    ET.SubElement( root , 'NumaBenchmark', name='%d'%scene.numa_benchmark_prop)
+    # output progressive rendering settings
+    ET.SubElement( root , 'Progressive', name='%d'%scene.progressive_prop)
+    ET.SubElement( root , 'TimeBudget', name='%f'%scene.time_budget_prop)
+    ET.SubElement( root , 'Deadline', name='%f'%scene.deadline_prop)
+    ET.SubElement( root , 'FramebufferFormat', name=scene.framebuffer_format_prop)
     # output the xml
     output_sort_file = preference.get_immediate_dir(force_debug) + 'blender_exported.xml'
     tree = ET.ElementTree(root)
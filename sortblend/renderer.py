@@ -2,7 +2,6 @@ import bpy
 import os
 import subprocess
 import math
-import struct
 import numpy
 import platform
 from . import exporter
@@ -10,10 +9,39 @@ from . import preference
 from . import common
 from extensions_framework.util import TimerThread
 
+# layout of the shared memory, it has to match src/imagesensor/blenderimage.h
+#   header | version of each tile | ring of tile descriptors | pixels of all tiles
+SM_MAGIC = 0x54524F53
+SM_VERSION = 3
+SM_HEADER_SIZE = 64
+SM_HEADER_MAGIC = 0
+SM_HEADER_VERSION = 1
+SM_HEADER_PROGRESS = 7
+SM_HEADER_FINAL = 8
+SM_HEADER_RING_CAPACITY = 9
+SM_HEADER_RING_HEAD = 10
+SM_HEADER_PIXEL_FORMAT = 11
+SM_DESC_SEQUENCE = 0
+SM_DESC_TILE = 1
+SM_DESC_VERSION = 2
+
+# storage format of the pixels, float and half pixels have an alpha channel
+SM_PIXEL_FORMATS = ['float', 'half', 'rgb9e5']
+SM_PIXEL_SIZES = {'float': 16, 'half': 8, 'rgb9e5': 4}
+
+# decode RGB9E5 pixels to rgba floats
+def decode_rgb9e5(v):
+    scale = numpy.ldexp(numpy.float32(1.0), (v >> 27).astype(numpy.int32) - 24).astype(numpy.float32)
+    rgba = numpy.empty(v.shape + (4,), dtype=numpy.float32)
+    rgba[..., 0] = (v & 511) * scale
+    rgba[..., 1] = ((v >> 9) & 511) * scale
+    rgba[..., 2] = ((v >> 18) & 511) * scale
+    rgba[..., 3] = 1.0
+    return rgba
+
 class SORT_Thread(TimerThread):
     render_engine = None
     shared_memory = None
-    float_shared_memory = None
 
     def setrenderengine(self, re):
         self.render_engine = re
@@ -22,13 +50,39 @@ class SORT_Thread(TimerThread):
         # setup shared memory
         self.shared_memory = sm
 
-        # pack image content as float
-        self.float_shared_memory = struct.pack('%sf'%(self.render_engine.image_size_in_bytes), *sm[self.render_engine.image_header_size:self.render_engine.image_size_in_bytes + self.render_engine.image_header_size] )
+        # map all parts of the shared memory without copying anything
+        re = self.render_engine
+        tile_num = re.image_header_size
+        self.header = numpy.frombuffer(sm, dtype=numpy.uint32, count=SM_HEADER_SIZE//4)
+        self.tile_versions = numpy.frombuffer(sm, dtype=numpy.uint32, count=tile_num, offset=re.image_version_offset)
+        self.ring = numpy.frombuffer(sm, dtype=numpy.uint32, count=re.image_ring_capacity*4, offset=re.image_ring_offset).reshape((re.image_ring_capacity, 4))
+        if re.image_pixel_format == 'rgb9e5':
+            self.pixels = numpy.frombuffer(sm, dtype=numpy.uint32, count=tile_num*re.image_tile_pixel_count, offset=re.image_pixel_offset).reshape((tile_num, re.image_tile_pixel_count))
+        else:
+            dtype = numpy.float16 if re.image_pixel_format == 'half' else numpy.float32
+            self.pixels = numpy.frombuffer(sm, dtype=dtype, count=tile_num*re.image_tile_pixel_count*4, offset=re.image_pixel_offset).reshape((tile_num, re.image_tile_pixel_count, 4))
+
+        # versions of the tiles that are already sent to blender
+        self.ring_tail = 0
+        self.shown_versions = numpy.zeros(tile_num, dtype=numpy.uint32)
+
+    def releasesharedmemory(self):
+        # the views have to be dropped before the shared memory is closed
+        self.header = None
+        self.tile_versions = None
+        self.ring = None
+        self.pixels = None
 
     def kick(self, render_end=False):
         self.update()
 
     def update(self, final_update=False):
+        if self.header is None or self.header[SM_HEADER_MAGIC] != SM_MAGIC or self.header[SM_HEADER_VERSION] != SM_VERSION:
+            return
+        pixel_format = self.render_engine.image_pixel_format
+        if SM_PIXEL_FORMATS[self.header[SM_HEADER_PIXEL_FORMAT]] != pixel_format:
+            return
+
         # total pixel count
         mod = self.render_engine.image_tile_size - ( self.render_engine.image_size_h % self.render_engine.image_tile_size )
         if mod is self.render_engine.image_tile_size:
@@ -38,6 +92,11 @@ class SORT_Thread(TimerThread):
         active_tiles = self.picknewtiles()
 
         for i in active_tiles:
+            # skip the tile if it is being rewritten, it will be published again
+            version = int(self.tile_versions[i])
+            if version == 0 or version & 1 or version == self.shown_versions[i]:
+                continue
+
             tile_x = i % self.render_engine.image_tile_count_x
             tile_y = int(i / self.render_engine.image_tile_count_x)
 
@@ -50,13 +109,12 @@ class SORT_Thread(TimerThread):
             # y offset
             offset_y = max( mod - tile_y_offset , 0 )
 
-            # load shared memory
-            self.shared_memory.seek( self.render_engine.image_header_size + i * self.render_engine.image_tile_size_in_bytes + offset_y * tile_size_x * 16)
-            byptes = self.shared_memory.read(self.render_engine.image_tile_size_in_bytes - offset_y * tile_size_x * 16)
-
-            # convert binary to two dimensional array
-            tile_data = numpy.fromstring(byptes, dtype=numpy.float32)
-            tile_rect = tile_data.reshape( ( ( self.render_engine.image_tile_pixel_count - offset_y * tile_size_x ) , 4 ) )
+            # view of the tile in the shared memory, blender copies it in end_result, compact formats are converted first
+            tile_rect = self.pixels[i, offset_y * tile_size_x : tile_size_y * tile_size_x]
+            if pixel_format == 'half':
+                tile_rect = tile_rect.astype(numpy.float32)
+            elif pixel_format == 'rgb9e5':
+                tile_rect = decode_rgb9e5(tile_rect)
 
             # begin result
             result = self.render_engine.begin_result(tile_x_offset, max(tile_y_offset - mod,0), tile_size_x, tile_size_y - offset_y)
@@ -67,20 +125,33 @@ class SORT_Thread(TimerThread):
             # refresh the update
             self.render_engine.end_result(result)
 
-            # update header info to make sure it is not processed again
-            self.shared_memory[i] = self.shared_memory[i] + 1
-
-        # close the shared memory if it is the last update
-        #if final_update:
-        #    self.shared_memory.close()
+            # the tile is only marked as shown if it was not touched during the copy
+            if self.tile_versions[i] == version:
+                self.shown_versions[i] = version
 
     def picknewtiles(self):
-        active_tiles = []
-        for i in range( self.render_engine.image_header_size ):
-            if self.shared_memory[i] is 1:
-                active_tiles.append(i)
+        capacity = self.ring.shape[0]
+        head = int(self.header[SM_HEADER_RING_HEAD])
+        tail = self.ring_tail
 
-        return active_tiles
+        # follow the descriptors published since the last update
+        active_tiles = []
+        lost = head - tail > capacity
+        if not lost:
+            for seq in range(tail, head):
+                desc = self.ring[seq % capacity]
+                if desc[SM_DESC_SEQUENCE] != seq + 1:
+                    lost = True
+                    break
+                active_tiles.append(int(desc[SM_DESC_TILE]))
+
+        # the ring wrapped around, fall back to the versions of all tiles
+        # a tile rewritten during its copy gets another descriptor once it is published again
+        if lost:
+            active_tiles = numpy.nonzero(self.tile_versions != self.shown_versions)[0].tolist()
+
+        self.ring_tail = head
+        return sorted(set(active_tiles))
 
 class SORT_RENDERER(bpy.types.RenderEngine):
     # These three members are used by blender to set up the
@@ -94,7 +165,7 @@ class SORT_RENDERER(bpy.types.RenderEngine):
         import mmap
 
         # setup shared memory size
-        self.sm_size = self.image_size_in_bytes * 2 + self.image_header_size + 2
+        self.sm_size = self.image_pixel_offset + self.image_size_in_bytes
  
         # on mac os
         if platform.system() == "Darwin" or platform.system() == "Linux":
@@ -112,7 +183,7 @@ class SORT_RENDERER(bpy.types.RenderEngine):
             self.sharedmemory = mmap.mmap(0, self.sm_size , "SORTBLEND_SHAREMEM")
 
         self.sort_thread.setsharedmemory(self.sharedmemory)
-        self.sort_thread.set_kick_period(1)
+        self.sort_thread.set_kick_period(0.25)
         self.sort_thread.start()
     
     def __init__(self):
@@ -131,8 +202,13 @@ class SORT_RENDERER(bpy.types.RenderEngine):
         self.image_tile_count_y = math.ceil( self.image_size_h / self.image_tile_size )
         self.image_header_size = self.image_tile_count_x * self.image_tile_count_y
         self.image_tile_pixel_count = self.image_tile_size * self.image_tile_size
-        self.image_tile_size_in_bytes = self.image_tile_pixel_count * 16
+        self.image_pixel_format = bpy.data.scenes[0].framebuffer_format_prop
+        self.image_tile_size_in_bytes = self.image_tile_pixel_count * SM_PIXEL_SIZES[self.image_pixel_format]
         self.image_size_in_bytes = self.image_tile_count_x * self.image_tile_count_y * self.image_tile_size_in_bytes
+        self.image_ring_capacity = 2 * self.image_header_size
+        self.image_version_offset = SM_HEADER_SIZE
+        self.image_ring_offset = self.image_version_offset + ( ( self.image_header_size * 4 + 15 ) & ~15 )
+        self.image_pixel_offset = self.image_ring_offset + self.image_ring_capacity * 16
 
     def __del__(self):
         print('delete')
@@ -190,7 +266,7 @@ class SORT_RENDERER(bpy.types.RenderEngine):
         while subprocess.Popen.poll(process) is None:
             if self.test_break():
                 break
-            progress = self.sharedmemory[self.image_size_in_bytes * 2 + self.image_header_size]
+            progress = self.sort_thread.header[SM_HEADER_PROGRESS]
             self.update_progress(progress/100)
 
         # terminate the process by force
@@ -201,27 +277,12 @@ class SORT_RENDERER(bpy.types.RenderEngine):
         if self.sort_thread.isAlive():
             self.sort_thread.stop()
             self.sort_thread.join()
-            self.sort_thread.update(True)
-
-            # if final update is necessary
-            final_update = self.sharedmemory[self.image_size_in_bytes * 2 + self.image_header_size + 1]
-            if final_update:
-                # begin result
-                result = self.begin_result(0, 0, bpy.data.scenes[0].render.resolution_x, bpy.data.scenes[0].render.resolution_y)
 
-                self.sharedmemory.seek( self.image_header_size + self.image_size_in_bytes)
-                byptes = self.sharedmemory.read(self.image_pixel_count * 16)
-
-                tile_data = numpy.fromstring(byptes, dtype=numpy.float32)
-                tile_rect = tile_data.reshape( self.image_pixel_count , 4 )
-
-                # update image memory
-                result.layers[0].passes[0].rect = tile_rect
-
-                # refresh the update
-                self.end_result(result)
+            # the final image is published in the same tiles, there is nothing else to copy
+            self.sort_thread.update(True)
 
             # close shared memory connection
+            self.sort_thread.releasesharedmemory()
             self.sharedmemory.close()
 
 def register():
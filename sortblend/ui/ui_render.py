@@ -35,6 +35,11 @@ class IntegratorPanel(SORTRenderPanel,bpy.types.Panel):
         ("uniform_grid", "Uniform Grid", "", 3),
         ("octree" , "OcTree" , "" , 4),
         ("bruteforce", "No Accelerator", "", 5),
+        ("bvh4", "4-wide BVH (SSE)", "", 6),
+        ("bvh8", "8-wide BVH (AVX2)", "", 7),
+        ("sbvh", "Spatial Split BVH", "", 8),
+        ("lbvh", "Linear BVH (Preview)", "", 9),
+        ("lbvh_treelet", "Linear BVH with Treelets", "", 10),
         ]
     bpy.types.Scene.accelerator_type_prop = bpy.props.EnumProperty(items=accelerator_types, name='Accelerator')
 
@@ -72,9 +77,14 @@ class MultiThreadPanel(SORTRenderPanel, bpy.types.Panel):
     bl_label = common.thread_panel_bl_name
 
     bpy.types.Scene.thread_num_prop = bpy.props.IntProperty(name='Thread Num', default=8, min=1, max=16)
+    bpy.types.Scene.numa_aware_prop = bpy.props.BoolProperty(name='NUMA Aware', default=False)
+    bpy.types.Scene.numa_benchmark_prop = bpy.props.BoolProperty(name='NUMA Bandwidth Benchmark', default=False)
 
     def draw(self, context):
         self.layout.prop(context.scene,"thread_num_prop")
+        self.layout.prop(context.scene,"numa_aware_prop")
+        if context.scene.numa_aware_prop:
+            self.layout.prop(context.scene,"numa_benchmark_prop")
 
 class SamplerPanel(SORTRenderPanel, bpy.types.Panel):
     bl_label = common.sampler_panel_bl_name
@@ -90,9 +100,41 @@ class SamplerPanel(SORTRenderPanel, bpy.types.Panel):
     # sampler count
     bpy.types.Scene.sampler_count_prop = bpy.props.IntProperty(name='Count',default=1, min=1)
 
+    # progressive rendering
+    bpy.types.Scene.progressive_prop = bpy.props.BoolProperty(name='Progressive', default=False)
+    bpy.types.Scene.time_budget_prop = bpy.props.FloatProperty(name='Time Budget (s)', default=0.0, min=0.0)
+    bpy.types.Scene.deadline_prop = bpy.props.FloatProperty(name='Deadline (s)', default=0.0, min=0.0)
+
+    # storage format of the frame buffer
+    framebuffer_formats = [
+        ("float", "Float", "", 1),
+        ("half", "Half Float", "", 2),
+        ("rgb9e5", "RGB9E5", "", 3),
+        ]
+    bpy.types.Scene.framebuffer_format_prop = bpy.props.EnumProperty(items=framebuffer_formats, name='Framebuffer', default='float')
+
+    # pixel filter
+    filter_types = [
+        ("none", "None", "", 5),
+        ("box", "Box", "", 4),
+        ("gaussian", "Gaussian", "", 3),
+        ("mitchell", "Mitchell", "", 2),
+        ("blackmanharris", "Blackman-Harris", "", 1),
+        ]
+    bpy.types.Scene.filter_type_prop = bpy.props.EnumProperty(items=filter_types, name='Filter')
+    bpy.types.Scene.filter_radius_prop = bpy.props.FloatProperty(name='Filter Radius', default=1.5, min=0.5, max=4.0)
+
     def draw(self, context):
         self.layout.prop(context.scene,"sampler_type_prop")
         self.layout.prop(context.scene,"sampler_count_prop")
+        self.layout.prop(context.scene,"filter_type_prop")
+        if context.scene.filter_type_prop != 'none':
+            self.layout.prop(context.scene,"filter_radius_prop")
+        self.layout.prop(context.scene,"progressive_prop")
+        if context.scene.progressive_prop:
+            self.layout.prop(context.scene,"time_budget_prop")
+        self.layout.prop(context.scene,"deadline_prop")
+        self.layout.prop(context.scene,"framebuffer_format_prop")
 
 # export debug scene
 class SORT_export_debug_scene(bpy.types.Operator):
@@ -17,6 +17,8 @@
 
 #include "accelerator.h"
 #include "geometry/primitive.h"
+#include "utility/multithread/threadpool.h"
+#include <mutex>
 
 // Generate the bounding box for the primitive set.
 void Accelerator::computeBBox()
@@ -24,9 +26,16 @@ void Accelerator::computeBBox()
 	// reset bounding box
 	m_bbox.InvalidBBox();
 
-	// update bounding box again
-    for( auto tri : *m_primitives )
-		m_bbox.Union( tri->GetBBox() );
+	// update bounding box again, bounding boxes of primitives are cached in parallel
+	std::mutex mutex;
+	ThreadPool::GetSingleton().ParallelFor( 0 , (unsigned)m_primitives->size() , 1024 , [&]( unsigned b , unsigned e ){
+		BBox bbox;
+		for( unsigned i = b ; i < e ; ++i )
+			bbox.Union( (*m_primitives)[i]->GetBBox() );
+
+		std::lock_guard<std::mutex> lock(mutex);
+		m_bbox.Union( bbox );
+	});
 
 	// enlarge the bounding box a little
 	static const float threshold = 0.001f;
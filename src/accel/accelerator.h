@@ -21,10 +21,13 @@
 #include <vector>
 #include "geometry/bbox.h"
 #include "utility/creator.h"
+#include "utility/memstats.h"
 
 class Primitive;
 class Intersection;
 class Ray;
+class CacheReader;
+class CacheWriter;
 
 //! @brief Spatial acceleration structure interface.
 /**
@@ -65,6 +68,18 @@ public:
 	//! @brief Output log information.
 	virtual void OutputLog() const = 0;
 
+	//! @brief Whether the built structure could be kept in the scene cache.
+	virtual bool SupportCache() const { return false; }
+
+	//! @brief Write the built structure to an entry of the scene cache.
+	//! @param writer   Writer of the cache entry.
+	virtual void SaveCache( CacheWriter& writer ) const {}
+
+	//! @brief Restore the structure from an entry of the scene cache instead of building it.
+	//! @param reader   Reader of the cache entry.
+	//! @return         False if the entry doesn't match the primitives, the structure is empty then.
+	virtual bool LoadCache( CacheReader& reader ) { return false; }
+
 	//! @brief Get the bounding box of the primitive set.
     //! @return Bounding box of the spatial acceleration structure.
 	const BBox& GetBBox() const { return m_bbox; }
@@ -78,6 +93,7 @@ public:
 protected:
 	vector<Primitive*>* m_primitives;   /**< The vector holding all pritmitive pointers. */
 	BBox                m_bbox;         /**< The bounding box of all pritmives. */
+	MemAccount          m_memory{ MEM_ACCELERATOR };   /**< Memory of nodes and primitive lists in memory statistics. */
 
 	//! Generate the bounding box for the primitive set.
 	void computeBBox();
@@ -21,12 +21,46 @@
 #include "managers/logmanager.h"
 #include "managers/memmanager.h"
 #include "geometry/intersection.h"
+#include "utility/multithread/threadpool.h"
+#include "utility/scenecache.h"
+#include "utility/sassert.h"
+#include <unordered_map>
+#include <cstdint>
+#include <climits>
 
 static const unsigned   BVH_LEAF_PRILIST_MEMID  = 1027;
+static const unsigned   BVH_SCRATCH_MEMID       = 1028;
 static const unsigned   BVH_SPLIT_COUNT         = 16;
 static const float      BVH_INV_SPLIT_COUNT     = 0.0625f;
+// maximum depth of the BVH, it is also the size of the traversal stack
+static const unsigned   BVH_MAX_DEPTH           = 64;
+// maximum number of primitives in a leaf node, it has to fit in the node
+static const unsigned   BVH_MAX_PRI_IN_LEAF     = 0xffff;
+// nodes are aligned to cache lines
+static const size_t     BVH_NODE_ALIGNMENT      = 64;
+// version of the BVH entries in the scene cache, it has to be bumped whenever the layout of the nodes changes
+static const unsigned   BVH_CACHE_VERSION       = 3;
+// nodes with more primitives are bounded, binned and partitioned in chunks of this size in parallel
+static const unsigned   BVH_PARALLEL_CHUNK      = 16384;
+// both children of a node need at least this many primitives to build them in different tasks
+static const unsigned   BVH_TASK_THRESHOLD      = 4096;
+// references duplicated by spatial splits are no more than this ratio of the primitives
+static const float      BVH_SPATIAL_SPLIT_BUDGET    = 1.0f;
+// spatial splits are only tried if the children of the object split overlap more than this ratio of the root surface area
+static const float      BVH_SPATIAL_SPLIT_ALPHA     = 1e-5f;
+
+static_assert( sizeof( Bvh::Bvh_LinearNode ) == 32 , "BVH node doesn't fit in half of a cache line." );
+
+// maximum number of primitives in a node at a specific depth, splitting it in halves still makes
+// all of its leaves fit in BVH_MAX_PRI_IN_LEAF before the maximum depth is reached
+static inline unsigned long long _maxPriAtDepth( unsigned depth )
+{
+	const unsigned levels = BVH_MAX_DEPTH - 1 - depth;
+	return ( levels >= 32 ) ? ULLONG_MAX : ( (unsigned long long)BVH_MAX_PRI_IN_LEAF << levels );
+}
 
 IMPLEMENT_CREATOR( Bvh );
+IMPLEMENT_CREATOR( Sbvh );
 
 // destructor
 Bvh::~Bvh()
@@ -38,13 +72,24 @@ Bvh::~Bvh()
 void Bvh::OutputLog() const
 {
 	LOG_HEADER( "Accelerator" );
-	LOG<<"Accelerator Type :\tBounding Volumn Hierarchy"<<ENDL;
+	LOG<<"Accelerator Type :\tBounding Volumn Hierarchy"<<( m_spatialSplit ? " with spatial splits" : "" )<<ENDL;
+	outputStats();
+}
+
+// output statistics of the built nodes
+void Bvh::outputStats() const
+{
 	LOG<<"BVH Depth        :\t"<<m_bvhDepth<<ENDL;
 	LOG<<"Total Node Count :\t"<<m_totalNode<<ENDL;
 	LOG<<"Inner Node Count :\t"<<m_totalNode - m_leafNode<<ENDL;
 	LOG<<"Leaf Node Count  :\t"<<m_leafNode<<ENDL;
-	LOG<<"Triangles per leaf:\t"<<(((float)m_primitives->size())/m_leafNode)<<ENDL;
-	LOG<<"Max triangles in leaf:\t"<<m_maxLeafTriNum<<ENDL<<ENDL;
+	LOG<<"Triangles per leaf:\t"<<(((float)m_leafPrimitives.size())/m_leafNode)<<ENDL;
+	if( m_spatialSplit ){
+		LOG<<"Spatial splits   :\t"<<m_spatialSplitNum<<ENDL;
+		LOG<<"Duplicated refs  :\t"<<(unsigned)( m_leafPrimitives.size() - m_primitives->size() )<<ENDL;
+	}
+	LOG<<"Max triangles in leaf:\t"<<m_maxLeafTriNum<<ENDL;
+	LOG<<"SAH cost         :\t"<<m_sahCost<<ENDL<<ENDL;
 }
 
 // malloc the memory
@@ -52,96 +97,285 @@ void Bvh::mallocMemory()
 {
 	SORT_PREMALLOC( sizeof( Bvh_Primitive ) * m_primitives->size() , BVH_LEAF_PRILIST_MEMID );
 	m_bvhpri = SORT_MEMORY_ID( Bvh_Primitive , BVH_LEAF_PRILIST_MEMID );
+
+	// only nodes split in chunks need the scratch buffer
+	if( m_primitives->size() >= 2 * BVH_PARALLEL_CHUNK ){
+		SORT_PREMALLOC( sizeof( Bvh_Primitive ) * m_primitives->size() , BVH_SCRATCH_MEMID );
+		m_bvhpriScratch = SORT_MEMORY_ID( Bvh_Primitive , BVH_SCRATCH_MEMID );
+	}
 }
 
 // dealloc memory
 void Bvh::deallocMemory()
 {
-	SORT_DEALLOC( BVH_LEAF_PRILIST_MEMID );
-    deleteNode( m_root );
+	// primitives used during construction are released once the BVH is built
+	if( m_bvhpri ){
+		SORT_DEALLOC( BVH_LEAF_PRILIST_MEMID );
+		m_bvhpri = nullptr;
+	}
+	if( m_bvhpriScratch ){
+		SORT_DEALLOC( BVH_SCRATCH_MEMID );
+		m_bvhpriScratch = nullptr;
+	}
+	m_buildNodes.clear();
+	m_nodeMemory.reset();
+	m_nodes = nullptr;
+	m_leafPrimitives.clear();
 }
 
 // build the acceleration structure
 void Bvh::Build()
 {
-	// malloc memory
-	mallocMemory();
-
 	// build bounding box
 	computeBBox();
 
+	if( m_spatialSplit ){
+		// references are kept in the nodes, they are distributed to the children while splitting
+		std::vector<Bvh_Reference> refs( m_primitives->size() );
+		for( unsigned i = 0 ; i < (unsigned)refs.size() ; ++i ){
+			refs[i].primitive = (*m_primitives)[i];
+			refs[i].bbox = refs[i].primitive->GetBBox();
+		}
+		const unsigned budget = (unsigned)( refs.size() * BVH_SPATIAL_SPLIT_BUDGET );
+		m_minOverlapArea = m_bbox.HalfSurfaceArea() * BVH_SPATIAL_SPLIT_ALPHA;
+
+		Bvh_BuildStats stats;
+		m_buildNodes.reserve( 2 * ( refs.size() + budget ) / m_maxPriInLeaf + 1 );
+		m_leafPrimitives.reserve( refs.size() + budget );
+		splitSpatialNode( m_buildNodes , m_leafPrimitives , stats , refs , budget , 0 );
+		m_leafNode = stats.leafNode;
+		m_bvhDepth = stats.depth;
+		m_maxLeafTriNum = stats.maxLeafTriNum;
+		m_spatialSplitNum = stats.spatialSplitNum;
+
+		finalizeNodes();
+		return;
+	}
+
+	// malloc memory
+	mallocMemory();
+
 	// generate bvh primitives
-    for( auto primitive : *m_primitives )
-        SORT_MALLOC_ID(Bvh_Primitive,BVH_LEAF_PRILIST_MEMID)(primitive);
+    ThreadPool::GetSingleton().ParallelFor( 0 , (unsigned)m_primitives->size() , 1024 , [this]( unsigned b , unsigned e ){
+        for( unsigned i = b ; i < e ; ++i )
+            new (&m_bvhpri[i]) Bvh_Primitive( (*m_primitives)[i] );
+    });
     
 	// recursively split node
-    m_root = new Bvh_Node();
-	splitNode( m_root , 0 , m_primitives->size() , 0 );
+	Bvh_BuildStats stats;
+	m_buildNodes.reserve( 2 * m_primitives->size() / m_maxPriInLeaf + 1 );
+	splitNode( m_buildNodes , stats , 0 , m_primitives->size() , 0 );
+	m_leafNode = stats.leafNode;
+	m_bvhDepth = stats.depth;
+	m_maxLeafTriNum = stats.maxLeafTriNum;
+
+	// leaves only need the primitives, not the centroids
+	m_leafPrimitives.resize( m_primitives->size() );
+	for( unsigned i = 0 ; i < (unsigned)m_leafPrimitives.size() ; ++i )
+		m_leafPrimitives[i] = m_bvhpri[i].primitive;
+	SORT_DEALLOC( BVH_LEAF_PRILIST_MEMID );
+	m_bvhpri = nullptr;
+	if( m_bvhpriScratch ){
+		SORT_DEALLOC( BVH_SCRATCH_MEMID );
+		m_bvhpriScratch = nullptr;
+	}
+
+	finalizeNodes();
 }
 
 // recursively split BVH node
-void Bvh::splitNode( Bvh_Node* node , unsigned _start , unsigned _end , unsigned depth )
+void Bvh::splitNode( std::vector<Bvh_LinearNode>& nodes , Bvh_BuildStats& stats , unsigned _start , unsigned _end , unsigned depth )
 {
-	m_totalNode ++;
-	m_bvhDepth = max( depth , m_bvhDepth );
+	const unsigned node = (unsigned)nodes.size();
+	nodes.push_back( Bvh_LinearNode() );
+	stats.depth = max( depth , stats.depth );
 
 	// generate the bounding box for the node
-	for( unsigned i = _start ; i < _end ; i++ )
-		node->bbox.Union( m_bvhpri[i].GetBBox() );
+	BBox bbox , centroid;
+	computeBounds( bbox , centroid , _start , _end );
+	nodes[node].bbox = bbox;
 
 	unsigned tri_num = _end - _start;
-	if( tri_num <= m_maxPriInLeaf ){
-		makeLeaf( node , _start , _end );
+	if( tri_num <= m_maxPriInLeaf || depth + 1 >= BVH_MAX_DEPTH ){
+		makeLeaf( nodes , stats , node , _start , _end );
 		return;
 	}
 
 	// pick best split plane
 	unsigned split_axis;
 	float split_pos;
-	float sah = pickBestSplit( split_axis , split_pos , node , _start , _end );
+	float sah = pickBestSplit( split_axis , split_pos , bbox , centroid , _start , _end );
+	unsigned mid;
 	if( sah >= tri_num ){
-		makeLeaf( node , _start , _end );
+		if( tri_num <= BVH_MAX_PRI_IN_LEAF ){
+			makeLeaf( nodes , stats , node , _start , _end );
+			return;
+		}
+		// the leaf would be too large, the primitives are simply split in halves
+		mid = ( _start + _end ) / 2;
+	}else{
+		// partition the data
+		mid = partitionPrimitives( split_axis , split_pos , _start , _end );
+
+		// a child too large to reach leaves small enough before the maximum depth is not allowed
+		if( max( mid - _start , _end - mid ) > _maxPriAtDepth( depth + 1 ) )
+			mid = ( _start + _end ) / 2;
+	}
+
+	// the first child follows its parent immediately
+	nodes[node].axis = split_axis;
+	if( min( mid - _start , _end - mid ) < BVH_TASK_THRESHOLD ){
+		splitNode( nodes , stats , _start , mid , depth + 1 );
+		nodes[node].offset = (unsigned)nodes.size();
+		splitNode( nodes , stats , mid , _end , depth + 1 );
 		return;
 	}
 
-	// partition the data
-    auto compare = [split_pos,split_axis](const Bvh::Bvh_Primitive& pri){return pri.m_centroid[split_axis] < split_pos;};
-	const Bvh_Primitive* middle = partition( &m_bvhpri[_start] , &m_bvhpri[_end-1]+1 , compare );
-	unsigned mid = middle - m_bvhpri;
+	// both children are large enough, the second one is built by another task in its own node list
+	std::vector<Bvh_LinearNode> right_nodes;
+	Bvh_BuildStats right_stats;
+	right_nodes.reserve( 2 * ( _end - mid ) / m_maxPriInLeaf + 1 );
+	JobCounter counter( 1 );
+	ThreadPool::GetSingleton().Schedule( [&]() {
+		splitNode( right_nodes , right_stats , mid , _end , depth + 1 );
+	} , &counter );
+	splitNode( nodes , stats , _start , mid , depth + 1 );
+	ThreadPool::GetSingleton().Wait( counter );
+
+	// splice the second subtree after the first one, indices of its interior nodes are relative to its own list
+	const unsigned base = (unsigned)nodes.size();
+	nodes[node].offset = base;
+	for( Bvh_LinearNode right : right_nodes ){
+		if( right.pri_num == 0 )
+			right.offset += base;
+		nodes.push_back( right );
+	}
+	mergeStats( stats , right_stats );
+}
 
-    node->left = new Bvh_Node();
-	splitNode( node->left , _start , mid , depth + 1 );
+// compute the bounding box of primitives and their centroids
+void Bvh::computeBounds( BBox& bbox , BBox& centroid , unsigned _start , unsigned _end ) const
+{
+	auto bound = [this]( BBox& bbox , BBox& centroid , unsigned b , unsigned e ){
+		for( unsigned i = b ; i < e ; i++ ){
+			bbox.Union( m_bvhpri[i].GetBBox() );
+			centroid.Union( m_bvhpri[i].m_centroid );
+		}
+	};
+
+	const unsigned chunk_num = ( _end - _start + BVH_PARALLEL_CHUNK - 1 ) / BVH_PARALLEL_CHUNK;
+	if( chunk_num < 2 ){
+		bound( bbox , centroid , _start , _end );
+		return;
+	}
 
-    node->right = new Bvh_Node();
-	splitNode( node->right , mid , _end , depth + 1 );
+	std::vector<BBox> boxes( chunk_num ) , centroids( chunk_num );
+	ThreadPool::GetSingleton().ParallelFor( 0 , chunk_num , 1 , [&]( unsigned b , unsigned e ){
+		for( unsigned c = b ; c < e ; ++c )
+			bound( boxes[c] , centroids[c] , _start + c * BVH_PARALLEL_CHUNK , min( _end , _start + ( c + 1 ) * BVH_PARALLEL_CHUNK ) );
+	});
+	for( unsigned c = 0 ; c < chunk_num ; ++c ){
+		bbox.Union( boxes[c] );
+		centroid.Union( centroids[c] );
+	}
 }
 
-// pick best split plane among all possible splits
-float Bvh::pickBestSplit( unsigned& axis , float& split_pos , Bvh_Node* node , unsigned _start , unsigned _end )
+// move primitives on the left of the split plane before the others
+unsigned Bvh::partitionPrimitives( unsigned axis , float split_pos , unsigned _start , unsigned _end )
 {
-	BBox inner;
-	for( unsigned i = _start ; i < _end ; i++ )
-		inner.Union( m_bvhpri[i].m_centroid );
+	auto is_left = [this,split_pos,axis]( unsigned i ){ return m_bvhpri[i].m_centroid[axis] < split_pos; };
+
+	const unsigned chunk_num = ( _end - _start + BVH_PARALLEL_CHUNK - 1 ) / BVH_PARALLEL_CHUNK;
+	if( chunk_num < 2 ){
+		auto compare = [split_pos,axis](const Bvh::Bvh_Primitive& pri){return pri.m_centroid[axis] < split_pos;};
+		const Bvh_Primitive* middle = partition( &m_bvhpri[_start] , &m_bvhpri[_end-1]+1 , compare );
+		return (unsigned)( middle - m_bvhpri );
+	}
+
+	// count primitives on the left in each chunk first, so that every chunk knows where to scatter its primitives
+	std::vector<unsigned> left( chunk_num + 1 , 0 );
+	ThreadPool::GetSingleton().ParallelFor( 0 , chunk_num , 1 , [&]( unsigned b , unsigned e ){
+		for( unsigned c = b ; c < e ; ++c ){
+			const unsigned chunk_end = min( _end , _start + ( c + 1 ) * BVH_PARALLEL_CHUNK );
+			for( unsigned i = _start + c * BVH_PARALLEL_CHUNK ; i < chunk_end ; ++i )
+				left[c+1] += is_left( i );
+		}
+	});
+	for( unsigned c = 0 ; c < chunk_num ; ++c )
+		left[c+1] += left[c];
+	const unsigned mid = _start + left[chunk_num];
+
+	// the order of primitives is kept, the scratch buffer is shared by all nodes since their ranges never overlap
+	ThreadPool::GetSingleton().ParallelFor( 0 , chunk_num , 1 , [&]( unsigned b , unsigned e ){
+		for( unsigned c = b ; c < e ; ++c ){
+			const unsigned chunk_start = _start + c * BVH_PARALLEL_CHUNK;
+			const unsigned chunk_end = min( _end , chunk_start + BVH_PARALLEL_CHUNK );
+			unsigned l = _start + left[c];
+			unsigned r = mid + ( chunk_start - _start ) - left[c];
+			for( unsigned i = chunk_start ; i < chunk_end ; ++i )
+				new (&m_bvhpriScratch[ is_left( i ) ? l++ : r++ ]) Bvh_Primitive( m_bvhpri[i] );
+		}
+	});
+	ThreadPool::GetSingleton().ParallelFor( _start , _end , BVH_PARALLEL_CHUNK , [this]( unsigned b , unsigned e ){
+		std::copy( m_bvhpriScratch + b , m_bvhpriScratch + e , m_bvhpri + b );
+	});
+	return mid;
+}
 
+// pick best split plane among all possible splits
+float Bvh::pickBestSplit( unsigned& axis , float& split_pos , const BBox& box , const BBox& centroid , unsigned _start , unsigned _end )
+{
 	unsigned tri_num = _end - _start;
-	axis = inner.MaxAxisId();
+
+	// the axis with the largest extent of centroids, ties are broken towards the lower axis so that
+	// a flat mesh is never split along the axis it is flat in
+	const Vector extent = centroid.m_Max - centroid.m_Min;
+	axis = ( extent.x >= extent.y && extent.x >= extent.z ) ? 0 : ( ( extent.y >= extent.z ) ? 1 : 2 );
 	float min_sah = FLT_MAX;
 
-	// distribute the triangles into bins
-	unsigned	bin[BVH_SPLIT_COUNT];
-	BBox		bbox[BVH_SPLIT_COUNT];
-	BBox		rbox[BVH_SPLIT_COUNT-1];
-	memset( bin , 0 , sizeof( unsigned ) * BVH_SPLIT_COUNT );
-	float split_start = inner.m_Min[axis];
-	float split_delta = inner.Delta(axis) * BVH_INV_SPLIT_COUNT;
+	// all centroids are at the same position, there is no way to split them
+	float split_start = centroid.m_Min[axis];
+	float split_delta = centroid.Delta(axis) * BVH_INV_SPLIT_COUNT;
+	if( !( split_delta > 0.0f ) )
+		return min_sah;
 	float inv_split_delta = 1.0f / split_delta;
-    for( unsigned i = _start ; i < _end ; i++ ){
-		int index = (int)((m_bvhpri[i].m_centroid[axis] - split_start) * inv_split_delta);
-		index = min( index , (int)(BVH_SPLIT_COUNT - 1) );
-		bin[index]++;
-		bbox[index].Union( m_bvhpri[i].GetBBox() );
+
+	// distribute the triangles into bins
+	struct Bins
+	{
+		unsigned	bin[BVH_SPLIT_COUNT] = { 0 };
+		BBox		bbox[BVH_SPLIT_COUNT];
+	};
+	auto binning = [&]( Bins& bins , unsigned b , unsigned e ){
+		for( unsigned i = b ; i < e ; i++ ){
+			int index = (int)((m_bvhpri[i].m_centroid[axis] - split_start) * inv_split_delta);
+			index = min( index , (int)(BVH_SPLIT_COUNT - 1) );
+			bins.bin[index]++;
+			bins.bbox[index].Union( m_bvhpri[i].GetBBox() );
+		}
+	};
+
+	Bins bins;
+	const unsigned chunk_num = ( tri_num + BVH_PARALLEL_CHUNK - 1 ) / BVH_PARALLEL_CHUNK;
+	if( chunk_num < 2 ){
+		binning( bins , _start , _end );
+	}else{
+		std::vector<Bins> chunk_bins( chunk_num );
+		ThreadPool::GetSingleton().ParallelFor( 0 , chunk_num , 1 , [&]( unsigned b , unsigned e ){
+			for( unsigned c = b ; c < e ; ++c )
+				binning( chunk_bins[c] , _start + c * BVH_PARALLEL_CHUNK , min( _end , _start + ( c + 1 ) * BVH_PARALLEL_CHUNK ) );
+		});
+		for( const Bins& chunk : chunk_bins ){
+			for( unsigned i = 0 ; i < BVH_SPLIT_COUNT ; ++i ){
+				bins.bin[i] += chunk.bin[i];
+				bins.bbox[i].Union( chunk.bbox[i] );
+			}
+		}
 	}
+	const unsigned* bin = bins.bin;
+	const BBox* bbox = bins.bbox;
 
+	BBox		rbox[BVH_SPLIT_COUNT-1];
 	rbox[BVH_SPLIT_COUNT-2].Union( bbox[BVH_SPLIT_COUNT-1] );
 	for( int i = BVH_SPLIT_COUNT-3; i >= 0 ; i-- )
 		rbox[i] = Union( rbox[i+1] , bbox[i+1] );
@@ -150,7 +384,7 @@ float Bvh::pickBestSplit( unsigned& axis , float& split_pos , Bvh_Node* node , u
 	BBox		lbox = bbox[0];
 	float pos = split_delta + split_start ;
 	for( unsigned i = 0 ; i < BVH_SPLIT_COUNT - 1 ; i++ ){
-		float sah_value = sah( left , tri_num - left , lbox , rbox[i] , node->bbox );
+		float sah_value = sah( left , tri_num - left , lbox , rbox[i] , box );
 		if( sah_value < min_sah ){
 			min_sah = sah_value;
 			split_pos = pos;
@@ -169,84 +403,474 @@ float Bvh::sah( unsigned left , unsigned right , const BBox& lbox , const BBox&
 	return (left * lbox.HalfSurfaceArea() + right * rbox.HalfSurfaceArea()) / box.HalfSurfaceArea();
 }
 
+// merge statistics of a subtree built by another task
+void Bvh::mergeStats( Bvh_BuildStats& stats , const Bvh_BuildStats& other )
+{
+	stats.leafNode += other.leafNode;
+	stats.depth = max( stats.depth , other.depth );
+	stats.maxLeafTriNum = max( stats.maxLeafTriNum , other.maxLeafTriNum );
+	stats.spatialSplitNum += other.spatialSplitNum;
+}
+
 // make the node as a leaf
-void Bvh::makeLeaf( Bvh_Node* node , unsigned _start , unsigned _end )
+void Bvh::makeLeaf( std::vector<Bvh_LinearNode>& nodes , Bvh_BuildStats& stats , unsigned node , unsigned _start , unsigned _end )
 {
-	node->pri_num = _end - _start;
-	node->pri_offset = _start;
+	// the number of primitives has to fit in the node, nodes are split in halves early enough to
+	// keep it so even at the maximum depth
+	Sort_Assert( _end - _start <= BVH_MAX_PRI_IN_LEAF );
+	nodes[node].pri_num = _end - _start;
+	nodes[node].offset = _start;
+
+	stats.leafNode++;
+	stats.maxLeafTriNum = max( stats.maxLeafTriNum , _end - _start );
+}
 
-	m_leafNode++;
-	m_maxLeafTriNum = max( m_maxLeafTriNum , node->pri_num );
+// recursively split BVH node considering spatial splits
+void Bvh::splitSpatialNode( std::vector<Bvh_LinearNode>& nodes , std::vector<Primitive*>& leaves , Bvh_BuildStats& stats ,
+							std::vector<Bvh_Reference>& refs , unsigned budget , unsigned depth )
+{
+	const unsigned node = (unsigned)nodes.size();
+	nodes.push_back( Bvh_LinearNode() );
+	stats.depth = max( depth , stats.depth );
+
+	BBox bbox;
+	for( const Bvh_Reference& ref : refs )
+		bbox.Union( ref.bbox );
+	nodes[node].bbox = bbox;
+
+	const unsigned tri_num = (unsigned)refs.size();
+	bool leaf = tri_num <= m_maxPriInLeaf || depth + 1 >= BVH_MAX_DEPTH;
+
+	// object split first, spatial splits are only tried if its children overlap
+	unsigned split_axis = 0;
+	float split_pos = 0.0f;
+	BBox lbox , rbox;
+	float sah = leaf ? FLT_MAX : pickObjectSplit( refs , bbox , split_axis , split_pos , lbox , rbox );
+	bool spatial = false;
+	unsigned left_num = 0 , right_num = 0;
+	if( !leaf && budget > 0 ){
+		Vector overlap = Vector( min( lbox.m_Max.x , rbox.m_Max.x ) , min( lbox.m_Max.y , rbox.m_Max.y ) , min( lbox.m_Max.z , rbox.m_Max.z ) ) -
+						 Vector( max( lbox.m_Min.x , rbox.m_Min.x ) , max( lbox.m_Min.y , rbox.m_Min.y ) , max( lbox.m_Min.z , rbox.m_Min.z ) );
+		const float overlap_area = ( overlap.x > 0.0f && overlap.y > 0.0f && overlap.z > 0.0f ) ?
+									 overlap.x * overlap.y + overlap.y * overlap.z + overlap.z * overlap.x : 0.0f;
+		if( sah == FLT_MAX || overlap_area > m_minOverlapArea ){
+			unsigned axis;
+			float pos;
+			BBox sl , sr;
+			const float spatial_sah = pickSpatialSplit( refs , bbox , axis , pos , sl , sr , left_num , right_num );
+			if( spatial_sah < sah ){
+				sah = spatial_sah;
+				split_axis = axis;
+				split_pos = pos;
+				lbox = sl;
+				rbox = sr;
+				spatial = true;
+			}
+		}
+	}
+
+	if( !leaf && sah >= tri_num )
+		leaf = tri_num <= BVH_MAX_PRI_IN_LEAF;
+	if( leaf ){
+		const unsigned start = (unsigned)leaves.size();
+		for( const Bvh_Reference& ref : refs )
+			leaves.push_back( ref.primitive );
+		makeLeaf( nodes , stats , node , start , start + tri_num );
+		std::vector<Bvh_Reference>().swap( refs );
+		return;
+	}
+
+	std::vector<Bvh_Reference> left , right;
+	if( sah >= tri_num ){
+		// the leaf would be too large, the references are simply split in halves
+		left.assign( refs.begin() , refs.begin() + tri_num / 2 );
+		right.assign( refs.begin() + tri_num / 2 , refs.end() );
+	}else if( !spatial ){
+		for( const Bvh_Reference& ref : refs ){
+			const float centroid = ( ref.bbox.m_Min[split_axis] + ref.bbox.m_Max[split_axis] ) * 0.5f;
+			( centroid < split_pos ? left : right ).push_back( ref );
+		}
+	}else{
+		++stats.spatialSplitNum;
+		std::vector<const Bvh_Reference*> straddling;
+		for( const Bvh_Reference& ref : refs ){
+			if( ref.bbox.m_Max[split_axis] <= split_pos )
+				left.push_back( ref );
+			else if( ref.bbox.m_Min[split_axis] >= split_pos )
+				right.push_back( ref );
+			else
+				straddling.push_back( &ref );
+		}
+
+		// a straddling reference is put in only one child if it is cheaper than duplicating it, or if the budget is used up
+		for( const Bvh_Reference* ref : straddling ){
+			Bvh_Reference l , r;
+			splitReference( *ref , split_axis , split_pos , l , r );
+
+			const float split_cost = lbox.HalfSurfaceArea() * left_num + rbox.HalfSurfaceArea() * right_num;
+			const BBox lunion = Union( lbox , ref->bbox );
+			const BBox runion = Union( rbox , ref->bbox );
+			const float left_cost = lunion.HalfSurfaceArea() * left_num + rbox.HalfSurfaceArea() * ( right_num ? right_num - 1 : 0 );
+			const float right_cost = lbox.HalfSurfaceArea() * ( left_num ? left_num - 1 : 0 ) + runion.HalfSurfaceArea() * right_num;
+			if( budget > 0 && split_cost < left_cost && split_cost < right_cost ){
+				left.push_back( l );
+				right.push_back( r );
+				--budget;
+			}else if( left_cost < right_cost ){
+				left.push_back( *ref );
+				lbox = lunion;
+				right_num -= ( right_num > 0 );
+			}else{
+				right.push_back( *ref );
+				rbox = runion;
+				left_num -= ( left_num > 0 );
+			}
+		}
+	}
+
+	// a child too large to reach leaves small enough before the maximum depth is not allowed, the
+	// references duplicated by the split go back to the budget
+	if( max( left.size() , right.size() ) > _maxPriAtDepth( depth + 1 ) ){
+		budget += (unsigned)( left.size() + right.size() - tri_num );
+		left.assign( refs.begin() , refs.begin() + tri_num / 2 );
+		right.assign( refs.begin() + tri_num / 2 , refs.end() );
+	}
+
+	// empty children can't be represented, it only happens if the split plane doesn't agree with the binning
+	if( left.empty() || right.empty() ){
+		std::vector<Bvh_Reference>& all = left.empty() ? right : left;
+		const unsigned half = (unsigned)all.size() / 2;
+		( left.empty() ? left : right ).assign( all.begin() + half , all.end() );
+		all.resize( half );
+	}
+	std::vector<Bvh_Reference>().swap( refs );
+
+	// the rest of the budget is shared by the children in proportion to their references
+	const unsigned left_budget = (unsigned)( (unsigned long long)budget * left.size() / ( left.size() + right.size() ) );
+	const unsigned right_budget = budget - left_budget;
+
+	// the first child follows its parent immediately
+	nodes[node].axis = split_axis;
+	if( min( left.size() , right.size() ) < BVH_TASK_THRESHOLD ){
+		splitSpatialNode( nodes , leaves , stats , left , left_budget , depth + 1 );
+		nodes[node].offset = (unsigned)nodes.size();
+		splitSpatialNode( nodes , leaves , stats , right , right_budget , depth + 1 );
+		return;
+	}
+
+	// both children are large enough, the second one is built by another task in its own lists
+	std::vector<Bvh_LinearNode> right_nodes;
+	std::vector<Primitive*> right_leaves;
+	Bvh_BuildStats right_stats;
+	JobCounter counter( 1 );
+	ThreadPool::GetSingleton().Schedule( [&]() {
+		splitSpatialNode( right_nodes , right_leaves , right_stats , right , right_budget , depth + 1 );
+	} , &counter );
+	splitSpatialNode( nodes , leaves , stats , left , left_budget , depth + 1 );
+	ThreadPool::GetSingleton().Wait( counter );
+
+	// splice the second subtree after the first one, both its nodes and its leaves are relative to its own lists
+	const unsigned base = (unsigned)nodes.size();
+	const unsigned leaf_base = (unsigned)leaves.size();
+	nodes[node].offset = base;
+	for( Bvh_LinearNode child : right_nodes ){
+		child.offset += ( child.pri_num == 0 ) ? base : leaf_base;
+		nodes.push_back( child );
+	}
+	leaves.insert( leaves.end() , right_leaves.begin() , right_leaves.end() );
+	mergeStats( stats , right_stats );
 }
 
-// get the intersection between the ray and the primitive set
-bool Bvh::GetIntersect( const Ray& ray , Intersection* intersect ) const
+// pick the best object split of references
+float Bvh::pickObjectSplit( const std::vector<Bvh_Reference>& refs , const BBox& box , unsigned& axis , float& split_pos , BBox& lbox , BBox& rbox )
 {
-	float fmax;
-	float fmin = Intersect( ray , m_bbox , &fmax );
-	if( fmin < 0.0f )
-		return false;
+	BBox inner;
+	for( const Bvh_Reference& ref : refs )
+		inner.Union( ( ref.bbox.m_Min + ref.bbox.m_Max ) * 0.5f );
 
-	if( traverseNode( m_root , ray , intersect , fmin , fmax ) ){
-		if( intersect == 0 )
-			return true;
-		return intersect->primitive != 0 ;
+	// all axes are tried, otherwise spatial splits would mostly win by picking a better axis instead of reducing overlap
+	const unsigned tri_num = (unsigned)refs.size();
+	float min_sah = FLT_MAX;
+	for( unsigned k = 0 ; k < 3 ; ++k ){
+		const float split_start = inner.m_Min[k];
+		const float split_delta = inner.Delta(k) * BVH_INV_SPLIT_COUNT;
+		if( !( split_delta > 0.0f ) )
+			continue;
+		const float inv_split_delta = 1.0f / split_delta;
+
+		unsigned	bin[BVH_SPLIT_COUNT] = { 0 };
+		BBox		bbox[BVH_SPLIT_COUNT];
+		for( const Bvh_Reference& ref : refs ){
+			int index = (int)(((ref.bbox.m_Min[k] + ref.bbox.m_Max[k]) * 0.5f - split_start) * inv_split_delta);
+			index = min( index , (int)(BVH_SPLIT_COUNT - 1) );
+			bin[index]++;
+			bbox[index].Union( ref.bbox );
+		}
+
+		BBox		right_box[BVH_SPLIT_COUNT-1];
+		right_box[BVH_SPLIT_COUNT-2].Union( bbox[BVH_SPLIT_COUNT-1] );
+		for( int i = BVH_SPLIT_COUNT-3; i >= 0 ; i-- )
+			right_box[i] = Union( right_box[i+1] , bbox[i+1] );
+
+		unsigned	left = bin[0];
+		BBox		left_box = bbox[0];
+		for( unsigned i = 0 ; i < BVH_SPLIT_COUNT - 1 ; i++ ){
+			float sah_value = sah( left , tri_num - left , left_box , right_box[i] , box );
+			if( sah_value < min_sah ){
+				min_sah = sah_value;
+				axis = k;
+				split_pos = split_start + split_delta * ( i + 1 );
+				lbox = left_box;
+				rbox = right_box[i];
+			}
+			left += bin[i+1];
+			left_box.Union( bbox[i+1] );
+		}
 	}
-    
-	return false;
+
+	return min_sah;
+}
+
+// pick the best spatial split of references
+float Bvh::pickSpatialSplit( const std::vector<Bvh_Reference>& refs , const BBox& box , unsigned& axis , float& split_pos ,
+							 BBox& lbox , BBox& rbox , unsigned& left , unsigned& right )
+{
+	float min_sah = FLT_MAX;
+	for( unsigned k = 0 ; k < 3 ; ++k ){
+		const float split_start = box.m_Min[k];
+		const float split_delta = box.Delta(k) * BVH_INV_SPLIT_COUNT;
+		if( !( split_delta > 0.0f ) )
+			continue;
+		const float inv_split_delta = 1.0f / split_delta;
+
+		// a reference enters the first bin it overlaps and exits the last one, it is clipped by all bins in between
+		unsigned	enter[BVH_SPLIT_COUNT] = { 0 };
+		unsigned	leave[BVH_SPLIT_COUNT] = { 0 };
+		BBox		bbox[BVH_SPLIT_COUNT];
+		for( const Bvh_Reference& ref : refs ){
+			const int first = max( 0 , min( (int)( ( ref.bbox.m_Min[k] - split_start ) * inv_split_delta ) , (int)(BVH_SPLIT_COUNT - 1) ) );
+			const int last = max( first , min( (int)( ( ref.bbox.m_Max[k] - split_start ) * inv_split_delta ) , (int)(BVH_SPLIT_COUNT - 1) ) );
+			Bvh_Reference current = ref;
+			for( int i = first ; i < last ; ++i ){
+				Bvh_Reference l , r;
+				splitReference( current , k , split_start + split_delta * ( i + 1 ) , l , r );
+				bbox[i].Union( l.bbox );
+				current = r;
+			}
+			bbox[last].Union( current.bbox );
+			enter[first]++;
+			leave[last]++;
+		}
+
+		BBox		right_box[BVH_SPLIT_COUNT-1];
+		unsigned	right_num[BVH_SPLIT_COUNT-1];
+		right_box[BVH_SPLIT_COUNT-2] = bbox[BVH_SPLIT_COUNT-1];
+		right_num[BVH_SPLIT_COUNT-2] = leave[BVH_SPLIT_COUNT-1];
+		for( int i = BVH_SPLIT_COUNT-3; i >= 0 ; i-- ){
+			right_box[i] = Union( right_box[i+1] , bbox[i+1] );
+			right_num[i] = right_num[i+1] + leave[i+1];
+		}
+
+		unsigned	left_num = enter[0];
+		BBox		left_box = bbox[0];
+		for( unsigned i = 0 ; i < BVH_SPLIT_COUNT - 1 ; i++ ){
+			float sah_value = sah( left_num , right_num[i] , left_box , right_box[i] , box );
+			if( sah_value < min_sah ){
+				min_sah = sah_value;
+				axis = k;
+				split_pos = split_start + split_delta * ( i + 1 );
+				lbox = left_box;
+				rbox = right_box[i];
+				left = left_num;
+				right = right_num[i];
+			}
+			left_num += enter[i+1];
+			left_box.Union( bbox[i+1] );
+		}
+	}
+
+	return min_sah;
 }
 
-// traverse node
-bool Bvh::traverseNode( const Bvh_Node* node , const Ray& ray , Intersection* intersect , float fmin , float fmax ) const
+// clip a reference by a split plane
+void Bvh::splitReference( const Bvh_Reference& ref , unsigned axis , float split_pos , Bvh_Reference& left , Bvh_Reference& right ) const
 {
-	if( fmin < 0.0f )
+	left.primitive = right.primitive = ref.primitive;
+	left.bbox.InvalidBBox();
+	right.bbox.InvalidBBox();
+
+	Point v[3];
+	if( ref.primitive->GetVertices( v[0] , v[1] , v[2] ) ){
+		// vertices on each side and the points where the edges cross the plane bound the two parts of the triangle
+		for( unsigned i = 0 ; i < 3 ; ++i ){
+			const Point& v0 = v[i];
+			const Point& v1 = v[(i+1)%3];
+			if( v0[axis] <= split_pos )
+				left.bbox.Union( v0 );
+			if( v0[axis] >= split_pos )
+				right.bbox.Union( v0 );
+			if( ( v0[axis] < split_pos && v1[axis] > split_pos ) || ( v0[axis] > split_pos && v1[axis] < split_pos ) ){
+				Point p = v0 + ( v1 - v0 ) * ( ( split_pos - v0[axis] ) / ( v1[axis] - v0[axis] ) );
+				p[axis] = split_pos;
+				left.bbox.Union( p );
+				right.bbox.Union( p );
+			}
+		}
+	}else{
+		// other primitives are only clipped by their bounding box
+		left.bbox = right.bbox = ref.bbox;
+	}
+
+	// the parts are never larger than the reference, which may have been clipped before
+	left.bbox.m_Max[axis] = split_pos;
+	right.bbox.m_Min[axis] = split_pos;
+	for( unsigned i = 0 ; i < 3 ; ++i ){
+		left.bbox.m_Min[i] = max( left.bbox.m_Min[i] , ref.bbox.m_Min[i] );
+		left.bbox.m_Max[i] = min( left.bbox.m_Max[i] , ref.bbox.m_Max[i] );
+		right.bbox.m_Min[i] = max( right.bbox.m_Min[i] , ref.bbox.m_Min[i] );
+		right.bbox.m_Max[i] = min( right.bbox.m_Max[i] , ref.bbox.m_Max[i] );
+	}
+}
+
+// move the nodes to the memory aligned to cache lines
+void Bvh::finalizeNodes()
+{
+	m_totalNode = (unsigned)m_buildNodes.size();
+	m_nodeMemory.reset( new char[ m_totalNode * sizeof( Bvh_LinearNode ) + BVH_NODE_ALIGNMENT ] );
+	m_nodes = (Bvh_LinearNode*)( ( (uintptr_t)m_nodeMemory.get() + BVH_NODE_ALIGNMENT - 1 ) & ~(uintptr_t)( BVH_NODE_ALIGNMENT - 1 ) );
+	std::uninitialized_copy( m_buildNodes.begin() , m_buildNodes.end() , m_nodes );
+	std::vector<Bvh_LinearNode>().swap( m_buildNodes );
+
+	// quality of the tree, it doesn't depend on the way it is built
+	double cost = 0.0;
+	const float root_area = m_nodes[0].bbox.HalfSurfaceArea();
+	for( unsigned i = 0 ; i < m_totalNode && root_area > 0.0f ; ++i )
+		cost += m_nodes[i].bbox.HalfSurfaceArea() / root_area * ( m_nodes[i].pri_num ? m_nodes[i].pri_num : 1 );
+	m_sahCost = (float)cost;
+
+	m_memory.Allocate( m_totalNode * sizeof( Bvh_LinearNode ) + m_leafPrimitives.size() * sizeof( Primitive* ) );
+}
+
+// get the intersection between the ray and the primitive set
+bool Bvh::GetIntersect( const Ray& ray , Intersection* intersect ) const
+{
+	if( m_leafPrimitives.empty() )
 		return false;
 
-	if( intersect && intersect->t < fmin )
-		return true;
-	
-    if( node->pri_num != 0 ){
-        unsigned _start = node->pri_offset;
-        unsigned _tri = node->pri_num;
-        unsigned _end = _start + _tri;
-        
-        bool inter = false;
-        for( unsigned i = _start ; i < _end ; i++ ){
-            inter |= m_bvhpri[i].primitive->GetIntersect( ray , intersect );
-            if( intersect == 0 && inter )
-                return true;
-        }
-        return inter;
-	}
-
-    const Bvh_Node* left = node->left;
-	const Bvh_Node* right = node->right;
-
-	float	_fmin0 , _fmax0;
-	_fmin0 = Intersect( ray , left->bbox , &_fmax0 );
-	float	_fmin1 , _fmax1;
-	_fmin1 = Intersect( ray , right->bbox , &_fmax1 );
+	// the reciprocal of the direction and its sign are shared by all slab tests
+	const float inv_dir[3] = { 1.0f / ray.m_Dir.x , 1.0f / ray.m_Dir.y , 1.0f / ray.m_Dir.z };
+	const unsigned dir_is_neg[3] = { inv_dir[0] < 0.0f , inv_dir[1] < 0.0f , inv_dir[2] < 0.0f };
 
+	unsigned stack[BVH_MAX_DEPTH];
+	unsigned stack_top = 0;
+	unsigned current = 0;
 	bool inter = false;
-	if( _fmin1 > _fmin0 ){
-		inter |= traverseNode( left , ray , intersect , _fmin0 , _fmax0 );
-		if( inter && intersect == 0 ) return true;
-		inter |= traverseNode( right , ray , intersect , _fmin1 , _fmax1 );
-	}else{
-		inter |= traverseNode( right , ray , intersect , _fmin1 , _fmax1 );
-		if( inter && intersect == 0 ) return true;
-		inter |= traverseNode( left , ray , intersect , _fmin0 , _fmax0 );
+	while( true ){
+		const Bvh_LinearNode& node = m_nodes[current];
+
+		// slab test, the ray is no longer than the nearest intersection found so far.
+		// NaN, which comes from a ray lying in the plane of a slab, fails all comparisons and is ignored.
+		float tmin = ray.m_fMin;
+		float tmax = ( intersect && intersect->t < ray.m_fMax ) ? intersect->t : ray.m_fMax;
+		for( unsigned axis = 0 ; axis < 3 ; ++axis ){
+			const float t0 = ( ( dir_is_neg[axis] ? node.bbox.m_Max[axis] : node.bbox.m_Min[axis] ) - ray.m_Ori[axis] ) * inv_dir[axis];
+			const float t1 = ( ( dir_is_neg[axis] ? node.bbox.m_Min[axis] : node.bbox.m_Max[axis] ) - ray.m_Ori[axis] ) * inv_dir[axis];
+			tmin = ( t0 > tmin ) ? t0 : tmin;
+			tmax = ( t1 < tmax ) ? t1 : tmax;
+		}
+
+		if( tmin <= tmax ){
+			if( node.pri_num != 0 ){
+				const unsigned _end = node.offset + node.pri_num;
+				for( unsigned i = node.offset ; i < _end ; i++ ){
+					inter |= m_leafPrimitives[i]->GetIntersect( ray , intersect );
+					if( intersect == 0 && inter )
+						return true;
+				}
+			}else{
+				// visit the near child first, the far one is pushed on the stack
+				if( dir_is_neg[node.axis] ){
+					stack[stack_top++] = current + 1;
+					current = node.offset;
+				}else{
+					stack[stack_top++] = node.offset;
+					current = current + 1;
+				}
+				continue;
+			}
+		}
+
+		if( stack_top == 0 )
+			break;
+		current = stack[--stack_top];
 	}
+
 	if( intersect == 0 )
 		return inter;
-	return true;
+	return intersect->primitive != 0;
+}
+
+// write the BVH to the scene cache
+void Bvh::SaveCache( CacheWriter& writer ) const
+{
+	// primitives are saved as their index in the scene, the scene is the same once the entry is loaded
+	std::unordered_map<const Primitive*,unsigned> pri_index;
+	pri_index.reserve( m_primitives->size() );
+	for( unsigned i = 0 ; i < (unsigned)m_primitives->size() ; ++i )
+		pri_index[(*m_primitives)[i]] = i;
+	std::vector<unsigned> order( m_leafPrimitives.size() );
+	for( unsigned i = 0 ; i < (unsigned)order.size() ; ++i )
+		order[i] = pri_index[m_leafPrimitives[i]];
+
+	const unsigned info[] = { BVH_CACHE_VERSION , m_leafNode , m_bvhDepth , m_maxLeafTriNum , m_spatialSplitNum };
+	writer.Write( info , sizeof( info ) );
+	writer.WriteVector( order );
+	writer.WriteVector( std::vector<Bvh_LinearNode>( m_nodes , m_nodes + m_totalNode ) );
 }
 
-// delete bvh node recursively
-void Bvh::deleteNode( Bvh_Node* node ){
-    if( !node )
-        return;
-    deleteNode( node->left );
-    deleteNode( node->right );
-    delete node;
+// restore the BVH from the scene cache
+bool Bvh::LoadCache( CacheReader& reader )
+{
+	unsigned info[5];
+	std::vector<unsigned> order;
+	if( !reader.Read( info , sizeof( info ) ) || info[0] != BVH_CACHE_VERSION || info[2] >= BVH_MAX_DEPTH ||
+		!reader.ReadVector( order ) || !reader.ReadVector( m_buildNodes ) || order.size() < m_primitives->size() || m_buildNodes.empty() ){
+		deallocMemory();
+		return false;
+	}
+
+	// children always follow their parent, the depth of every node is checked so that the traversal stack can't overflow
+	const unsigned node_num = (unsigned)m_buildNodes.size();
+	std::vector<unsigned char> depth( node_num , 0 );
+	for( unsigned i = 0 ; i < node_num ; ++i ){
+		const Bvh_LinearNode& node = m_buildNodes[i];
+		const bool valid = ( node.pri_num != 0 ) ? ( (unsigned long long)node.offset + node.pri_num <= order.size() ) :
+			( i + 1 < node_num && node.offset > i + 1 && node.offset < node_num && node.axis < 3 && depth[i] + 1u < BVH_MAX_DEPTH );
+		if( !valid ){
+			deallocMemory();
+			return false;
+		}
+		if( node.pri_num == 0 ){
+			depth[i+1] = max( depth[i+1] , (unsigned char)( depth[i] + 1 ) );
+			depth[node.offset] = max( depth[node.offset] , (unsigned char)( depth[i] + 1 ) );
+		}
+	}
+	for( unsigned index : order ){
+		if( index >= m_primitives->size() ){
+			deallocMemory();
+			return false;
+		}
+	}
+
+	computeBBox();
+	m_leafPrimitives.resize( order.size() );
+	for( unsigned i = 0 ; i < (unsigned)order.size() ; ++i )
+		m_leafPrimitives[i] = (*m_primitives)[order[i]];
+
+	m_leafNode = info[1];
+	m_bvhDepth = info[2];
+	m_maxLeafTriNum = info[3];
+	m_spatialSplitNum = info[4];
+	finalizeNodes();
+	return true;
 }
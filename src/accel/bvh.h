@@ -19,6 +19,7 @@
 
 #include "accelerator.h"
 #include "geometry/primitive.h"
+#include <memory>
 
 //! @brief Bounding volume hierarchy.
 /**
@@ -28,12 +29,26 @@
  * Please refer to this paper 
  * <a href="http://www.sci.utah.edu/~wald/Publications/2007/ParallelBVHBuild/fastbuild.pdf">
  * On fast Construction of SAH-based Bounding Volume Hierarchies</a> for further details.
+ * The tree is flattened into an array of 32 bytes nodes in depth first order once it is
+ * built, it is traversed with an explicit stack instead of recursion.
+ * Construction runs on the thread pool. Bounds, binning and partitioning of large nodes
+ * near the root are split into chunks processed in parallel, while smaller subtrees are
+ * built as independent tasks. The chunks don't depend on the number of threads, so the
+ * tree is the same no matter how many threads build it.
+ * Optionally, spatial splits clipping primitives at the split plane are considered as
+ * well. Please refer to this paper
+ * <a href="http://www.nvidia.com/docs/IO/77714/sbvh.pdf">Spatial Splits in Bounding
+ * Volume Hierarchies</a> for further details.
  */
 class Bvh : public Accelerator
 {
 public:
 	DEFINE_CREATOR( Bvh , "bvh" );
 
+	//! @brief Constructor.
+	//! @param spatial_split    Whether spatial splits are considered during construction.
+	Bvh( bool spatial_split = false ) : m_spatialSplit( spatial_split ) {}
+
 	//! Destructor
     ~Bvh() override;
 
@@ -58,14 +73,40 @@ public:
 	//! Output log information
 	void OutputLog() const override;
 
-    //! Bounding volume hierarchy node.
-    struct Bvh_Node
+	//! BVH could be kept in the scene cache.
+	bool SupportCache() const override { return true; }
+
+	//! @brief Write the flattened nodes and the order of primitives to the scene cache.
+	//! @param writer   Writer of the cache entry.
+	void SaveCache( CacheWriter& writer ) const override;
+
+	//! @brief Restore nodes and the order of primitives from the scene cache.
+	//! @param reader   Reader of the cache entry.
+	//! @return         False if the entry doesn't match the primitives.
+	bool LoadCache( CacheReader& reader ) override;
+
+    struct Bvh_LinearNode;
+
+    //! @brief Nodes of the built BVH in depth first order, wider BVHs are collapsed from them.
+    const Bvh_LinearNode* GetNodes() const { return m_nodes; }
+
+    //! @brief Number of nodes in the built BVH.
+    unsigned GetNodeCount() const { return m_totalNode; }
+
+    //! @brief Primitives of the leaf nodes in the order of the nodes.
+    const std::vector<Primitive*>& GetLeafPrimitives() const { return m_leafPrimitives; }
+
+    //! @brief Node of the flattened BVH.
+    //!
+    //! Nodes are kept in one contiguous array in depth first order, so the first child of an
+    //! interior node always follows it immediately and only the second child needs an index.
+    //! A node is 32 bytes, two of them fit in a cache line.
+    struct Bvh_LinearNode
     {
-        BBox		bbox;               /**< Bounding box of the BVH node. */
-        unsigned 	pri_num     = 0;    /**< Number of primitives in the BVH node. */
-        unsigned	pri_offset  = 0;    /**< Offset in the primitive buffer. It is 0 for interior nodes. */
-        Bvh_Node*   left        = 0;    /**< Left child of the BVH node. */
-        Bvh_Node*   right       = 0;    /**< Right child of the BVH node. */
+        BBox            bbox;               /**< Bounding box of the BVH node. */
+        unsigned        offset  = 0;        /**< Offset in the primitive buffer for leaf nodes, index of the second child for interior nodes. */
+        unsigned short  pri_num = 0;        /**< Number of primitives in the BVH node. It is 0 for interior nodes. */
+        unsigned short  axis    = 0;        /**< Axis of the split plane of interior nodes. */
     };
     
     //! Bounding volume hierarchy node primitives. It is used during BVH construction.
@@ -85,9 +126,9 @@ public:
         {return primitive->GetBBox();}
     };
     
-private:
-    Bvh_Primitive*	m_bvhpri = nullptr; /**< Primitive list during BVH construction. */
-    Bvh_Node*       m_root = nullptr;   /**< Root node of the BVH structure. */
+protected:
+    std::vector<Bvh_LinearNode> m_buildNodes;   /**< Nodes appended during BVH construction. */
+    std::vector<Primitive*>     m_leafPrimitives;       /**< Primitives of the leaf nodes in the order of the nodes. */
 
 	const unsigned	m_maxPriInLeaf = 8; /**< Maximum primitives in a leaf node. During BVH construction, a node with less primitives will be marked as a leaf node. */
 
@@ -96,6 +137,40 @@ private:
 	unsigned	m_leafNode = 0;         /**< Number of leaf nodes in the BVH. */
 	unsigned	m_bvhDepth = 0;         /**< Depth of the BVH. */
 	unsigned	m_maxLeafTriNum = 0;    /**< Real maximum number of primitives in the leaf node after construction. */
+	float		m_sahCost = 0.0f;       /**< SAH cost of the whole tree, both a traversal step and an intersection test cost one. */
+
+	//! @brief Move the nodes and the primitives of the leaves to their final place once the BVH is built.
+	void finalizeNodes();
+
+	//! @brief Output statistics of the built nodes, it is shared by the BVHs built in different ways.
+	void outputStats() const;
+
+private:
+    //! Statistics of a subtree gathered during construction, subtrees built by different tasks are merged once they are done.
+    struct Bvh_BuildStats
+    {
+        unsigned    leafNode = 0;       /**< Number of leaf nodes in the subtree. */
+        unsigned    depth = 0;          /**< Depth of the deepest node in the subtree. */
+        unsigned    maxLeafTriNum = 0;  /**< Maximum number of primitives in a leaf of the subtree. */
+        unsigned    spatialSplitNum = 0;    /**< Number of nodes split by spatial splits in the subtree. */
+    };
+
+    //! Reference to a primitive, or part of it, during construction with spatial splits.
+    struct Bvh_Reference
+    {
+        Primitive*  primitive;      /**< The referenced primitive. */
+        BBox        bbox;           /**< Bounding box of the part of the primitive in the node. */
+    };
+
+    Bvh_Primitive*	m_bvhpri = nullptr; /**< Primitive list during BVH construction. */
+    Bvh_Primitive*	m_bvhpriScratch = nullptr;  /**< Temporary buffer used by parallel partitioning. */
+
+    std::unique_ptr<char[]>     m_nodeMemory;           /**< Memory holding the nodes. */
+    Bvh_LinearNode*             m_nodes = nullptr;      /**< Nodes of the BVH, aligned to cache lines. */
+
+	const bool		m_spatialSplit;     /**< Whether spatial splits are considered during construction. */
+	unsigned		m_spatialSplitNum = 0;  /**< Number of nodes split by spatial splits. */
+	float			m_minOverlapArea = 0.0f;    /**< Spatial splits are only tried if children of the object split overlap more than this. */
 
 	//! Malloc necessary memory.
 	void mallocMemory();
@@ -103,18 +178,38 @@ private:
 	//! Dealloc all allocated memory.
 	void deallocMemory();
 
-	//! @brief Split current BVH node.
-    //! @param node     The BVH node to be split.
+	//! @brief Split current BVH node, the node and its subtree are appended to the node list.
+    //! Large enough subtrees are built by other tasks in their own node lists and spliced
+    //! into this one once they are done.
+    //! @param nodes    The node list that the subtree is appended to.
+    //! @param stats    Statistics of the subtree.
     //! @param _start   The start offset of primitives that the node holds.
     //! @param _end     The end offset of prititives that the node holds.
     //! @param depth    The current depth of the node.
-	void splitNode( Bvh_Node* node , unsigned _start , unsigned _end , unsigned depth );
+	void splitNode( std::vector<Bvh_LinearNode>& nodes , Bvh_BuildStats& stats , unsigned _start , unsigned _end , unsigned depth );
 
 	//! @brief Mark the current node as leaf node.
-    //! @param node     The BVH node to be marked as leaf node.
+    //! @param nodes    The node list holding the node.
+    //! @param stats    Statistics of the subtree holding the node.
+    //! @param node     Index of the BVH node to be marked as leaf node.
     //! @param _start   The start offset of primitives that the node holds.
     //! @param _end     The end offset of prititives that the node holds.
-	void makeLeaf( Bvh_Node* node , unsigned _start , unsigned _end );
+	void makeLeaf( std::vector<Bvh_LinearNode>& nodes , Bvh_BuildStats& stats , unsigned node , unsigned _start , unsigned _end );
+
+	//! @brief Compute the bounding box of primitives and the one of their centroids.
+    //! @param bbox     Bounding box of the primitives.
+    //! @param centroid Bounding box of the centroids of the primitives.
+    //! @param _start   The start offset of primitives.
+    //! @param _end     The end offset of prititives.
+	void computeBounds( BBox& bbox , BBox& centroid , unsigned _start , unsigned _end ) const;
+
+	//! @brief Move primitives whose centroid is on the left of the split plane before the others.
+    //! @param axis      Axis of the split plane.
+    //! @param split_pos Position of the split plane.
+    //! @param _start    The start offset of primitives.
+    //! @param _end      The end offset of prititives.
+    //! @return          Offset of the first primitive on the right of the split plane.
+	unsigned partitionPrimitives( unsigned axis , float split_pos , unsigned _start , unsigned _end );
 
 	//! @brief Evaluate the SAH value of a specific splitting.
     //! @param left     The number of primitives in the left node to be split.
@@ -128,24 +223,73 @@ private:
 	//! @brief Pick the best split among all possible splits.
     //! @param axis      The selected axis id of the picked split plane.
     //! @param split_pos Position of the selected split plane.
-    //! @param node      The node to be split.
+    //! @param box       Bounding box of the node to be split.
+    //! @param centroid  Bounding box of the centroids of primitives in the node.
     //! @param _start    The start offset of primitives that the node holds.
     //! @param _end      The end offset of prititives that the node holds.
     //! @return          The SAH value of the selected best split plane.
-	float pickBestSplit( unsigned& axis , float& split_pos , Bvh_Node* node , unsigned _start , unsigned _end );
-
-	//! @brief A recursive function that traverses the BVH node.
-    //! @param node         The node to be traversed.
-    //! @param ray          The ray to be tested.
-    //! @param intersect    The structure holding the intersection information. If empty pointer is passed,
-    //!                     it will return as long as one intersection is found and it won't be necessary to be
-    //!                     the nearest one.
-    //! @param fmin         The minimum range along the ray.
-    //! @param fmax         The maximum range along the ray.
-    //! @return             True if there is intersection, otherwise it will return false.
-	bool traverseNode( const Bvh_Node* node , const Ray& ray , Intersection* intersect , float fmin , float fmax ) const;
-    
-    //! @brief Delete all nodes in the BVH.
-    //! @param node The node to be deleted.
-    void deleteNode( Bvh_Node* node );
+	float pickBestSplit( unsigned& axis , float& split_pos , const BBox& box , const BBox& centroid , unsigned _start , unsigned _end );
+
+	//! @brief Split current BVH node considering spatial splits, the node and its subtree are appended
+    //! to the node list and primitives of its leaves are appended to the leaf primitive list.
+    //! @param nodes    The node list that the subtree is appended to.
+    //! @param leaves   The leaf primitive list that primitives of the leaves are appended to.
+    //! @param stats    Statistics of the subtree.
+    //! @param refs     References in the node, it is emptied once the references are distributed to the children.
+    //! @param budget   Maximum number of references that the subtree could duplicate.
+    //! @param depth    The current depth of the node.
+	void splitSpatialNode( std::vector<Bvh_LinearNode>& nodes , std::vector<Primitive*>& leaves , Bvh_BuildStats& stats ,
+						   std::vector<Bvh_Reference>& refs , unsigned budget , unsigned depth );
+
+	//! @brief Merge statistics of a subtree built by another task.
+    //! @param stats    Statistics to be updated.
+    //! @param other    Statistics of the other subtree.
+	static void mergeStats( Bvh_BuildStats& stats , const Bvh_BuildStats& other );
+
+	//! @brief Pick the best object split of references, which are binned by their centroids.
+    //! @param refs      References in the node.
+    //! @param box       Bounding box of the node.
+    //! @param axis      The selected axis id of the picked split plane.
+    //! @param split_pos Position of the selected split plane.
+    //! @param lbox      Bounding box of the left child.
+    //! @param rbox      Bounding box of the right child.
+    //! @return          The SAH value of the selected best split plane.
+	float pickObjectSplit( const std::vector<Bvh_Reference>& refs , const BBox& box , unsigned& axis , float& split_pos , BBox& lbox , BBox& rbox );
+
+	//! @brief Pick the best spatial split of references, references are clipped by the bins they overlap.
+    //! @param refs      References in the node.
+    //! @param box       Bounding box of the node.
+    //! @param axis      The selected axis id of the picked split plane.
+    //! @param split_pos Position of the selected split plane.
+    //! @param lbox      Bounding box of the left child.
+    //! @param rbox      Bounding box of the right child.
+    //! @param left      Number of references in the left child.
+    //! @param right     Number of references in the right child.
+    //! @return          The SAH value of the selected best split plane.
+	float pickSpatialSplit( const std::vector<Bvh_Reference>& refs , const BBox& box , unsigned& axis , float& split_pos ,
+							BBox& lbox , BBox& rbox , unsigned& left , unsigned& right );
+
+	//! @brief Clip a reference by a split plane.
+    //! @param ref       The reference to be clipped.
+    //! @param axis      Axis of the split plane.
+    //! @param split_pos Position of the split plane.
+    //! @param left      Part of the reference on the left of the split plane.
+    //! @param right     Part of the reference on the right of the split plane.
+	void splitReference( const Bvh_Reference& ref , unsigned axis , float split_pos , Bvh_Reference& left , Bvh_Reference& right ) const;
+
+};
+
+//! @brief BVH whose construction considers spatial splits.
+/**
+ * Spatial splits duplicate references of primitives straddling the split plane, they
+ * reduce the overlap of nodes around long and thin primitives at the cost of more memory
+ * and a slower construction. It is a good choice for offline rendering.
+ */
+class Sbvh : public Bvh
+{
+public:
+	DEFINE_CREATOR( Sbvh , "sbvh" );
+
+	//! Constructor.
+	Sbvh() : Bvh( true ) {}
 };
@@ -72,6 +72,7 @@ void KDTree::Build()
 
 	// build kd-tree
 	splitNode( m_root , splits , count , 0 );
+	m_memory.Allocate( m_total * sizeof( Kd_Node ) );
 
 	if( m_leaf != 0 )
 		m_fAvgLeafTri /= m_leaf;
@@ -277,6 +278,7 @@ void KDTree::makeLeaf( Kd_Node* node , Splits& splits , unsigned prinum )
 		}
 	}
 	splits.Release();
+	m_memory.Allocate( node->trilist.capacity() * sizeof( const Primitive* ) );
 
 	m_leaf++;
 	m_fAvgLeafTri += prinum;
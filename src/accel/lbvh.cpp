@@ -0,0 +1,514 @@
+/*
+    This file is a part of SORT(Simple Open Ray Tracing), an open-source cross
+    platform physically based renderer.
+ 
+    Copyright (c) 2011-2016 by Cao Jiayin - All rights reserved.
+ 
+    SORT is a free software written for educational purpose. Anyone can distribute
+    or modify it under the the terms of the GNU General Public License Version 3 as
+    published by the Free Software Foundation. However, there is NO warranty that
+    all components are functional in a perfect manner. Without even the implied
+    warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License along with
+    this program. If not, see <http://www.gnu.org/licenses/gpl-3.0.html>.
+ */
+
+#include "lbvh.h"
+#include "managers/logmanager.h"
+#include "utility/multithread/threadpool.h"
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#if defined(_MSC_VER)
+    #include <intrin.h>
+#endif
+
+IMPLEMENT_CREATOR( Lbvh );
+IMPLEMENT_CREATOR( LbvhTreelet );
+
+// children of interior nodes with this bit set are sorted primitives
+static const unsigned   LBVH_LEAF               = 0x80000000u;
+static const unsigned   LBVH_INVALID            = 0xffffffffu;
+// bits of the Morton codes per axis
+static const unsigned   LBVH_MORTON_BITS        = 10;
+// bits sorted by each pass of the radix sort
+static const unsigned   LBVH_RADIX_BITS         = 8;
+static const unsigned   LBVH_RADIX_SIZE         = 1 << LBVH_RADIX_BITS;
+// primitives are processed in chunks of this size in parallel
+static const unsigned   LBVH_PARALLEL_CHUNK     = 16384;
+// maximum number of leaves of a restructured treelet, seven leaves are only slightly better but four times slower
+static const unsigned   LBVH_TREELET_SIZE       = 5;
+// limits of the flattened nodes, they are the same as the ones of Bvh
+static const unsigned   LBVH_MAX_DEPTH          = 64;
+static const unsigned   LBVH_MAX_PRI_IN_LEAF    = 0xffff;
+
+// number of leading zero bits, the value is not zero
+static inline unsigned _clz( unsigned v )
+{
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanReverse( &index , v );
+    return 31 - (unsigned)index;
+#else
+    return (unsigned)__builtin_clz( v );
+#endif
+}
+
+// spread the lower ten bits so that there are two zero bits between every two of them
+static inline unsigned _expandBits( unsigned v )
+{
+    v = ( v * 0x00010001u ) & 0xFF0000FFu;
+    v = ( v * 0x00000101u ) & 0x0F00F00Fu;
+    v = ( v * 0x00000011u ) & 0xC30C30C3u;
+    v = ( v * 0x00000005u ) & 0x49249249u;
+    return v;
+}
+
+// milliseconds elapsed since a time point
+static inline float _elapsed( std::chrono::steady_clock::time_point& start )
+{
+    const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    const float ms = std::chrono::duration<float,std::milli>( now - start ).count();
+    start = now;
+    return ms;
+}
+
+// build the acceleration structure
+void Lbvh::Build()
+{
+    m_fallback = false;
+    computeBBox();
+
+    const unsigned n = (unsigned)m_primitives->size();
+    if( n == 0 )
+        return;
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<unsigned> codes;
+    sortPrimitives( codes );
+    m_buildTime[0] = _elapsed( start );
+
+    std::vector<unsigned> parents;
+    if( n > 1 )
+        emitNodes( codes , parents );
+    std::vector<unsigned>().swap( codes );
+    m_buildTime[1] = _elapsed( start );
+
+    if( n > 1 )
+        refitNodes( parents );
+    m_buildTime[2] = _elapsed( start );
+
+    m_buildNodes.reserve( 2 * n - 1 );
+    m_leafPrimitives.reserve( n );
+    const bool flattened = flattenNode( ( n > 1 ) ? 0 : LBVH_LEAF , 0 );
+    std::vector<Primitive*>().swap( m_sorted );
+    std::vector<Lbvh_Node>().swap( m_lbvhNodes );
+    m_buildTime[3] = _elapsed( start );
+
+    if( !flattened ){
+        // it only happens with pathological Morton codes after restructuring
+        LOG_WARNING<<"LBVH is too deep to be traversed, a SAH BVH is built instead."<<ENDL;
+        m_buildNodes.clear();
+        m_leafPrimitives.clear();
+        m_leafNode = m_bvhDepth = m_maxLeafTriNum = 0;
+        m_treeletNum = 0;
+        m_fallback = true;
+        Bvh::Build();
+        return;
+    }
+
+    finalizeNodes();
+}
+
+// output log information
+void Lbvh::OutputLog() const
+{
+    LOG_HEADER( "Accelerator" );
+    if( m_fallback ){
+        // the Morton phases are thrown away, only the SAH BVH built instead is reported
+        LOG<<"Accelerator Type :\tBounding Volumn Hierarchy (fallback of a too deep LBVH)"<<ENDL;
+        outputStats();
+        return;
+    }
+    LOG<<"Accelerator Type :\tLinear Bounding Volume Hierarchy"<<( m_treelet ? " with treelet restructuring" : "" )<<ENDL;
+    // nothing is built if the nodes are loaded from the scene cache
+    if( m_buildTime[3] > 0.0f ){
+        LOG<<"Morton sort      :\t"<<m_buildTime[0]<<" ms"<<ENDL;
+        LOG<<"Node emission    :\t"<<m_buildTime[1]<<" ms"<<ENDL;
+        LOG<<"Bounding boxes   :\t"<<m_buildTime[2]<<" ms"<<ENDL;
+        LOG<<"Flattening       :\t"<<m_buildTime[3]<<" ms"<<ENDL;
+        if( m_treelet )
+            LOG<<"Treelets changed :\t"<<m_treeletNum<<ENDL;
+    }
+    outputStats();
+}
+
+// sort primitives along the Morton curve
+void Lbvh::sortPrimitives( std::vector<unsigned>& codes )
+{
+    ThreadPool& pool = ThreadPool::GetSingleton();
+    const unsigned n = (unsigned)m_primitives->size();
+    const unsigned chunk_num = ( n + LBVH_PARALLEL_CHUNK - 1 ) / LBVH_PARALLEL_CHUNK;
+    auto centroid = [this]( unsigned i ){
+        const BBox& box = (*m_primitives)[i]->GetBBox();
+        return ( box.m_Min + box.m_Max ) * 0.5f;
+    };
+    auto chunk_end = [n]( unsigned c ){ return min( n , ( c + 1 ) * LBVH_PARALLEL_CHUNK ); };
+
+    // centroids are quantized in their bounding box
+    std::vector<BBox> boxes( chunk_num );
+    pool.ParallelFor( 0 , chunk_num , 1 , [&]( unsigned b , unsigned e ){
+        for( unsigned c = b ; c < e ; ++c )
+            for( unsigned i = c * LBVH_PARALLEL_CHUNK ; i < chunk_end( c ) ; ++i )
+                boxes[c].Union( centroid( i ) );
+    });
+    BBox bound;
+    for( const BBox& box : boxes )
+        bound.Union( box );
+    const unsigned quantize = ( 1u << LBVH_MORTON_BITS ) - 1;
+    float scale[3];
+    for( unsigned k = 0 ; k < 3 ; ++k )
+        scale[k] = ( bound.Delta( k ) > 0.0f ) ? quantize / bound.Delta( k ) : 0.0f;
+
+    std::vector<unsigned> keys( n ) , values( n );
+    pool.ParallelFor( 0 , n , LBVH_PARALLEL_CHUNK , [&]( unsigned b , unsigned e ){
+        for( unsigned i = b ; i < e ; ++i ){
+            const Point p = centroid( i );
+            unsigned code = 0;
+            for( unsigned k = 0 ; k < 3 ; ++k )
+                code |= _expandBits( min( (unsigned)( ( p[k] - bound.m_Min[k] ) * scale[k] ) , quantize ) ) << ( 2 - k );
+            keys[i] = code;
+            values[i] = i;
+        }
+    });
+
+    // LSD radix sort, every chunk scatters its keys to the offsets reserved by its histogram so that the sort is stable
+    std::vector<unsigned> keys_tmp( n ) , values_tmp( n );
+    std::vector<unsigned> histogram( chunk_num * LBVH_RADIX_SIZE );
+    for( unsigned shift = 0 ; shift < 3 * LBVH_MORTON_BITS ; shift += LBVH_RADIX_BITS ){
+        pool.ParallelFor( 0 , chunk_num , 1 , [&]( unsigned b , unsigned e ){
+            for( unsigned c = b ; c < e ; ++c ){
+                unsigned* count = &histogram[c * LBVH_RADIX_SIZE];
+                memset( count , 0 , sizeof( unsigned ) * LBVH_RADIX_SIZE );
+                for( unsigned i = c * LBVH_PARALLEL_CHUNK ; i < chunk_end( c ) ; ++i )
+                    ++count[ ( keys[i] >> shift ) & ( LBVH_RADIX_SIZE - 1 ) ];
+            }
+        });
+
+        unsigned offset = 0;
+        for( unsigned digit = 0 ; digit < LBVH_RADIX_SIZE ; ++digit ){
+            for( unsigned c = 0 ; c < chunk_num ; ++c ){
+                const unsigned count = histogram[c * LBVH_RADIX_SIZE + digit];
+                histogram[c * LBVH_RADIX_SIZE + digit] = offset;
+                offset += count;
+            }
+        }
+
+        pool.ParallelFor( 0 , chunk_num , 1 , [&]( unsigned b , unsigned e ){
+            for( unsigned c = b ; c < e ; ++c ){
+                unsigned* offsets = &histogram[c * LBVH_RADIX_SIZE];
+                for( unsigned i = c * LBVH_PARALLEL_CHUNK ; i < chunk_end( c ) ; ++i ){
+                    const unsigned dst = offsets[ ( keys[i] >> shift ) & ( LBVH_RADIX_SIZE - 1 ) ]++;
+                    keys_tmp[dst] = keys[i];
+                    values_tmp[dst] = values[i];
+                }
+            }
+        });
+        keys.swap( keys_tmp );
+        values.swap( values_tmp );
+    }
+
+    m_sorted.resize( n );
+    pool.ParallelFor( 0 , n , LBVH_PARALLEL_CHUNK , [&]( unsigned b , unsigned e ){
+        for( unsigned i = b ; i < e ; ++i )
+            m_sorted[i] = (*m_primitives)[values[i]];
+    });
+    codes.swap( keys );
+}
+
+// emit interior nodes of the radix tree
+void Lbvh::emitNodes( const std::vector<unsigned>& codes , std::vector<unsigned>& parents )
+{
+    const int n = (int)codes.size();
+    m_lbvhNodes.resize( n - 1 );
+    parents.resize( n );
+
+    // length of the common prefix of two codes, duplicated codes are told apart by their indices
+    auto delta = [&]( int i , int j ) -> int {
+        if( j < 0 || j >= n )
+            return -1;
+        const unsigned x = codes[i] ^ codes[j];
+        return x ? (int)_clz( x ) : 32 + (int)_clz( (unsigned)( i ^ j ) );
+    };
+
+    // every interior node finds the range of primitives it covers and where the range is split independently
+    m_lbvhNodes[0].parent = LBVH_INVALID;
+    ThreadPool::GetSingleton().ParallelFor( 0 , n - 1 , LBVH_PARALLEL_CHUNK , [&]( unsigned b , unsigned e ){
+        for( int i = (int)b ; i < (int)e ; ++i ){
+            // direction of the range
+            const int d = ( delta( i , i + 1 ) - delta( i , i - 1 ) >= 0 ) ? 1 : -1;
+
+            // the other end of the range is found by an exponential search followed by a binary search
+            const int delta_min = delta( i , i - d );
+            int length_max = 2;
+            while( delta( i , i + length_max * d ) > delta_min )
+                length_max <<= 1;
+            int length = 0;
+            for( int t = length_max >> 1 ; t >= 1 ; t >>= 1 ){
+                if( delta( i , i + ( length + t ) * d ) > delta_min )
+                    length += t;
+            }
+            const int j = i + length * d;
+
+            // the range is split where the common prefix gets shorter
+            const int delta_node = delta( i , j );
+            int split = 0;
+            for( int t = length ; t > 1 ; ){
+                t = ( t + 1 ) >> 1;
+                if( delta( i , i + ( split + t ) * d ) > delta_node )
+                    split += t;
+            }
+            const int gamma = i + split * d + min( d , 0 );
+
+            Lbvh_Node& node = m_lbvhNodes[i];
+            node.child[0] = ( min( i , j ) == gamma ) ? ( gamma | LBVH_LEAF ) : gamma;
+            node.child[1] = ( max( i , j ) == gamma + 1 ) ? ( ( gamma + 1 ) | LBVH_LEAF ) : ( gamma + 1 );
+            for( unsigned child : node.child ){
+                if( child & LBVH_LEAF )
+                    parents[child & ~LBVH_LEAF] = i;
+                else
+                    m_lbvhNodes[child].parent = i;
+            }
+        }
+    });
+}
+
+// compute bounding boxes from the leaves up to the root
+void Lbvh::refitNodes( std::vector<unsigned>& parents )
+{
+    ThreadPool& pool = ThreadPool::GetSingleton();
+    const unsigned n = (unsigned)parents.size();
+    std::unique_ptr<std::atomic<unsigned>[]> visits( new std::atomic<unsigned>[ n - 1 ] );
+    pool.ParallelFor( 0 , n - 1 , LBVH_PARALLEL_CHUNK , [&]( unsigned b , unsigned e ){
+        for( unsigned i = b ; i < e ; ++i )
+            visits[i].store( 0 , std::memory_order_relaxed );
+    });
+
+    // every primitive walks up the tree, the first child reaching a node stops there and the second one,
+    // whose sibling is already done, finishes the node. A finished subtree is only touched by the thread
+    // finishing it, so its treelet could be restructured without any lock. Subtrees small enough to be a
+    // single leaf are left alone, most of them are collapsed anyway.
+    std::atomic<unsigned> treelet_num( 0 );
+    pool.ParallelFor( 0 , n , LBVH_PARALLEL_CHUNK , [&]( unsigned b , unsigned e ){
+        unsigned restructured = 0;
+        for( unsigned i = b ; i < e ; ++i ){
+            unsigned node = parents[i];
+            while( node != LBVH_INVALID && visits[node].fetch_add( 1 , std::memory_order_acq_rel ) == 1 ){
+                updateNode( node );
+                if( m_treelet && m_lbvhNodes[node].pri_num > m_maxPriInLeaf && restructureTreelet( node , parents ) )
+                    ++restructured;
+                node = m_lbvhNodes[node].parent;
+            }
+        }
+        treelet_num += restructured;
+    });
+    m_treeletNum = treelet_num;
+}
+
+// update a node from its children
+void Lbvh::updateNode( unsigned node )
+{
+    Lbvh_Node& lnode = m_lbvhNodes[node];
+    lnode.bbox.InvalidBBox();
+    lnode.pri_num = 0;
+    float children_cost = 0.0f;
+    for( unsigned child : lnode.child ){
+        if( child & LBVH_LEAF ){
+            const BBox& box = m_sorted[child & ~LBVH_LEAF]->GetBBox();
+            lnode.bbox.Union( box );
+            lnode.pri_num += 1;
+            children_cost += box.HalfSurfaceArea();
+        }else{
+            const Lbvh_Node& cnode = m_lbvhNodes[child];
+            lnode.bbox.Union( cnode.bbox );
+            lnode.pri_num += cnode.pri_num;
+            children_cost += cnode.cost;
+        }
+    }
+
+    // small subtrees become leaves if it is cheaper, traversal steps and intersection tests cost the same as in Bvh
+    const float area = lnode.bbox.HalfSurfaceArea();
+    lnode.collapse = lnode.pri_num <= m_maxPriInLeaf && area * lnode.pri_num <= area + children_cost;
+    lnode.cost = lnode.collapse ? area * lnode.pri_num : area + children_cost;
+}
+
+// restructure a treelet
+bool Lbvh::restructureTreelet( unsigned root , std::vector<unsigned>& parents )
+{
+    // the treelet grows by expanding the leaf with the largest surface area
+    unsigned leaves[LBVH_TREELET_SIZE];
+    unsigned interiors[LBVH_TREELET_SIZE - 1];
+    unsigned leaf_num = 2 , interior_num = 1;
+    leaves[0] = m_lbvhNodes[root].child[0];
+    leaves[1] = m_lbvhNodes[root].child[1];
+    interiors[0] = root;
+    while( leaf_num < LBVH_TREELET_SIZE ){
+        int largest = -1;
+        float largest_area = -1.0f;
+        for( unsigned i = 0 ; i < leaf_num ; ++i ){
+            if( leaves[i] & LBVH_LEAF )
+                continue;
+            const float area = m_lbvhNodes[leaves[i]].bbox.HalfSurfaceArea();
+            if( area > largest_area ){
+                largest_area = area;
+                largest = (int)i;
+            }
+        }
+        if( largest < 0 )
+            break;
+        const Lbvh_Node& expanded = m_lbvhNodes[leaves[largest]];
+        interiors[interior_num++] = leaves[largest];
+        leaves[largest] = expanded.child[0];
+        leaves[leaf_num++] = expanded.child[1];
+    }
+    if( leaf_num < 3 )
+        return false;
+
+    // optimal cost of every subset of the leaves, subsets of a set are always smaller numbers than the set
+    const unsigned full = ( 1u << leaf_num ) - 1;
+    BBox        box[1 << LBVH_TREELET_SIZE];
+    float       cost[1 << LBVH_TREELET_SIZE];
+    unsigned    pri_num[1 << LBVH_TREELET_SIZE];
+    unsigned    partition[1 << LBVH_TREELET_SIZE];
+    for( unsigned i = 0 ; i < leaf_num ; ++i ){
+        const unsigned set = 1u << i;
+        if( leaves[i] & LBVH_LEAF ){
+            box[set] = m_sorted[leaves[i] & ~LBVH_LEAF]->GetBBox();
+            cost[set] = box[set].HalfSurfaceArea();
+            pri_num[set] = 1;
+        }else{
+            const Lbvh_Node& leaf = m_lbvhNodes[leaves[i]];
+            box[set] = leaf.bbox;
+            cost[set] = leaf.cost;
+            pri_num[set] = leaf.pri_num;
+        }
+    }
+    for( unsigned set = 1 ; set <= full ; ++set ){
+        const unsigned lowest = set & ( ~set + 1 );
+        if( set == lowest )
+            continue;
+        box[set] = Union( box[set ^ lowest] , box[lowest] );
+        pri_num[set] = pri_num[set ^ lowest] + pri_num[lowest];
+
+        // the part holding the lowest leaf is always the first one, so that every partition is only tried once
+        float best = FLT_MAX;
+        const unsigned rest = set ^ lowest;
+        for( unsigned sub = ( rest - 1 ) & rest ; ; sub = ( sub - 1 ) & rest ){
+            const unsigned part = sub | lowest;
+            if( cost[part] + cost[set ^ part] < best ){
+                best = cost[part] + cost[set ^ part];
+                partition[set] = part;
+            }
+            if( sub == 0 )
+                break;
+        }
+        const float area = box[set].HalfSurfaceArea();
+        cost[set] = ( pri_num[set] <= m_maxPriInLeaf ) ? min( area + best , area * pri_num[set] ) : area + best;
+    }
+    if( !( cost[full] < m_lbvhNodes[root].cost * 0.9999f ) )
+        return false;
+
+    // interior nodes of the treelet are reused, children are always assigned after their parent
+    unsigned sets[LBVH_TREELET_SIZE - 1];
+    sets[0] = full;
+    unsigned assigned = 1;
+    for( unsigned k = 0 ; k < assigned ; ++k ){
+        const unsigned node = interiors[k];
+        const unsigned parts[2] = { partition[sets[k]] , sets[k] ^ partition[sets[k]] };
+        for( unsigned c = 0 ; c < 2 ; ++c ){
+            unsigned child;
+            if( ( parts[c] & ( parts[c] - 1 ) ) == 0 ){
+                unsigned i = 0;
+                while( ( parts[c] >> i ) != 1 )
+                    ++i;
+                child = leaves[i];
+            }else{
+                sets[assigned] = parts[c];
+                child = interiors[assigned++];
+            }
+            m_lbvhNodes[node].child[c] = child;
+            if( child & LBVH_LEAF )
+                parents[child & ~LBVH_LEAF] = node;
+            else
+                m_lbvhNodes[child].parent = node;
+        }
+    }
+    for( unsigned k = assigned ; k > 0 ; --k )
+        updateNode( interiors[k-1] );
+    return true;
+}
+
+// flatten a subtree in depth first order
+bool Lbvh::flattenNode( unsigned node , unsigned depth )
+{
+    const unsigned index = (unsigned)m_buildNodes.size();
+    m_buildNodes.push_back( Bvh_LinearNode() );
+    m_bvhDepth = max( m_bvhDepth , depth );
+
+    if( node & LBVH_LEAF ){
+        Primitive* primitive = m_sorted[node & ~LBVH_LEAF];
+        m_buildNodes[index].bbox = primitive->GetBBox();
+        m_buildNodes[index].offset = (unsigned)m_leafPrimitives.size();
+        m_buildNodes[index].pri_num = 1;
+        m_leafPrimitives.push_back( primitive );
+        m_leafNode++;
+        m_maxLeafTriNum = max( m_maxLeafTriNum , 1u );
+        return true;
+    }
+
+    const Lbvh_Node& lnode = m_lbvhNodes[node];
+    m_buildNodes[index].bbox = lnode.bbox;
+    if( lnode.collapse || depth + 1 >= LBVH_MAX_DEPTH ){
+        if( lnode.pri_num > LBVH_MAX_PRI_IN_LEAF )
+            return false;
+
+        m_buildNodes[index].offset = (unsigned)m_leafPrimitives.size();
+        m_buildNodes[index].pri_num = lnode.pri_num;
+        gatherPrimitives( node );
+        m_leafNode++;
+        m_maxLeafTriNum = max( m_maxLeafTriNum , lnode.pri_num );
+        return true;
+    }
+
+    // children are ordered along the axis separating their centers the most, so that the traversal visits the near one first
+    BBox boxes[2];
+    for( unsigned c = 0 ; c < 2 ; ++c )
+        boxes[c] = ( lnode.child[c] & LBVH_LEAF ) ? m_sorted[lnode.child[c] & ~LBVH_LEAF]->GetBBox() : m_lbvhNodes[lnode.child[c]].bbox;
+    const Vector offset = ( boxes[1].m_Min + boxes[1].m_Max ) - ( boxes[0].m_Min + boxes[0].m_Max );
+    unsigned axis = 0;
+    for( unsigned k = 1 ; k < 3 ; ++k ){
+        if( fabs( offset[k] ) > fabs( offset[axis] ) )
+            axis = k;
+    }
+    const unsigned first = ( offset[axis] < 0.0f ) ? 1 : 0;
+
+    m_buildNodes[index].axis = axis;
+    if( !flattenNode( lnode.child[first] , depth + 1 ) )
+        return false;
+    m_buildNodes[index].offset = (unsigned)m_buildNodes.size();
+    return flattenNode( lnode.child[1 - first] , depth + 1 );
+}
+
+// append all primitives in a subtree to the leaf primitives
+void Lbvh::gatherPrimitives( unsigned node )
+{
+    if( node & LBVH_LEAF ){
+        m_leafPrimitives.push_back( m_sorted[node & ~LBVH_LEAF] );
+        return;
+    }
+    gatherPrimitives( m_lbvhNodes[node].child[0] );
+    gatherPrimitives( m_lbvhNodes[node].child[1] );
+}
@@ -0,0 +1,113 @@
+/*
+    This file is a part of SORT(Simple Open Ray Tracing), an open-source cross
+    platform physically based renderer.
+ 
+    Copyright (c) 2011-2016 by Cao Jiayin - All rights reserved.
+ 
+    SORT is a free software written for educational purpose. Anyone can distribute
+    or modify it under the the terms of the GNU General Public License Version 3 as
+    published by the Free Software Foundation. However, there is NO warranty that
+    all components are functional in a perfect manner. Without even the implied
+    warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License along with
+    this program. If not, see <http://www.gnu.org/licenses/gpl-3.0.html>.
+ */
+
+#pragma once
+
+#include "bvh.h"
+
+//! @brief Linear bounding volume hierarchy.
+/**
+ * LBVH is built by sorting the primitives along a Morton curve, the hierarchy is then
+ * emitted from the sorted Morton codes with all interior nodes processed in parallel.
+ * It is a lot faster to build than the SAH BVH at the cost of a lower quality, which
+ * makes it suitable for interactive previews where construction dominates.
+ * Please refer to this paper
+ * <a href="http://research.nvidia.com/sites/default/files/publications/karras2012hpg_paper.pdf">
+ * Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees</a> for further details.
+ * The quality could be improved by restructuring small treelets afterwards, please refer to
+ * <a href="http://research.nvidia.com/sites/default/files/publications/karras2013hpg_paper.pdf">
+ * Fast Parallel Construction of High-Quality Bounding Volume Hierarchies</a>.
+ * The result is flattened into the same nodes as Bvh, so they share traversal and caching.
+ */
+class Lbvh : public Bvh
+{
+public:
+    DEFINE_CREATOR( Lbvh , "lbvh" );
+
+    //! @brief Constructor.
+    //! @param treelet  Whether treelets are restructured after the hierarchy is emitted.
+    Lbvh( bool treelet = false ) : m_treelet( treelet ) {}
+
+    //! Build LBVH structure in O(N).
+    void Build() override;
+
+    //! Output log information
+    void OutputLog() const override;
+
+private:
+    //! Node of the binary radix tree emitted from the Morton codes.
+    struct Lbvh_Node
+    {
+        BBox        bbox;               /**< Bounding box of the node. */
+        unsigned    child[2];           /**< Children of the node, indices of sorted primitives are marked with LBVH_LEAF. */
+        unsigned    parent;             /**< Parent of the node. */
+        unsigned    pri_num;            /**< Number of primitives in the subtree. */
+        float       cost;               /**< SAH cost of the subtree, not normalized by the surface area of the root. */
+        bool        collapse;           /**< Whether the subtree is cheaper as a single leaf. */
+    };
+
+    const bool  m_treelet;              /**< Whether treelets are restructured. */
+    unsigned    m_treeletNum = 0;       /**< Number of treelets that are restructured. */
+    float       m_buildTime[4] = { 0 }; /**< Time spent on sorting, emission, bounding boxes and flattening in milliseconds. */
+    bool        m_fallback = false;     /**< Whether a SAH BVH is built instead because the LBVH is too deep. */
+
+    std::vector<Primitive*> m_sorted;   /**< Primitives sorted along the Morton curve. */
+    std::vector<Lbvh_Node>  m_lbvhNodes;    /**< Interior nodes of the radix tree. */
+
+    //! @brief Compute Morton codes of the primitive centroids and sort the primitives by them.
+    //! @param codes    Sorted Morton codes.
+    void sortPrimitives( std::vector<unsigned>& codes );
+
+    //! @brief Emit interior nodes of the radix tree from the sorted Morton codes.
+    //! @param codes    Sorted Morton codes.
+    //! @param parents  Parents of the sorted primitives.
+    void emitNodes( const std::vector<unsigned>& codes , std::vector<unsigned>& parents );
+
+    //! @brief Compute bounding boxes and SAH costs from the leaves up to the root, treelets are restructured meanwhile.
+    //! @param parents  Parents of the sorted primitives.
+    void refitNodes( std::vector<unsigned>& parents );
+
+    //! @brief Restructure the treelet rooted at a node so that its SAH cost is minimal.
+    //! @param root     Root of the treelet, the subtree is complete.
+    //! @param parents  Parents of the sorted primitives.
+    //! @return         Whether the treelet is changed.
+    bool restructureTreelet( unsigned root , std::vector<unsigned>& parents );
+
+    //! @brief Update bounding box, number of primitives and SAH cost of a node from its children.
+    //! @param node     The node to be updated.
+    void updateNode( unsigned node );
+
+    //! @brief Flatten a subtree into BVH nodes in depth first order.
+    //! @param node     The node in the radix tree, it could be a sorted primitive marked with LBVH_LEAF.
+    //! @param depth    Depth of the node.
+    //! @return         False if the subtree is too deep to be traversed.
+    bool flattenNode( unsigned node , unsigned depth );
+
+    //! @brief Append all primitives in a subtree to the primitives of the leaf nodes.
+    //! @param node     The node in the radix tree, it could be a sorted primitive marked with LBVH_LEAF.
+    void gatherPrimitives( unsigned node );
+};
+
+//! @brief LBVH whose treelets are restructured after emission.
+class LbvhTreelet : public Lbvh
+{
+public:
+    DEFINE_CREATOR( LbvhTreelet , "lbvh_treelet" );
+
+    //! Constructor.
+    LbvhTreelet() : Lbvh( true ) {}
+};
@@ -63,6 +63,7 @@ void OcTree::Build()
 	// create root node
 	m_pRoot = new OcTreeNode();
 	m_pRoot->bb = m_bbox;
+	m_memory.Allocate( sizeof( OcTreeNode ) );
 
 	// split octree node
 	splitNode( m_pRoot , container , 0 );
@@ -112,6 +113,7 @@ void OcTree::splitNode( OcTreeNode* node , NodeTriangleContainer* container , un
 		node->child[i] = new OcTreeNode();
 		childcontainer[i] = new NodeTriangleContainer();
 	}
+	m_memory.Allocate( 8 * sizeof( OcTreeNode ) );
 	
 	// get the center point of this tree node
 	int offset = 0;
@@ -173,6 +175,7 @@ void OcTree::makeLeaf( OcTreeNode* node , NodeTriangleContainer* container )
 {
     for( auto primitive : container->primitives )
 		node->primitives.push_back( primitive );
+	m_memory.Allocate( node->primitives.capacity() * sizeof( const Primitive* ) );
 	delete container;
 }
 
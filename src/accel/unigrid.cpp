@@ -141,6 +141,8 @@ void UniGrid::Build()
 	// allocate the memory
 	SAFE_DELETE_ARRAY( m_pVoxels );
 	m_pVoxels = new vector<Primitive*>[ m_voxelCount ];
+	m_memory.Release();
+	m_memory.Allocate( m_voxelCount * sizeof( vector<Primitive*> ) );
 
 	// distribute the primitives
 	vector<Primitive*>::const_iterator it = m_primitives->begin();
@@ -168,6 +170,12 @@ void UniGrid::Build()
 				}
 		it++;
 	}
+
+	// account for the primitive lists of all voxels
+	size_t bytes = 0;
+	for( unsigned i = 0 ; i < m_voxelCount ; i++ )
+		bytes += m_pVoxels[i].capacity() * sizeof( Primitive* );
+	m_memory.Allocate( bytes );
 }
 
 // voxel id from point
@@ -0,0 +1,484 @@
+/*
+    This file is a part of SORT(Simple Open Ray Tracing), an open-source cross
+    platform physically based renderer.
+ 
+    Copyright (c) 2011-2016 by Cao Jiayin - All rights reserved.
+ 
+    SORT is a free software written for educational purpose. Anyone can distribute
+    or modify it under the the terms of the GNU General Public License Version 3 as
+    published by the Free Software Foundation. However, there is NO warranty that
+    all components are functional in a perfect manner. Without even the implied
+    warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License along with
+    this program. If not, see <http://www.gnu.org/licenses/gpl-3.0.html>.
+ */
+
+#include "widebvh.h"
+#include "bvh.h"
+#include "geometry/ray.h"
+#include "geometry/intersection.h"
+#include "managers/logmanager.h"
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64)
+    #define SORT_WIDEBVH_SSE
+    #include <emmintrin.h>
+#endif
+
+// AVX2 is not part of the baseline instruction set, it is only used if the cpu reports it at runtime
+#if defined(SORT_WIDEBVH_SSE) && defined(__GNUC__)
+    #define SORT_WIDEBVH_AVX2
+    #include <immintrin.h>
+    #define SORT_AVX2   __attribute__((target("avx2")))
+#endif
+
+IMPLEMENT_CREATOR( Bvh4 );
+IMPLEMENT_CREATOR( Bvh8 );
+
+// children with this bit set are leaves
+static const unsigned   WIDEBVH_LEAF        = 0x80000000u;
+// the wide BVH is no deeper than the binary one, whose depth is limited to 64
+static const unsigned   WIDEBVH_STACK_SIZE  = 64 * 8;
+// nodes and triangle blocks are aligned to cache lines
+static const size_t     WIDEBVH_ALIGNMENT   = 64;
+// triangles passing the SIMD test are tested again by the primitive, the SIMD test is a bit more
+// tolerant than Triangle::GetIntersect so that no intersection is lost because of rounding
+static const float      WIDEBVH_UV_EPSILON  = 0.0002f;
+static const float      WIDEBVH_T_EPSILON   = 0.0001f;
+
+static_assert( sizeof( WideBvh_Node<4> ) == 128 && sizeof( WideBvh_Node<8> ) == 256 , "Wide BVH nodes are not padded to cache lines." );
+
+#if defined(SORT_WIDEBVH_AVX2)
+static bool _hasAvx2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports( "avx2" );
+}
+static const bool g_Avx2 = _hasAvx2();
+#else
+static const bool g_Avx2 = false;
+#endif
+
+// copy elements to memory aligned to cache lines
+template< typename T >
+static const T* _copyAligned( const std::vector<T>& src , std::unique_ptr<char[]>& memory )
+{
+    memory.reset( new char[ src.size() * sizeof( T ) + WIDEBVH_ALIGNMENT ] );
+    T* dst = (T*)( ( (uintptr_t)memory.get() + WIDEBVH_ALIGNMENT - 1 ) & ~(uintptr_t)( WIDEBVH_ALIGNMENT - 1 ) );
+    if( !src.empty() )
+        memcpy( dst , &src[0] , src.size() * sizeof( T ) );
+    return dst;
+}
+
+// Tests of the children of a node and the triangles of a block. A bit is set in the result for
+// each lane passing the test. This is the portable version, it works for any width.
+template< int N >
+struct WideBvh_Kernel
+{
+    static unsigned TestNode( const WideBvh_Node<N>& node , const WideBvh_Ray& ray , float tmax , float* tnear ){
+        unsigned mask = 0;
+        for( int i = 0 ; i < N ; ++i ){
+            float t0 = ray.tmin , t1 = tmax;
+            for( int axis = 0 ; axis < 3 ; ++axis ){
+                const float tn = ( ( ray.dir_is_neg[axis] ? node.bmax[axis][i] : node.bmin[axis][i] ) - ray.org[axis] ) * ray.inv_dir[axis];
+                const float tf = ( ( ray.dir_is_neg[axis] ? node.bmin[axis][i] : node.bmax[axis][i] ) - ray.org[axis] ) * ray.inv_dir[axis];
+                t0 = ( tn > t0 ) ? tn : t0;
+                t1 = ( tf < t1 ) ? tf : t1;
+            }
+            tnear[i] = t0;
+            mask |= ( t0 <= t1 ) ? ( 1u << i ) : 0u;
+        }
+        return mask;
+    }
+
+    static unsigned TestBlock( const WideBvh_TriBlock<N>& block , const WideBvh_Ray& ray , float tlo , float thi ){
+        const float* d = ray.dir;
+        unsigned mask = 0;
+        for( int i = 0 ; i < N ; ++i ){
+            const float e1[3] = { block.e1[0][i] , block.e1[1][i] , block.e1[2][i] };
+            const float e2[3] = { block.e2[0][i] , block.e2[1][i] , block.e2[2][i] };
+            const float s1[3] = { d[1] * e2[2] - d[2] * e2[1] , d[2] * e2[0] - d[0] * e2[2] , d[0] * e2[1] - d[1] * e2[0] };
+            const float inv_divisor = 1.0f / ( s1[0] * e1[0] + s1[1] * e1[1] + s1[2] * e1[2] );
+            const float o[3] = { ray.org[0] - block.v0[0][i] , ray.org[1] - block.v0[1][i] , ray.org[2] - block.v0[2][i] };
+            const float s2[3] = { o[1] * e1[2] - o[2] * e1[1] , o[2] * e1[0] - o[0] * e1[2] , o[0] * e1[1] - o[1] * e1[0] };
+            const float u = ( o[0] * s1[0] + o[1] * s1[1] + o[2] * s1[2] ) * inv_divisor;
+            const float v = ( d[0] * s2[0] + d[1] * s2[1] + d[2] * s2[2] ) * inv_divisor;
+            const float t = ( e2[0] * s2[0] + e2[1] * s2[1] + e2[2] * s2[2] ) * inv_divisor;
+            if( u >= -WIDEBVH_UV_EPSILON && u <= 1.0f + WIDEBVH_UV_EPSILON && v >= -WIDEBVH_UV_EPSILON &&
+                u + v <= 1.0f + WIDEBVH_UV_EPSILON && t >= tlo && t <= thi )
+                mask |= 1u << i;
+        }
+        return mask;
+    }
+};
+
+#if defined(SORT_WIDEBVH_SSE)
+template<>
+struct WideBvh_Kernel<4>
+{
+    static unsigned TestNode( const WideBvh_Node<4>& node , const WideBvh_Ray& ray , float tmax , float* tnear ){
+        __m128 t0 = _mm_set1_ps( ray.tmin );
+        __m128 t1 = _mm_set1_ps( tmax );
+        for( int axis = 0 ; axis < 3 ; ++axis ){
+            const __m128 org = _mm_set1_ps( ray.org[axis] );
+            const __m128 inv_dir = _mm_set1_ps( ray.inv_dir[axis] );
+            const __m128 tn = _mm_mul_ps( _mm_sub_ps( _mm_load_ps( ray.dir_is_neg[axis] ? node.bmax[axis] : node.bmin[axis] ) , org ) , inv_dir );
+            const __m128 tf = _mm_mul_ps( _mm_sub_ps( _mm_load_ps( ray.dir_is_neg[axis] ? node.bmin[axis] : node.bmax[axis] ) , org ) , inv_dir );
+            // min and max return the second operand if there is a NaN, which comes from a ray lying in the plane of a slab
+            t0 = _mm_max_ps( tn , t0 );
+            t1 = _mm_min_ps( tf , t1 );
+        }
+        _mm_storeu_ps( tnear , t0 );
+        return (unsigned)_mm_movemask_ps( _mm_cmple_ps( t0 , t1 ) );
+    }
+
+    static unsigned TestBlock( const WideBvh_TriBlock<4>& block , const WideBvh_Ray& ray , float tlo , float thi ){
+        const __m128 dx = _mm_set1_ps( ray.dir[0] ) , dy = _mm_set1_ps( ray.dir[1] ) , dz = _mm_set1_ps( ray.dir[2] );
+        const __m128 e1x = _mm_load_ps( block.e1[0] ) , e1y = _mm_load_ps( block.e1[1] ) , e1z = _mm_load_ps( block.e1[2] );
+        const __m128 e2x = _mm_load_ps( block.e2[0] ) , e2y = _mm_load_ps( block.e2[1] ) , e2z = _mm_load_ps( block.e2[2] );
+
+        const __m128 s1x = _mm_sub_ps( _mm_mul_ps( dy , e2z ) , _mm_mul_ps( dz , e2y ) );
+        const __m128 s1y = _mm_sub_ps( _mm_mul_ps( dz , e2x ) , _mm_mul_ps( dx , e2z ) );
+        const __m128 s1z = _mm_sub_ps( _mm_mul_ps( dx , e2y ) , _mm_mul_ps( dy , e2x ) );
+        const __m128 divisor = _mm_add_ps( _mm_add_ps( _mm_mul_ps( s1x , e1x ) , _mm_mul_ps( s1y , e1y ) ) , _mm_mul_ps( s1z , e1z ) );
+        const __m128 inv_divisor = _mm_div_ps( _mm_set1_ps( 1.0f ) , divisor );
+
+        const __m128 ox = _mm_sub_ps( _mm_set1_ps( ray.org[0] ) , _mm_load_ps( block.v0[0] ) );
+        const __m128 oy = _mm_sub_ps( _mm_set1_ps( ray.org[1] ) , _mm_load_ps( block.v0[1] ) );
+        const __m128 oz = _mm_sub_ps( _mm_set1_ps( ray.org[2] ) , _mm_load_ps( block.v0[2] ) );
+        const __m128 s2x = _mm_sub_ps( _mm_mul_ps( oy , e1z ) , _mm_mul_ps( oz , e1y ) );
+        const __m128 s2y = _mm_sub_ps( _mm_mul_ps( oz , e1x ) , _mm_mul_ps( ox , e1z ) );
+        const __m128 s2z = _mm_sub_ps( _mm_mul_ps( ox , e1y ) , _mm_mul_ps( oy , e1x ) );
+
+        const __m128 u = _mm_mul_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( ox , s1x ) , _mm_mul_ps( oy , s1y ) ) , _mm_mul_ps( oz , s1z ) ) , inv_divisor );
+        const __m128 v = _mm_mul_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( dx , s2x ) , _mm_mul_ps( dy , s2y ) ) , _mm_mul_ps( dz , s2z ) ) , inv_divisor );
+        const __m128 t = _mm_mul_ps( _mm_add_ps( _mm_add_ps( _mm_mul_ps( e2x , s2x ) , _mm_mul_ps( e2y , s2y ) ) , _mm_mul_ps( e2z , s2z ) ) , inv_divisor );
+
+        // empty lanes have zero edges, the NaN fails all comparisons
+        const __m128 lo = _mm_set1_ps( -WIDEBVH_UV_EPSILON );
+        const __m128 hi = _mm_set1_ps( 1.0f + WIDEBVH_UV_EPSILON );
+        __m128 mask = _mm_and_ps( _mm_cmpge_ps( u , lo ) , _mm_cmple_ps( u , hi ) );
+        mask = _mm_and_ps( mask , _mm_cmpge_ps( v , lo ) );
+        mask = _mm_and_ps( mask , _mm_cmple_ps( _mm_add_ps( u , v ) , hi ) );
+        mask = _mm_and_ps( mask , _mm_cmpge_ps( t , _mm_set1_ps( tlo ) ) );
+        mask = _mm_and_ps( mask , _mm_cmple_ps( t , _mm_set1_ps( thi ) ) );
+        return (unsigned)_mm_movemask_ps( mask );
+    }
+};
+#endif
+
+#if defined(SORT_WIDEBVH_AVX2)
+template<>
+struct WideBvh_Kernel<8>
+{
+    SORT_AVX2 static unsigned TestNode( const WideBvh_Node<8>& node , const WideBvh_Ray& ray , float tmax , float* tnear ){
+        __m256 t0 = _mm256_set1_ps( ray.tmin );
+        __m256 t1 = _mm256_set1_ps( tmax );
+        for( int axis = 0 ; axis < 3 ; ++axis ){
+            const __m256 org = _mm256_set1_ps( ray.org[axis] );
+            const __m256 inv_dir = _mm256_set1_ps( ray.inv_dir[axis] );
+            const __m256 tn = _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( ray.dir_is_neg[axis] ? node.bmax[axis] : node.bmin[axis] ) , org ) , inv_dir );
+            const __m256 tf = _mm256_mul_ps( _mm256_sub_ps( _mm256_load_ps( ray.dir_is_neg[axis] ? node.bmin[axis] : node.bmax[axis] ) , org ) , inv_dir );
+            // min and max return the second operand if there is a NaN, which comes from a ray lying in the plane of a slab
+            t0 = _mm256_max_ps( tn , t0 );
+            t1 = _mm256_min_ps( tf , t1 );
+        }
+        _mm256_storeu_ps( tnear , t0 );
+        return (unsigned)_mm256_movemask_ps( _mm256_cmp_ps( t0 , t1 , _CMP_LE_OQ ) );
+    }
+
+    SORT_AVX2 static unsigned TestBlock( const WideBvh_TriBlock<8>& block , const WideBvh_Ray& ray , float tlo , float thi ){
+        const __m256 dx = _mm256_set1_ps( ray.dir[0] ) , dy = _mm256_set1_ps( ray.dir[1] ) , dz = _mm256_set1_ps( ray.dir[2] );
+        const __m256 e1x = _mm256_load_ps( block.e1[0] ) , e1y = _mm256_load_ps( block.e1[1] ) , e1z = _mm256_load_ps( block.e1[2] );
+        const __m256 e2x = _mm256_load_ps( block.e2[0] ) , e2y = _mm256_load_ps( block.e2[1] ) , e2z = _mm256_load_ps( block.e2[2] );
+
+        const __m256 s1x = _mm256_sub_ps( _mm256_mul_ps( dy , e2z ) , _mm256_mul_ps( dz , e2y ) );
+        const __m256 s1y = _mm256_sub_ps( _mm256_mul_ps( dz , e2x ) , _mm256_mul_ps( dx , e2z ) );
+        const __m256 s1z = _mm256_sub_ps( _mm256_mul_ps( dx , e2y ) , _mm256_mul_ps( dy , e2x ) );
+        const __m256 divisor = _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( s1x , e1x ) , _mm256_mul_ps( s1y , e1y ) ) , _mm256_mul_ps( s1z , e1z ) );
+        const __m256 inv_divisor = _mm256_div_ps( _mm256_set1_ps( 1.0f ) , divisor );
+
+        const __m256 ox = _mm256_sub_ps( _mm256_set1_ps( ray.org[0] ) , _mm256_load_ps( block.v0[0] ) );
+        const __m256 oy = _mm256_sub_ps( _mm256_set1_ps( ray.org[1] ) , _mm256_load_ps( block.v0[1] ) );
+        const __m256 oz = _mm256_sub_ps( _mm256_set1_ps( ray.org[2] ) , _mm256_load_ps( block.v0[2] ) );
+        const __m256 s2x = _mm256_sub_ps( _mm256_mul_ps( oy , e1z ) , _mm256_mul_ps( oz , e1y ) );
+        const __m256 s2y = _mm256_sub_ps( _mm256_mul_ps( oz , e1x ) , _mm256_mul_ps( ox , e1z ) );
+        const __m256 s2z = _mm256_sub_ps( _mm256_mul_ps( ox , e1y ) , _mm256_mul_ps( oy , e1x ) );
+
+        const __m256 u = _mm256_mul_ps( _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( ox , s1x ) , _mm256_mul_ps( oy , s1y ) ) , _mm256_mul_ps( oz , s1z ) ) , inv_divisor );
+        const __m256 v = _mm256_mul_ps( _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( dx , s2x ) , _mm256_mul_ps( dy , s2y ) ) , _mm256_mul_ps( dz , s2z ) ) , inv_divisor );
+        const __m256 t = _mm256_mul_ps( _mm256_add_ps( _mm256_add_ps( _mm256_mul_ps( e2x , s2x ) , _mm256_mul_ps( e2y , s2y ) ) , _mm256_mul_ps( e2z , s2z ) ) , inv_divisor );
+
+        // empty lanes have zero edges, the NaN fails all comparisons
+        const __m256 lo = _mm256_set1_ps( -WIDEBVH_UV_EPSILON );
+        const __m256 hi = _mm256_set1_ps( 1.0f + WIDEBVH_UV_EPSILON );
+        __m256 mask = _mm256_and_ps( _mm256_cmp_ps( u , lo , _CMP_GE_OQ ) , _mm256_cmp_ps( u , hi , _CMP_LE_OQ ) );
+        mask = _mm256_and_ps( mask , _mm256_cmp_ps( v , lo , _CMP_GE_OQ ) );
+        mask = _mm256_and_ps( mask , _mm256_cmp_ps( _mm256_add_ps( u , v ) , hi , _CMP_LE_OQ ) );
+        mask = _mm256_and_ps( mask , _mm256_cmp_ps( t , _mm256_set1_ps( tlo ) , _CMP_GE_OQ ) );
+        mask = _mm256_and_ps( mask , _mm256_cmp_ps( t , _mm256_set1_ps( thi ) , _CMP_LE_OQ ) );
+        return (unsigned)_mm256_movemask_ps( mask );
+    }
+};
+#endif
+
+// get the intersection between the ray and the primitive set
+bool WideBvh::GetIntersect( const Ray& r , Intersection* intersect ) const
+{
+    if( m_leaves.empty() )
+        return false;
+
+    if( m_width == 8 )
+        return traverse<8>( r , intersect );
+    return traverse<4>( r , intersect );
+}
+
+// build the acceleration structure
+void WideBvh::Build()
+{
+    computeBBox();
+
+    if( m_width == 8 && !g_Avx2 ){
+        LOG_WARNING<<"AVX2 is not supported by the cpu, a BVH with four children per node is built instead."<<ENDL;
+        m_width = 4;
+    }
+
+    if( m_primitives->empty() )
+        return;
+
+    // the binary BVH is only needed during construction
+    Bvh bvh;
+    bvh.SetPrimitives( m_primitives );
+    bvh.Build();
+    if( m_width == 8 )
+        collapse<8>( bvh );
+    else
+        collapse<4>( bvh );
+
+    const size_t node_size = ( m_width == 8 ) ? sizeof( WideBvh_Node<8> ) : sizeof( WideBvh_Node<4> );
+    const size_t block_size = ( m_width == 8 ) ? sizeof( WideBvh_TriBlock<8> ) : sizeof( WideBvh_TriBlock<4> );
+    m_memory.Allocate( m_totalNode * node_size + m_blockCount * block_size + m_leaves.size() * sizeof( WideBvh_Leaf ) +
+                       ( m_blockPrimitives.size() + m_otherPrimitives.size() ) * sizeof( Primitive* ) );
+}
+
+// output log information
+void WideBvh::OutputLog() const
+{
+#if defined(SORT_WIDEBVH_SSE)
+    const char* isa = ( m_width == 8 ) ? "avx2" : "sse";
+#else
+    const char* isa = "portable";
+#endif
+    unsigned used_lanes = 0;
+    for( const Primitive* primitive : m_blockPrimitives )
+        used_lanes += ( primitive != nullptr );
+
+    LOG_HEADER( "Accelerator" );
+    LOG<<"Accelerator Type :\tWide Bounding Volume Hierarchy"<<ENDL;
+    LOG<<"Node Width       :\t"<<m_width<<" ("<<isa<<")"<<ENDL;
+    LOG<<"BVH Depth        :\t"<<m_depth<<ENDL;
+    LOG<<"Total Node Count :\t"<<m_totalNode<<ENDL;
+    LOG<<"Leaf Node Count  :\t"<<(unsigned)m_leaves.size()<<ENDL;
+    LOG<<"Children per node:\t"<<( m_totalNode ? (float)m_childCount / m_totalNode : 0.0f )<<ENDL;
+    LOG<<"Triangle blocks  :\t"<<m_blockCount<<ENDL;
+    LOG<<"Lanes used in blocks:\t"<<( m_blockCount ? (float)used_lanes / ( m_blockCount * m_width ) : 0.0f )<<ENDL<<ENDL;
+}
+
+// collapse the binary BVH
+template< int N >
+void WideBvh::collapse( const Bvh& bvh )
+{
+    std::vector<WideBvh_Node<N>> nodes;
+    std::vector<WideBvh_TriBlock<N>> blocks;
+    nodes.reserve( bvh.GetNodeCount() / ( N - 1 ) + 1 );
+    m_root = collapseNode<N>( bvh , 0 , nodes , blocks , 0 );
+
+    m_totalNode = (unsigned)nodes.size();
+    m_blockCount = (unsigned)blocks.size();
+    m_nodes = _copyAligned( nodes , m_nodeMemory );
+    m_blocks = _copyAligned( blocks , m_blockMemory );
+}
+
+// create a wide node from a sub-tree of the binary BVH
+template< int N >
+unsigned WideBvh::collapseNode( const Bvh& bvh , unsigned index , std::vector<WideBvh_Node<N>>& nodes ,
+                                std::vector<WideBvh_TriBlock<N>>& blocks , unsigned depth )
+{
+    const Bvh::Bvh_LinearNode* bnodes = bvh.GetNodes();
+    if( bnodes[index].pri_num != 0 )
+        return makeLeaf<N>( bvh , index , blocks );
+
+    // open the child with the largest surface area until there are N children
+    unsigned children[N];
+    unsigned count = 2;
+    children[0] = index + 1;
+    children[1] = bnodes[index].offset;
+    while( count < N ){
+        int best = -1;
+        float best_area = -1.0f;
+        for( unsigned i = 0 ; i < count ; ++i ){
+            const Bvh::Bvh_LinearNode& child = bnodes[children[i]];
+            if( child.pri_num == 0 && child.bbox.HalfSurfaceArea() > best_area ){
+                best = i;
+                best_area = child.bbox.HalfSurfaceArea();
+            }
+        }
+        if( best < 0 )
+            break;
+        const unsigned opened = children[best];
+        children[best] = opened + 1;
+        children[count++] = bnodes[opened].offset;
+    }
+
+    // empty lanes have inverted infinite boxes, no ray could hit them
+    const unsigned node = (unsigned)nodes.size();
+    nodes.push_back( WideBvh_Node<N>() );
+    for( unsigned i = 0 ; i < N ; ++i ){
+        for( unsigned axis = 0 ; axis < 3 ; ++axis ){
+            nodes[node].bmin[axis][i] = ( i < count ) ? bnodes[children[i]].bbox.m_Min[axis] : INFINITY;
+            nodes[node].bmax[axis][i] = ( i < count ) ? bnodes[children[i]].bbox.m_Max[axis] : -INFINITY;
+        }
+    }
+    m_depth = max( m_depth , depth + 1 );
+    m_childCount += count;
+
+    for( unsigned i = 0 ; i < count ; ++i ){
+        const unsigned child = collapseNode<N>( bvh , children[i] , nodes , blocks , depth + 1 );
+        nodes[node].child[i] = child;
+    }
+    return node;
+}
+
+// create a leaf from a leaf of the binary BVH
+template< int N >
+unsigned WideBvh::makeLeaf( const Bvh& bvh , unsigned index , std::vector<WideBvh_TriBlock<N>>& blocks )
+{
+    const Bvh::Bvh_LinearNode& bnode = bvh.GetNodes()[index];
+    const std::vector<Primitive*>& primitives = bvh.GetLeafPrimitives();
+
+    WideBvh_Leaf leaf;
+    leaf.block_offset = (unsigned)blocks.size();
+    leaf.block_num = 0;
+    leaf.other_offset = (unsigned)m_otherPrimitives.size();
+    leaf.other_num = 0;
+
+    unsigned lane = N;
+    for( unsigned i = bnode.offset ; i < bnode.offset + bnode.pri_num ; ++i ){
+        Primitive* primitive = primitives[i];
+        Point p0 , p1 , p2;
+        if( !primitive->GetVertices( p0 , p1 , p2 ) ){
+            m_otherPrimitives.push_back( primitive );
+            ++leaf.other_num;
+            continue;
+        }
+
+        if( lane == N ){
+            blocks.push_back( WideBvh_TriBlock<N>() );
+            m_blockPrimitives.resize( blocks.size() * N , nullptr );
+            ++leaf.block_num;
+            lane = 0;
+        }
+        WideBvh_TriBlock<N>& block = blocks.back();
+        for( unsigned axis = 0 ; axis < 3 ; ++axis ){
+            block.v0[axis][lane] = p0[axis];
+            block.e1[axis][lane] = p1[axis] - p0[axis];
+            block.e2[axis][lane] = p2[axis] - p0[axis];
+        }
+        m_blockPrimitives[( blocks.size() - 1 ) * N + lane] = primitive;
+        ++lane;
+    }
+
+    m_leaves.push_back( leaf );
+    return WIDEBVH_LEAF | (unsigned)( m_leaves.size() - 1 );
+}
+
+// traverse the wide BVH
+template< int N >
+bool WideBvh::traverse( const Ray& r , Intersection* intersect ) const
+{
+    float fmax;
+    const float fmin = Intersect( r , m_bbox , &fmax );
+    if( fmin < 0.0f )
+        return false;
+
+    // the reciprocal of the direction and its sign are shared by all tests
+    WideBvh_Ray ray;
+    for( unsigned axis = 0 ; axis < 3 ; ++axis ){
+        ray.org[axis] = r.m_Ori[axis];
+        ray.dir[axis] = r.m_Dir[axis];
+        ray.inv_dir[axis] = 1.0f / r.m_Dir[axis];
+        ray.dir_is_neg[axis] = ray.inv_dir[axis] < 0.0f;
+    }
+    ray.tmin = r.m_fMin;
+
+    const WideBvh_Node<N>* nodes = (const WideBvh_Node<N>*)m_nodes;
+    const WideBvh_TriBlock<N>* blocks = (const WideBvh_TriBlock<N>*)m_blocks;
+
+    // nodes are pushed with the entry distance, they are skipped if something nearer is found meanwhile
+    struct StackEntry
+    {
+        unsigned    node;
+        float       tnear;
+    };
+    StackEntry stack[WIDEBVH_STACK_SIZE];
+    unsigned stack_top = 0;
+    stack[stack_top++] = { m_root , fmin };
+
+    bool inter = false;
+    while( stack_top > 0 ){
+        const StackEntry entry = stack[--stack_top];
+        float tmax = ( intersect && intersect->t < r.m_fMax ) ? intersect->t : r.m_fMax;
+        if( entry.tnear > tmax )
+            continue;
+
+        if( entry.node & WIDEBVH_LEAF ){
+            const WideBvh_Leaf& leaf = m_leaves[entry.node & ~WIDEBVH_LEAF];
+            for( unsigned b = leaf.block_offset ; b < leaf.block_offset + leaf.block_num ; ++b ){
+                tmax = ( intersect && intersect->t < r.m_fMax ) ? intersect->t : r.m_fMax;
+                const float tlo = r.m_fMin - WIDEBVH_T_EPSILON * ( 1.0f + fabs( r.m_fMin ) );
+                const float thi = tmax + WIDEBVH_T_EPSILON * ( 1.0f + fabs( tmax ) );
+                const unsigned mask = WideBvh_Kernel<N>::TestBlock( blocks[b] , ray , tlo , thi );
+                for( unsigned lane = 0 ; mask >> lane ; ++lane ){
+                    const Primitive* primitive = m_blockPrimitives[b * N + lane];
+                    if( ( mask & ( 1u << lane ) ) && primitive && primitive->GetIntersect( r , intersect ) ){
+                        inter = true;
+                        if( intersect == 0 )
+                            return true;
+                    }
+                }
+            }
+            for( unsigned i = leaf.other_offset ; i < leaf.other_offset + leaf.other_num ; ++i ){
+                if( m_otherPrimitives[i]->GetIntersect( r , intersect ) ){
+                    inter = true;
+                    if( intersect == 0 )
+                        return true;
+                }
+            }
+            continue;
+        }
+
+        // children are pushed from far to near so that the nearest one is visited first
+        const WideBvh_Node<N>& node = nodes[entry.node];
+        float tnear[N];
+        const unsigned mask = WideBvh_Kernel<N>::TestNode( node , ray , tmax , tnear );
+        const unsigned first = stack_top;
+        for( unsigned lane = 0 ; mask >> lane ; ++lane ){
+            if( !( mask & ( 1u << lane ) ) )
+                continue;
+            unsigned i = stack_top++;
+            while( i > first && stack[i-1].tnear < tnear[lane] ){
+                stack[i] = stack[i-1];
+                --i;
+            }
+            stack[i] = { node.child[lane] , tnear[lane] };
+        }
+    }
+
+    if( intersect == 0 )
+        return inter;
+    return intersect->primitive != 0;
+}
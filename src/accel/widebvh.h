@@ -0,0 +1,173 @@
+/*
+    This file is a part of SORT(Simple Open Ray Tracing), an open-source cross
+    platform physically based renderer.
+ 
+    Copyright (c) 2011-2016 by Cao Jiayin - All rights reserved.
+ 
+    SORT is a free software written for educational purpose. Anyone can distribute
+    or modify it under the the terms of the GNU General Public License Version 3 as
+    published by the Free Software Foundation. However, there is NO warranty that
+    all components are functional in a perfect manner. Without even the implied
+    warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License along with
+    this program. If not, see <http://www.gnu.org/licenses/gpl-3.0.html>.
+ */
+
+#pragma once
+
+#include "accelerator.h"
+#include "geometry/primitive.h"
+#include <memory>
+
+class Bvh;
+
+//! @brief Node of a wide BVH, bounding boxes of the children are stored in SoA layout.
+template< int N >
+struct WideBvh_Node
+{
+    float       bmin[3][N];     /**< Minimum corners of the bounding boxes of the children, one row per axis. */
+    float       bmax[3][N];     /**< Maximum corners of the bounding boxes of the children, one row per axis. */
+    unsigned    child[N];       /**< Index of a child node, or index of a leaf if WIDEBVH_LEAF is set. */
+    unsigned    padding[N];     /**< Nodes are padded to a multiple of the cache line size. */
+};
+
+//! @brief N triangles of a leaf in SoA layout, the ray is tested against all of them at once.
+template< int N >
+struct WideBvh_TriBlock
+{
+    float       v0[3][N];       /**< The first vertex of the triangles. */
+    float       e1[3][N];       /**< Edge from the first vertex to the second one. */
+    float       e2[3][N];       /**< Edge from the first vertex to the third one. */
+};
+
+//! @brief Leaf of a wide BVH.
+struct WideBvh_Leaf
+{
+    unsigned    block_offset;   /**< Offset of the first triangle block of the leaf. */
+    unsigned    block_num;      /**< Number of triangle blocks in the leaf. */
+    unsigned    other_offset;   /**< Offset of the first primitive that is not a triangle. */
+    unsigned    other_num;      /**< Number of primitives that are not triangles. */
+};
+
+//! @brief Ray data shared by all node and triangle tests of a traversal.
+struct WideBvh_Ray
+{
+    float       org[3];         /**< Origin of the ray. */
+    float       dir[3];         /**< Direction of the ray. */
+    float       inv_dir[3];     /**< Reciprocal of the direction. */
+    unsigned    dir_is_neg[3];  /**< Whether the direction is negative along each axis. */
+    float       tmin;           /**< Minimum range along the ray. */
+};
+
+//! @brief Bounding volume hierarchy with four or eight children per node.
+/**
+ * A wide BVH is collapsed from the binary SAH BVH, each node pulls in the grand children with
+ * the largest surface area until it has four or eight children. Triangles in the leaves are
+ * stored as vertex and edges in SoA blocks of the same width. A single SIMD instruction stream
+ * tests the ray against all children of a node, or all triangles of a block, at once. The
+ * triangles passing the test are checked again by Primitive::GetIntersect, which fills the
+ * intersection, so the results are exactly the same as the other accelerators.
+ * Four wide nodes are tested with SSE, eight wide ones with AVX2. The instruction set is
+ * picked by CPUID at runtime, a cpu without AVX2 falls back to four wide nodes.
+ * Please refer to this paper
+ * <a href="https://www.embree.org/papers/2008-EGSR-MultiBVH.pdf">Getting Rid of Packets -
+ * Efficient SIMD Single-Ray Traversal using Multi-branching BVHs</a> for further details.
+ */
+class WideBvh : public Accelerator
+{
+public:
+    //! @brief Constructor.
+    //! @param width    Number of children per node, it is either 4 or 8.
+    WideBvh( unsigned width ) : m_width( width ) {}
+
+    //! @brief Get intersection between the ray and the primitive set using the wide BVH.
+    //!
+    //! It will return true if there is intersection between the ray and the primitive set.
+    //! In case of an existed intersection, if intersect is not empty, it will fill the
+    //! structure and return the nearest intersection.
+    //! If intersect is nullptr, it will stop as long as one intersection is found, it is not
+    //! necessary to be the nearest one.
+    //! False will be returned if there is no intersection at all.
+    //! @param r            The input ray to be tested.
+    //! @param intersect    The intersection result. If a nullptr pointer is provided, it stops as
+    //!                     long as it finds an intersection.
+    //! @return             It will return true if there is an intersection, otherwise it returns false.
+    bool GetIntersect( const Ray& r , Intersection* intersect ) const override;
+
+    //! Build the binary BVH and collapse it.
+    void Build() override;
+
+    //! Output log information
+    void OutputLog() const override;
+
+private:
+    unsigned                    m_width;                /**< Number of children per node. */
+    unsigned                    m_root = 0;             /**< The root, it could be a leaf if there are only a few primitives. */
+
+    std::unique_ptr<char[]>     m_nodeMemory;           /**< Memory holding the nodes. */
+    const void*                 m_nodes = nullptr;      /**< Nodes aligned to cache lines, their type depends on the width. */
+    std::unique_ptr<char[]>     m_blockMemory;          /**< Memory holding the triangle blocks. */
+    const void*                 m_blocks = nullptr;     /**< Triangle blocks aligned to cache lines, their type depends on the width. */
+    std::vector<Primitive*>     m_blockPrimitives;      /**< Primitive of each lane in the triangle blocks, it is null for empty lanes. */
+    std::vector<Primitive*>     m_otherPrimitives;      /**< Primitives that are not triangles. */
+    std::vector<WideBvh_Leaf>   m_leaves;               /**< Leaves of the wide BVH. */
+
+    // BVH information
+    unsigned    m_totalNode = 0;        /**< Total number of nodes in the wide BVH. */
+    unsigned    m_depth = 0;            /**< Depth of the wide BVH. */
+    unsigned    m_childCount = 0;       /**< Total number of children of all nodes. */
+    unsigned    m_blockCount = 0;       /**< Total number of triangle blocks. */
+
+    //! @brief Collapse the binary BVH into nodes of N children.
+    //! @param bvh      The binary BVH.
+    template< int N >
+    void collapse( const Bvh& bvh );
+
+    //! @brief Create a wide node from a sub-tree of the binary BVH.
+    //! @param bvh      The binary BVH.
+    //! @param index    Index of the root of the sub-tree in the binary BVH.
+    //! @param nodes    Nodes of the wide BVH.
+    //! @param blocks   Triangle blocks of the wide BVH.
+    //! @param depth    Depth of the wide node.
+    //! @return         Index of the wide node, or index of a leaf with WIDEBVH_LEAF set.
+    template< int N >
+    unsigned collapseNode( const Bvh& bvh , unsigned index , std::vector<WideBvh_Node<N>>& nodes ,
+                           std::vector<WideBvh_TriBlock<N>>& blocks , unsigned depth );
+
+    //! @brief Create a leaf from a leaf of the binary BVH.
+    //! @param bvh      The binary BVH.
+    //! @param index    Index of the leaf in the binary BVH.
+    //! @param blocks   Triangle blocks of the wide BVH.
+    //! @return         Index of the leaf with WIDEBVH_LEAF set.
+    template< int N >
+    unsigned makeLeaf( const Bvh& bvh , unsigned index , std::vector<WideBvh_TriBlock<N>>& blocks );
+
+    //! @brief Traverse the wide BVH.
+    //! @param ray          The ray to be tested.
+    //! @param intersect    The intersection result, it could be nullptr for shadow rays.
+    //! @return             Whether any intersection is found.
+    template< int N >
+    bool traverse( const Ray& ray , Intersection* intersect ) const;
+};
+
+//! @brief BVH with four children per node, they are tested with SSE.
+class Bvh4 : public WideBvh
+{
+public:
+    DEFINE_CREATOR( Bvh4 , "bvh4" );
+
+    //! Constructor.
+    Bvh4() : WideBvh( 4 ) {}
+};
+
+//! @brief BVH with eight children per node, they are tested with AVX2.
+class Bvh8 : public WideBvh
+{
+public:
+    DEFINE_CREATOR( Bvh8 , "bvh8" );
+
+    //! Constructor.
+    Bvh8() : WideBvh( 8 ) {}
+};
@@ -68,6 +68,7 @@ void FourierBxdf::LoadData( const string& filename )
     bsdfTable.a = new float[coeff];
     bsdfTable.a0 = new float[sqMu];
     bsdfTable.recip = new float[bsdfTable.nMu];
+    m_memory.Allocate( ( bsdfTable.nMu * 2 + sqMu * 2 + coeff ) * sizeof( float ) + sqMu * 2 * sizeof( int ) );
     
     if(!ReadFile( (char*)bsdfTable.mu , bsdfTable.nMu * sizeof(float) ) ||
        !ReadFile( (char*)bsdfTable.cdf , sqMu * sizeof(float) ) ||
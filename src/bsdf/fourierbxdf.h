@@ -19,6 +19,7 @@
 
 // include header file
 #include "bxdf.h"
+#include "utility/memstats.h"
 
 //! @brief FourierBxdf.
 /**
@@ -99,6 +100,7 @@ private:
     };
     
     FourierBxdfTable    bsdfTable;
+    MemAccount          m_memory{ MEM_BXDF_TABLE };     // memory of the table in memory statistics
     
     // Fourier interpolation
     float fourier( const float* ak , int m , double cosPhi ) const;
@@ -61,6 +61,7 @@ void Merl::LoadData( const string& filename )
     unsigned size = 3 * trunksize;
     m_data = new double[size];
     file.read( (char*)m_data , sizeof( double ) * size );
+    m_memory.Allocate( sizeof( double ) * size );
     
     unsigned offset = 0;
     for( unsigned i = 0 ; i < trunksize ; i++ )
@@ -18,6 +18,7 @@
 #pragma once
 
 #include "bxdf.h"
+#include "utility/memstats.h"
 
 //! @brief  MERL brdf.
 /**
@@ -54,4 +55,5 @@ public:
 
 private:
 	double*	m_data = nullptr;   /**< The actual data of MERL brdf. */
+	MemAccount m_memory{ MEM_BXDF_TABLE };  /**< Memory of the data in memory statistics. */
 };
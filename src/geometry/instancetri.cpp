@@ -80,3 +80,13 @@ const BBox& InstanceTriangle::GetBBox() const
 
 	return *m_bbox;
 }
+
+// get the vertices of the triangle
+bool InstanceTriangle::GetVertices( Point& p0 , Point& p1 , Point& p2 ) const
+{
+	const BufferMemory* mem = m_trimesh->m_pMemory;
+	p0 = (*transform)(mem->m_PositionBuffer[m_Index[0].posIndex]);
+	p1 = (*transform)(mem->m_PositionBuffer[m_Index[1].posIndex]);
+	p2 = (*transform)(mem->m_PositionBuffer[m_Index[2].posIndex]);
+	return true;
+}
@@ -46,6 +46,9 @@ public:
 	// get the bounding box of the triangle
 	const BBox&	GetBBox() const;
 
+	// get the vertices of the triangle in world space
+	bool GetVertices( Point& p0 , Point& p1 , Point& p2 ) const;
+
 // private field
 private:
 	// the transformation of the triangle
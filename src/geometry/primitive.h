@@ -48,6 +48,11 @@ public:
 	// get the bounding box of the primitive
 	virtual const BBox&	GetBBox() const = 0;
 
+	// get the vertices of the primitive in world space
+	// para 'p0' , 'p1' , 'p2' : the three vertices
+	// result : false if the primitive is not a triangle
+	virtual bool GetVertices( Point& p0 , Point& p1 , Point& p2 ) const { return false; }
+
 	// get surface area of the primitive
 	virtual float	SurfaceArea() const = 0;
 
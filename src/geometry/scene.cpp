@@ -24,6 +24,8 @@
 #include "utility/samplemethod.h"
 #include "utility/sassert.h"
 #include "managers/matmanager.h"
+#include "utility/scenecache.h"
+#include "utility/multithread/threadpool.h"
 #include "light/light.h"
 #include "shape/shape.h"
 
@@ -185,6 +187,7 @@ bool Scene::LoadScene( const string& str )
 		// set cooresponding type of accelerator
 		const char* type = accelNode->Attribute( "type" );
 		if( type != 0 )	m_pAccelerator = CREATE_TYPE( type , Accelerator );
+		if( m_pAccelerator ) m_accelType = type;
 	}
 
 	// restore resource path
@@ -284,10 +287,50 @@ void Scene::PreProcess()
 	if( m_pAccelerator )
 	{
 		m_pAccelerator->SetPrimitives( &m_triBuf );
-		m_pAccelerator->Build();
+
+		// the structure is picked from the scene cache if it was built for the same primitives before
+		const unsigned long long key = _accelCacheKey();
+		const string cache_entry = key ? SceneCache::GetSingleton().GetEntryPath( key , "accel" ) : string();
+		CacheReader reader;
+		if( key && reader.Open( cache_entry , key ) && m_pAccelerator->LoadCache( reader ) )
+			SceneCache::GetSingleton().AddHit( reader.GetSize() );
+		else
+		{
+			m_pAccelerator->Build();
+
+			if( key )
+				SceneCache::GetSingleton().AddMiss();
+			CacheWriter writer;
+			if( key && writer.Open( cache_entry , key ) )
+			{
+				m_pAccelerator->SaveCache( writer );
+				if( !writer.Close() )
+					LOG_WARNING<<"Failed to write scene cache entry \'"<<cache_entry<<"\'."<<ENDL;
+			}
+		}
 	}
 }
 
+// key of the acceleration structure in the scene cache
+unsigned long long Scene::_accelCacheKey() const
+{
+	if( !SceneCache::GetSingleton().IsEnabled() || !m_pAccelerator->SupportCache() )
+		return 0;
+
+	// the structure only depends on the bounding boxes of the primitives and the type of it
+	vector<BBox> boxes( m_triBuf.size() );
+	ThreadPool::GetSingleton().ParallelFor( 0 , (unsigned)boxes.size() , 4096 , [&]( unsigned b , unsigned e ){
+		for( unsigned i = b ; i < e ; ++i )
+			boxes[i] = m_triBuf[i]->GetBBox();
+	});
+	unsigned long long key = HashMemory( m_accelType.c_str() , m_accelType.size() );
+	if( !boxes.empty() )
+		key = HashMemory( &boxes[0] , boxes.size() * sizeof( BBox ) , key );
+
+	// zero is reserved for the entries not cached
+	return key ? key : 1;
+}
+
 // parse transformation
 Transform Scene::_parseTransform( const TiXmlElement* node )
 {
@@ -110,6 +110,8 @@ private:
 
 	// the acceleration structure for the scene
 	Accelerator*		m_pAccelerator;
+	// the type of the acceleration structure
+	string		m_accelType;
 
 	// the file name for the scene
 	string		m_filename;
@@ -127,6 +129,10 @@ private:
 	// generate triangle buffer
 	void	_generateTriBuf();
 
+	// key of the acceleration structure in the scene cache
+	// result   : zero if the acceleration structure is not cached
+	unsigned long long	_accelCacheKey() const;
+
 	// initialize default data
 	void	_init();
 
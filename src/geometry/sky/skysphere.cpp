@@ -21,6 +21,7 @@
 #include "geometry/ray.h"
 #include "utility/samplemethod.h"
 #include "managers/memmanager.h"
+#include "utility/multithread/threadpool.h"
 
 IMPLEMENT_CREATOR( SkySphere );
 
@@ -71,14 +72,16 @@ void SkySphere::_generateDistribution2D()
 	unsigned nv = m_sky.GetHeight();
 	Sort_Assert( nu != 0 && nv != 0 );
 	float* data = new float[nu*nv];
-	for( unsigned i = 0 ; i < nv ; i++ )
-	{
-		unsigned offset = i * nu;
-		float sin_theta = sin( (float)i / (float)nv * PI );
-
-		for( unsigned j = 0 ; j < nu ; j++ )
-			data[offset+j] = max( 0.0f , m_sky.GetColor( (int)j , (int)i ).GetIntensity() * sin_theta );
-	}
+	ThreadPool::GetSingleton().ParallelFor( 0 , nv , 16 , [&]( unsigned b , unsigned e ){
+		for( unsigned i = b ; i < e ; i++ )
+		{
+			unsigned offset = i * nu;
+			float sin_theta = sin( (float)i / (float)nv * PI );
+
+			for( unsigned j = 0 ; j < nu ; j++ )
+				data[offset+j] = max( 0.0f , m_sky.GetColor( (int)j , (int)i ).GetIntensity() * sin_theta );
+		}
+	});
 
 	distribution = new Distribution2D( data , nu , nv );
 
@@ -131,6 +131,16 @@ const BBox& Triangle::GetBBox() const
 	return *m_bbox;
 }
 
+// get the vertices of the triangle
+bool Triangle::GetVertices( Point& p0 , Point& p1 , Point& p2 ) const
+{
+	const BufferMemory* mem = m_trimesh->m_pMemory;
+	p0 = mem->m_PositionBuffer[m_Index[0].posIndex];
+	p1 = mem->m_PositionBuffer[m_Index[1].posIndex];
+	p2 = mem->m_PositionBuffer[m_Index[2].posIndex];
+	return true;
+}
+
 // get the surface area of the triangle
 float Triangle::SurfaceArea() const
 {
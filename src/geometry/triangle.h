@@ -56,6 +56,11 @@ public:
 	// get the bounding box of the triangle
 	virtual const BBox&	GetBBox() const;
 
+	// get the vertices of the triangle in world space
+	// para 'p0' , 'p1' , 'p2' : the three vertices
+	// result : always true
+	virtual bool GetVertices( Point& p0 , Point& p1 , Point& p2 ) const;
+
 	// get the surface area
 	virtual float SurfaceArea() const;
 
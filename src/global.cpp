@@ -20,3 +20,6 @@ int		g_iTileSize = 64;		// default tile size is 64 x 64 square
 
 // blender mode
 bool	g_bBlenderMode = false;	// whether blender mode is enabled
+
+// resume mode
+bool	g_bResumeMode = false;	// whether rendering continues from the last checkpoint
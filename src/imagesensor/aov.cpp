@@ -0,0 +1,220 @@
+/*
+    This file is a part of SORT(Simple Open Ray Tracing), an open-source cross
+    platform physically based renderer.
+ 
+    Copyright (c) 2011-2016 by Cao Jiayin - All rights reserved.
+ 
+    SORT is a free software written for educational purpose. Anyone can distribute
+    or modify it under the the terms of the GNU General Public License Version 3 as
+    published by the Free Software Foundation. However, there is NO warranty that
+    all components are functional in a perfect manner. Without even the implied
+    warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License along with
+    this program. If not, see <http://www.gnu.org/licenses/gpl-3.0.html>.
+ */
+
+
+#include "aov.h"
+#include "geometry/intersection.h"
+#include "geometry/primitive.h"
+#include "material/material.h"
+#include "bsdf/bsdf.h"
+#include "sampler/sample.h"
+#include "texture/rendertarget.h"
+#include "managers/texio/exrio.h"
+#include "utility/strhelper.h"
+#include <sstream>
+
+// number of components of each channel, the variance keeps the sum and the squared sum of the luminance
+static const unsigned AOV_COMPONENTS[AOV_CHANNEL_NUM] = { 1 , 3 , 3 , 1 , 3 , 3 , 2 };
+// name of each channel and its components in the exr file
+static const char* AOV_NAMES[AOV_CHANNEL_NUM] = { "depth" , "normal" , "albedo" , "primitive" , "direct" , "indirect" , "variance" };
+static const char* AOV_COMPONENT_NAMES[AOV_CHANNEL_NUM][3] = {
+    { "Z" } , { "X" , "Y" , "Z" } , { "R" , "G" , "B" } , { "id" } , { "R" , "G" , "B" } , { "R" , "G" , "B" } , { "Y" } };
+// the albedo is estimated with this number of stratified bsdf samples in each dimension
+static const unsigned ALBEDO_SAMPLE_GRID = 4;
+
+void AovSample::SetFirstHit( const Intersection* inter , const Vector& wo )
+{
+    hitPublished = true;
+    if( !inter ){
+        depth = 0.0f;
+        normal = Vector();
+        albedo = Spectrum();
+        primitive = AOV_BACKGROUND_ID;
+        return;
+    }
+
+    depth = inter->t;
+    normal = inter->normal;
+    primitive = inter->primitive->GetID();
+
+    // the directional albedo is estimated with a fixed set of stratified samples instead of random numbers,
+    // drawing from the random sequence of the render thread would change the rendered image once AOVs are enabled
+    const Bsdf* bsdf = inter->primitive->GetMaterial()->GetBsdf( inter );
+    const unsigned sample_num = ALBEDO_SAMPLE_GRID * ALBEDO_SAMPLE_GRID;
+    albedo = Spectrum();
+    for( unsigned i = 0 ; i < sample_num ; ++i ){
+        BsdfSample bs;
+        bs.u = ( i % ALBEDO_SAMPLE_GRID + 0.5f ) / ALBEDO_SAMPLE_GRID;
+        bs.v = ( i / ALBEDO_SAMPLE_GRID + 0.5f ) / ALBEDO_SAMPLE_GRID;
+        bs.t = ( i + 0.5f ) / sample_num;
+        Vector wi;
+        float pdf = 0.0f;
+        const Spectrum f = bsdf->sample_f( wo , wi , bs , &pdf );
+        if( pdf > 0.0f )
+            albedo += f * AbsDot( wi , inter->normal ) / pdf;
+    }
+    albedo = albedo / (float)sample_num;
+}
+
+AovBuffer::AovBuffer( unsigned mask ) : m_mask( mask )
+{
+    m_planeNum = 0;
+    for( unsigned i = 0 ; i < AOV_CHANNEL_NUM ; ++i ){
+        // primitive ids are kept as integers apart from the planes
+        m_offset[i] = ( IsEnabled( (AOV_CHANNEL)i ) && i != AOV_PRIMITIVE_ID ) ? (int)m_planeNum : -1;
+        if( m_offset[i] >= 0 )
+            m_planeNum += AOV_COMPONENTS[i];
+    }
+    // the last plane is the number of samples of each pixel
+    ++m_planeNum;
+}
+
+unsigned AovBuffer::MaskFromStr( const string& str )
+{
+    unsigned mask = 0;
+    std::istringstream stream( str );
+    string name;
+    while( stream >> name ){
+        transform( name.begin() , name.end() , name.begin() , ToLower() );
+        if( name == "all" )
+            mask = ( 1u << AOV_CHANNEL_NUM ) - 1;
+        for( unsigned i = 0 ; i < AOV_CHANNEL_NUM ; ++i ){
+            if( name == AOV_NAMES[i] )
+                mask |= 1u << i;
+        }
+    }
+    return mask;
+}
+
+const char* AovBuffer::GetName( AOV_CHANNEL channel )
+{
+    return AOV_NAMES[channel];
+}
+
+void AovBuffer::Reset( int width , int height )
+{
+    m_width = width;
+    m_height = height;
+    m_data.assign( m_planeNum * width * height , 0.0f );
+    m_primitiveIds.assign( IsEnabled( AOV_PRIMITIVE_ID ) ? width * height : 0 , AOV_BACKGROUND_ID );
+    m_memory.Release();
+    m_memory.Allocate( m_data.size() * sizeof( float ) + m_primitiveIds.size() * sizeof( unsigned ) );
+}
+
+void AovBuffer::AddPixel( int x , int y , const AovSample& sum , float lum , float lum2 , unsigned count )
+{
+    const int pixel = y * m_width + x;
+    auto add = [&]( AOV_CHANNEL channel , unsigned component , float v ){
+        _plane( channel , component )[pixel] += v;
+    };
+
+    if( m_offset[AOV_DEPTH] >= 0 )
+        add( AOV_DEPTH , 0 , sum.depth );
+    if( m_offset[AOV_NORMAL] >= 0 ){
+        add( AOV_NORMAL , 0 , sum.normal.x );
+        add( AOV_NORMAL , 1 , sum.normal.y );
+        add( AOV_NORMAL , 2 , sum.normal.z );
+    }
+    if( m_offset[AOV_ALBEDO] >= 0 ){
+        add( AOV_ALBEDO , 0 , sum.albedo.GetR() );
+        add( AOV_ALBEDO , 1 , sum.albedo.GetG() );
+        add( AOV_ALBEDO , 2 , sum.albedo.GetB() );
+    }
+    if( !m_primitiveIds.empty() )
+        m_primitiveIds[pixel] = sum.primitive;
+    if( m_offset[AOV_DIRECT] >= 0 ){
+        add( AOV_DIRECT , 0 , sum.direct.GetR() );
+        add( AOV_DIRECT , 1 , sum.direct.GetG() );
+        add( AOV_DIRECT , 2 , sum.direct.GetB() );
+    }
+    if( m_offset[AOV_INDIRECT] >= 0 ){
+        add( AOV_INDIRECT , 0 , sum.indirect.GetR() );
+        add( AOV_INDIRECT , 1 , sum.indirect.GetG() );
+        add( AOV_INDIRECT , 2 , sum.indirect.GetB() );
+    }
+    if( m_offset[AOV_VARIANCE] >= 0 ){
+        add( AOV_VARIANCE , 0 , lum );
+        add( AOV_VARIANCE , 1 , lum2 );
+    }
+    m_data[( m_planeNum - 1 ) * m_width * m_height + pixel] += (float)count;
+}
+
+void AovBuffer::GetChannel( AOV_CHANNEL channel , unsigned component , std::vector<float>& plane ) const
+{
+    const unsigned pixel_num = m_width * m_height;
+    const float* count = &m_data[( m_planeNum - 1 ) * pixel_num];
+    plane.assign( pixel_num , 0.0f );
+
+    if( channel == AOV_VARIANCE ){
+        // variance of the mean of the luminance
+        const float* sum = _plane( channel , 0 );
+        const float* sum2 = _plane( channel , 1 );
+        for( unsigned k = 0 ; k < pixel_num ; ++k ){
+            if( count[k] > 1.0f )
+                plane[k] = max( 0.0f , ( sum2[k] - sum[k] * sum[k] / count[k] ) / ( count[k] * ( count[k] - 1.0f ) ) );
+        }
+        return;
+    }
+
+    const float* src = _plane( channel , component );
+    for( unsigned k = 0 ; k < pixel_num ; ++k )
+        plane[k] = ( count[k] > 0.0f ) ? src[k] / count[k] : 0.0f;
+}
+
+void AovBuffer::Output( const string& filename , const RenderTarget& beauty ) const
+{
+    const unsigned pixel_num = m_width * m_height;
+
+    // the rendered image is the default layer
+    std::vector<string> names = { "R" , "G" , "B" };
+    std::vector<std::vector<float>> planes( 3 , std::vector<float>( pixel_num ) );
+    for( int y = 0 ; y < m_height ; ++y )
+        for( int x = 0 ; x < m_width ; ++x ){
+            const Spectrum c = beauty.GetColor( x , y );
+            planes[0][y * m_width + x] = c.GetR();
+            planes[1][y * m_width + x] = c.GetG();
+            planes[2][y * m_width + x] = c.GetB();
+        }
+
+    for( unsigned i = 0 ; i < AOV_CHANNEL_NUM ; ++i ){
+        if( m_offset[i] < 0 )
+            continue;
+
+        // the variance keeps two sums, but it is resolved into one value
+        const AOV_CHANNEL channel = (AOV_CHANNEL)i;
+        const unsigned component_num = ( channel == AOV_VARIANCE ) ? 1 : AOV_COMPONENTS[i];
+        for( unsigned c = 0 ; c < component_num ; ++c ){
+            std::vector<float> plane;
+            GetChannel( channel , c , plane );
+            names.push_back( string( AOV_NAMES[i] ) + "." + AOV_COMPONENT_NAMES[i][c] );
+            planes.push_back( std::move( plane ) );
+        }
+    }
+
+    std::vector<const float*> data;
+    for( const std::vector<float>& plane : planes )
+        data.push_back( plane.data() );
+
+    // primitive ids are written as integers
+    std::vector<string> uint_names;
+    std::vector<const unsigned*> uint_data;
+    if( !m_primitiveIds.empty() ){
+        uint_names.push_back( string( AOV_NAMES[AOV_PRIMITIVE_ID] ) + "." + AOV_COMPONENT_NAMES[AOV_PRIMITIVE_ID][0] );
+        uint_data.push_back( m_primitiveIds.data() );
+    }
+    ExrIO::WriteChannels( filename , m_width , m_height , names , data , uint_names , uint_data );
+}
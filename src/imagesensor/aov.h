@@ -0,0 +1,164 @@
+/*
+    This file is a part of SORT(Simple Open Ray Tracing), an open-source cross
+    platform physically based renderer.
+ 
+    Copyright (c) 2011-2016 by Cao Jiayin - All rights reserved.
+ 
+    SORT is a free software written for educational purpose. Anyone can distribute
+    or modify it under the the terms of the GNU General Public License Version 3 as
+    published by the Free Software Foundation. However, there is NO warranty that
+    all components are functional in a perfect manner. Without even the implied
+    warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License along with
+    this program. If not, see <http://www.gnu.org/licenses/gpl-3.0.html>.
+ */
+
+
+#pragma once
+
+#include "sort.h"
+#include "spectrum/spectrum.h"
+#include "math/vector3.h"
+#include "utility/memstats.h"
+#include <vector>
+
+class Intersection;
+class RenderTarget;
+
+//! @brief Auxiliary output variables written next to the rendered image.
+enum AOV_CHANNEL
+{
+    AOV_DEPTH = 0,      /**< Distance from the camera to the first hit. */
+    AOV_NORMAL,         /**< World space normal at the first hit. */
+    AOV_ALBEDO,         /**< Directional albedo of the surface at the first hit. */
+    AOV_PRIMITIVE_ID,   /**< Id of the primitive at the first hit, AOV_BACKGROUND_ID for the background. */
+    AOV_DIRECT,         /**< Radiance reaching the camera after at most one bounce. */
+    AOV_INDIRECT,       /**< Radiance reaching the camera after more than one bounce. */
+    AOV_VARIANCE,       /**< Variance of the estimated luminance of the pixel. */
+    AOV_CHANNEL_NUM
+};
+
+//! @brief Primitive id of pixels where nothing is hit.
+static const unsigned AOV_BACKGROUND_ID = 0xffffffff;
+
+//! @brief Auxiliary values of a single camera sample.
+/**
+ * Render tasks hand a record to the integrator through the pixel sample only if AOVs are enabled,
+ * integrators fill in the values they know about. Values of the first hit are evaluated by the
+ * render task itself if the integrator doesn't publish them.
+ */
+class AovSample
+{
+public:
+    float       depth = 0.0f;           /**< Distance from the camera to the first hit, zero for the background. */
+    Vector      normal;                 /**< World space normal at the first hit. */
+    Spectrum    albedo;                 /**< Directional albedo at the first hit. */
+    unsigned    primitive = AOV_BACKGROUND_ID;  /**< Id of the primitive at the first hit. */
+    Spectrum    direct;                 /**< Radiance after at most one bounce. */
+    Spectrum    indirect;               /**< Radiance after more than one bounce. */
+    bool        hitPublished = false;   /**< Whether values of the first hit are published. */
+
+    //! @brief Add the values of another sample, the primitive id is replaced instead.
+    void Accumulate( const AovSample& sample ){
+        depth += sample.depth;
+        normal += sample.normal;
+        albedo += sample.albedo;
+        primitive = sample.primitive;
+        direct += sample.direct;
+        indirect += sample.indirect;
+    }
+
+    //! @brief Publish values of the first hit.
+    //! @param inter    The first intersection of the camera ray, it is null if nothing is hit.
+    //! @param wo       Direction from the hit point towards the camera.
+    void SetFirstHit( const Intersection* inter , const Vector& wo );
+};
+
+//! @brief Auxiliary output variables of all pixels in structure-of-arrays layout.
+/**
+ * Every component of every enabled channel is kept in a separate plane of the image, so
+ * that each plane is handed to the exr writer as it is. Samples are summed up, values are
+ * divided by the number of samples once the image is written, which makes the buffer work the
+ * same way with progressive rendering and adaptive sampling. The primitive id is never averaged,
+ * the one of the last sample is kept. It is stored as an integer apart from the float planes,
+ * floats only represent ids up to 2^24 exactly.
+ */
+class AovBuffer
+{
+public:
+    //! @brief Constructor.
+    //! @param mask     Bit mask of enabled channels.
+    AovBuffer( unsigned mask );
+
+    //! @brief Parse a space separated list of channel names, "all" enables all channels.
+    //! @return         Bit mask of the channels, unknown names are ignored.
+    static unsigned MaskFromStr( const string& str );
+
+    //! @brief Name of a channel, which is also the name of the layer in the exr file.
+    static const char* GetName( AOV_CHANNEL channel );
+
+    //! @brief Bit mask of enabled channels.
+    unsigned GetMask() const{
+        return m_mask;
+    }
+
+    //! @brief Whether a channel is enabled.
+    bool IsEnabled( AOV_CHANNEL channel ) const{
+        return ( m_mask & ( 1u << channel ) ) != 0;
+    }
+
+    //! @brief Clear the buffer.
+    //! @param width    Width of the image.
+    //! @param height   Height of the image.
+    void Reset( int width , int height );
+
+    //! @brief Add the samples of a pixel, a pixel is only touched by one thread at a time.
+    //! @param x        Horizontal coordinate of the pixel.
+    //! @param y        Vertical coordinate of the pixel.
+    //! @param sum      Sum of the auxiliary values of all samples.
+    //! @param lum      Sum of the luminance of all samples.
+    //! @param lum2     Sum of the squared luminance of all samples.
+    //! @param count    Number of samples.
+    void AddPixel( int x , int y , const AovSample& sum , float lum , float lum2 , unsigned count );
+
+    //! @brief Get the resolved value of a component of an enabled channel of all pixels.
+    //! @param channel      The channel, it has to be enabled and it can't be the primitive id.
+    //! @param component    Component of the channel, the variance only has one component.
+    //! @param plane        One value per pixel, row by row.
+    void GetChannel( AOV_CHANNEL channel , unsigned component , std::vector<float>& plane ) const;
+
+    //! @brief Write the rendered image and all enabled channels as layers of one exr file.
+    //! @param filename Name of the exr file.
+    //! @param beauty   The rendered image, it is the default layer of the file.
+    void Output( const string& filename , const RenderTarget& beauty ) const;
+
+    //! @brief Planes of all pixels, used by checkpoints.
+    std::vector<float>& GetData(){
+        return m_data;
+    }
+
+    //! @brief Primitive ids of all pixels, it is empty if the channel is disabled.
+    std::vector<unsigned>& GetPrimitiveIds(){
+        return m_primitiveIds;
+    }
+
+private:
+    int             m_offset[AOV_CHANNEL_NUM];  /**< First plane of each channel, -1 if it is disabled or not kept in the planes. */
+    unsigned        m_mask;                 /**< Bit mask of enabled channels. */
+    int             m_width = 0;            /**< Width of the image. */
+    int             m_height = 0;           /**< Height of the image. */
+    unsigned        m_planeNum = 0;         /**< Number of planes including the sample count. */
+    std::vector<float>  m_data;             /**< All planes, one after another. */
+    std::vector<unsigned>   m_primitiveIds; /**< Primitive id of each pixel. */
+    MemAccount      m_memory{ MEM_FRAMEBUFFER };    /**< Memory of the planes in memory statistics. */
+
+    //! @brief Plane of a component of a channel.
+    float* _plane( AOV_CHANNEL channel , unsigned component ){
+        return &m_data[( m_offset[channel] + component ) * m_width * m_height];
+    }
+    const float* _plane( AOV_CHANNEL channel , unsigned component ) const{
+        return &m_data[( m_offset[channel] + component ) * m_width * m_height];
+    }
+};
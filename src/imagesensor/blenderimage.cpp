@@ -18,6 +18,7 @@
 #include "blenderimage.h"
 #include "utility/multithread/multithread.h"
 #include "managers/smmanager.h"
+#include <atomic>
 
 // tile size
 extern int g_iTileSize;
@@ -25,42 +26,132 @@ extern int g_iTileSize;
 // store pixel information
 void BlenderImage::StorePixel( int x , int y , const Spectrum& color , const RenderTask& rt )
 {
-	if (!m_sharedMemory.bytes)
+	if (!m_pixels)
 		return;
 
-	int tile_w = rt.size.x;
+	// pixels are written in place, the tile is not visible to blender until it is published
+	const float rgb[3] = { color.GetR() , color.GetG() , color.GetB() };
+	_storeTileRow( x , y , 1 , rgb );
+
+	// for final update, a pixel is only stored by one thread while splats go to the splat buffer
+	m_rendertarget.SetColor( x , y , color );
+}
+
+// finish image tile
+void BlenderImage::FinishTile( int tile_x , int tile_y , const RenderTask& rt )
+{
+	if (!m_pixels)
+		return;
+
+	const int tile = tile_y * m_tilenum_x + tile_x;
+
+	// pixels are reconstructed once the film tiles of the task are merged, the guard bands of
+	// the neighbouring tasks that are not finished yet are missing until the final update
+	if( m_film )
+	{
+		_lockTile( tile );
+		std::vector<float> row( 3 * rt.size.x );
+		for( int y = rt.ori.y ; y < rt.ori.y + rt.size.y ; ++y )
+		{
+			for( int x = 0 ; x < rt.size.x ; ++x )
+			{
+				const Spectrum c = m_film->GetColor( rt.ori.x + x , y );
+				row[3 * x] = c.GetR();
+				row[3 * x + 1] = c.GetG();
+				row[3 * x + 2] = c.GetB();
+			}
+			_storeTileRow( rt.ori.x , y , rt.size.x , row.data() );
+		}
+	}
+
+	// it is only called by the main thread after the tile is popped from the completion ring
+	_publishTile( tile );
+}
+
+// write pixels of a row to a tile in the shared memory
+void BlenderImage::_storeTileRow( int x , int y , int count , const float* rgb )
+{
+	int ori_x = x - x % g_iTileSize;
+	int ori_y = y - y % g_iTileSize;
+	int tile_w = min( g_iTileSize , m_width - ori_x );
 	int tile_size = g_iTileSize * g_iTileSize;
-	int x_off = (int)(rt.ori.x / g_iTileSize);
-	int y_off = (int)(floor((m_height - 1 - rt.ori.y) / (float)g_iTileSize));
+	int x_off = (int)(ori_x / g_iTileSize);
+	int y_off = (int)(floor((m_height - 1 - ori_y) / (float)g_iTileSize));
 	int tile_offset = y_off * m_tilenum_x + x_off;
-	int offset = 4 * tile_offset * tile_size;
-
-	// get the data pointer
-	float* data = (float*)(m_sharedMemory.bytes + m_header_offset);
+	int offset = tile_offset * tile_size;
 
 	// get offset
-	int inner_offset = offset + 4 * (x - rt.ori.x + (g_iTileSize - 1 - (y - rt.ori.y)) * tile_w);
-
-	// copy data
-	data[ inner_offset ] = color.GetR();
-	data[ inner_offset + 1 ] = color.GetG();
-	data[ inner_offset + 2 ] = color.GetB();
-	data[ inner_offset + 3 ] = 1.0f;
-
-	// for final update
-	m_mutex[x][y].Lock();
-	Spectrum _color = m_rendertarget.GetColor(x,y);
-	m_rendertarget.SetColor(x, y, color+_color);
-	m_mutex[x][y].Unlock();
+	int inner_offset = offset + x - ori_x + (g_iTileSize - 1 - (y - ori_y)) * tile_w;
+
+	// convert the pixels to the format of the shared memory
+	EncodePixels( GetFramebufferFormat() , rgb , count , m_pixels + inner_offset * m_pixelSize , true );
 }
 
-// finish image tile
-void BlenderImage::FinishTile( int tile_x , int tile_y , const RenderTask& rt )
+// mark a tile as being rewritten
+void BlenderImage::_lockTile( int tile )
 {
-	if (!m_sharedMemory.bytes)
+	// an odd version tells blender that the pixels of the tile are not consistent
+	m_tileVersions[tile] |= 1;
+	std::atomic_thread_fence( std::memory_order_release );
+}
+
+// publish a tile
+void BlenderImage::_publishTile( int tile )
+{
+	// the pixels land in the shared memory before the new version
+	std::atomic_thread_fence( std::memory_order_release );
+	const unsigned version = ( m_tileVersions[tile] | 1 ) + 1;
+	m_tileVersions[tile] = version;
+
+	// the sequence is written after the rest of the descriptor, blender drops descriptors with a stale
+	// sequence, which happens if the ring wraps around before blender reads them
+	const unsigned head = m_header->ringHead;
+	BlenderTileDescriptor& desc = m_ring[ head % m_header->ringCapacity ];
+	desc.sequence = 0;
+	std::atomic_thread_fence( std::memory_order_release );
+	desc.tile = tile;
+	desc.version = version;
+	std::atomic_thread_fence( std::memory_order_release );
+	desc.sequence = head + 1;
+	std::atomic_thread_fence( std::memory_order_release );
+	m_header->ringHead = head + 1;
+}
+
+// rewrite and publish all tiles
+void BlenderImage::_publishRenderTarget()
+{
+	const int tile_num = m_tilenum_x * m_tilenum_y;
+	for( int i = 0 ; i < tile_num ; ++i )
+		_lockTile( i );
+
+	std::vector<float> row( 3 * m_width );
+	for( int y = 0 ; y < m_height ; ++y )
+	{
+		m_rendertarget.GetRow( y , row.data() );
+		for( int x = 0 ; x < m_width ; x += g_iTileSize )
+			_storeTileRow( x , y , min( g_iTileSize , m_width - x ) , &row[3 * x] );
+	}
+
+	for( int i = 0 ; i < tile_num ; ++i )
+		_publishTile( i );
+}
+
+// publish an intermediate frame
+void BlenderImage::PublishFrame( unsigned passes )
+{
+	ImageSensor::PublishFrame( passes );
+
+	if (!m_pixels)
 		return;
 
-	m_sharedMemory.bytes[tile_y * m_tilenum_x + tile_x] = 1;
+	_publishRenderTarget();
+}
+
+// size of the shared memory
+int BlenderImage::SharedMemorySize( int w , int h , int tile_size , PIXEL_FORMAT format )
+{
+	const int tile_num = (int)(ceil(w / (float)tile_size)) * (int)(ceil(h / (float)tile_size));
+	return _pixelOffset( tile_num ) + tile_num * tile_size * tile_size * (int)PixelFormatSize( format , true );
 }
 
 // pre process
@@ -68,10 +159,28 @@ void BlenderImage::PreProcess()
 {
 	m_tilenum_x = (int)(ceil(m_width / (float)g_iTileSize));
 	m_tilenum_y = (int)(ceil(m_height / (float)g_iTileSize));
-	m_header_offset = m_tilenum_x * m_tilenum_y;
-	m_final_update_flag_offset = m_header_offset * g_iTileSize * g_iTileSize * 4 * sizeof(float) * 2 + m_header_offset + 1;
 
 	m_sharedMemory = SMManager::GetSingleton().GetSharedMemory("SORTBLEND_SHAREMEM");
+	if( m_sharedMemory.bytes && m_sharedMemory.size >= SharedMemorySize( m_width , m_height , g_iTileSize , GetFramebufferFormat() ) )
+	{
+		const int tile_num = m_tilenum_x * m_tilenum_y;
+		m_header = (BlenderSharedHeader*)m_sharedMemory.bytes;
+		m_tileVersions = (unsigned*)( m_sharedMemory.bytes + _versionOffset() );
+		m_ring = (BlenderTileDescriptor*)( m_sharedMemory.bytes + _ringOffset( tile_num ) );
+		m_pixels = (unsigned char*)( m_sharedMemory.bytes + _pixelOffset( tile_num ) );
+		m_pixelSize = PixelFormatSize( GetFramebufferFormat() , true );
+
+		m_header->version = BLENDER_SM_VERSION;
+		m_header->width = m_width;
+		m_header->height = m_height;
+		m_header->tileSize = g_iTileSize;
+		m_header->tileNumX = m_tilenum_x;
+		m_header->tileNumY = m_tilenum_y;
+		m_header->ringCapacity = 2 * tile_num;
+		m_header->pixelFormat = GetFramebufferFormat();
+		std::atomic_thread_fence( std::memory_order_release );
+		m_header->magic = BLENDER_SM_MAGIC;
+	}
 
 	ImageSensor::PreProcess();
 }
@@ -79,22 +188,17 @@ void BlenderImage::PreProcess()
 // post process
 void BlenderImage::PostProcess()
 {
-	// perform a copy from render target to shared memory
-	float* data = (float*)(m_sharedMemory.bytes + m_header_offset + m_header_offset * g_iTileSize * g_iTileSize * 4 * sizeof(float));
+	// merge the splats first
+	ImageSensor::PostProcess();
 
-	int offset = 0;
-	for (int i = 0; i < (int)m_rendertarget.GetHeight(); ++i)
-		for (int j = 0; j < (int)m_rendertarget.GetWidth(); ++j)
-		{
-			const Spectrum& c = m_rendertarget.GetColor(j, m_rendertarget.GetHeight() - i - 1);
-			data[offset++] = c.GetR();
-			data[offset++] = c.GetG();
-			data[offset++] = c.GetB();
-			data[offset++] = 1.0f;
-		}
+	if (!m_pixels)
+		return;
 
-	// signal a final update
-	m_sharedMemory.bytes[m_final_update_flag_offset] = 1;
+	// pixels of the shared memory are already final unless they are resolved after the tiles are done
+	if( m_progressive || m_film || m_splat )
+		_publishRenderTarget();
 
-	ImageSensor::PostProcess();
+	// signal a final update
+	std::atomic_thread_fence( std::memory_order_release );
+	m_header->finalUpdate = 1;
 }
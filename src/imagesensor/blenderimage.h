@@ -22,6 +22,41 @@
 #include "texture/rendertarget.h"
 #include "managers/smmanager.h"
 
+// version of the shared memory protocol, sortblend/renderer.py has to agree on it
+#define	BLENDER_SM_MAGIC	0x54524F53		// 'SORT'
+#define	BLENDER_SM_VERSION	3
+
+// The shared memory between SORT and blender is laid out as
+//		header | version of each tile | ring of tile descriptors | pixels of all tiles
+// Pixels are written only once in place, a tile is published by bumping its version and pushing
+// a descriptor in the ring, blender follows the ring and maps the pixels without copying them.
+// All integers are 32 bits little endian, sortblend/renderer.py relies on the same layout.
+struct BlenderSharedHeader
+{
+	unsigned	magic;				// BLENDER_SM_MAGIC, it is written once the layout is ready
+	unsigned	version;			// BLENDER_SM_VERSION
+	unsigned	width;				// width of the image
+	unsigned	height;				// height of the image
+	unsigned	tileSize;			// size of the tiles
+	unsigned	tileNumX;			// number of tiles along x
+	unsigned	tileNumY;			// number of tiles along y
+	unsigned	progress;			// progress of the rendering in percentage
+	unsigned	finalUpdate;		// it is set once all tiles hold the final image
+	unsigned	ringCapacity;		// number of descriptors in the ring
+	unsigned	ringHead;			// number of descriptors published so far
+	unsigned	pixelFormat;		// PIXEL_FORMAT of the pixels, float and half pixels have an alpha channel
+	unsigned	reserved[4];
+};
+
+// descriptor of an updated tile in the ring
+struct BlenderTileDescriptor
+{
+	unsigned	sequence;			// index of the descriptor plus one, it is written last
+	unsigned	tile;				// index of the updated tile
+	unsigned	version;			// version of the tile when it is published
+	unsigned	reserved;
+};
+
 // generate output
 class BlenderImage : public ImageSensor
 {
@@ -32,19 +67,45 @@ public:
 	// finish image tile
 	virtual void FinishTile( int tile_x , int tile_y , const RenderTask& rt );
 
+	// publish an intermediate frame by updating all tiles in the shared memory
+	virtual void PublishFrame( unsigned passes );
+
 	// pre process
 	virtual void PreProcess();
 
 	// post process
 	virtual void PostProcess();
 
+	// size of the shared memory for an image of a specific resolution
+	static int SharedMemorySize( int w , int h , int tile_size , PIXEL_FORMAT format );
+
 private:
-	int				m_header_offset;
-	int				m_final_update_flag_offset;
 	int				m_tilenum_x;
 	int				m_tilenum_y;
 
-	SharedMemory	m_sharedMemory;
+	SharedMemory			m_sharedMemory;
+	BlenderSharedHeader*	m_header = nullptr;
+	unsigned*				m_tileVersions = nullptr;
+	BlenderTileDescriptor*	m_ring = nullptr;
+	unsigned char*			m_pixels = nullptr;
+	unsigned				m_pixelSize = 0;
+
+	// write pixels of a row to a tile in the shared memory, all of them have to be in the same tile
+	void _storeTileRow( int x , int y , int count , const float* rgb );
+
+	// mark a tile as being rewritten, blender skips it until it is published again
+	void _lockTile( int tile );
+
+	// publish a tile whose pixels are all written, only the main thread could publish tiles
+	void _publishTile( int tile );
+
+	// rewrite and publish all tiles with the pixels of the render target
+	void _publishRenderTarget();
+
+	// offsets of each part in the shared memory
+	static int _versionOffset() { return (int)sizeof( BlenderSharedHeader ); }
+	static int _ringOffset( int tile_num ) { return _versionOffset() + ( ( tile_num * 4 + 15 ) & ~15 ); }
+	static int _pixelOffset( int tile_num ) { return _ringOffset( tile_num ) + 2 * tile_num * (int)sizeof( BlenderTileDescriptor ); }
 };
 
 #endif
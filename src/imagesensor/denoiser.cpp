@@ -0,0 +1,252 @@
+/*
+    This file is a part of SORT(Simple Open Ray Tracing), an open-source cross
+    platform physically based renderer.
+ 
+    Copyright (c) 2011-2016 by Cao Jiayin - All rights reserved.
+ 
+    SORT is a free software written for educational purpose. Anyone can distribute
+    or modify it under the the terms of the GNU General Public License Version 3 as
+    published by the Free Software Foundation. However, there is NO warranty that
+    all components are functional in a perfect manner. Without even the implied
+    warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License along with
+    this program. If not, see <http://www.gnu.org/licenses/gpl-3.0.html>.
+ */
+
+
+#include "denoiser.h"
+#include "texture/rendertarget.h"
+#include "texture/imagetexture.h"
+#include "utility/multithread/threadpool.h"
+#include <chrono>
+#include <math.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+    #define SORT_DENOISE_SSE2
+    #include <emmintrin.h>
+#endif
+
+// weights of the B3 spline, which is the kernel of the à-trous wavelet transform
+static const float  ATROUS_KERNEL[5] = { 1.0f / 16.0f , 1.0f / 4.0f , 3.0f / 8.0f , 1.0f / 4.0f , 1.0f / 16.0f };
+// luminance differences are measured in multiples of the standard deviation of the pixel
+static const float  SIGMA_LUMINANCE = 1.0f;
+// depth differences are measured relative to the depth of the pixel and the footprint of the filter
+static const float  SIGMA_DEPTH = 0.01f;
+// albedo below it is not divided out, so that black surfaces don't blow up the noise
+static const float  MIN_ALBEDO = 0.01f;
+
+// max( 0 , x ) without any comparison, compilers keep comparisons of floats as branches unless traps are disabled
+static inline float clampPositive( float x )
+{
+    return 0.5f * ( x + fabs( x ) );
+}
+
+// exp( x ) for x <= 0, it is ( 1 + x / 256 ) ^ 256 which only takes multiplications unlike exp
+static inline float fastExp( float x )
+{
+    float y = clampPositive( 1.0f + x * ( 1.0f / 256.0f ) );
+    y *= y; y *= y; y *= y; y *= y;
+    y *= y; y *= y; y *= y; y *= y;
+    return y;
+}
+
+// similarity of two normals, it is max( 0 , dot ) ^ 128
+static inline float normalWeight( float d )
+{
+    float y = clampPositive( d );
+    y *= y; y *= y; y *= y; y *= y;
+    y *= y; y *= y; y *= y;
+    return y;
+}
+
+#if defined(SORT_DENOISE_SSE2)
+// fastExp of four values
+static inline __m128 fastExp4( __m128 x )
+{
+    __m128 y = _mm_max_ps( _mm_setzero_ps() , _mm_add_ps( _mm_set1_ps( 1.0f ) , _mm_mul_ps( x , _mm_set1_ps( 1.0f / 256.0f ) ) ) );
+    y = _mm_mul_ps( y , y ); y = _mm_mul_ps( y , y ); y = _mm_mul_ps( y , y ); y = _mm_mul_ps( y , y );
+    y = _mm_mul_ps( y , y ); y = _mm_mul_ps( y , y ); y = _mm_mul_ps( y , y ); y = _mm_mul_ps( y , y );
+    return y;
+}
+
+// normalWeight of four values
+static inline __m128 normalWeight4( __m128 d )
+{
+    __m128 y = _mm_max_ps( _mm_setzero_ps() , d );
+    y = _mm_mul_ps( y , y ); y = _mm_mul_ps( y , y ); y = _mm_mul_ps( y , y ); y = _mm_mul_ps( y , y );
+    y = _mm_mul_ps( y , y ); y = _mm_mul_ps( y , y ); y = _mm_mul_ps( y , y );
+    return y;
+}
+
+// fabs of four values, the sign bit is cleared
+static inline __m128 abs4( __m128 x )
+{
+    return _mm_and_ps( x , _mm_castsi128_ps( _mm_set1_epi32( 0x7fffffff ) ) );
+}
+#endif
+
+void Denoiser::Apply( RenderTarget& image , const AovBuffer& aov )
+{
+    // the reference image is loaded before the timer starts, so that only denoising is timed
+    m_errorBefore = _error( image );
+    auto start = std::chrono::steady_clock::now();
+
+    const int width = image.GetWidth();
+    const int height = image.GetHeight();
+    const unsigned pixel_num = width * height;
+
+    std::vector<float> depth , nx , ny , nz , ar , ag , ab , variance;
+    aov.GetChannel( AOV_DEPTH , 0 , depth );
+    aov.GetChannel( AOV_NORMAL , 0 , nx );
+    aov.GetChannel( AOV_NORMAL , 1 , ny );
+    aov.GetChannel( AOV_NORMAL , 2 , nz );
+    aov.GetChannel( AOV_ALBEDO , 0 , ar );
+    aov.GetChannel( AOV_ALBEDO , 1 , ag );
+    aov.GetChannel( AOV_ALBEDO , 2 , ab );
+    aov.GetChannel( AOV_VARIANCE , 0 , variance );
+
+    // the albedo is divided out so that only the illumination is filtered, the variance is scaled along
+    std::vector<float> cr( pixel_num ) , cg( pixel_num ) , cb( pixel_num ) , lum( pixel_num );
+    for( unsigned k = 0 ; k < pixel_num ; ++k ){
+        ar[k] = ( ar[k] > MIN_ALBEDO ) ? ar[k] : 1.0f;
+        ag[k] = ( ag[k] > MIN_ALBEDO ) ? ag[k] : 1.0f;
+        ab[k] = ( ab[k] > MIN_ALBEDO ) ? ab[k] : 1.0f;
+        const Spectrum c = image.GetColor( k % width , k / width );
+        cr[k] = c.GetR() / ar[k];
+        cg[k] = c.GetG() / ag[k];
+        cb[k] = c.GetB() / ab[k];
+        const float a = Spectrum( ar[k] , ag[k] , ab[k] ).GetIntensity();
+        variance[k] /= a * a;
+    }
+
+    std::vector<float> out_r( pixel_num ) , out_g( pixel_num ) , out_b( pixel_num ) , out_v( pixel_num );
+    for( unsigned it = 0 ; it < m_iterations ; ++it ){
+        const int step = 1 << it;
+
+        for( unsigned k = 0 ; k < pixel_num ; ++k )
+            lum[k] = Spectrum( cr[k] , cg[k] , cb[k] ).GetIntensity();
+
+        ThreadPool::GetSingleton().ParallelFor( 0 , height , 8 , [&]( unsigned b , unsigned e ){
+            // weighted sums of the row, inverse of the luminance and depth tolerance of each pixel of the row
+            std::vector<float> sr( width ) , sg( width ) , sb( width ) , sv( width ) , sw( width );
+            std::vector<float> inv_l( width ) , inv_z( width );
+            for( unsigned y = b ; y < e ; ++y ){
+                const unsigned row = y * width;
+
+                // the center tap has a weight of one for both normal and luminance, it starts the sums
+                const float hc = ATROUS_KERNEL[2] * ATROUS_KERNEL[2];
+                for( int x = 0 ; x < width ; ++x ){
+                    sr[x] = hc * cr[row + x];
+                    sg[x] = hc * cg[row + x];
+                    sb[x] = hc * cb[row + x];
+                    sv[x] = hc * hc * variance[row + x];
+                    sw[x] = hc;
+                    inv_l[x] = 1.0f / ( SIGMA_LUMINANCE * sqrt( variance[row + x] ) + 1e-4f );
+                    inv_z[x] = 1.0f / ( SIGMA_DEPTH * step * depth[row + x] + 1e-4f );
+                }
+
+                for( int ty = 0 ; ty < 5 ; ++ty ){
+                    const int qy = (int)y + ( ty - 2 ) * step;
+                    if( qy < 0 || qy >= height )
+                        continue;
+                    const unsigned qrow = qy * width;
+
+                    for( int tx = 0 ; tx < 5 ; ++tx ){
+                        if( tx == 2 && ty == 2 )
+                            continue;
+                        const int dx = ( tx - 2 ) * step;
+                        const float h = ATROUS_KERNEL[tx] * ATROUS_KERNEL[ty];
+
+                        // only pixels whose neighbour is inside the image, which keeps the loops free of branches
+                        const int x0 = std::max( 0 , -dx );
+                        const int x1 = std::min( width , width - dx );
+                        const float* pl = &lum[row];
+                        const float* ql = &lum[qrow];
+                        const float* pz = &depth[row];
+                        const float* qz = &depth[qrow];
+                        const float* pnx = &nx[row];
+                        const float* pny = &ny[row];
+                        const float* pnz = &nz[row];
+                        const float* qnx = &nx[qrow];
+                        const float* qny = &ny[qrow];
+                        const float* qnz = &nz[qrow];
+                        const float* qr = &cr[qrow];
+                        const float* qg = &cg[qrow];
+                        const float* qb = &cb[qrow];
+                        const float* qv = &variance[qrow];
+                        int x = x0;
+#if defined(SORT_DENOISE_SSE2)
+                        // four pixels at once, the weights are computed exactly like the scalar loop below
+                        const __m128 h4 = _mm_set1_ps( h );
+                        for( ; x + 4 <= x1 ; x += 4 ){
+                            const __m128 dot = _mm_add_ps( _mm_add_ps(
+                                _mm_mul_ps( _mm_loadu_ps( pnx + x ) , _mm_loadu_ps( qnx + x + dx ) ) ,
+                                _mm_mul_ps( _mm_loadu_ps( pny + x ) , _mm_loadu_ps( qny + x + dx ) ) ) ,
+                                _mm_mul_ps( _mm_loadu_ps( pnz + x ) , _mm_loadu_ps( qnz + x + dx ) ) );
+                            const __m128 dl = _mm_mul_ps( abs4( _mm_sub_ps( _mm_loadu_ps( pl + x ) , _mm_loadu_ps( ql + x + dx ) ) ) , _mm_loadu_ps( &inv_l[x] ) );
+                            const __m128 dz = _mm_mul_ps( abs4( _mm_sub_ps( _mm_loadu_ps( pz + x ) , _mm_loadu_ps( qz + x + dx ) ) ) , _mm_loadu_ps( &inv_z[x] ) );
+                            const __m128 w = _mm_mul_ps( _mm_mul_ps( h4 , normalWeight4( dot ) ) , fastExp4( _mm_sub_ps( _mm_setzero_ps() , _mm_add_ps( dl , dz ) ) ) );
+                            _mm_storeu_ps( &sr[x] , _mm_add_ps( _mm_loadu_ps( &sr[x] ) , _mm_mul_ps( w , _mm_loadu_ps( qr + x + dx ) ) ) );
+                            _mm_storeu_ps( &sg[x] , _mm_add_ps( _mm_loadu_ps( &sg[x] ) , _mm_mul_ps( w , _mm_loadu_ps( qg + x + dx ) ) ) );
+                            _mm_storeu_ps( &sb[x] , _mm_add_ps( _mm_loadu_ps( &sb[x] ) , _mm_mul_ps( w , _mm_loadu_ps( qb + x + dx ) ) ) );
+                            _mm_storeu_ps( &sv[x] , _mm_add_ps( _mm_loadu_ps( &sv[x] ) , _mm_mul_ps( _mm_mul_ps( w , w ) , _mm_loadu_ps( qv + x + dx ) ) ) );
+                            _mm_storeu_ps( &sw[x] , _mm_add_ps( _mm_loadu_ps( &sw[x] ) , w ) );
+                        }
+#endif
+                        for( ; x < x1 ; ++x ){
+                            const float wn = normalWeight( pnx[x] * qnx[x + dx] + pny[x] * qny[x + dx] + pnz[x] * qnz[x + dx] );
+                            const float wl = fastExp( -fabs( pl[x] - ql[x + dx] ) * inv_l[x] - fabs( pz[x] - qz[x + dx] ) * inv_z[x] );
+                            const float w = h * wn * wl;
+                            sr[x] += w * qr[x + dx];
+                            sg[x] += w * qg[x + dx];
+                            sb[x] += w * qb[x + dx];
+                            sv[x] += w * w * qv[x + dx];
+                            sw[x] += w;
+                        }
+                    }
+                }
+
+                // the center pixel is always taken, so the sum of weights is never zero
+                for( int x = 0 ; x < width ; ++x ){
+                    const float inv = 1.0f / sw[x];
+                    out_r[row + x] = sr[x] * inv;
+                    out_g[row + x] = sg[x] * inv;
+                    out_b[row + x] = sb[x] * inv;
+                    out_v[row + x] = sv[x] * inv * inv;
+                }
+            }
+        });
+
+        cr.swap( out_r );
+        cg.swap( out_g );
+        cb.swap( out_b );
+        variance.swap( out_v );
+    }
+
+    // the albedo is multiplied back
+    for( unsigned k = 0 ; k < pixel_num ; ++k )
+        image.SetColor( k % width , k / width , cr[k] * ar[k] , cg[k] * ag[k] , cb[k] * ab[k] );
+
+    m_time = (unsigned)std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::steady_clock::now() - start ).count();
+    m_errorAfter = _error( image );
+}
+
+float Denoiser::_error( const RenderTarget& image ) const
+{
+    if( m_reference.empty() )
+        return -1.0f;
+
+    ImageTexture reference;
+    if( !reference.LoadImageFromFile( m_reference ) || reference.GetWidth() != image.GetWidth() || reference.GetHeight() != image.GetHeight() )
+        return -1.0f;
+
+    double error = 0.0;
+    for( unsigned y = 0 ; y < image.GetHeight() ; ++y )
+        for( unsigned x = 0 ; x < image.GetWidth() ; ++x ){
+            const Spectrum d = image.GetColor( x , y ) - reference.GetColor( (int)x , (int)y );
+            error += d.GetR() * d.GetR() + d.GetG() * d.GetG() + d.GetB() * d.GetB();
+        }
+    return (float)sqrt( error / ( 3.0 * image.GetWidth() * image.GetHeight() ) );
+}
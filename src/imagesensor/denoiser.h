@@ -0,0 +1,85 @@
+/*
+    This file is a part of SORT(Simple Open Ray Tracing), an open-source cross
+    platform physically based renderer.
+ 
+    Copyright (c) 2011-2016 by Cao Jiayin - All rights reserved.
+ 
+    SORT is a free software written for educational purpose. Anyone can distribute
+    or modify it under the the terms of the GNU General Public License Version 3 as
+    published by the Free Software Foundation. However, there is NO warranty that
+    all components are functional in a perfect manner. Without even the implied
+    warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License along with
+    this program. If not, see <http://www.gnu.org/licenses/gpl-3.0.html>.
+ */
+
+
+#pragma once
+
+#include "sort.h"
+#include "aov.h"
+
+class RenderTarget;
+
+//! @brief Feature guided denoiser applied to the final image.
+/**
+ * This is an edge-avoiding à-trous wavelet filter, please refer to this paper
+ * <a href="https://jo.dreggn.org/home/2010_atrous.pdf">Edge-Avoiding À-Trous Wavelet Transform
+ * for fast Global Illumination Filtering</a> for further details. Like SVGF, the albedo is
+ * divided out before filtering so that textures are kept sharp, neighbours are weighted by the
+ * similarity of their normals, depth and luminance, where the luminance is compared relative to
+ * its standard deviation so that noisy regions are smoothed harder than converged ones.
+ * All buffers are in structure-of-arrays layout, the inner loops run over contiguous pixels of a
+ * row without any branch, they process four pixels at once with SSE2, rows are filtered in parallel.
+ */
+class Denoiser
+{
+public:
+    //! @brief Channels of the AOV buffer the denoiser relies on.
+    static unsigned RequiredAovs(){
+        return ( 1u << AOV_DEPTH ) | ( 1u << AOV_NORMAL ) | ( 1u << AOV_ALBEDO ) | ( 1u << AOV_VARIANCE );
+    }
+
+    //! @brief Set the number of filter iterations, the footprint of the filter doubles in every iteration.
+    void SetIterations( unsigned iterations ){
+        m_iterations = std::max( 1u , std::min( iterations , 10u ) );
+    }
+
+    //! @brief Number of filter iterations.
+    unsigned GetIterations() const{
+        return m_iterations;
+    }
+
+    //! @brief Set a converged image, the error of the image is measured against it before and after denoising.
+    void SetReference( const string& filename ){
+        m_reference = filename;
+    }
+
+    //! @brief Denoise the image.
+    //! @param image    The image to be denoised, the result is written back to it.
+    //! @param aov      AOVs of the image, the required channels have to be enabled.
+    void Apply( RenderTarget& image , const AovBuffer& aov );
+
+    //! @brief Time spent on denoising in milliseconds.
+    unsigned GetTime() const{
+        return m_time;
+    }
+
+    //! @brief Root mean squared error against the reference before and after denoising, negative without reference.
+    void GetError( float& before , float& after ) const{
+        before = m_errorBefore;
+        after = m_errorAfter;
+    }
+
+private:
+    unsigned    m_iterations = 5;       /**< Number of filter iterations. */
+    string      m_reference;            /**< Converged image to measure the error, it is optional. */
+    unsigned    m_time = 0;             /**< Time spent on denoising in milliseconds. */
+    float       m_errorBefore = -1.0f;  /**< Error of the noisy image. */
+    float       m_errorAfter = -1.0f;   /**< Error of the denoised image. */
+
+    //! @brief Root mean squared error of an image against the reference, negative if the reference is not available.
+    float _error( const RenderTarget& image ) const;
+};
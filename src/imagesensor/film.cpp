@@ -0,0 +1,148 @@
+/*
+    This file is a part of SORT(Simple Open Ray Tracing), an open-source cross
+    platform physically based renderer.
+ 
+    Copyright (c) 2011-2016 by Cao Jiayin - All rights reserved.
+ 
+    SORT is a free software written for educational purpose. Anyone can distribute
+    or modify it under the the terms of the GNU General Public License Version 3 as
+    published by the Free Software Foundation. However, there is NO warranty that
+    all components are functional in a perfect manner. Without even the implied
+    warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License along with
+    this program. If not, see <http://www.gnu.org/licenses/gpl-3.0.html>.
+ */
+
+
+#include "film.h"
+#include <math.h>
+
+void FilterTable::Build( const Filter& filter )
+{
+    m_radius = filter.GetRadius();
+    m_scale = FILTER_TABLE_SIZE / m_radius;
+
+    // entries are evaluated at their centers
+    for( unsigned y = 0 ; y < FILTER_TABLE_SIZE ; ++y )
+        for( unsigned x = 0 ; x < FILTER_TABLE_SIZE ; ++x )
+            m_table[y * FILTER_TABLE_SIZE + x] = filter.Evaluate( ( x + 0.5f ) / m_scale , ( y + 0.5f ) / m_scale );
+}
+
+FilmTile::FilmTile( const FilterTable& table , int x0 , int y0 , int width , int height )
+    : m_table( table ) , m_x0( x0 ) , m_y0( y0 ) , m_width( width ) , m_height( height ) , m_data( 4 * width * height , 0.0f )
+{
+    m_memory.Allocate( m_data.size() * sizeof( float ) );
+}
+
+void FilmTile::AddSample( float x , float y , const Spectrum& radiance )
+{
+    // pixels whose centers are in the radius of the sample, pixel centers are at half integers
+    // the footprint is half open, ( -radius , radius ], so that a sample exactly on a pixel edge
+    // of the box filter lands in exactly one pixel instead of none.
+    const float radius = m_table.GetRadius();
+    const int px0 = std::max( (int)ceilf( x - 0.5f - radius ) , m_x0 );
+    const int px1 = std::min( (int)floorf( x - 0.5f + radius ) , m_x0 + m_width - 1 );
+    const int py0 = std::max( (int)ceilf( y - 0.5f - radius ) , m_y0 );
+    const int py1 = std::min( (int)floorf( y - 0.5f + radius ) , m_y0 + m_height - 1 );
+
+    for( int py = py0 ; py <= py1 ; ++py ){
+        const float dy = py + 0.5f - y;
+        if( dy <= -radius || dy > radius )
+            continue;
+        for( int px = px0 ; px <= px1 ; ++px ){
+            const float dx = px + 0.5f - x;
+            if( dx <= -radius || dx > radius )
+                continue;
+            const float weight = m_table.Lookup( dx , dy );
+            float* data = &m_data[4 * ( ( py - m_y0 ) * m_width + px - m_x0 )];
+            data[0] += radiance.GetR() * weight;
+            data[1] += radiance.GetG() * weight;
+            data[2] += radiance.GetB() * weight;
+            data[3] += weight;
+        }
+    }
+}
+
+Film::Film( Filter* filter ) : m_filter( filter )
+{
+    m_table.Build( *m_filter );
+    m_guardBand = (int)ceilf( m_filter->GetRadius() - 0.5f );
+}
+
+Film::~Film()
+{
+    DiscardTiles();
+}
+
+void Film::Reset( int width , int height )
+{
+    m_width = width;
+    m_height = height;
+    m_data.assign( 4 * width * height , 0.0f );
+    m_memory.Release();
+    m_memory.Allocate( m_data.size() * sizeof( float ) );
+}
+
+void Film::SetupTiles( unsigned task_num , unsigned thread_num )
+{
+    DiscardTiles();
+    m_taskNum = task_num;
+    m_tiles.reset( new std::atomic<FilmTile*>[task_num] );
+    for( unsigned i = 0 ; i < task_num ; ++i )
+        m_tiles[i].store( nullptr , std::memory_order_relaxed );
+    m_threadTiles.assign( thread_num , ThreadTile() );
+}
+
+FilmTile* Film::GetTile( unsigned tid , unsigned task_id , int x , int y , int width , int height )
+{
+    // a thread never comes back to a task once it leaves it in a pass
+    ThreadTile& current = m_threadTiles[tid];
+    if( current.task == (int)task_id )
+        return current.tile;
+
+    FilmTile* tile = new FilmTile( m_table , x - m_guardBand , y - m_guardBand , width + 2 * m_guardBand , height + 2 * m_guardBand );
+    tile->m_next = m_tiles[task_id].load( std::memory_order_relaxed );
+    while( !m_tiles[task_id].compare_exchange_weak( tile->m_next , tile , std::memory_order_release , std::memory_order_relaxed ) );
+
+    current.tile = tile;
+    current.task = (int)task_id;
+    return tile;
+}
+
+void Film::MergeTiles( unsigned task_id )
+{
+    // all threads are done with the task, the completion of the task synchronizes with their writes
+    FilmTile* tile = m_tiles[task_id].exchange( nullptr , std::memory_order_acquire );
+    while( tile ){
+        const int x0 = std::max( tile->m_x0 , 0 ) , x1 = std::min( tile->m_x0 + tile->m_width , m_width );
+        const int y0 = std::max( tile->m_y0 , 0 ) , y1 = std::min( tile->m_y0 + tile->m_height , m_height );
+        for( int y = y0 ; y < y1 ; ++y ){
+            const float* src = &tile->m_data[4 * ( ( y - tile->m_y0 ) * tile->m_width + x0 - tile->m_x0 )];
+            float* dst = &m_data[4 * ( y * m_width + x0 )];
+            for( int i = 0 ; i < 4 * ( x1 - x0 ) ; ++i )
+                dst[i] += src[i];
+        }
+
+        FilmTile* next = tile->m_next;
+        delete tile;
+        tile = next;
+    }
+}
+
+void Film::DiscardTiles()
+{
+    for( unsigned i = 0 ; i < m_taskNum ; ++i ){
+        FilmTile* tile = m_tiles[i].exchange( nullptr , std::memory_order_acquire );
+        while( tile ){
+            FilmTile* next = tile->m_next;
+            delete tile;
+            tile = next;
+        }
+    }
+    for( auto& current : m_threadTiles ){
+        current.tile = nullptr;
+        current.task = -1;
+    }
+}
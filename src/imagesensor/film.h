@@ -0,0 +1,175 @@
+/*
+    This file is a part of SORT(Simple Open Ray Tracing), an open-source cross
+    platform physically based renderer.
+ 
+    Copyright (c) 2011-2016 by Cao Jiayin - All rights reserved.
+ 
+    SORT is a free software written for educational purpose. Anyone can distribute
+    or modify it under the the terms of the GNU General Public License Version 3 as
+    published by the Free Software Foundation. However, there is NO warranty that
+    all components are functional in a perfect manner. Without even the implied
+    warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License along with
+    this program. If not, see <http://www.gnu.org/licenses/gpl-3.0.html>.
+ */
+
+
+#pragma once
+
+#include "sort.h"
+#include "filter.h"
+#include "spectrum/spectrum.h"
+#include "utility/memstats.h"
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <math.h>
+
+//! @brief Number of entries of the filter table along each axis.
+static const unsigned FILTER_TABLE_SIZE = 16;
+
+//! @brief Filter weights precomputed in the positive quadrant.
+/**
+ * Since all filters are symmetric, only one quadrant of the filter is baked, offsets of samples
+ * are looked up by their absolute values.
+ */
+class FilterTable
+{
+public:
+    //! @brief Bake a filter into the table.
+    void Build( const Filter& filter );
+
+    //! @brief Weight of a sample at an offset from the center of a pixel.
+    //! @param dx   Horizontal offset, its absolute value has to be smaller than the radius.
+    //! @param dy   Vertical offset, its absolute value has to be smaller than the radius.
+    float Lookup( float dx , float dy ) const{
+        const unsigned ix = std::min( (unsigned)( fabs( dx ) * m_scale ) , FILTER_TABLE_SIZE - 1 );
+        const unsigned iy = std::min( (unsigned)( fabs( dy ) * m_scale ) , FILTER_TABLE_SIZE - 1 );
+        return m_table[iy * FILTER_TABLE_SIZE + ix];
+    }
+
+    //! @brief Radius of the baked filter.
+    float GetRadius() const{
+        return m_radius;
+    }
+
+private:
+    float   m_table[FILTER_TABLE_SIZE * FILTER_TABLE_SIZE];     /**< Weights of the filter. */
+    float   m_radius = 0.5f;                                    /**< Radius of the filter. */
+    float   m_scale = 1.0f;                                     /**< Number of entries per pixel. */
+};
+
+//! @brief Weighted sum of samples in a tile and its guard band.
+/**
+ * A film tile covers a tile of the image extended by the radius of the filter, so that samples
+ * near the edges of the tile are splatted on the pixels of the neighbouring tiles without touching
+ * them. A film tile is only written by one render thread and merged into the film by the main thread.
+ */
+class FilmTile
+{
+public:
+    //! @brief Constructor.
+    //! @param table    Filter table to weight the samples.
+    //! @param x0       Left most pixel covered by the tile, it could be out of the image.
+    //! @param y0       Top most pixel covered by the tile, it could be out of the image.
+    //! @param width    Width of the tile including the guard band.
+    //! @param height   Height of the tile including the guard band.
+    FilmTile( const FilterTable& table , int x0 , int y0 , int width , int height );
+
+    //! @brief Splat a sample on all pixels in the radius of the filter.
+    //! @param x            Horizontal position of the sample in raster space.
+    //! @param y            Vertical position of the sample in raster space.
+    //! @param radiance     Radiance of the sample.
+    void AddSample( float x , float y , const Spectrum& radiance );
+
+private:
+    const FilterTable&  m_table;            /**< Filter table to weight the samples. */
+    int                 m_x0 , m_y0;        /**< Top left pixel covered by the tile. */
+    int                 m_width , m_height; /**< Size of the tile including the guard band. */
+    std::vector<float>  m_data;             /**< Weighted radiance and the sum of weights of each pixel. */
+    MemAccount          m_memory{ MEM_FRAMEBUFFER };    /**< Memory of the tile in memory statistics. */
+    FilmTile*           m_next = nullptr;   /**< Next film tile of the same render task. */
+
+    friend class Film;
+};
+
+//! @brief Image reconstruction with a pixel filter.
+/**
+ * Film keeps the weighted sum of radiance and the sum of weights of every pixel. Every render
+ * thread working on a render task owns a film tile of the task, which is pushed into a lock-free
+ * list of the task. Once the task is completed, the main thread merges all film tiles of it into
+ * the film. Tiles are never merged concurrently, there is no lock at all.
+ */
+class Film
+{
+public:
+    //! @brief Constructor.
+    //! @param filter   Pixel filter, the film takes the ownership of it.
+    Film( Filter* filter );
+
+    //! @brief Destructor, all unmerged film tiles are released.
+    ~Film();
+
+    //! @brief The pixel filter.
+    const Filter& GetFilter() const{
+        return *m_filter;
+    }
+
+    //! @brief Clear the film.
+    //! @param width    Width of the image.
+    //! @param height   Height of the image.
+    void Reset( int width , int height );
+
+    //! @brief Prepare the lists of film tiles.
+    //! @param task_num     Number of render tasks.
+    //! @param thread_num   Number of render threads.
+    void SetupTiles( unsigned task_num , unsigned thread_num );
+
+    //! @brief Get the film tile of a render thread for a task, a new one is created the first time.
+    //! @param tid      Id of the render thread.
+    //! @param task_id  Id of the render task.
+    //! @param x        Left most pixel of the task.
+    //! @param y        Top most pixel of the task.
+    //! @param width    Width of the task.
+    //! @param height   Height of the task.
+    FilmTile* GetTile( unsigned tid , unsigned task_id , int x , int y , int width , int height );
+
+    //! @brief Merge all film tiles of a completed task into the film, it is only called by the main thread.
+    void MergeTiles( unsigned task_id );
+
+    //! @brief Drop the film tiles of unfinished tasks, it is called between passes.
+    void DiscardTiles();
+
+    //! @brief Reconstructed radiance of a pixel.
+    Spectrum GetColor( int x , int y ) const{
+        const float* data = &m_data[4 * ( y * m_width + x )];
+        return ( data[3] != 0.0f ) ? Spectrum( data[0] , data[1] , data[2] ) / data[3] : Spectrum();
+    }
+
+    //! @brief Weighted radiance and the sum of weights of all pixels.
+    std::vector<float>& GetData(){
+        return m_data;
+    }
+
+private:
+    //! @brief The film tile a render thread is writing, padded to avoid false sharing.
+    struct ThreadTile
+    {
+        FilmTile*   tile = nullptr;
+        int         task = -1;
+        char        padding[64 - sizeof( FilmTile* ) - sizeof( int )];
+    };
+
+    std::unique_ptr<Filter>                     m_filter;           /**< The pixel filter. */
+    FilterTable                                 m_table;            /**< Baked pixel filter. */
+    int                                         m_guardBand = 0;    /**< Number of pixels a sample could reach beyond its own pixel. */
+    int                                         m_width = 0;        /**< Width of the image. */
+    int                                         m_height = 0;       /**< Height of the image. */
+    std::vector<float>                          m_data;             /**< Weighted radiance and the sum of weights of each pixel. */
+    MemAccount                                  m_memory{ MEM_FRAMEBUFFER };    /**< Memory of the film in memory statistics. */
+    std::unique_ptr<std::atomic<FilmTile*>[]>   m_tiles;            /**< Lists of film tiles of each task. */
+    unsigned                                    m_taskNum = 0;      /**< Number of render tasks. */
+    std::vector<ThreadTile>                     m_threadTiles;      /**< The film tile of each render thread. */
+};
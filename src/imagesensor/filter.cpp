@@ -0,0 +1,55 @@
+/*
+    This file is a part of SORT(Simple Open Ray Tracing), an open-source cross
+    platform physically based renderer.
+ 
+    Copyright (c) 2011-2016 by Cao Jiayin - All rights reserved.
+ 
+    SORT is a free software written for educational purpose. Anyone can distribute
+    or modify it under the the terms of the GNU General Public License Version 3 as
+    published by the Free Software Foundation. However, there is NO warranty that
+    all components are functional in a perfect manner. Without even the implied
+    warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License along with
+    this program. If not, see <http://www.gnu.org/licenses/gpl-3.0.html>.
+ */
+
+
+#include "filter.h"
+#include "utility/define.h"
+#include <math.h>
+
+IMPLEMENT_CREATOR( BoxFilter );
+IMPLEMENT_CREATOR( GaussianFilter );
+IMPLEMENT_CREATOR( MitchellFilter );
+IMPLEMENT_CREATOR( BlackmanHarrisFilter );
+
+// falloff of the gaussian filter
+static const float GAUSSIAN_ALPHA = 2.0f;
+// parameters of the mitchell filter
+static const float MITCHELL_B = 1.0f / 3.0f;
+static const float MITCHELL_C = 1.0f / 3.0f;
+
+float GaussianFilter::evaluate1D( float x ) const
+{
+    return std::max( 0.0f , expf( -GAUSSIAN_ALPHA * x * x ) - expf( -GAUSSIAN_ALPHA * m_radius * m_radius ) );
+}
+
+float MitchellFilter::evaluate1D( float x ) const
+{
+    // the filter is defined in [-2,2]
+    x = fabs( 2.0f * x / m_radius );
+    if( x > 1.0f )
+        return ( ( -MITCHELL_B - 6.0f * MITCHELL_C ) * x * x * x + ( 6.0f * MITCHELL_B + 30.0f * MITCHELL_C ) * x * x +
+                 ( -12.0f * MITCHELL_B - 48.0f * MITCHELL_C ) * x + ( 8.0f * MITCHELL_B + 24.0f * MITCHELL_C ) ) / 6.0f;
+    return ( ( 12.0f - 9.0f * MITCHELL_B - 6.0f * MITCHELL_C ) * x * x * x + ( -18.0f + 12.0f * MITCHELL_B + 6.0f * MITCHELL_C ) * x * x +
+             ( 6.0f - 2.0f * MITCHELL_B ) ) / 6.0f;
+}
+
+float BlackmanHarrisFilter::evaluate1D( float x ) const
+{
+    // the window spans [-radius,radius]
+    const float t = TWO_PI * ( 0.5f + 0.5f * x / m_radius );
+    return 0.35875f - 0.48829f * cosf( t ) + 0.14128f * cosf( 2.0f * t ) - 0.01168f * cosf( 3.0f * t );
+}
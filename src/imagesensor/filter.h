@@ -0,0 +1,123 @@
+/*
+    This file is a part of SORT(Simple Open Ray Tracing), an open-source cross
+    platform physically based renderer.
+ 
+    Copyright (c) 2011-2016 by Cao Jiayin - All rights reserved.
+ 
+    SORT is a free software written for educational purpose. Anyone can distribute
+    or modify it under the the terms of the GNU General Public License Version 3 as
+    published by the Free Software Foundation. However, there is NO warranty that
+    all components are functional in a perfect manner. Without even the implied
+    warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License along with
+    this program. If not, see <http://www.gnu.org/licenses/gpl-3.0.html>.
+ */
+
+
+#pragma once
+
+#include "sort.h"
+#include "utility/creator.h"
+
+//! @brief Pixel reconstruction filter.
+/**
+ * A filter weights the contribution of a sample to the pixels around it. All filters here are
+ * separable, the weight is the product of a 1D filter evaluated along both axes. Filters are
+ * never evaluated during rendering, they are baked into a FilterTable once.
+ */
+class Filter
+{
+public:
+    //! @brief Virtual destructor.
+    virtual ~Filter() {}
+
+    //! @brief Evaluate the filter.
+    //! @param x    Horizontal offset from the center of the pixel.
+    //! @param y    Vertical offset from the center of the pixel.
+    //! @return     Weight of a sample at the offset.
+    float Evaluate( float x , float y ) const{
+        return evaluate1D( x ) * evaluate1D( y );
+    }
+
+    //! @brief Radius of the filter in pixels, the filter is zero beyond it.
+    float GetRadius() const{
+        return m_radius;
+    }
+
+    //! @brief Set the radius of the filter.
+    //! @param radius   Radius in pixels, it is clamped to no smaller than half a pixel.
+    void SetRadius( float radius ){
+        m_radius = ( radius > 0.5f ) ? radius : 0.5f;
+    }
+
+protected:
+    float   m_radius = 0.5f;    /**< Radius of the filter in pixels. */
+
+    //! @brief Evaluate the 1D filter.
+    //! @param x    Offset from the center of the pixel, its absolute value is no larger than the radius.
+    virtual float evaluate1D( float x ) const = 0;
+};
+
+//! @brief Box filter, it gives the same result as averaging samples in a pixel with radius of half a pixel.
+class BoxFilter : public Filter
+{
+public:
+    DEFINE_CREATOR( BoxFilter , "box" );
+
+protected:
+    float evaluate1D( float x ) const override{
+        return 1.0f;
+    }
+};
+
+//! @brief Gaussian filter shifted down so that it reaches zero at the radius.
+class GaussianFilter : public Filter
+{
+public:
+    DEFINE_CREATOR( GaussianFilter , "gaussian" );
+
+    //! @brief Default constructor.
+    GaussianFilter(){
+        m_radius = 1.5f;
+    }
+
+protected:
+    float evaluate1D( float x ) const override;
+};
+
+//! @brief Mitchell-Netravali filter with B = C = 1/3.
+/**
+ * Please refer to the paper <a href="http://www.cs.utexas.edu/~fussell/courses/cs384g-fall2013/lectures/mitchell/Mitchell.pdf">
+ * Reconstruction Filters in Computer Graphics</a> for further details. It has negative lobes,
+ * which sharpen the image a bit.
+ */
+class MitchellFilter : public Filter
+{
+public:
+    DEFINE_CREATOR( MitchellFilter , "mitchell" );
+
+    //! @brief Default constructor.
+    MitchellFilter(){
+        m_radius = 2.0f;
+    }
+
+protected:
+    float evaluate1D( float x ) const override;
+};
+
+//! @brief Four-term Blackman-Harris window, it keeps the image sharp with very little ringing.
+class BlackmanHarrisFilter : public Filter
+{
+public:
+    DEFINE_CREATOR( BlackmanHarrisFilter , "blackmanharris" );
+
+    //! @brief Default constructor.
+    BlackmanHarrisFilter(){
+        m_radius = 2.0f;
+    }
+
+protected:
+    float evaluate1D( float x ) const override;
+};
@@ -23,6 +23,16 @@
 #include "utility/propertyset.h"
 #include "texture/rendertarget.h"
 #include "utility/multithread/multithread.h"
+#include "utility/multithread/threadpool.h"
+#include "utility/memstats.h"
+#include "film.h"
+#include "aov.h"
+#include "denoiser.h"
+#include <vector>
+#include <iostream>
+#include <atomic>
+#include <memory>
+#include <cstring>
 
 // pre-decleration
 class RenderTask;
@@ -31,7 +41,7 @@ class RenderTask;
 class ImageSensor : public PropertySet<ImageSensor>
 {
 public:
-    ImageSensor(){
+    ImageSensor() : m_framebufferMemory( MEM_FRAMEBUFFER ) , m_splatMemory( MEM_SPLAT ){
         _registerAllProperty();
     }
     virtual ~ImageSensor(){}
@@ -39,11 +49,289 @@ public:
 	// pre process
     virtual void PreProcess()
 	{
-		m_rendertarget.SetSize(m_width, m_height);
+		// the render target is not needed if finished tiles are streamed to the output file
+		if( !m_streaming )
+			m_rendertarget.SetSize(m_width, m_height);
 
-		m_mutex = new PlatformMutex*[m_width];
-		for( int i = 0 ; i < m_width ; ++i )
-			m_mutex[i] = new PlatformMutex[m_height];
+		// float buffer accumulating the radiance of all passes, the film accumulates filtered samples itself
+		if( m_film )
+			m_film->Reset( m_width , m_height );
+		else if( m_progressive )
+			m_accumulation.assign( 3 * m_width * m_height , 0.0f );
+		if( m_aov )
+			m_aov->Reset( m_width , m_height );
+		m_framebufferMemory.Release();
+		m_framebufferMemory.Allocate( ( m_streaming ? 0 : m_width * m_height * _pixelSize() ) + m_accumulation.size() * sizeof( float ) );
+	}
+
+	// whether the sensor is able to write finished tiles straight to the output file
+	virtual bool SupportStreaming() const { return false; }
+
+	// storage format of the render target, accumulation buffers always keep floats for precision
+	// para 'format' : storage format, it has to be set before pre-processing
+	void SetFramebufferFormat( PIXEL_FORMAT format ) { m_rendertarget.SetFormat( format ); }
+
+	// get the storage format of the render target
+	PIXEL_FORMAT GetFramebufferFormat() const { return m_rendertarget.GetFormat(); }
+
+	// stream finished tiles to the output file instead of keeping the whole image in memory
+	// para 'streaming' : whether tiles are streamed, the render target is allocated if it is disabled after pre-processing
+	void SetStreaming( bool streaming )
+	{
+		m_streaming = streaming;
+		if( !m_streaming && m_width > 0 && m_rendertarget.GetWidth() == 0 )
+		{
+			m_rendertarget.SetSize( m_width , m_height );
+			m_framebufferMemory.Allocate( m_width * m_height * _pixelSize() );
+		}
+	}
+	// whether finished tiles are streamed to the output file
+	bool IsStreaming() const { return m_streaming; }
+
+	// enable the splat buffer, it is called after the sensor is pre-processed
+	// para 'splatting' : whether the integrator splats radiance on arbitrary pixels with UpdatePixel
+	// para 'thread_num': number of render threads, splats are counted per thread
+	void SetSplatting( bool splatting , unsigned thread_num )
+	{
+		m_splat.reset();
+		m_splatMemory.Release();
+		m_splatCount.clear();
+		if( !splatting )
+			return;
+
+		const unsigned size = 4 * m_width * m_height;
+		m_splat.reset( new std::atomic<float>[size] );
+		for( unsigned i = 0 ; i < size ; ++i )
+			m_splat[i].store( 0.0f , std::memory_order_relaxed );
+		m_splatMemory.Allocate( size * sizeof( std::atomic<float> ) );
+		m_splatCount.resize( thread_num );
+	}
+
+	// reconstruct the image with a pixel filter instead of averaging samples in each pixel
+	// para 'filter' : the pixel filter, the sensor takes the ownership of it
+	void SetFilter( Filter* filter ) { m_film.reset( filter ? new Film( filter ) : nullptr ); }
+	// get the film, it is null if there is no pixel filter
+	Film* GetFilm() { return m_film.get(); }
+
+	// enable auxiliary output variables
+	// para 'mask'   : bit mask of the enabled channels, AOVs are disabled if it is zero
+	// para 'output' : whether AOVs are written to a file, they may only be used by the denoiser
+	void SetAov( unsigned mask , bool output = true )
+	{
+		m_aov.reset( mask ? new AovBuffer( mask ) : nullptr );
+		m_aovOutput = output && mask;
+	}
+	// get the AOV buffer, it is null if AOVs are disabled
+	AovBuffer* GetAov() { return m_aov.get(); }
+
+	// denoise the final image, the AOVs it relies on are enabled along
+	// para 'denoiser' : the denoiser, the sensor takes the ownership of it
+	void SetDenoiser( Denoiser* denoiser )
+	{
+		m_denoiser.reset( denoiser );
+		if( m_denoiser )
+			SetAov( Denoiser::RequiredAovs() | ( m_aov ? m_aov->GetMask() : 0 ) , m_aovOutput );
+	}
+	// get the denoiser, it is null if denoising is disabled
+	const Denoiser* GetDenoiser() const { return m_denoiser.get(); }
+
+	// denoise the resolved image, it is called after post-processing by sensors writing the image
+	void Denoise()
+	{
+		if( m_denoiser && m_aov )
+			m_denoiser->Apply( m_rendertarget , *m_aov );
+	}
+
+	// prepare the per-task resources, like film tiles, it is called after the sensor is pre-processed
+	// para 'task_num'   : number of render tasks
+	// para 'thread_num' : number of render threads
+	virtual void SetupTasks( unsigned task_num , unsigned thread_num )
+	{
+		if( m_film )
+			m_film->SetupTiles( task_num , thread_num );
+	}
+
+	// a task is completed, it is only called by the main thread
+	// para 'task_id' : id of the completed task
+	// para 'rt'      : the completed task
+	virtual void CompleteTask( unsigned task_id , const RenderTask& rt )
+	{
+		// merge the samples of the task into the film
+		if( m_film )
+			m_film->MergeTiles( task_id );
+	}
+
+	// drop the samples of unfinished tasks once a pass is over
+	void DiscardFilmTiles()
+	{
+		if( m_film )
+			m_film->DiscardTiles();
+	}
+
+	// get the number of splats of all threads
+	unsigned long long GetSplatCount() const
+	{
+		unsigned long long total = 0;
+		for( const SplatCounter& counter : m_splatCount )
+			total += counter.count;
+		return total;
+	}
+
+	// enable progressive rendering
+	// para 'progressive' : whether the radiance of each pass is accumulated instead of stored directly
+	void SetProgressive( bool progressive ) { m_progressive = progressive; }
+	// whether progressive rendering is enabled
+	bool IsProgressive() const { return m_progressive; }
+
+	// accumulate radiance of a pass, a pixel is only touched by one thread in a pass
+	void AccumulatePixel( int x , int y , const Spectrum& color )
+	{
+		float* data = &m_accumulation[3 * ( y * m_width + x )];
+		data[0] += color.GetR();
+		data[1] += color.GetG();
+		data[2] += color.GetB();
+	}
+
+	// resolve the accumulated radiance into the render target
+	// para 'passes' : number of passes accumulated so far
+	void ResolveFrame( unsigned passes )
+	{
+		if( !m_progressive || passes == 0 )
+			return;
+
+		const float inv = 1.0f / passes;
+		ThreadPool::GetSingleton().ParallelFor( 0 , m_height , 16 , [&]( unsigned b , unsigned e ){
+			// rows are resolved in floats first, then converted to the format of the render target in batch
+			std::vector<float> row( 3 * m_width );
+			for( unsigned y = b ; y < e ; ++y )
+			{
+				for( int x = 0 ; x < m_width ; ++x )
+				{
+					Spectrum c;
+					if( m_film )
+						c = m_film->GetColor( x , y ) + _getSplat( x , y ) * inv;
+					else
+					{
+						const float* data = &m_accumulation[3 * ( y * m_width + x )];
+						c = ( Spectrum( data[0] , data[1] , data[2] ) + _getSplat( x , y ) ) * inv;
+					}
+					_setRowPixel( row , x , c );
+				}
+				m_rendertarget.SetRow( y , row.data() );
+			}
+		});
+	}
+
+	// enable statistics of adaptive sampling, it is called after the sensor is pre-processed
+	// para 'adaptive' : whether the number of samples differs from pixel to pixel
+	void SetAdaptive( bool adaptive )
+	{
+		m_adaptive = adaptive;
+		if( m_adaptive )
+		{
+			m_variance.assign( m_width * m_height , 0.0f );
+			m_sampleCount.assign( m_width * m_height , 0 );
+			m_framebufferMemory.Allocate( m_width * m_height * ( sizeof( float ) + sizeof( unsigned ) ) );
+		}
+	}
+	// whether adaptive sampling is enabled
+	bool IsAdaptive() const { return m_adaptive; }
+
+	// store statistics of adaptive sampling, a pixel is only touched by one thread
+	// para 'variance' : variance of the estimated luminance of the pixel
+	// para 'count'    : number of samples taken in the pixel
+	void StorePixelStatistics( int x , int y , float variance , unsigned count )
+	{
+		m_variance[ y * m_width + x ] = variance;
+		m_sampleCount[ y * m_width + x ] = count;
+	}
+
+	// get the number of samples taken in all pixels with adaptive sampling
+	unsigned long long GetTotalSampleCount() const
+	{
+		unsigned long long total = 0;
+		for( unsigned count : m_sampleCount )
+			total += count;
+		return total;
+	}
+
+	// save the radiance and the statistics of all pixels in binary form
+	// para 'stream'    : stream to write to
+	// para 'task_done' : finished tasks of a pass in progress, only their pixels are saved since render threads
+	//                    are still writing the others, all pixels are saved if it is null and threads are idle
+	void SaveState( std::ostream& stream , const bool* task_done = nullptr ) const
+	{
+		// pixels of unfinished tiles are saved as zero, they are rendered again once the rendering is resumed
+		std::vector<char> mask;
+		if( task_done )
+		{
+			mask.assign( m_width * m_height , 0 );
+			const RenderTaskScheduler& scheduler = RenderTaskScheduler::GetSingleton();
+			for( unsigned i = 0 ; i < scheduler.GetTaskCount() ; ++i )
+			{
+				if( !task_done[i] )
+					continue;
+				const RenderTask& rt = scheduler.GetTask( i );
+				for( int y = rt.ori.y ; y < rt.ori.y + rt.size.y ; ++y )
+					memset( &mask[y * m_width + rt.ori.x] , 1 , rt.size.x );
+			}
+		}
+
+		std::vector<float> colors( 3 * m_width * m_height , 0.0f );
+		for( int y = 0 ; y < m_height ; ++y )
+			for( int x = 0 ; x < m_width ; ++x )
+			{
+				if( !mask.empty() && !mask[y * m_width + x] )
+					continue;
+				const Spectrum c = m_rendertarget.GetColor( x , y );
+				float* data = &colors[3 * ( y * m_width + x )];
+				data[0] = c.GetR();
+				data[1] = c.GetG();
+				data[2] = c.GetB();
+			}
+		_saveBuffer( stream , colors );
+		_saveBuffer( stream , m_accumulation );
+		_saveBuffer( stream , _copySplat() );
+		// the film is only touched by the main thread, samples of unfinished tiles are still in the film tiles
+		_saveBuffer( stream , m_film ? m_film->GetData() : std::vector<float>() );
+		_saveBuffer( stream , _maskPlanes( m_aov ? m_aov->GetData() : std::vector<float>() , mask ) );
+		_saveBuffer( stream , _maskPlanes( m_aov ? m_aov->GetPrimitiveIds() : std::vector<unsigned>() , mask ) );
+		_saveBuffer( stream , _maskPlanes( m_variance , mask ) );
+		_saveBuffer( stream , _maskPlanes( m_sampleCount , mask ) );
+	}
+
+	// load the radiance and the statistics of all pixels saved by SaveState
+	// para 'stream' : stream to read from
+	// result        : false if the data doesn't match the setup of the sensor
+	bool LoadState( std::istream& stream )
+	{
+		std::vector<float> colors( 3 * m_width * m_height );
+		std::vector<float> splat = _copySplat();
+		std::vector<float> no_film , no_aov;
+		std::vector<unsigned> no_ids;
+		if( !_loadBuffer( stream , colors ) || !_loadBuffer( stream , m_accumulation ) || !_loadBuffer( stream , splat ) ||
+			!_loadBuffer( stream , m_film ? m_film->GetData() : no_film ) || !_loadBuffer( stream , m_aov ? m_aov->GetData() : no_aov ) ||
+			!_loadBuffer( stream , m_aov ? m_aov->GetPrimitiveIds() : no_ids ) ||
+			!_loadBuffer( stream , m_variance ) || !_loadBuffer( stream , m_sampleCount ) )
+			return false;
+
+		for( unsigned i = 0 ; i < (unsigned)splat.size() ; ++i )
+			m_splat[i].store( splat[i] , std::memory_order_relaxed );
+
+		for( int y = 0 ; y < m_height ; ++y )
+			for( int x = 0 ; x < m_width ; ++x )
+			{
+				const float* data = &colors[3 * ( y * m_width + x )];
+				m_rendertarget.SetColor( x , y , data[0] , data[1] , data[2] );
+			}
+		return true;
+	}
+
+	// publish an intermediate frame of progressive rendering
+	// para 'passes' : number of passes accumulated so far
+	virtual void PublishFrame( unsigned passes )
+	{
+		ResolveFrame( passes );
 	}
 
 	// set image size
@@ -53,7 +341,7 @@ public:
 		m_height = h;
 	}
 
-	// finish image tile
+	// finish image tile, it is called by the main thread once the tile is completed
 	virtual void FinishTile( int tile_x , int tile_y , const RenderTask& rt ){}
 
     // store pixel information
@@ -61,10 +349,23 @@ public:
     
 	// post process
     virtual void PostProcess(){
-		// delete the mutex
-		for( int i = 0 ; i < m_width ; ++i )
-			delete[] m_mutex[i];
-		delete[] m_mutex;
+		// the film and splats are already resolved with the accumulated radiance in progressive rendering
+		if( m_progressive || ( !m_film && !m_splat ) )
+			return;
+		ThreadPool::GetSingleton().ParallelFor( 0 , m_height , 16 , [&]( unsigned b , unsigned e ){
+			std::vector<float> row( 3 * m_width );
+			for( unsigned y = b ; y < e ; ++y )
+			{
+				if( !m_film )
+					m_rendertarget.GetRow( y , row.data() );
+				for( int x = 0 ; x < m_width ; ++x )
+				{
+					const Spectrum base = m_film ? m_film->GetColor( x , y ) : Spectrum( row[3 * x] , row[3 * x + 1] , row[3 * x + 2] );
+					_setRowPixel( row , x , base + _getSplat( x , y ) );
+				}
+				m_rendertarget.SetRow( y , row.data() );
+			}
+		});
 	}
     
     // get width
@@ -77,24 +378,133 @@ public:
         return m_height;
     }
 
-	// add radiance
+	// add radiance splatted by light paths, any thread could splat on any pixel without taking a lock
 	virtual void UpdatePixel(int x, int y, const Spectrum& color)
 	{
-		m_mutex[x][y].Lock();
-		Spectrum _color = m_rendertarget.GetColor(x, y);
-		m_rendertarget.SetColor(x, y, _color + color);
-		m_mutex[x][y].Unlock();
+		std::atomic<float>* data = &m_splat[4 * ( y * m_width + x )];
+		_atomicAdd( data[0] , color.GetR() );
+		_atomicAdd( data[1] , color.GetG() );
+		_atomicAdd( data[2] , color.GetB() );
+		++m_splatCount[ThreadId()].count;
 	}
 
 protected:
 	int m_width;
 	int m_height;
-    
-	// the mutex
-	PlatformMutex**	m_mutex;
+
+	// write a buffer with its size
+	template<typename T>
+	static void _saveBuffer( std::ostream& stream , const std::vector<T>& buffer )
+	{
+		const unsigned size = (unsigned)buffer.size();
+		stream.write( (const char*)&size , sizeof( size ) );
+		stream.write( (const char*)buffer.data() , size * sizeof( T ) );
+	}
+
+	// copy a buffer made of planes of all pixels, pixels out of the mask are zero, everything is copied if the mask is empty
+	template<typename T>
+	static std::vector<T> _maskPlanes( const std::vector<T>& buffer , const std::vector<char>& mask )
+	{
+		if( mask.empty() )
+			return buffer;
+		std::vector<T> masked( buffer.size() , T() );
+		for( size_t i = 0 ; i < buffer.size() ; ++i )
+		{
+			if( mask[i % mask.size()] )
+				masked[i] = buffer[i];
+		}
+		return masked;
+	}
+
+	// read a buffer written by _saveBuffer, its size has to match the current one
+	template<typename T>
+	static bool _loadBuffer( std::istream& stream , std::vector<T>& buffer )
+	{
+		unsigned size = 0;
+		stream.read( (char*)&size , sizeof( size ) );
+		if( !stream || size != buffer.size() )
+			return false;
+		stream.read( (char*)buffer.data() , size * sizeof( T ) );
+		return (bool)stream;
+	}
+
+	// add a value to an atomic float, there is no fetch_add for floating point in C++11
+	static void _atomicAdd( std::atomic<float>& target , float value )
+	{
+		float old = target.load( std::memory_order_relaxed );
+		while( !target.compare_exchange_weak( old , old + value , std::memory_order_relaxed ) );
+	}
+
+	// get the radiance splatted on a pixel
+	Spectrum _getSplat( int x , int y ) const
+	{
+		if( !m_splat )
+			return Spectrum();
+		const std::atomic<float>* data = &m_splat[4 * ( y * m_width + x )];
+		return Spectrum( data[0].load( std::memory_order_relaxed ) , data[1].load( std::memory_order_relaxed ) , data[2].load( std::memory_order_relaxed ) );
+	}
+
+	// number of bytes of a pixel in the render target
+	unsigned _pixelSize() const
+	{
+		return PixelFormatSize( m_rendertarget.GetFormat() );
+	}
+
+	// write a color in a row of floats
+	static void _setRowPixel( std::vector<float>& row , int x , const Spectrum& c )
+	{
+		row[3 * x] = c.GetR();
+		row[3 * x + 1] = c.GetG();
+		row[3 * x + 2] = c.GetB();
+	}
+
+	// copy the splat buffer, it is empty if splatting is disabled
+	std::vector<float> _copySplat() const
+	{
+		std::vector<float> splat( m_splat ? 4 * m_width * m_height : 0 );
+		for( unsigned i = 0 ; i < (unsigned)splat.size() ; ++i )
+			splat[i] = m_splat[i].load( std::memory_order_relaxed );
+		return splat;
+	}
 
 	// the render target
 	RenderTarget m_rendertarget;
+
+	// whether progressive rendering is enabled
+	bool m_progressive = false;
+	// sum of radiance stored by camera rays in all passes
+	std::vector<float> m_accumulation;
+	// sum of radiance splatted by light paths, one float4 per pixel with the last one unused to keep pixels aligned
+	std::unique_ptr<std::atomic<float>[]> m_splat;
+	// number of splats of each thread, counters are padded to separate cache lines
+	struct SplatCounter
+	{
+		unsigned long long count = 0;
+		char padding[56];
+	};
+	std::vector<SplatCounter> m_splatCount;
+
+	// whether adaptive sampling is enabled
+	bool m_adaptive = false;
+	// variance of the estimated luminance and number of samples of each pixel with adaptive sampling
+	std::vector<float> m_variance;
+	std::vector<unsigned> m_sampleCount;
+
+	// whether finished tiles are streamed to the output file, the render target is not allocated then
+	bool m_streaming = false;
+
+	// film reconstructing the image with a pixel filter, samples are averaged in each pixel without it
+	std::unique_ptr<Film> m_film;
+	// auxiliary output variables, it is null if they are disabled
+	std::unique_ptr<AovBuffer> m_aov;
+	// whether AOVs are written to a file
+	bool m_aovOutput = false;
+	// denoiser applied to the final image, it is null if denoising is disabled
+	std::unique_ptr<Denoiser> m_denoiser;
+
+	// memory of the buffers and the splat buffer in memory statistics
+	MemAccount m_framebufferMemory;
+	MemAccount m_splatMemory;
 };
 
 #endif
@@ -16,11 +16,102 @@
  */
 
 #include "rendertargetimage.h"
+#include "utility/multithread/multithread.h"
+#include "utility/strhelper.h"
+
+// size of render tiles
+extern int g_iTileSize;
 
 // store pixel information
 void RenderTargetImage::StorePixel( int x , int y , const Spectrum& color , const RenderTask& rt )
 {
-	m_rendertarget.SetColor( x , y , color );
+	if( !m_streaming )
+	{
+		m_rendertarget.SetColor( x , y , color );
+		return;
+	}
+
+	float* data = _getStreamTile( rt ) + 3 * ( ( y - rt.ori.y ) * rt.size.x + x - rt.ori.x );
+	data[0] = color.GetR();
+	data[1] = color.GetG();
+	data[2] = color.GetB();
+}
+
+// get the pixels of a task, it is allocated if it doesn't exist yet
+float* RenderTargetImage::_getStreamTile( const RenderTask& rt )
+{
+	std::atomic<float*>& slot = m_streamTiles[rt.taskId];
+	float* tile = slot.load( std::memory_order_acquire );
+	if( tile )
+		return tile;
+
+	// a task could be shared by threads, only one of them installs its buffer
+	const unsigned size = 3 * rt.size.x * rt.size.y;
+	float* created = new float[size]();
+	if( slot.compare_exchange_strong( tile , created , std::memory_order_acq_rel , std::memory_order_acquire ) )
+	{
+		MemStats::Allocate( MEM_FRAMEBUFFER , size * sizeof( float ) );
+		return created;
+	}
+	delete[] created;
+	return tile;
+}
+
+// finished tiles could be streamed to exr files
+bool RenderTargetImage::SupportStreaming() const
+{
+	return !m_filename.empty() && TexTypeFromStr( m_filename ) == TT_EXR;
+}
+
+// prepare the per-task resources
+void RenderTargetImage::SetupTasks( unsigned task_num , unsigned thread_num )
+{
+	ImageSensor::SetupTasks( task_num , thread_num );
+
+	m_streamTiles.reset();
+	m_streamTileNum = 0;
+	if( !m_streaming )
+		return;
+
+	if( !m_tileWriter.Open( m_filename , m_width , m_height , g_iTileSize ) )
+	{
+		LOG_WARNING<<"Streaming output is disabled."<<ENDL;
+		SetStreaming( false );
+		return;
+	}
+
+	m_streamTileNum = task_num;
+	m_streamTiles.reset( new std::atomic<float*>[task_num] );
+	for( unsigned i = 0 ; i < task_num ; ++i )
+		m_streamTiles[i].store( nullptr , std::memory_order_relaxed );
+}
+
+// a task is completed
+void RenderTargetImage::CompleteTask( unsigned task_id , const RenderTask& rt )
+{
+	ImageSensor::CompleteTask( task_id , rt );
+
+	if( !m_streaming )
+		return;
+
+	// the tile is dropped once it is written, render threads don't touch it anymore
+	float* tile = m_streamTiles[task_id].exchange( nullptr , std::memory_order_acquire );
+	if( !tile )
+		return;
+	m_tileWriter.WriteTile( rt.ori.x , rt.ori.y , rt.size.x , rt.size.y , tile );
+	delete[] tile;
+	MemStats::Release( MEM_FRAMEBUFFER , 3 * rt.size.x * rt.size.y * sizeof( float ) );
+}
+
+// publish an intermediate frame by writing it to the output file
+void RenderTargetImage::PublishFrame( unsigned passes )
+{
+	ImageSensor::PublishFrame( passes );
+
+	if( !m_filename.empty() )
+		m_rendertarget.Output(m_filename);
+	else
+		m_rendertarget.Output("default.bmp");
 }
 
 // post process
@@ -28,8 +119,32 @@ void RenderTargetImage::PostProcess()
 {
 	ImageSensor::PostProcess();
 
+    // all tiles are in the file already
+    if( m_streaming )
+    {
+        m_tileWriter.Close();
+        return;
+    }
+
+    // the noisy image and the auxiliary output variables are written as layers of one exr file
+    if( m_aovOutput )
+    {
+        string filename = m_filename.empty() ? "default.bmp" : m_filename;
+        const size_t dot = filename.find_last_of( '.' );
+        m_aov->Output( filename.substr( 0 , dot ) + "_aov.exr" , m_rendertarget );
+    }
+
+    Denoise();
+
     if( !m_filename.empty() )
         m_rendertarget.Output(m_filename);
     else
         m_rendertarget.Output("default.bmp");	
+
+    // variance and sample count of each pixel are written with adaptive sampling
+    if( m_adaptive )
+    {
+        _outputChannel( "_variance" , m_variance );
+        _outputChannel( "_samples" , m_sampleCount );
+    }
 }
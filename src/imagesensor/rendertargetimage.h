@@ -19,6 +19,7 @@
 #define SORT_IMAGEOUTPUT
 
 #include "imagesensor.h"
+#include "managers/texio/exrio.h"
 
 // generate output
 class RenderTargetImage : public ImageSensor
@@ -32,12 +33,40 @@ public:
 	// store pixel information
 	virtual void StorePixel( int x , int y , const Spectrum& color , const RenderTask& rt );
 
+	// publish an intermediate frame of progressive rendering
+	virtual void PublishFrame( unsigned passes );
+
 	// post process
 	virtual void PostProcess();
 
+	// finished tiles could be streamed to exr files
+	virtual bool SupportStreaming() const;
+
+	// prepare the per-task resources, the output file is created if tiles are streamed
+	virtual void SetupTasks( unsigned task_num , unsigned thread_num );
+
+	// a task is completed, its pixels are written to the output file if tiles are streamed
+	virtual void CompleteTask( unsigned task_id , const RenderTask& rt );
+
 private:
     // filename
     string      m_filename;
+
+    // writer of the output file if tiles are streamed
+    ExrTileWriter   m_tileWriter;
+    // pixels of the tasks in flight, a buffer is allocated once the first pixel of the task is stored
+    // and it is released once the task is written to the output file
+    std::unique_ptr<std::atomic<float*>[]>  m_streamTiles;
+    unsigned        m_streamTileNum = 0;
+
+    // get the pixels of a task, it is allocated if it doesn't exist yet
+    float* _getStreamTile( const RenderTask& rt );
+
+    // output a buffer with one value per pixel to a float exr file next to the output file, whatever its format is
+    // para 'suffix' : suffix appended to the name of the output file
+    // para 'data'   : value of each pixel
+    template<typename T>
+    void _outputChannel( const string& suffix , const std::vector<T>& data ) const;
     
     // register property
     void _registerAllProperty()
@@ -59,4 +88,17 @@ private:
     };
 };
 
+// output a buffer with one value per pixel to a float exr file next to the output file
+template<typename T>
+void RenderTargetImage::_outputChannel( const string& suffix , const std::vector<T>& data ) const
+{
+    // the values are data rather than colors, formats like bmp would clamp and quantize them
+    std::vector<float> plane( data.begin() , data.end() );
+
+    string filename = m_filename.empty() ? "default.bmp" : m_filename;
+    const size_t dot = filename.find_last_of( '.' );
+    filename = filename.substr( 0 , dot ) + suffix + ".exr";
+    ExrIO::WriteChannels( filename , m_width , m_height , std::vector<string>( 1 , "Y" ) , std::vector<const float*>( 1 , plane.data() ) );
+}
+
 #endif
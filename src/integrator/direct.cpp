@@ -24,6 +24,7 @@
 #include "light/light.h"
 #include "managers/memmanager.h"
 #include "sampler/sampler.h"
+#include "imagesensor/aov.h"
 
 IMPLEMENT_CREATOR( DirectLight );
 
@@ -37,7 +38,14 @@ Spectrum DirectLight::Li( const Ray& r , const PixelSample& ps ) const
 	Intersection ip;
 	// evaluate light directly
 	if( false == scene.GetIntersect( r , &ip ) )
+	{
+		if( ps.aov && r.m_Depth == 0 )
+		{
+			ps.aov->SetFirstHit( 0 , -r.m_Dir );
+			ps.aov->direct = scene.Le( r );
+		}
 		return scene.Le( r );
+	}
 
 	Spectrum li = ip.Le( -r.m_Dir );
 
@@ -49,6 +57,13 @@ Spectrum DirectLight::Li( const Ray& r , const PixelSample& ps ) const
 		li += EvaluateDirect( r , scene , light , ip , LightSample(true) , BsdfSample(true), BXDF_TYPE( BXDF_ALL ) );
 	}
 
+	// all radiance is direct lighting of the first hit
+	if( ps.aov && r.m_Depth == 0 )
+	{
+		ps.aov->SetFirstHit( &ip , -r.m_Dir );
+		ps.aov->direct = li;
+	}
+
 	return li;
 }
 
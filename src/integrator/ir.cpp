@@ -22,6 +22,9 @@
 #include "geometry/scene.h"
 #include "light/light.h"
 #include "bsdf/bsdf.h"
+#include "managers/memmanager.h"
+#include "utility/multithread/threadpool.h"
+#include <mutex>
 
 IMPLEMENT_CREATOR( InstantRadiosity );
 
@@ -30,10 +33,14 @@ void InstantRadiosity::PreProcess()
 {
 	m_pVirtualLightSources = new list<VirtualLightSource>[m_nLightPathSet];
 
-	for( int k = 0 ; k < m_nLightPathSet ; ++k )
-	{
-		for( int i = 0 ; i < m_nLightPaths ; ++i )
+	// light paths are independent of each other, they are traced in parallel
+	std::mutex mutex;
+	const unsigned total_paths = (unsigned)( m_nLightPathSet * m_nLightPaths );
+	ThreadPool::GetSingleton().ParallelFor( 0 , total_paths , 8 , [&]( unsigned b , unsigned e ){
+		for( unsigned p = b ; p < e ; ++p )
 		{
+			const int k = p / m_nLightPaths;
+
 			// pick a light first
 			float light_pick_pdf;
 			const Light* light = scene.SampleLight( sort_canonical() , &light_pick_pdf );
@@ -47,6 +54,7 @@ void InstantRadiosity::PreProcess()
 
 			Spectrum throughput = le * cosAtLight / ( light_pick_pdf * light_emission_pdf );
 
+			list<VirtualLightSource> path;
 			int current_depth = 0;
 			Intersection intersect;
 			while( true )
@@ -59,7 +67,7 @@ void InstantRadiosity::PreProcess()
 				ls.intersect = intersect;
 				ls.wi = -ray.m_Dir;
 				ls.depth = ++current_depth;
-				m_pVirtualLightSources[k].push_back( ls );
+				path.push_back( ls );
 
 				float bsdf_pdf;
 				Vector wo;
@@ -81,8 +89,14 @@ void InstantRadiosity::PreProcess()
 				// update next ray
 				ray = Ray(intersect.intersect, wo, 0, 0.001f);
 			}
+
+			// bsdfs are not referenced by the virtual light sources, the memory can be reused
+			SORT_CLEARMEM();
+
+			std::lock_guard<std::mutex> lock(mutex);
+			m_pVirtualLightSources[k].splice( m_pVirtualLightSources[k].end() , path );
 		}
-	}
+	});
 }
 
 // PostProcess
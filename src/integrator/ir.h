@@ -21,6 +21,7 @@
 // include the header file
 #include "integrator.h"
 #include "geometry/intersection.h"
+#include <list>
 
 class Bsdf;
 
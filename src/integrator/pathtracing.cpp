@@ -21,6 +21,7 @@
 #include "geometry/scene.h"
 #include "integratormethod.h"
 #include "camera/camera.h"
+#include "imagesensor/aov.h"
 
 IMPLEMENT_CREATOR( PathTracing );
 
@@ -43,11 +44,20 @@ Spectrum PathTracing::Li( const Ray& ray , const PixelSample& ps ) const
 		if( false == scene.GetIntersect( r , &inter ) )
 		{
 			if( bounces == 0 )
+			{
+				if( ps.aov )
+				{
+					ps.aov->SetFirstHit( 0 , -r.m_Dir );
+					ps.aov->direct = scene.Le( r );
+				}
 				return scene.Le( r );
+			}
 			break;
 		}
 
 		if( bounces == 0 ) L+=inter.Le(-r.m_Dir);
+		if( bounces == 0 && ps.aov )
+			ps.aov->SetFirstHit( &inter , -r.m_Dir );
 
 		// make sure there is intersected primitive
 		Sort_Assert( inter.primitive != 0 );
@@ -62,6 +72,10 @@ Spectrum PathTracing::Li( const Ray& ray , const PixelSample& ps ) const
 			L += throughput * EvaluateDirect(	r  , scene , light , inter , light_sample , 
 												bsdf_sample , BXDF_TYPE(BXDF_ALL) ) / light_pdf;
 
+		// radiance gathered at the first hit is direct lighting, the rest of the path is indirect
+		if( bounces == 0 && ps.aov )
+			ps.aov->direct = L;
+
 		// sample the next direction using bsdf
 		float		path_pdf;
 		Vector		wi;
@@ -97,6 +111,8 @@ Spectrum PathTracing::Li( const Ray& ray , const PixelSample& ps ) const
 			break;
 	}
 
+	if( ps.aov )
+		ps.aov->indirect = L - ps.aov->direct;
 	return L;
 }
 
@@ -23,6 +23,7 @@
 System g_System;
 
 extern bool g_bBlenderMode;
+extern bool g_bResumeMode;
 
 // the main func
 #ifdef SORT_IN_WINDOWS
@@ -38,11 +39,13 @@ int main( int argc , char** argv )
 		return 0;
 	}
 
-	// enable blender mode if possible
-	if (argc > 2)
+	// enable blender mode or resume mode if possible
+	for (int i = 2; i < argc; ++i)
 	{
-		if (strcmp(argv[2], "blendermode") == 0)
+		if (strcmp(argv[i], "blendermode") == 0)
 			g_bBlenderMode = true;
+		else if (strcmp(argv[i], "--resume") == 0)
+			g_bResumeMode = true;
 	}
 
 	// setup the system
@@ -17,16 +17,112 @@
 
 // include the headers
 #include "memmanager.h"
-#include "utility/define.h"
+#include <algorithm>
 
 // instance the singleton with tex manager
 DEFINE_SINGLETON(MemManager);
 
+// the arena of the current thread and the memory manager owning it
+Thread_Local MemArena*		g_ThreadArena = 0;
+Thread_Local const void*	g_ThreadArenaOwner = 0;
+
+// size of a memory page
+static const size_t	MEM_PAGE_SIZE = 4096;
+// chunks are aligned to cache lines
+static const size_t	MEM_CHUNK_ALIGNMENT = 64;
+
+// constructor
+MemArena::MemArena( size_t chunk_size ) : m_chunkSize( chunk_size )
+{
+}
+
+// destructor
+MemArena::~MemArena()
+{
+	while( m_head )
+	{
+		Chunk* next = m_head->next;
+		delete[] m_head->raw;
+		MemStats::Release( MEM_ARENA , m_head->size + MEM_CHUNK_ALIGNMENT );
+		delete m_head;
+		m_head = next;
+	}
+}
+
+// make sure the first chunk is no smaller than a specific size
+void MemArena::Reserve( size_t size , bool touch )
+{
+	if( m_head && m_head->size >= size )
+		return;
+
+	// the new chunk goes in front of the others
+	Chunk* chunk = _allocateChunk( size , touch );
+	chunk->next = m_head;
+	m_head = chunk;
+	Reset();
+}
+
+// get the maximum number of bytes used between two resets
+size_t MemArena::GetHighWater() const
+{
+	return max( m_highWater , m_usedBefore + m_offset );
+}
+
+// move to the next chunk that is large enough
+void* MemArena::_allocateInNextChunk( size_t size , size_t align )
+{
+	// the chunks are aligned, no padding is needed at the beginning of a chunk
+	if( m_current == 0 )
+	{
+		if( m_head == 0 )
+			m_head = _allocateChunk( max( size , m_chunkSize ) );
+		m_current = m_head;
+		m_offset = 0;
+		if( size <= m_current->size )
+		{
+			m_offset = size;
+			return m_current->memory;
+		}
+	}
+
+	// skip the chunks that are too small, which only happens to chunks allocated for big requests
+	m_usedBefore += m_offset;
+	while( m_current->next && m_current->next->size < size )
+		m_current = m_current->next;
+
+	if( m_current->next == 0 )
+		m_current->next = _allocateChunk( max( size , m_chunkSize ) );
+	m_current = m_current->next;
+	m_offset = size;
+	_updateHighWater();
+	return m_current->memory;
+}
+
+// allocate a chunk
+MemArena::Chunk* MemArena::_allocateChunk( size_t size , bool touch )
+{
+	Chunk* chunk = new Chunk();
+	chunk->raw = new char[size + MEM_CHUNK_ALIGNMENT];
+	chunk->memory = (char*)( ( (size_t)chunk->raw + MEM_CHUNK_ALIGNMENT - 1 ) & ~( MEM_CHUNK_ALIGNMENT - 1 ) );
+	chunk->size = size;
+	chunk->next = 0;
+
+	// one byte per page is enough to commit the page
+	if( touch )
+	{
+		for( size_t offset = 0 ; offset < size ; offset += MEM_PAGE_SIZE )
+			chunk->memory[offset] = 0;
+	}
+
+	MemStats::Allocate( MEM_ARENA , size + MEM_CHUNK_ALIGNMENT );
+	m_reserved += size;
+	++m_chunkCount;
+	return chunk;
+}
+
 // default constructor
 MemManager::MemManager()
 {
-	// 16mb memory for default
-	PreMalloc( 1024 * 1024 * 1024 );
 }
 
 // destructor
@@ -35,24 +131,41 @@ MemManager::~MemManager()
 	_deallocAllMemory();
 }
 
+// create the arena of the calling thread
+MemArena& MemManager::_createArena()
+{
+	MemArena* arena = new MemArena();
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_arenas.push_back( std::unique_ptr<MemArena>( arena ) );
+	}
+
+	g_ThreadArena = arena;
+	g_ThreadArenaOwner = this;
+	return *arena;
+}
+
 // pre-allocate memory
-void MemManager::PreMalloc( unsigned size , unsigned id )
+void MemManager::PreMalloc( unsigned size , unsigned id , bool touch )
 {
 	// if size is equal to zero , just return
 	if( size == 0 )
 		return;
 
-	Memory* mem = _getMemory( id );
-
-	if( mem != 0 )
+	Memory* mem = 0;
 	{
-		if( size != mem->m_size )
-			DeAlloc( id );
-		else
+		std::lock_guard<std::mutex> lock(m_mutex);
+		mem = _getMemory( id );
+		if( mem != 0 && size == mem->m_size )
 		{
-			ClearMem( id );
+			mem->m_offset = 0;
 			return;
 		}
+		if( mem != 0 )
+		{
+			delete mem;
+			m_MemPool.erase( id );
+		}
 	}
 
 	// create new memory
@@ -62,25 +175,24 @@ void MemManager::PreMalloc( unsigned size , unsigned id )
 	mem->m_offset = 0;
 	// set size
 	mem->m_size = size;
+	MemStats::Allocate( MEM_BLOCK , size );
+
+	// one byte per page is enough to commit the page
+	if( touch )
+	{
+		for( unsigned offset = 0 ; offset < size ; offset += MEM_PAGE_SIZE )
+			mem->m_memory[offset] = 0;
+	}
 
 	// push it into the map
+	std::lock_guard<std::mutex> lock(m_mutex);
 	m_MemPool.insert( make_pair( id , mem ) );
 }
 
-// clear the allocated memory
-void MemManager::ClearMem( unsigned id )
-{
-	Memory* mem = _getMemory( id );
-	if( mem == 0 )
-		LOG_ERROR<<"Can't clear memory, because there is no memory with id "<<id<<"."<<CRASH;
-
-	//reset the offset
-	mem->m_offset = 0;
-}
-
 // de-allocate memory
 void MemManager::DeAlloc( unsigned id )
 {
+	std::lock_guard<std::mutex> lock(m_mutex);
 	Memory* mem = _getMemory( id );
 	if( mem == 0 )
 		LOG_WARNING<<"Can't delete memory, because there is no memory with id "<<id<<"."<<ENDL;
@@ -90,3 +202,24 @@ void MemManager::DeAlloc( unsigned id )
 
 	m_MemPool.erase( id );
 }
+
+// output statistics of the arenas
+void MemManager::OutputLog() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	size_t high_water = 0 , reserved = 0;
+	unsigned chunks = 0;
+	for( const auto& arena : m_arenas )
+	{
+		high_water = max( high_water , arena->GetHighWater() );
+		reserved += arena->GetReservedSize();
+		chunks += arena->GetChunkCount();
+	}
+
+	LOG_HEADER( "Memory Arenas" );
+	LOG<<"Number of arenas              : "<<(unsigned)m_arenas.size()<<ENDL;
+	LOG<<"Number of chunks              : "<<chunks<<ENDL;
+	LOG<<"Reserved memory               : "<<(unsigned)( reserved / 1024 )<<" KB"<<ENDL;
+	LOG<<"High water mark of an arena   : "<<(unsigned)( high_water / 1024 )<<" KB"<<ENDL;
+}
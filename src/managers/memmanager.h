@@ -20,9 +20,19 @@
 
 // include the header
 #include "utility/singleton.h"
+#include "utility/define.h"
 #include "utility/multithread/multithread.h"
+#include "utility/memstats.h"
 #include "logmanager.h"
 #include <map>
+#include <vector>
+#include <memory>
+#include <mutex>
+
+// default alignment of memory allocated in arenas, it is enough for SSE data
+static const size_t	MEM_DEFAULT_ALIGNMENT = 16;
+// default size of the chunks of arenas
+static const size_t	MEM_DEFAULT_CHUNK_SIZE = 1024 * 1024;
 
 struct Memory
 {
@@ -39,17 +49,120 @@ struct Memory
 	~Memory()
 	{
 		delete[] m_memory;
+		MemStats::Release( MEM_BLOCK , m_size );
 		m_offset=0;
 		m_size=0;
 	}
 };
 
+//////////////////////////////////////////////////////////////////////////////////
+// definition of memory arena
+// desc :	A memory arena hands out memory by bumping a pointer in a chunk of memory.
+//			Once the current chunk runs out of space, the arena moves to the next chunk,
+//			which is allocated on demand, so that it never runs out of memory. Chunks are
+//			kept once they are allocated, resetting the arena simply rewinds the pointer to
+//			the first chunk. An arena is owned by a single thread, there is no lock at all.
+class	MemArena
+{
+// public method
+public:
+	// constructor
+	// para 'chunk_size' : minimum size of a chunk
+	MemArena( size_t chunk_size = MEM_DEFAULT_CHUNK_SIZE );
+	// destructor
+	~MemArena();
+
+	// allocate memory
+	// para 'size'  : size of the memory in bytes
+	// para 'align' : alignment of the memory, it has to be power of two and no larger than 64
+	void* Allocate( size_t size , size_t align = MEM_DEFAULT_ALIGNMENT )
+	{
+		const size_t offset = ( m_offset + align - 1 ) & ~( align - 1 );
+		if( m_current == 0 || offset + size > m_current->size )
+			return _allocateInNextChunk( size , align );
+		m_offset = offset + size;
+		return m_current->memory + offset;
+	}
+
+	// allocate memory for objects
+	// para 'count' : number of objects
+	template< typename T >
+	T* Allocate( unsigned count )
+	{
+		return (T*)Allocate( sizeof(T) * count , ( alignof(T) > MEM_DEFAULT_ALIGNMENT ) ? alignof(T) : MEM_DEFAULT_ALIGNMENT );
+	}
+
+	// release all memory allocated so far, chunks are kept for later allocation
+	void Reset()
+	{
+		_updateHighWater();
+		m_current = m_head;
+		m_offset = 0;
+		m_usedBefore = 0;
+	}
+
+	// make sure the first chunk is no smaller than a specific size
+	// para 'size'  : size of the first chunk
+	// para 'touch' : write every page of the chunk from the calling thread, so that the pages
+	//                are placed on the NUMA node of the thread by the first-touch policy.
+	void Reserve( size_t size , bool touch = false );
+
+	// get the beginning of the first chunk
+	const char* GetBaseAddress() const { return m_head ? m_head->memory : 0; }
+
+	// get the maximum number of bytes used between two resets
+	size_t GetHighWater() const;
+
+	// get the total size of all chunks
+	size_t GetReservedSize() const { return m_reserved; }
+
+	// get the number of chunks
+	unsigned GetChunkCount() const { return m_chunkCount; }
+
+// private field
+private:
+	// a chunk of memory
+	struct Chunk
+	{
+		char*	raw;		// memory allocated from system
+		char*	memory;		// memory aligned to cache line
+		size_t	size;		// usable size of the memory
+		Chunk*	next;		// next chunk in the arena
+	};
+
+	Chunk*		m_head = 0;			// the first chunk
+	Chunk*		m_current = 0;		// the chunk to allocate memory from
+	size_t		m_offset = 0;		// offset of free memory in the current chunk
+	size_t		m_usedBefore = 0;	// bytes used by the chunks before the current one
+	size_t		m_highWater = 0;	// maximum number of bytes used between two resets
+	size_t		m_reserved = 0;		// total size of all chunks
+	unsigned	m_chunkCount = 0;	// number of chunks
+	size_t		m_chunkSize;		// minimum size of a chunk
+
+	// move to the next chunk that is large enough, a new chunk is allocated if there is none
+	void*	_allocateInNextChunk( size_t size , size_t align );
+	// allocate a chunk
+	Chunk*	_allocateChunk( size_t size , bool touch = false );
+	// update the high water mark
+	void	_updateHighWater()
+	{
+		const size_t used = m_usedBefore + m_offset;
+		if( used > m_highWater )
+			m_highWater = used;
+	}
+};
+
+// the arena of the current thread and the memory manager owning it
+extern Thread_Local MemArena*	g_ThreadArena;
+extern Thread_Local const void*	g_ThreadArenaOwner;
+
 //////////////////////////////////////////////////////////////////////////////////
 // definition of memory manager
-// desc :	Memory manager could allocate small memory space efficiently. Actually
-//			it would pre-allocate some memmory space , it will return alloacted space 
-//			when asked for memory space , not really allocate it so that to save
-//			more time on allocating memory.
+// desc :	Memory manager could allocate small memory space efficiently. Each thread
+//			owns a memory arena, which is reached through a thread local pointer, so that
+//			allocating memory is no more than bumping a pointer. Besides the arenas, there
+//			are some big blocks of memory with specific ids, they are allocated during
+//			pre-processing and live until they are de-allocated explicitly.
 class	MemManager : public Singleton<MemManager>
 {
 // public method
@@ -59,47 +172,47 @@ public:
 	// destructor
 	~MemManager();
 
-	// pre-allocate memory
-	void PreMalloc( unsigned size , unsigned id = 0 );
+	// get the arena of the calling thread, it is created on first use
+	MemArena& GetArena()
+	{
+		if( g_ThreadArenaOwner != this )
+			return _createArena();
+		return *g_ThreadArena;
+	}
 
-	// clear the allocated memory
-	void ClearMem( unsigned id=0 );
+	// pre-allocate a block of memory
+	// para 'touch' : write every page of the memory from the calling thread, so that the pages
+	//                are placed on the NUMA node of the thread by the first-touch policy.
+	void PreMalloc( unsigned size , unsigned id , bool touch = false );
 
-	// de-allocate memory
-	void DeAlloc( unsigned id=0 );
+	// de-allocate a block of memory
+	void DeAlloc( unsigned id );
 
-	// get pointer and set the offset
+	// get the beginning of a block of memory
 	template< typename T >
-	T* GetPtr(unsigned count , unsigned id=0)
+	T* GetPtr( unsigned id )
 	{
-		// get the memory pointer first
+		std::lock_guard<std::mutex> lock(m_mutex);
 		Memory* mem = _getMemory(id);
-
 		if( mem == 0 )
 			LOG_ERROR<<"No memory with id "<<id<<"."<<CRASH;
-
-		// check if the memory is enough
-		if( sizeof( T ) * count + mem->m_offset > mem->m_size )
-			LOG_ERROR<<"There is not enough memory in memory manager.(mem id:"<<id<<")"<<CRASH;
-
-		unsigned addr = mem->m_offset;
-		mem->m_offset += sizeof(T) * count;
-		return (T*)(mem->m_memory + addr);
+		return (T*)mem->m_memory;
 	}
 
-	// get the offset of the memory
-	unsigned GetOffset( unsigned id=0 ) const
-	{
-		Memory* mem = _getMemory(id);
-		if( mem == 0 )
-			LOG_ERROR<<"No memory with id "<<id<<"."<<CRASH;
-		return mem->m_offset;
-	}
+	// output statistics of the arenas
+	void OutputLog() const;
 
 // private field
 private:
-	// the memories
+	// the blocks of memory with ids
 	map<unsigned,Memory*> m_MemPool;
+	// arenas of all threads
+	vector<std::unique_ptr<MemArena>> m_arenas;
+	// mutex protecting the memory blocks and the arena list
+	mutable std::mutex	m_mutex;
+
+	// create the arena of the calling thread
+	MemArena& _createArena();
 
 	// get memory
 	Memory*	_getMemory( unsigned id ) const
@@ -125,37 +238,29 @@ private:
 	friend class Singleton<MemManager>;
 };
 
-// allocate memory
-#define	SORT_MALLOC(T) SORT_MALLOC_ID(T,ThreadId())
-#define SORT_MALLOC_ID(T,id) new (MemManager::GetSingleton().GetPtr<T>(1,id)) T
-#define SORT_MALLOC_ARRAY(T,c) SORT_MALLOC_ARRAY_ID( T , c , ThreadId() )
-#define	SORT_MALLOC_ARRAY_ID(T,c,id) new (MemManager::GetSingleton().GetPtr<T>(c,id)) T
+// allocate memory from the arena of the current thread
+#define	SORT_MALLOC(T) new (MemManager::GetSingleton().GetArena().Allocate<T>(1)) T
+#define SORT_MALLOC_ARRAY(T,c) new (MemManager::GetSingleton().GetArena().Allocate<T>(c)) T
 
 // get sort memory
-#define	SORT_MEMORY_ID(T,id) MemManager::GetSingleton().GetPtr<T>(0,id)
+#define	SORT_MEMORY_ID(T,id) MemManager::GetSingleton().GetPtr<T>(id)
 
 // premalloc memory
-inline void SORT_PREMALLOC(unsigned size , unsigned id=0)
+inline void SORT_PREMALLOC(unsigned size , unsigned id)
 {
 	MemManager::GetSingleton().PreMalloc(size,id);
 }
 
-//clear memory
-inline void SORT_CLEARMEM(unsigned id=0)
+// clear the arena of the current thread
+inline void SORT_CLEARMEM()
 {
-	MemManager::GetSingleton().ClearMem(id);
+	MemManager::GetSingleton().GetArena().Reset();
 }
 
 // dealloc
-inline void SORT_DEALLOC(unsigned id=0)
+inline void SORT_DEALLOC(unsigned id)
 {
 	MemManager::GetSingleton().DeAlloc(id);
 }
 
-// get the offset
-inline unsigned SORT_OFFSET(unsigned id=0)
-{
-	return MemManager::GetSingleton().GetOffset(id);
-}
-
 #endif
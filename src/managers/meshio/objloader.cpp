@@ -76,6 +76,7 @@ bool ObjLoader::LoadMesh( const string& str , BufferMemory* mem )
 			string name;
 			file>>name;
 			MatManager::GetSingleton().ParseMatFile( name );
+			mem->m_MaterialLibs.push_back( name );
 		}else if( strcmp( prefix.c_str() , "usemtl" ) == 0 )
 		{
 			string name;
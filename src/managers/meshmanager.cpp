@@ -24,6 +24,13 @@
 #include "geometry/triangle.h"
 #include "utility/path.h"
 #include "bsdf/bsdf.h"
+#include "utility/multithread/threadpool.h"
+#include "utility/scenecache.h"
+#include "managers/matmanager.h"
+#include <atomic>
+
+// minimum number of elements processed by a single job of the thread pool
+static const unsigned MESH_PARALLEL_GRAIN = 4096;
 
 // instance the singleton with tex manager
 DEFINE_SINGLETON(MeshManager);
@@ -115,23 +122,53 @@ bool MeshManager::LoadMesh( const string& filename , TriMesh* mesh )
 		// create the new memory
 		BufferMemory* mem = new BufferMemory();
 
-		// load the mesh from file
-		read = loader->LoadMesh( str , mem );
-
-		// reset count
-		mem->CalculateCount();
+		// the processed buffers are picked from the scene cache if the same file was loaded with the same transform before
+		const unsigned long long key = _cacheKey( str , mesh->m_Transform );
+		const string cache_entry = key ? SceneCache::GetSingleton().GetEntryPath( key , "mesh" ) : string();
+		if( key && mem->LoadCache( cache_entry , key ) )
+		{
+			read = true;
+			mem->CalculateCount();
+			mem->m_pPrototype = mesh;
+		}
+		else
+		{
+			// a broken entry may have filled some of the buffers
+			if( key )
+			{
+				delete mem;
+				mem = new BufferMemory();
+			}
+
+			// load the mesh from file
+			read = loader->LoadMesh( str , mem );
+
+			// reset count
+			mem->CalculateCount();
+
+			if( read )
+			{
+				// apply the transformation
+				mem->ApplyTransform( mesh );
+
+				// if there is no normal or texture coordinate or tagent , generate them
+				// because the rendering method requires all of the data
+				mem->GenSmoothNormal();
+				mem->GenTexCoord();
+				mem->GenSmoothTagent();
+
+				if( key )
+				{
+					SceneCache::GetSingleton().AddMiss();
+					mem->SaveCache( cache_entry , key );
+				}
+			}
+		}
 
 		// set the pointer
 		if( read )
 		{
-			// apply the transformation
-			mem->ApplyTransform( mesh );
-
-			// if there is no normal or texture coordinate or tagent , generate them
-			// because the rendering method requires all of the data
-			mem->GenSmoothNormal();
-			mem->GenTexCoord();
-			mem->GenSmoothTagent();
+			mem->AccountMemory();
 
 			mesh->m_bInstanced = false;
 			mesh->m_pMemory = mem;
@@ -151,18 +188,17 @@ bool MeshManager::LoadMesh( const string& filename , TriMesh* mesh )
 // apply transform
 void BufferMemory::ApplyTransform( TriMesh* mesh )
 {
-	vector<Point>::iterator p_it = m_PositionBuffer.begin();
-	while( p_it != m_PositionBuffer.end() )
-	{
-		*p_it = (mesh->m_Transform)(*p_it);
-		p_it++;
-	}
-	vector<Vector>::iterator n_it = m_NormalBuffer.begin();
-	while( n_it != m_NormalBuffer.end() )
-	{
-		*n_it = (mesh->m_Transform.invMatrix.Transpose())(*n_it);	// use inverse transpose matrix here
-		n_it++;
-	}
+	const Transform& transform = mesh->m_Transform;
+	ThreadPool::GetSingleton().ParallelFor( 0 , (unsigned)m_PositionBuffer.size() , MESH_PARALLEL_GRAIN , [&]( unsigned b , unsigned e ){
+		for( unsigned i = b ; i < e ; i++ )
+			m_PositionBuffer[i] = transform(m_PositionBuffer[i]);
+	});
+
+	const Matrix normalMatrix = transform.invMatrix.Transpose();	// use inverse transpose matrix here
+	ThreadPool::GetSingleton().ParallelFor( 0 , (unsigned)m_NormalBuffer.size() , MESH_PARALLEL_GRAIN , [&]( unsigned b , unsigned e ){
+		for( unsigned i = b ; i < e ; i++ )
+			m_NormalBuffer[i] = normalMatrix(m_NormalBuffer[i]);
+	});
 	m_pPrototype = mesh;
 }
 
@@ -175,31 +211,36 @@ void BufferMemory::_genFlatNormal()
 	// generate the triangles
 	unsigned totalTriNum = 0;
 	unsigned trunkNum = m_TrunkBuffer.size();
+	for( unsigned i = 0 ; i < trunkNum ; i++ )
+		totalTriNum += m_TrunkBuffer[i]->m_iTriNum;
+	m_NormalBuffer.resize( m_NormalBuffer.size() + totalTriNum );
+
 	unsigned base = 0;
 	for( unsigned i = 0 ; i < trunkNum ; i++ )
 	{
 		Trunk* trunk = m_TrunkBuffer[i];
-		for( unsigned k = 0 ; k < trunk->m_iTriNum ; k++ )
-		{
-			unsigned offset = 3*k;
-			unsigned id0 = trunk->m_IndexBuffer[offset].posIndex;
-			unsigned id1 = trunk->m_IndexBuffer[offset+1].posIndex;
-			unsigned id2 = trunk->m_IndexBuffer[offset+2].posIndex;
-
-			// get the vertexes
-			Vector v0 = m_PositionBuffer[id0] - m_PositionBuffer[id1];
-			Vector v1 = m_PositionBuffer[id2] - m_PositionBuffer[id1];
-
-			// set the normal
-			Vector n = Cross( v1 , v0 );
-			n.Normalize();
-			m_NormalBuffer.push_back( n );
-
-			trunk->m_IndexBuffer[offset].norIndex = base+k;
-			trunk->m_IndexBuffer[offset+1].norIndex = base+k;
-			trunk->m_IndexBuffer[offset+2].norIndex = base+k;
-		}
-		totalTriNum += trunk->m_iTriNum;
+		ThreadPool::GetSingleton().ParallelFor( 0 , trunk->m_iTriNum , MESH_PARALLEL_GRAIN , [&]( unsigned b , unsigned e ){
+			for( unsigned k = b ; k < e ; k++ )
+			{
+				unsigned offset = 3*k;
+				unsigned id0 = trunk->m_IndexBuffer[offset].posIndex;
+				unsigned id1 = trunk->m_IndexBuffer[offset+1].posIndex;
+				unsigned id2 = trunk->m_IndexBuffer[offset+2].posIndex;
+
+				// get the vertexes
+				Vector v0 = m_PositionBuffer[id0] - m_PositionBuffer[id1];
+				Vector v1 = m_PositionBuffer[id2] - m_PositionBuffer[id1];
+
+				// set the normal
+				Vector n = Cross( v1 , v0 );
+				n.Normalize();
+				m_NormalBuffer[base+k] = n;
+
+				trunk->m_IndexBuffer[offset].norIndex = base+k;
+				trunk->m_IndexBuffer[offset+1].norIndex = base+k;
+				trunk->m_IndexBuffer[offset+2].norIndex = base+k;
+			}
+		});
 		base += trunk->m_iTriNum;
 	}
 	m_iNBCount = totalTriNum;
@@ -240,25 +281,27 @@ void BufferMemory::GenSmoothNormal()
 	}
 
 	// generate smooth normal
-	vector<Vector> smoothNormal;
-	for( unsigned i = 0 ; i < m_iVBCount ; i++ )
-	{
-		Vector n;
-
-		vector<unsigned>::iterator it = adjacency[i].begin();
-		while( it != adjacency[i].end() )
+	vector<Vector> smoothNormal( m_iVBCount );
+	ThreadPool::GetSingleton().ParallelFor( 0 , m_iVBCount , MESH_PARALLEL_GRAIN , [&]( unsigned b , unsigned e ){
+		for( unsigned i = b ; i < e ; i++ )
 		{
-			n += m_NormalBuffer[*it];
-			it++;
-		}
+			Vector n;
 
-		if( 0 != adjacency[i].size() )
-		{
-			n.Normalize();
-		}
+			vector<unsigned>::iterator it = adjacency[i].begin();
+			while( it != adjacency[i].end() )
+			{
+				n += m_NormalBuffer[*it];
+				it++;
+			}
 
-		smoothNormal.push_back(n);
-	}
+			if( 0 != adjacency[i].size() )
+			{
+				n.Normalize();
+			}
+
+			smoothNormal[i] = n;
+		}
+	});
 	m_NormalBuffer = smoothNormal;
 	m_iNBCount = m_NormalBuffer.size();
 
@@ -274,12 +317,24 @@ void BufferMemory::GenSmoothTagent()
 	// generate tagent for each triangle
 	vector<Vector> tagents;
 	const unsigned trunkNum = m_TrunkBuffer.size();
+	std::atomic<unsigned> degenerated( 0 );
 	for( unsigned i = 0 ; i < trunkNum ; i++ )
 	{
 		Trunk* trunk = m_TrunkBuffer[i];
-		for( unsigned k = 0 ; k < trunk->m_iTriNum ; k++ )
-			tagents.push_back( _genTagentForTri( trunk , k ) );
+		const unsigned base = tagents.size();
+		tagents.resize( base + trunk->m_iTriNum );
+		ThreadPool::GetSingleton().ParallelFor( 0 , trunk->m_iTriNum , MESH_PARALLEL_GRAIN , [&]( unsigned b , unsigned e ){
+			for( unsigned k = b ; k < e ; k++ )
+			{
+				bool valid = true;
+				tagents[base+k] = _genTagentForTri( trunk , k , valid );
+				if( !valid )
+					degenerated.fetch_add( 1 , std::memory_order_relaxed );
+			}
+		});
 	}
+	if( degenerated > 0 )
+		LOG_WARNING<<"There are "<<degenerated.load()<<" triangles containing three vertexes with same texture coordinate , can't generate shading coordinate correctly."<<ENDL;
 
 	// set the adjacency information
 	vector<unsigned>* adjacency = new vector<unsigned>[m_iNBCount];
@@ -302,22 +357,25 @@ void BufferMemory::GenSmoothTagent()
 	}
 
 	// generate smooth normal
-	for( unsigned i = 0 ; i < m_iNBCount ; i++ )
-	{
-		Vector t;
-
-		vector<unsigned>::iterator it = adjacency[i].begin();
-		while( it != adjacency[i].end() )
+	m_TangentBuffer.resize( m_iNBCount );
+	ThreadPool::GetSingleton().ParallelFor( 0 , m_iNBCount , MESH_PARALLEL_GRAIN , [&]( unsigned b , unsigned e ){
+		for( unsigned i = b ; i < e ; i++ )
 		{
-			t += tagents[*it];
-			it++;
-		}
+			Vector t;
 
-		if( 0 != adjacency[i].size() )
-			t.Normalize();
+			vector<unsigned>::iterator it = adjacency[i].begin();
+			while( it != adjacency[i].end() )
+			{
+				t += tagents[*it];
+				it++;
+			}
 
-		m_TangentBuffer.push_back(t);
-	}
+			if( 0 != adjacency[i].size() )
+				t.Normalize();
+
+			m_TangentBuffer[i] = t;
+		}
+	});
 	m_iTeBcount = m_TangentBuffer.size();
 
 	// free the memory
@@ -325,7 +383,7 @@ void BufferMemory::GenSmoothTagent()
 }
 
 // generate tagent vector for a triangle
-Vector BufferMemory::_genTagentForTri( const Trunk* trunk , unsigned k ) const
+Vector BufferMemory::_genTagentForTri( const Trunk* trunk , unsigned k , bool& valid ) const
 {
 	unsigned offset = 3 * k;
 	unsigned pid0 = trunk->m_IndexBuffer[offset].posIndex;
@@ -358,7 +416,7 @@ Vector BufferMemory::_genTagentForTri( const Trunk* trunk , unsigned k ) const
 	float determinant = du1 * dv2 - dv1 * du2 ;
 	if( determinant == 0.0f )
 	{
-		LOG_WARNING<<"There is a triangle containing three vertexes with same texture coordinate , can't generate shading coordinate correctly."<<ENDL;
+		valid = false;
 		Vector n = Normalize( p0 - p1 );
 		Vector t0 , t1;
 		CoordinateSystem( n , t0 , t1 );
@@ -386,20 +444,21 @@ void BufferMemory::GenTexCoord()
 	}
 	center /= (float)m_PositionBuffer.size();
 
-	it = m_PositionBuffer.begin();
-	while( it != m_PositionBuffer.end() )
-	{
-		Vector diff = *it - center;
-		diff.Normalize();
-
-		float u = SphericalTheta( diff ) / PI ;
-		float v = SphericalPhi( diff ) / PI * 0.5f;
+	const unsigned base = m_TexCoordBuffer.size();
+	m_TexCoordBuffer.resize( base + 2 * m_PositionBuffer.size() );
+	ThreadPool::GetSingleton().ParallelFor( 0 , (unsigned)m_PositionBuffer.size() , MESH_PARALLEL_GRAIN , [&]( unsigned b , unsigned e ){
+		for( unsigned i = b ; i < e ; i++ )
+		{
+			Vector diff = m_PositionBuffer[i] - center;
+			diff.Normalize();
 
-		m_TexCoordBuffer.push_back( u );
-		m_TexCoordBuffer.push_back( v );
+			float u = SphericalTheta( diff ) / PI ;
+			float v = SphericalPhi( diff ) / PI * 0.5f;
 
-		it++;
-	}
+			m_TexCoordBuffer[base+2*i] = u;
+			m_TexCoordBuffer[base+2*i+1] = v;
+		}
+	});
 	m_iTBCount = m_TexCoordBuffer.size();
 
 	// set the texture coordinate index
@@ -416,3 +475,116 @@ void BufferMemory::GenTexCoord()
 		}
 	}
 }
+
+// account for the memory of all buffers
+void BufferMemory::AccountMemory()
+{
+	size_t bytes = m_PositionBuffer.capacity() * sizeof( Point ) + m_NormalBuffer.capacity() * sizeof( Vector ) +
+					m_TangentBuffer.capacity() * sizeof( Vector ) + m_TexCoordBuffer.capacity() * sizeof( float );
+	vector<Trunk*>::const_iterator it = m_TrunkBuffer.begin();
+	while( it != m_TrunkBuffer.end() )
+	{
+		bytes += sizeof( Trunk ) + (*it)->m_IndexBuffer.capacity() * sizeof( VertexIndex );
+		it++;
+	}
+	m_memory.Release();
+	m_memory.Allocate( bytes );
+}
+
+// key of a mesh in the scene cache
+unsigned long long MeshManager::_cacheKey( const string& filename , const Transform& transform ) const
+{
+	if( !SceneCache::GetSingleton().IsEnabled() )
+		return 0;
+
+	// hashing the raw file is much cheaper than parsing it
+	MappedFile file;
+	if( !file.Open( filename ) )
+		return 0;
+	const unsigned long long key = HashMemory( transform.matrix.m , sizeof( transform.matrix.m ) , HashMemory( file.GetData() , file.GetSize() ) );
+
+	// zero means that the mesh is not cached
+	return key ? key : 1;
+}
+
+// write the processed buffers to the scene cache
+void BufferMemory::SaveCache( const string& filename , unsigned long long key ) const
+{
+	CacheWriter writer;
+	if( !writer.Open( filename , key ) )
+		return;
+
+	const unsigned long long lib_num = m_MaterialLibs.size();
+	writer.Write( &lib_num , sizeof( lib_num ) );
+	for( unsigned i = 0 ; i < lib_num ; i++ )
+		writer.WriteString( m_MaterialLibs[i] );
+
+	writer.WriteVector( m_PositionBuffer );
+	writer.WriteVector( m_NormalBuffer );
+	writer.WriteVector( m_TangentBuffer );
+	writer.WriteVector( m_TexCoordBuffer );
+
+	const unsigned long long trunk_num = m_TrunkBuffer.size();
+	writer.Write( &trunk_num , sizeof( trunk_num ) );
+	for( unsigned i = 0 ; i < trunk_num ; i++ )
+	{
+		const Trunk* trunk = m_TrunkBuffer[i];
+		writer.WriteString( trunk->name );
+		writer.WriteString( trunk->m_mat ? trunk->m_mat->GetName() : string() );
+		writer.WriteVector( trunk->m_IndexBuffer );
+	}
+
+	if( !writer.Close() )
+		LOG_WARNING<<"Failed to write scene cache entry \'"<<filename<<"\'."<<ENDL;
+}
+
+// load the processed buffers from the scene cache
+bool BufferMemory::LoadCache( const string& filename , unsigned long long key )
+{
+	CacheReader reader;
+	if( !reader.Open( filename , key ) )
+		return false;
+
+	// materials of the trunks may be defined in the libraries referenced by the mesh file
+	unsigned long long lib_num = 0;
+	if( !reader.Read( &lib_num , sizeof( lib_num ) ) || lib_num > reader.GetSize() )
+		return false;
+	vector<string> libs( (size_t)lib_num );
+	for( unsigned i = 0 ; i < libs.size() ; i++ )
+		if( !reader.ReadString( libs[i] ) )
+			return false;
+
+	unsigned long long trunk_num = 0;
+	if( !reader.ReadVector( m_PositionBuffer ) || !reader.ReadVector( m_NormalBuffer ) || !reader.ReadVector( m_TangentBuffer ) ||
+		!reader.ReadVector( m_TexCoordBuffer ) || !reader.Read( &trunk_num , sizeof( trunk_num ) ) )
+		return false;
+
+	vector<string> materials;
+	for( unsigned long long i = 0 ; i < trunk_num ; i++ )
+	{
+		string name , material;
+		if( !reader.ReadString( name ) || !reader.ReadString( material ) )
+			return false;
+		Trunk* trunk = new Trunk( name );
+		m_TrunkBuffer.push_back( trunk );
+		if( !reader.ReadVector( trunk->m_IndexBuffer ) )
+			return false;
+		materials.push_back( material );
+	}
+
+	// the entry is valid, resolve the materials the same way the loader does
+	m_MaterialLibs = libs;
+	for( unsigned i = 0 ; i < m_MaterialLibs.size() ; i++ )
+		MatManager::GetSingleton().ParseMatFile( m_MaterialLibs[i] );
+	for( unsigned i = 0 ; i < m_TrunkBuffer.size() ; i++ )
+	{
+		if( materials[i].empty() )
+			continue;
+		m_TrunkBuffer[i]->m_mat = MatManager::GetSingleton().FindMaterial( materials[i] );
+		if( 0 == m_TrunkBuffer[i]->m_mat )
+			LOG_WARNING<<"Material named \'"<<materials[i]<<"\' not found, use default material in subset \'"<<m_TrunkBuffer[i]->name<<"\'."<<ENDL;
+	}
+
+	SceneCache::GetSingleton().AddHit( reader.GetSize() );
+	return true;
+}
@@ -24,6 +24,7 @@
 #include "utility/referencecount.h"
 #include "utility/enum.h"
 #include "utility/define.h"
+#include "utility/memstats.h"
 #include <vector>
 #include <map>
 #include "math/point.h"
@@ -97,9 +98,14 @@ public:
 	TriMesh*		m_pPrototype;
 	// the name for the file
 	std::string		m_filename;
+	// material libraries referenced by the mesh file
+	vector<string>	m_MaterialLibs;
+
+	// memory of all buffers in memory statistics
+	MemAccount		m_memory;
 
 	// set default data for the buffer memory
-	BufferMemory()
+	BufferMemory() : m_memory( MEM_MESH )
 	{
 		m_iVBCount = 0;
 		m_iNBCount = 0;
@@ -147,10 +153,23 @@ public:
 	// generate texture coordinate
 	void	GenTexCoord();
 
+	// account for the memory of all buffers in memory statistics, it is called once all buffers are generated
+	void	AccountMemory();
+
+	// write the processed buffers to an entry of the scene cache
+	// para 'filename' : name of the cache entry
+	// para 'key'      : hash of the mesh file and its transform
+	void	SaveCache( const string& filename , unsigned long long key ) const;
+	// load the processed buffers from an entry of the scene cache
+	// para 'filename' : name of the cache entry
+	// para 'key'      : hash of the mesh file and its transform
+	// result          : 'true' if the entry exists and is valid
+	bool	LoadCache( const string& filename , unsigned long long key );
+
 // private method
 private:
 	void	_genFlatNormal();
-	Vector	_genTagentForTri( const Trunk* trunk , unsigned k  ) const;
+	Vector	_genTagentForTri( const Trunk* trunk , unsigned k , bool& valid ) const;
 };
 
 /////////////////////////////////////////////////////////////////////////
@@ -188,6 +207,8 @@ private:
 
 	// initialize the manager
 	void	_init();
+	// key of a mesh in the scene cache, it is zero if the cache is disabled
+	unsigned long long	_cacheKey( const string& filename , const Transform& transform ) const;
 	// release the manager
 	void	_release();
 
@@ -24,6 +24,11 @@
 #include <half.h>
 #include <ImfRgba.h>
 #include <ImfRgbaFile.h>
+#include <ImfTiledOutputFile.h>
+#include <ImfChannelList.h>
+#include <ImfFrameBuffer.h>
+#include <ImfOutputFile.h>
+#include <vector>
 
 using namespace Imf;
 using namespace Imath;
@@ -72,30 +77,129 @@ bool ExrIO::Write( const string& name , const Texture* tex )
 {
 	unsigned totalXRes = tex->GetWidth();
 	unsigned totalYRes = tex->GetHeight();
-	unsigned total = totalXRes * totalYRes;
-
-	Rgba *hrgba = new Rgba[total];
-    for (unsigned i = 0; i < total; ++i)
-	{
-		unsigned x = i % totalXRes;
-		unsigned y = i / totalXRes;
-		Spectrum c = tex->GetColor( x , y );
-		hrgba[i] = Rgba( c.GetR() , c.GetG() , c.GetB() , 1.f);
-	}
-	
+
+	// the image is converted and written in strips of scanlines instead of copying it as a whole
+	const unsigned strip = 64;
+	std::vector<Rgba> hrgba( totalXRes * min( strip , totalYRes ) );
+
     Box2i displayWindow(V2i(0,0), V2i(totalXRes-1, totalYRes-1));
     Box2i dataWindow(V2i(0, 0), V2i(totalXRes - 1, totalYRes - 1));
 
     try {
         RgbaOutputFile file(name.c_str(), displayWindow, dataWindow, WRITE_RGBA);
-        file.setFrameBuffer(hrgba, 1, totalXRes);
-        file.writePixels(totalYRes);
+		for( unsigned y0 = 0 ; y0 < totalYRes ; y0 += strip )
+		{
+			const unsigned rows = min( strip , totalYRes - y0 );
+			for( unsigned i = 0 ; i < rows * totalXRes ; ++i )
+			{
+				Spectrum c = tex->GetColor( i % totalXRes , y0 + i / totalXRes );
+				hrgba[i] = Rgba( c.GetR() , c.GetG() , c.GetB() , 1.f);
+			}
+			// the frame buffer is addressed with the absolute coordinate of pixels
+			file.setFrameBuffer(&hrgba[0] - (size_t)y0 * totalXRes, 1, totalXRes);
+			file.writePixels(rows);
+		}
     }
     catch (const std::exception &e) {
 		LOG_WARNING<<"Unable to write image file \""<<name<<"\": "<<e.what()<<ENDL;
     }
 
-    delete[] hrgba;
+	return true;
+}
 
+// output several channels into one exr file
+bool ExrIO::WriteChannels( const string& name , int w , int h , const vector<string>& names , const vector<const float*>& data ,
+						   const vector<string>& uint_names , const vector<const unsigned*>& uint_data )
+{
+	try {
+		Header header( w , h );
+		FrameBuffer frameBuffer;
+		for( unsigned i = 0 ; i < names.size() ; ++i )
+		{
+			header.channels().insert( names[i].c_str() , Channel( FLOAT ) );
+			frameBuffer.insert( names[i].c_str() , Slice( FLOAT , (char*)data[i] , sizeof(float) , w * sizeof(float) ) );
+		}
+		for( unsigned i = 0 ; i < uint_names.size() ; ++i )
+		{
+			header.channels().insert( uint_names[i].c_str() , Channel( UINT ) );
+			frameBuffer.insert( uint_names[i].c_str() , Slice( UINT , (char*)uint_data[i] , sizeof(unsigned) , w * sizeof(unsigned) ) );
+		}
+
+		OutputFile file( name.c_str() , header );
+		file.setFrameBuffer( frameBuffer );
+		file.writePixels( h );
+	}
+	catch (const std::exception &e) {
+		LOG_WARNING<<"Unable to write image file \""<<name<<"\": "<<e.what()<<ENDL;
+		return false;
+	}
 	return true;
 }
+
+// create the file
+bool ExrTileWriter::Open( const string& name , int w , int h , int tile_size )
+{
+	Close();
+
+	try {
+		Header header( w , h );
+		header.channels().insert( "R" , Channel( HALF ) );
+		header.channels().insert( "G" , Channel( HALF ) );
+		header.channels().insert( "B" , Channel( HALF ) );
+		header.channels().insert( "A" , Channel( HALF ) );
+		header.setTileDescription( TileDescription( tile_size , tile_size , ONE_LEVEL ) );
+		// tiles are stored in the order they are finished, they would be buffered in memory otherwise
+		header.lineOrder() = RANDOM_Y;
+		m_file = new TiledOutputFile( name.c_str() , header );
+	}
+	catch (const std::exception &e) {
+		LOG_WARNING<<"Unable to write image file \""<<name<<"\": "<<e.what()<<ENDL;
+		m_file = 0;
+		return false;
+	}
+
+	m_tileSize = tile_size;
+	m_name = name;
+	return true;
+}
+
+// write a tile into the file
+bool ExrTileWriter::WriteTile( int x , int y , int w , int h , const float* data )
+{
+	if( m_file == 0 )
+		return false;
+
+	std::vector<Rgba> hrgba( w * h );
+	for( int i = 0 ; i < w * h ; ++i )
+		hrgba[i] = Rgba( data[3*i] , data[3*i+1] , data[3*i+2] , 1.f );
+
+	// the frame buffer is addressed with the absolute coordinate of pixels
+	Rgba* base = &hrgba[0] - x - (size_t)y * w;
+	FrameBuffer frameBuffer;
+	frameBuffer.insert( "R" , Slice( HALF , (char*)&base->r , sizeof(Rgba) , w * sizeof(Rgba) ) );
+	frameBuffer.insert( "G" , Slice( HALF , (char*)&base->g , sizeof(Rgba) , w * sizeof(Rgba) ) );
+	frameBuffer.insert( "B" , Slice( HALF , (char*)&base->b , sizeof(Rgba) , w * sizeof(Rgba) ) );
+	frameBuffer.insert( "A" , Slice( HALF , (char*)&base->a , sizeof(Rgba) , w * sizeof(Rgba) ) );
+
+	try {
+		m_file->setFrameBuffer( frameBuffer );
+		m_file->writeTile( x / m_tileSize , y / m_tileSize );
+	}
+	catch (const std::exception &e) {
+		LOG_WARNING<<"Unable to write tile of image file \""<<m_name<<"\": "<<e.what()<<ENDL;
+		return false;
+	}
+	return true;
+}
+
+// finish writing the file
+void ExrTileWriter::Close()
+{
+	try {
+		delete m_file;
+	}
+	catch (const std::exception &e) {
+		LOG_WARNING<<"Unable to write image file \""<<m_name<<"\": "<<e.what()<<ENDL;
+	}
+	m_file = 0;
+}
@@ -20,6 +20,7 @@
 
 // include the header file
 #include "texio.h"
+#include <vector>
 
 ////////////////////////////////////////////////////////////////////////////
 // definition of bmpio
@@ -43,6 +44,63 @@ public:
 	// para 'mem' : the memory for the image
 	// result     :	'true' if the input file is parsed successfully
 	virtual bool Read( const string& str , ImgMemory* mem );
+
+	// output several channels of full float precision into one exr file
+	// para 'str'       : the name of the file
+	// para 'w'         : width of the image
+	// para 'h'         : height of the image
+	// para 'names'     : name of each channel, like "R" or "normal.X" for channels of layers
+	// para 'data'      : one float per pixel of each channel, row by row
+	// para 'uint_names': name of each channel of unsigned integers, like ids which floats can't represent exactly
+	// para 'uint_data' : one unsigned integer per pixel of each integer channel, row by row
+	// result           : 'true' if saving is successful
+	static bool WriteChannels( const string& str , int w , int h , const vector<string>& names , const vector<const float*>& data ,
+							   const vector<string>& uint_names = vector<string>() , const vector<const unsigned*>& uint_data = vector<const unsigned*>() );
+};
+
+namespace Imf { class TiledOutputFile; }
+
+////////////////////////////////////////////////////////////////////////////
+// definition of exr tile writer
+// write a tiled exr file tile by tile so that the whole image never has to
+// be kept in memory, tiles could be written in any order
+class ExrTileWriter
+{
+// public method
+public:
+	// default constructor
+	ExrTileWriter(){m_file=0;m_tileSize=0;}
+	// the file is closed in destructor
+	~ExrTileWriter(){Close();}
+
+	// create the file
+	// para 'str'       : the name of the file
+	// para 'w'         : width of the image
+	// para 'h'         : height of the image
+	// para 'tile_size' : size of the square tiles in the file
+	// result           : 'true' if the file is created
+	bool Open( const string& str , int w , int h , int tile_size );
+
+	// write a tile into the file, tiles are aligned to the tile size
+	// para 'x'    : x coordinate of the top-left pixel of the tile
+	// para 'y'    : y coordinate of the top-left pixel of the tile
+	// para 'w'    : width of the tile, it is smaller than the tile size on the right border
+	// para 'h'    : height of the tile, it is smaller than the tile size on the bottom border
+	// para 'data' : three floats per pixel of the tile, row by row
+	// result      : 'true' if the tile is written
+	bool WriteTile( int x , int y , int w , int h , const float* data );
+
+	// finish writing the file, missing tiles are left empty
+	void Close();
+
+	// whether the file is opened
+	bool IsOpen() const {return m_file!=0;}
+
+// private field
+private:
+	Imf::TiledOutputFile*	m_file;
+	int						m_tileSize;
+	string					m_name;
 };
 
 #endif
@@ -148,6 +148,7 @@ bool TexManager::Read( const string& filename , ImageTexture* tex )
 			tex->m_pMemory = mem;
 			tex->m_iTexWidth = mem->m_iWidth;
 			tex->m_iTexHeight = mem->m_iHeight;
+			mem->m_memory.Allocate( sizeof( Spectrum ) * mem->m_iWidth * mem->m_iHeight );
 			
 			// insert it into the container
 			m_ImgContainer.insert( make_pair( str , mem ) );
@@ -25,6 +25,7 @@
 #include <map>
 #include "spectrum/spectrum.h"
 #include "utility/referencecount.h"
+#include "utility/memstats.h"
 
 class Texture;
 class ImageTexture;
@@ -36,6 +37,11 @@ public:
 	Spectrum*	m_ImgMem;
 	unsigned	m_iWidth;
 	unsigned	m_iHeight;
+
+	// memory of the image in memory statistics
+	MemAccount	m_memory;
+
+	ImgMemory() : m_memory( MEM_TEXTURE ) {}
 };
 
 //////////////////////////////////////////////////////////////////
@@ -0,0 +1,90 @@
+/*
+    This file is a part of SORT(Simple Open Ray Tracing), an open-source cross
+    platform physically based renderer.
+ 
+    Copyright (c) 2011-2016 by Cao Jiayin - All rights reserved.
+ 
+    SORT is a free software written for educational purpose. Anyone can distribute
+    or modify it under the the terms of the GNU General Public License Version 3 as
+    published by the Free Software Foundation. However, there is NO warranty that
+    all components are functional in a perfect manner. Without even the implied
+    warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License along with
+    this program. If not, see <http://www.gnu.org/licenses/gpl-3.0.html>.
+ */
+
+
+#include "mappedfile.h"
+
+#if defined(SORT_IN_WINDOWS)
+    #include <windows.h>
+#else
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+
+bool MappedFile::Open( const std::string& filename )
+{
+    Close();
+
+#if defined(SORT_IN_WINDOWS)
+    HANDLE file = CreateFileA( filename.c_str() , GENERIC_READ , FILE_SHARE_READ , NULL , OPEN_EXISTING , FILE_ATTRIBUTE_NORMAL , NULL );
+    if( file == INVALID_HANDLE_VALUE )
+        return false;
+    LARGE_INTEGER size;
+    if( !GetFileSizeEx( file , &size ) || size.QuadPart == 0 ){
+        CloseHandle( file );
+        return false;
+    }
+    HANDLE mapping = CreateFileMappingA( file , NULL , PAGE_READONLY , 0 , 0 , NULL );
+    const void* data = mapping ? MapViewOfFile( mapping , FILE_MAP_READ , 0 , 0 , 0 ) : NULL;
+    if( !data ){
+        if( mapping )
+            CloseHandle( mapping );
+        CloseHandle( file );
+        return false;
+    }
+    m_file = file;
+    m_mapping = mapping;
+    m_data = (const char*)data;
+    m_size = (size_t)size.QuadPart;
+#else
+    const int fd = open( filename.c_str() , O_RDONLY );
+    if( fd == -1 )
+        return false;
+    struct stat st;
+    if( fstat( fd , &st ) == -1 || st.st_size == 0 ){
+        close( fd );
+        return false;
+    }
+    void* data = mmap( 0 , (size_t)st.st_size , PROT_READ , MAP_PRIVATE , fd , 0 );
+    // the mapping stays valid after the descriptor is closed
+    close( fd );
+    if( data == MAP_FAILED )
+        return false;
+    m_data = (const char*)data;
+    m_size = (size_t)st.st_size;
+#endif
+    return true;
+}
+
+void MappedFile::Close()
+{
+    if( !m_data )
+        return;
+
+#if defined(SORT_IN_WINDOWS)
+    UnmapViewOfFile( m_data );
+    CloseHandle( m_mapping );
+    CloseHandle( m_file );
+    m_file = m_mapping = nullptr;
+#else
+    munmap( (void*)m_data , m_size );
+#endif
+    m_data = nullptr;
+    m_size = 0;
+}
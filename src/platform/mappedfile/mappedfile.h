@@ -0,0 +1,65 @@
+/*
+    This file is a part of SORT(Simple Open Ray Tracing), an open-source cross
+    platform physically based renderer.
+ 
+    Copyright (c) 2011-2016 by Cao Jiayin - All rights reserved.
+ 
+    SORT is a free software written for educational purpose. Anyone can distribute
+    or modify it under the the terms of the GNU General Public License Version 3 as
+    published by the Free Software Foundation. However, there is NO warranty that
+    all components are functional in a perfect manner. Without even the implied
+    warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License along with
+    this program. If not, see <http://www.gnu.org/licenses/gpl-3.0.html>.
+ */
+
+
+#pragma once
+
+#include "sort.h"
+#include <string>
+
+//! @brief Read-only memory mapping of a whole file.
+/**
+ * Pages of the file are loaded on demand by the operating system, nothing is copied or parsed
+ * when the file is opened.
+ */
+class MappedFile
+{
+public:
+    //! @brief Default constructor.
+    MappedFile() {}
+
+    //! @brief Destructor, the mapping is closed.
+    ~MappedFile() { Close(); }
+
+    //! @brief Map a file in memory.
+    //! @param filename Name of the file.
+    //! @return         False if the file doesn't exist, it is empty or it can't be mapped.
+    bool Open( const std::string& filename );
+
+    //! @brief Unmap the file.
+    void Close();
+
+    //! @brief Whether a file is mapped.
+    bool IsOpen() const { return m_data != nullptr; }
+
+    //! @brief Content of the file.
+    const char* GetData() const { return m_data; }
+
+    //! @brief Size of the file in bytes.
+    size_t GetSize() const { return m_size; }
+
+private:
+    const char* m_data = nullptr;   /**< Mapped content of the file. */
+    size_t      m_size = 0;         /**< Size of the file in bytes. */
+#if defined(SORT_IN_WINDOWS)
+    void*       m_file = nullptr;   /**< Handle of the file. */
+    void*       m_mapping = nullptr;/**< Handle of the file mapping. */
+#endif
+
+    MappedFile( const MappedFile& ) = delete;
+    MappedFile& operator = ( const MappedFile& ) = delete;
+};
@@ -23,6 +23,7 @@
 #include "managers/logmanager.h"
 #include <sys/mman.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 
 #include <sys/types.h>
 #include <sys/mman.h>
@@ -47,6 +48,16 @@ void MmapSharedMemory::CreateSharedMemory( const string& name , int size , unsig
         return;
     }
     
+    // pages beyond the end of the file can't be touched, the file is created by blender with the size of its layout
+    struct stat st;
+    if( fstat( fd , &st ) == -1 || st.st_size < size )
+    {
+        cout<< "Shared memory file is smaller than expected"<<endl;
+        close( fd );
+        fd = -1;
+        return;
+    }
+
     // map a new file
     sharedmemory.bytes = (char*)mmap(0, size, PROT_READ|PROT_WRITE, MAP_FILE|MAP_SHARED, fd, 0);
     if( sharedmemory.bytes == MAP_FAILED)
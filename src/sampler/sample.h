@@ -23,6 +23,8 @@
 #include "utility/rand.h"
 #include "utility/define.h"
 
+class AovSample;
+
 // Light Sample
 class	LightSample
 {
@@ -98,6 +100,7 @@ public:
 	vector<unsigned>	light_dimension;
 	vector<unsigned>	bsdf_dimension;
 	float*				data;		// the data to used
+	AovSample*			aov;		// auxiliary values of the sample, it is null unless AOVs are enabled
 
 	// default constructor
 	PixelSample()
@@ -107,6 +110,7 @@ public:
 		light_sample = 0;
 		bsdf_sample = 0;
 		data = 0;
+		aov = 0;
 	}
 	~PixelSample()
 	{
@@ -28,6 +28,14 @@
 #include "utility/creator.h"
 #include "sampler/sampler.h"
 #include "utility/multithread/multithread.h"
+#include "utility/multithread/threadpool.h"
+#include "utility/multithread/numa.h"
+#include "utility/checkpoint.h"
+#include "utility/memstats.h"
+#include "utility/scenecache.h"
+#include <atomic>
+#include <chrono>
+#include <climits>
 #include <ImfHeader.h>
 #include "utility/strhelper.h"
 #include "camera/camera.h"
@@ -38,8 +46,49 @@
 #include "math/vector2.h"
 
 extern bool g_bBlenderMode;
+extern bool g_bResumeMode;
 extern int  g_iTileSize;
 
+// interval between two progress updates in milliseconds
+static const unsigned PROGRESS_UPDATE_INTERVAL = 100;
+// number of samples per pixel taken in each pass of progressive rendering
+static const unsigned SAMPLES_PER_PASS = 1;
+// time reserved for writing the image before the deadline in milliseconds
+static const unsigned DEADLINE_RESERVED_TIME = 500;
+// default interval between two checkpoints in seconds
+static const float DEFAULT_CHECKPOINT_INTERVAL = 60.0f;
+// minimum interval between two intermediate frames in milliseconds
+static const unsigned PUBLISH_INTERVAL = 1000;
+// range of tile size and the desired number of tiles per thread
+static const int MIN_TILE_SIZE = 16;
+static const int MAX_TILE_SIZE = 128;
+static const unsigned MIN_TILES_PER_THREAD = 4;
+static const unsigned MAX_TILES_PER_THREAD = 32;
+// size of the memory read by each thread in the memory traffic benchmark
+static const unsigned MEMORY_BENCHMARK_SIZE = 1024 * 1024 * 64;
+// sum of the memory read in the benchmark, it is consumed so that the reading is not optimized out
+static std::atomic<unsigned long long> g_memoryBenchmarkSink( 0 );
+
+// read the beginning of the memory arena of a thread
+// result : bandwidth in GB/s
+static float readThreadMemory( const char* memory )
+{
+	const unsigned long long* data = (const unsigned long long*)memory;
+	const unsigned count = MEMORY_BENCHMARK_SIZE / sizeof( unsigned long long );
+
+	auto start = std::chrono::high_resolution_clock::now();
+	unsigned long long sum = 0;
+	for( unsigned i = 0 ; i < count ; ++i )
+		sum += data[i];
+	auto end = std::chrono::high_resolution_clock::now();
+
+	// make sure the loop is not optimized out
+	g_memoryBenchmarkSink.fetch_add( sum , std::memory_order_relaxed );
+
+	const float seconds = std::chrono::duration<float>( end - start ).count();
+	return ( seconds > 0.0f ) ? MEMORY_BENCHMARK_SIZE / seconds / ( 1024.0f * 1024.0f * 1024.0f ) : 0.0f;
+}
+
 // constructor
 System::System()
 {
@@ -68,19 +117,43 @@ void System::_preInit()
 	Timer::CreateInstance();
 	// initialize shared memory
 	SMManager::CreateInstance();
+	// initialize thread pool, worker threads are not spawned until the setup
+	ThreadPool::CreateInstance();
 
 	// setup default value
 	m_camera = 0;
 	m_uRenderingTime = 0;
 	m_uPreProcessingTime = 0;
-	m_thread_num = 1;
+	m_uLoadingTime = 0;
+	m_thread_num = 0;
 	m_pProgress = 0;
     m_imagesensor = 0;
+	m_pIntegrator = 0;
+	m_numaAware = false;
+	m_numaBenchmark = false;
+	m_progressive = false;
+	m_timeBudget = 0;
+	m_deadline = 0;
+	m_adaptiveThreshold = 0.0f;
+	m_adaptiveMaxSpp = 0;
+	m_adaptive = false;
+	m_checkpointInterval = 0;
+	m_resumed = false;
+	m_lastCheckpointCost = 0;
+	m_checkpointCost = 0;
+	m_checkpointCount = 0;
+	m_passNum = 1;
+	m_passDone = 0;
+	m_localBandwidth = 0.0f;
+	m_remoteBandwidth = 0.0f;
 }
 
 // post-uninit
 void System::_postUninit()
 {
+	// stop all worker threads before releasing anything they may touch
+	ThreadPool::DeleteSingleton();
+
 	// relase the memory
 	m_Scene.Release();
 
@@ -88,6 +161,7 @@ void System::_postUninit()
     SAFE_DELETE( m_imagesensor );
 	SAFE_DELETE( m_camera );
 	SAFE_DELETE( m_pSampler );
+	SAFE_DELETE( m_pIntegrator );
 	SAFE_DELETE_ARRAY( m_taskDone );
 
 	// release managers
@@ -99,7 +173,9 @@ void System::_postUninit()
 	Timer::DeleteSingleton();
 	LogManager::DeleteSingleton();
 	SMManager::DeleteSingleton();
-	RenderTaskQueue::DeleteSingleton();
+	RenderTaskScheduler::DeleteSingleton();
+	NumaTopology::DeleteSingleton();
+	Checkpoint::DeleteSingleton();
 }
 
 // render the image
@@ -113,6 +189,9 @@ void System::Render()
 
 	// push rendering task
 	_pushRenderTask();
+	// continue from the last checkpoint
+	if( g_bResumeMode )
+		_loadCheckpoint();
 	// execute rendering tasks
 	_executeRenderingTasks();
 	
@@ -124,7 +203,12 @@ void System::Render()
 bool System::LoadScene( const string& filename )
 {
 	string str = GetFullPath(filename);
-	return m_Scene.LoadScene( str );
+
+	Timer::GetSingleton().StartTimer();
+	bool result = m_Scene.LoadScene( str );
+	m_uLoadingTime = Timer::GetSingleton().StopTimer();
+
+	return result;
 }
 
 // pre-process before rendering
@@ -144,8 +228,37 @@ void System::PreProcess()
 		return;
 	}
 
-	// preprocess scene
-	m_Scene.PreProcess();
+	// arenas of threads grow on demand, with NUMA enabled the first chunk of each arena is allocated
+	// and first touched by its owner, so that it lives on the node of the thread
+	if( m_numaAware )
+	{
+		// the chunk is only made large enough for the benchmark if it is asked for
+		const size_t reserved = m_numaBenchmark ? MEMORY_BENCHMARK_SIZE : MEM_DEFAULT_CHUNK_SIZE;
+		vector<const char*> arenas( m_thread_num , 0 );
+		ThreadPool::GetSingleton().RunOnEachWorker( [&arenas,reserved]( unsigned tid ){
+			MemArena& arena = MemManager::GetSingleton().GetArena();
+			arena.Reserve( reserved , true );
+			arenas[tid] = arena.GetBaseAddress();
+		});
+		if( m_numaBenchmark )
+			_benchmarkMemoryTraffic( arenas );
+	}
+
+	// the image sensor is independent of the scene, while the integrator can't be pre-processed
+	// until the acceleration structure is ready
+	TaskGraph graph;
+	TaskGraph::TaskId scene_task = graph.AddTask( [this]() { m_Scene.PreProcess(); } );
+	graph.AddTask( [this]() { m_imagesensor->PreProcess(); } );
+	TaskGraph::TaskId integrator_task = graph.AddTask( [this]() {
+		m_pIntegrator = _allocateIntegrator();
+		if( m_pIntegrator )
+		{
+			m_pIntegrator->PreProcess();
+			m_pIntegrator->SetupCamera(m_camera);
+		}
+	} );
+	graph.AddDependency( scene_task , integrator_task );
+	graph.Execute();
 
 	// stop timer
 	Timer::GetSingleton().StopTimer();
@@ -178,12 +291,15 @@ unsigned System::GetRenderingTime() const
 void System::_outputProgress()
 {
 	// get the number of tasks done
-	unsigned taskDone = 0;
-	for( unsigned i = 0; i < m_totalTask; ++i )
-		taskDone += m_taskDone[i];
+	const unsigned taskDone = RenderTaskScheduler::GetSingleton().GetCompletedTaskCount();
+
+	// output progress, all passes are taken into account in progressive rendering
+	float pass_progress = ( m_passDone < m_passNum ) ? (float)(taskDone) / (float)m_totalTask : 0.0f;
+	unsigned progress = (unsigned)( ( m_passDone + pass_progress ) / (float)max( m_passNum , 1u ) * 100 );
 
-	// output progress
-	unsigned progress = (unsigned)( (float)(taskDone) / (float)m_totalTask * 100 );
+	// the progress depends on time only if there is a deadline
+	if( m_deadline > 0 )
+		progress = ( m_passDone < m_passNum ) ? 100 - _timeBeforeDeadline() * 100 / m_deadline : 100;
 
 	if (!g_bBlenderMode)
 		cout<< progress<<"\rProgress: ";
@@ -191,6 +307,37 @@ void System::_outputProgress()
 		*m_pProgress = progress;
 }
 
+// compare the bandwidth of reading memory on the local node against memory on a remote node
+void System::_benchmarkMemoryTraffic( const vector<const char*>& arenas )
+{
+	const ThreadPool& pool = ThreadPool::GetSingleton();
+	const unsigned thread_num = pool.GetThreadNum();
+	vector<float> local( thread_num , 0.0f ) , remote( thread_num , 0.0f );
+	ThreadPool::GetSingleton().RunOnEachWorker( [&]( unsigned tid ){
+		// read the arena of the first thread on another node, the next thread is picked if there is only one node
+		unsigned other = ( tid + 1 ) % thread_num;
+		for( unsigned i = 1 ; i < thread_num ; ++i )
+		{
+			const unsigned t = ( tid + i ) % thread_num;
+			if( pool.GetWorkerNode( t ) != pool.GetWorkerNode( tid ) )
+			{
+				other = t;
+				break;
+			}
+		}
+		local[tid] = readThreadMemory( arenas[tid] );
+		remote[tid] = readThreadMemory( arenas[other] );
+	});
+
+	m_localBandwidth = 0.0f;
+	m_remoteBandwidth = 0.0f;
+	for( unsigned i = 0 ; i < thread_num ; ++i )
+	{
+		m_localBandwidth += local[i] / thread_num;
+		m_remoteBandwidth += remote[i] / thread_num;
+	}
+}
+
 // output log information
 void System::OutputLog() const
 {
@@ -199,8 +346,108 @@ void System::OutputLog() const
 
 	// output time information
 	LOG_HEADER( "Rendering Information" );
+	LOG<<"Time spent on loading scene   : "<<m_uLoadingTime<<ENDL;
 	LOG<<"Time spent on pre-processing  : "<<m_uPreProcessingTime<<ENDL;
 	LOG<<"Time spent on rendering       : "<<m_uRenderingTime<<ENDL;
+	if( SceneCache::GetSingleton().IsEnabled() )
+	{
+		const SceneCache& cache = SceneCache::GetSingleton();
+		LOG<<"Scene cache                   : "<<cache.GetDirectory()<<" ("<<cache.GetHits()<<" hits , "<<cache.GetMisses()<<" misses , "<<(unsigned)( cache.GetHitBytes() / 1024 )<<" KB loaded)"<<ENDL;
+	}
+	if( m_imagesensor->IsStreaming() )
+		LOG<<"Streaming output              : tiled exr"<<ENDL;
+	if( m_imagesensor->GetFramebufferFormat() != PF_FLOAT )
+		LOG<<"Framebuffer format            : "<<PixelFormatName( m_imagesensor->GetFramebufferFormat() )<<ENDL;
+	if( const AovBuffer* aov = m_imagesensor->GetAov() )
+	{
+		string names;
+		for( unsigned i = 0 ; i < AOV_CHANNEL_NUM ; ++i )
+			if( aov->IsEnabled( (AOV_CHANNEL)i ) )
+				names += string( names.empty() ? "" : " " ) + AovBuffer::GetName( (AOV_CHANNEL)i );
+		LOG<<"AOV                           : "<<names<<ENDL;
+	}
+	if( const Denoiser* denoiser = m_imagesensor->GetDenoiser() )
+	{
+		float before , after;
+		denoiser->GetError( before , after );
+		LOG<<"Denoiser                      : a-trous wavelet ("<<denoiser->GetIterations()<<" iterations)"<<ENDL;
+		LOG<<"Time spent on denoising       : "<<denoiser->GetTime()<<" ms"<<ENDL;
+		if( before >= 0.0f )
+			LOG<<"RMSE before and after denoise : "<<before<<" , "<<after<<ENDL;
+	}
+	if( !m_filterType.empty() )
+		LOG<<"Pixel filter                  : "<<m_filterType<<" (radius "<<m_imagesensor->GetFilm()->GetFilter().GetRadius()<<")"<<ENDL;
+	if( m_deadline > 0 )
+	{
+		LOG<<"Deadline                      : "<<m_deadline<<ENDL;
+		LOG<<"Samples per pixel             : "<<m_passDone * SAMPLES_PER_PASS<<" (requested "<<m_iSamplePerPixel<<")"<<ENDL;
+		if( m_passDone * SAMPLES_PER_PASS < m_iSamplePerPixel )
+			LOG_WARNING<<"The requested number of samples per pixel is not reached before the deadline."<<ENDL;
+	}
+	else if( m_adaptive )
+	{
+		const float avg_spp = (float)m_imagesensor->GetTotalSampleCount() / ( m_imagesensor->GetWidth() * m_imagesensor->GetHeight() );
+		LOG<<"Adaptive sampling threshold   : "<<m_adaptiveThreshold<<ENDL;
+		LOG<<"Samples per pixel             : "<<avg_spp<<" (min "<<m_iSamplePerPixel<<", max "<<m_adaptiveMaxSpp<<")"<<ENDL;
+		LOG<<"Samples saved                 : "<<( 1.0f - avg_spp / m_adaptiveMaxSpp ) * 100.0f<<"%"<<ENDL;
+	}
+	else if( m_progressive )
+	{
+		LOG<<"Number of passes              : "<<m_passDone<<"/"<<m_passNum<<ENDL;
+		LOG<<"Samples per pixel             : "<<m_passDone * SAMPLES_PER_PASS<<ENDL;
+	}
+
+	// output scheduler information
+	const RenderTaskScheduler& scheduler = RenderTaskScheduler::GetSingleton();
+	const float tiles_per_sec = ( m_uRenderingTime > 0 ) ? scheduler.GetTaskCount() * 1000.0f / m_uRenderingTime : 0.0f;
+	LOG<<"Number of threads             : "<<m_thread_num<<ENDL;
+	LOG<<"Number of tiles               : "<<scheduler.GetTaskCount()<<ENDL;
+	LOG<<"Number of stolen tiles        : "<<scheduler.GetStolenTaskCount()<<ENDL;
+	LOG<<"Tiles per second              : "<<tiles_per_sec<<ENDL;
+
+	// output tile cost information
+	float max_cost , avg_cost;
+	scheduler.GetTaskCost( max_cost , avg_cost );
+	LOG<<"Tile size                     : "<<g_iTileSize<<ENDL;
+	LOG<<"Average time per tile         : "<<avg_cost<<" ms"<<ENDL;
+	LOG<<"Maximum time per tile         : "<<max_cost<<" ms"<<ENDL;
+	LOG<<"Tiles split among threads     : "<<scheduler.GetSharedTaskCount()<<ENDL;
+	LOG<<"Tail latency                  : "<<scheduler.GetTailLatency()<<" ms"<<ENDL;
+
+	// output splat information
+	const unsigned long long splats = m_imagesensor->GetSplatCount();
+	if( splats > 0 )
+	{
+		LOG<<"Number of splats              : "<<(float)splats<<ENDL;
+		LOG<<"Splats per second             : "<<( m_uRenderingTime > 0 ? splats * 1000.0f / m_uRenderingTime : 0.0f )<<ENDL;
+	}
+
+	// output checkpoint information
+	if( m_resumed )
+		LOG<<"Resumed from checkpoint       : "<<m_checkpointFile<<ENDL;
+	if( !m_checkpointFile.empty() )
+	{
+		LOG<<"Number of checkpoints         : "<<m_checkpointCount<<ENDL;
+		LOG<<"Time spent on checkpoints     : "<<m_checkpointCost<<" ms ("<<( m_uRenderingTime > 0 ? m_checkpointCost * 100.0f / m_uRenderingTime : 0.0f )<<"%)"<<ENDL;
+	}
+
+	// output NUMA information
+	if( m_numaAware )
+	{
+		LOG<<"Number of NUMA nodes          : "<<NumaTopology::GetSingleton().GetNodeCount()<<ENDL;
+		LOG<<"Tiles stolen across nodes     : "<<scheduler.GetRemoteStolenTaskCount()<<ENDL;
+		if( m_numaBenchmark )
+		{
+			LOG<<"Local memory bandwidth        : "<<m_localBandwidth<<" GB/s per thread"<<ENDL;
+			LOG<<"Remote memory bandwidth       : "<<m_remoteBandwidth<<" GB/s per thread"<<ENDL;
+		}
+	}
+
+	// output memory information
+	MemManager::GetSingleton().OutputLog();
+	MemStats::OutputLog();
+	if( !m_memoryReport.empty() && !MemStats::WriteJson( m_memoryReport ) )
+		LOG_WARNING<<"Failed to write memory report "<<m_memoryReport<<"."<<ENDL;
 }
 
 // uninitialize 3rd party library
@@ -230,7 +477,45 @@ void System::_pushRenderTask()
 	m_taskDone = new bool[m_totalTask];
 	memset( m_taskDone , 0 , m_totalTask * sizeof(bool) );
 
-	RenderTask rt(m_Scene,m_pSampler,m_camera,m_taskDone,m_iSamplePerPixel);
+	// reset the scheduler
+	RenderTaskScheduler::GetSingleton().Reset( m_thread_num , m_totalTask );
+
+	RenderTask rt(m_Scene,m_pSampler,m_camera,m_progressive?SAMPLES_PER_PASS:m_iSamplePerPixel);
+
+	// radiance splatted by light paths is normalized by the fixed sample count, adaptive sampling doesn't work with it
+	if( m_adaptiveMaxSpp > m_iSamplePerPixel )
+	{
+		if( m_progressive || ( m_pIntegrator && m_pIntegrator->SupportPendingWrite() ) )
+			LOG_WARNING<<"Adaptive sampling is not supported by progressive rendering or the integrator, it is disabled."<<ENDL;
+		else
+			m_adaptive = true;
+	}
+	if( m_adaptive )
+	{
+		rt.maxSamplePerPixel = m_adaptiveMaxSpp;
+		rt.adaptiveThreshold = m_adaptiveThreshold;
+	}
+	m_imagesensor->SetAdaptive( m_adaptive );
+	m_imagesensor->SetSplatting( m_pIntegrator && m_pIntegrator->SupportPendingWrite() , ThreadPool::GetSingleton().GetThreadNum() );
+
+	// splats of unfinished tiles can't be told apart from the others, they would be added again once the tiles are
+	// rendered after resuming, so checkpoints of these integrators are only taken between passes of progressive rendering
+	if( !m_checkpointFile.empty() && !m_progressive && m_pIntegrator && m_pIntegrator->SupportPendingWrite() )
+	{
+		LOG_WARNING<<"Checkpoints of the integrator require progressive rendering, they are disabled."<<ENDL;
+		m_checkpointFile.clear();
+	}
+
+	// the whole image has to be kept in memory if pixels are touched after their tiles are finished
+	if( m_imagesensor->IsStreaming() )
+	{
+		if( m_progressive || m_adaptive || !m_filterType.empty() || !m_checkpointFile.empty() || m_imagesensor->GetAov() || ( m_pIntegrator && m_pIntegrator->SupportPendingWrite() ) )
+		{
+			LOG_WARNING<<"Streaming output is not supported by progressive rendering, adaptive sampling, pixel filters, checkpoints, AOVs or the integrator, it is disabled."<<ENDL;
+			m_imagesensor->SetStreaming( false );
+		}
+	}
+	m_imagesensor->SetupTasks( m_totalTask , ThreadPool::GetSingleton().GetThreadNum() );
 
 	//int tile_num_x = ceil(m_imagesensor->GetWidth() / (float)tilesize);
 	//int tile_num_y = ceil(m_imagesensor->GetHeight() / (float)tilesize);
@@ -254,11 +539,8 @@ void System::_pushRenderTask()
 			rt.size.x = (tilesize < (m_imagesensor->GetWidth() - rt.ori.x)) ? tilesize : (m_imagesensor->GetWidth() - rt.ori.x);
 			rt.size.y = (tilesize < (m_imagesensor->GetHeight() - rt.ori.y)) ? tilesize : (m_imagesensor->GetHeight() - rt.ori.y);
 
-			// create new pixel samples
-			rt.pixelSamples = new PixelSample[m_iSamplePerPixel];
-
 			// push the render task
-            RenderTaskQueue::GetSingleton().PushTask( rt );
+            RenderTaskScheduler::GetSingleton().PushTask( rt );
 		}
 
 		// turn to the next direction
@@ -281,18 +563,91 @@ void System::_pushRenderTask()
 // do ray tracing in a multithread enviroment
 void System::_executeRenderingTasks()
 {
-    m_imagesensor->PreProcess();
-    
-	// will be parameterized later
+	if( m_pIntegrator == 0 )
+		return;
+
+	// all samples are taken in one pass unless progressive rendering is enabled,
+	// passes are not limited if there is a deadline
+	if( m_deadline > 0 )
+		m_passNum = UINT_MAX;
+	else
+		m_passNum = m_progressive ? m_iSamplePerPixel / SAMPLES_PER_PASS : 1;
+
+	// passes done before the checkpoint are not counted for the prediction of the cost of a pass
+	const unsigned first_pass = m_passDone;
+	bool resumed = m_resumed;
+
+	auto start = std::chrono::steady_clock::now();
+	m_lastCheckpoint = start;
+	auto elapsed = [&start]() {
+		return (unsigned)std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::steady_clock::now() - start ).count();
+	};
+
+	unsigned last_publish = 0;
+	while( m_passDone < m_passNum )
+	{
+		// don't start a pass that is not expected to be finished before the deadline
+		if( m_deadline > 0 && m_passDone > first_pass && _timeBeforeDeadline() < elapsed() / ( m_passDone - first_pass ) )
+			break;
+
+		// tiles finished before the checkpoint are not rendered again
+		if( !resumed )
+			memset( m_taskDone , 0 , m_totalTask * sizeof(bool) );
+		resumed = false;
+
+		// a pass aborted by the deadline is discarded so that all pixels have the same number of samples
+		if( !_executeRenderingPass() )
+			break;
+		++m_passDone;
+
+		if( !m_progressive )
+			break;
+
+		// checkpoints are only taken between passes in progressive rendering
+		if( _checkpointDue() )
+			_saveCheckpoint();
+
+		// the frame is resolved after every pass, it is written as is once the deadline is reached
+		if( m_deadline > 0 )
+			m_imagesensor->ResolveFrame( m_passDone );
+
+		// stop once the time budget is used up
+		if( m_timeBudget > 0 && elapsed() >= m_timeBudget )
+			break;
+
+		// publish the intermediate frame
+		if( m_passDone < m_passNum && elapsed() - last_publish >= PUBLISH_INTERVAL )
+		{
+			m_imagesensor->PublishFrame( m_passDone );
+			last_publish = elapsed();
+		}
+	}
+	_outputProgress();
+
+	// resolve the final frame
+	if( m_deadline == 0 )
+		m_imagesensor->ResolveFrame( m_passDone );
+
+	// the checkpoint is useless once all passes are done
+	if( !m_checkpointFile.empty() && ( !m_progressive || m_passDone == m_passNum ) )
+		remove( m_checkpointFile.c_str() );
+
+	SAFE_DELETE( m_pIntegrator );
+
+	cout<<endl;
+
+    m_imagesensor->PostProcess();
+}
+
+// render all tasks once
+bool System::_executeRenderingPass()
+{
+	// there is a render thread running on each worker of the thread pool
 	const int THREAD_NUM = m_thread_num;
 
-	Integrator* integrator = _allocateIntegrator();
-	integrator->PreProcess();
-	integrator->SetupCamera(m_camera);
+	// the latch is signaled once all threads are finished
+	PlatformLatch latch( THREAD_NUM );
 
-	// pre allocate memory for the specific thread
-	for( int i = 0 ; i < THREAD_NUM ; ++i )
-		MemManager::GetSingleton().PreMalloc( 1024 * 1024 * 256 , i );
 	PlatformThreadUnit** threadUnits = new PlatformThreadUnit*[THREAD_NUM];
 	for( int i = 0 ; i < THREAD_NUM ; ++i )
 	{
@@ -300,42 +655,144 @@ void System::_executeRenderingTasks()
 		threadUnits[i] = new PlatformThreadUnit(i);
 		
 		// setup basic data
-		threadUnits[i]->m_pIntegrator = integrator;
+		threadUnits[i]->m_pIntegrator = m_pIntegrator;
+		threadUnits[i]->m_pLatch = &latch;
 	}
 
+	// deal the tasks to all threads
+	RenderTaskScheduler& scheduler = RenderTaskScheduler::GetSingleton();
+	scheduler.DistributeTasks( m_taskDone );
+
 	for( int i = 0 ; i < THREAD_NUM ; ++i ){
 		// start new thread
 		threadUnits[i]->BeginThread();
 	}
 
-	// wait for all the threads to be finished
+	// sleep until all the threads are finished, progress is updated periodically
 	while( true )
 	{
-		bool allfinished = true;
-		for( int i = 0 ; i < THREAD_NUM ; ++i )
-		{
-			if( !threadUnits[i]->IsFinished() )
-				allfinished = false;
-		}
-		
-		// Output progress
+		unsigned interval = PROGRESS_UPDATE_INTERVAL;
+		if( m_deadline > 0 )
+			interval = max( min( interval , _timeBeforeDeadline() ) , 1u );
+		if( latch.WaitFor( interval ) )
+			break;
+
+		_consumeCompletedTasks();
 		_outputProgress();
 
-		if (allfinished)
+		// tiles are saved as they are finished unless the rendering is progressive
+		if( !m_progressive && _checkpointDue() )
+			_saveCheckpoint();
+
+		// the first pass is always finished, otherwise there would be nothing to output
+		if( m_deadline > 0 && m_passDone > 0 && _timeBeforeDeadline() == 0 )
+			scheduler.Abort();
+	}
+	_consumeCompletedTasks();
+	m_imagesensor->DiscardFilmTiles();
+
+	for( int i = 0 ; i < THREAD_NUM ; ++i )
+		delete threadUnits[i];
+	delete[] threadUnits;
+
+	return !scheduler.IsAborted();
+}
+
+// consume the tasks completed by render threads
+void System::_consumeCompletedTasks()
+{
+	RenderTaskScheduler& scheduler = RenderTaskScheduler::GetSingleton();
+
+	// tiles are published once a pass is done in progressive rendering
+	const bool refresh = m_pIntegrator->NeedRefreshTile() && !m_progressive;
+
+	unsigned task_id;
+	while( scheduler.PopCompletedTask( task_id ) )
+	{
+		m_taskDone[task_id] = true;
+		const RenderTask& task = scheduler.GetTask( task_id );
+		m_imagesensor->CompleteTask( task_id , task );
+
+		if( refresh )
 		{
-			break;
+			int x_off = task.ori.x / g_iTileSize;
+			int y_off = ( m_imagesensor->GetHeight() - 1 - task.ori.y ) / g_iTileSize;
+			m_imagesensor->FinishTile( x_off , y_off , task );
 		}
 	}
-	for( int i = 0 ; i < THREAD_NUM ; ++i )
+}
+
+// setup of the rendering saved in checkpoints
+CheckpointHeader System::_checkpointHeader() const
+{
+	CheckpointHeader header;
+	header.width = m_imagesensor->GetWidth();
+	header.height = m_imagesensor->GetHeight();
+	header.samplePerPixel = m_iSamplePerPixel;
+	header.taskNum = m_totalTask;
+	header.progressive = m_progressive;
+	header.passDone = m_passDone;
+	return header;
+}
+
+// whether it is time to take a checkpoint
+bool System::_checkpointDue() const
+{
+	if( m_checkpointFile.empty() )
+		return false;
+
+	// the interval grows with the cost of a checkpoint, so that it takes less than one percent of the rendering time
+	const unsigned interval = max( m_checkpointInterval , m_lastCheckpointCost * 100 );
+	const unsigned elapsed = (unsigned)std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::steady_clock::now() - m_lastCheckpoint ).count();
+	return elapsed >= interval;
+}
+
+// save the rendering state in the checkpoint file
+void System::_saveCheckpoint()
+{
+	auto start = std::chrono::steady_clock::now();
+
+	if( !Checkpoint::GetSingleton().Save( m_checkpointFile , _checkpointHeader() , m_progressive ? 0 : m_taskDone , *m_imagesensor ) )
+		LOG_WARNING<<"Failed to write checkpoint file "<<m_checkpointFile<<"."<<ENDL;
+
+	m_lastCheckpoint = std::chrono::steady_clock::now();
+	m_lastCheckpointCost = (unsigned)std::chrono::duration_cast<std::chrono::milliseconds>( m_lastCheckpoint - start ).count();
+	m_checkpointCost += m_lastCheckpointCost;
+	++m_checkpointCount;
+}
+
+// continue the rendering from the checkpoint file
+void System::_loadCheckpoint()
+{
+	if( m_checkpointFile.empty() )
 	{
-		delete threadUnits[i];
+		LOG_WARNING<<"There is no checkpoint file setup, rendering can't be resumed."<<ENDL;
+		return;
 	}
-	delete integrator;
-	delete[] threadUnits;
 
-	cout<<endl;
+	CheckpointHeader header = _checkpointHeader();
+	if( !Checkpoint::GetSingleton().Load( m_checkpointFile , header , m_taskDone , *m_imagesensor ) )
+	{
+		LOG_WARNING<<"Checkpoint file "<<m_checkpointFile<<" doesn't exist or doesn't match the setup, rendering starts from the beginning."<<ENDL;
+		memset( m_taskDone , 0 , m_totalTask * sizeof(bool) );
+		return;
+	}
+	m_passDone = header.passDone;
+	m_resumed = true;
 
-    m_imagesensor->PostProcess();
+	// every thread continues with its own random state
+	ThreadPool::GetSingleton().RunOnEachWorker( []( unsigned ){
+		Checkpoint::GetSingleton().RestoreRandomState();
+	});
+}
+
+// time left for rendering before the deadline
+unsigned System::_timeBeforeDeadline() const
+{
+	// some time is reserved for writing the image
+	const unsigned reserved = min( DEADLINE_RESERVED_TIME , m_deadline / 10 );
+	const unsigned elapsed = (unsigned)std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::steady_clock::now() - m_setupTime ).count();
+	return ( elapsed + reserved < m_deadline ) ? m_deadline - reserved - elapsed : 0;
 }
 
 // allocate integrator
@@ -359,9 +816,32 @@ Integrator*	System::_allocateIntegrator()
 	return integrator;
 }
 
+// pick the size of tiles
+int System::_pickTileSize() const
+{
+	const unsigned w = m_imagesensor->GetWidth();
+	const unsigned h = m_imagesensor->GetHeight();
+	auto tile_num = [w,h]( int tile_size ) {
+		return ( ( w + tile_size - 1 ) / tile_size ) * ( ( h + tile_size - 1 ) / tile_size );
+	};
+
+	// smaller tiles are used if there are not enough tiles to keep all threads busy,
+	// while larger tiles are used for large images to reduce the scheduling overhead
+	int tile_size = 64;
+	while( tile_size > MIN_TILE_SIZE && tile_num( tile_size ) < MIN_TILES_PER_THREAD * m_thread_num )
+		tile_size /= 2;
+	while( tile_size < MAX_TILE_SIZE && tile_num( tile_size ) > MAX_TILES_PER_THREAD * m_thread_num &&
+		tile_num( tile_size * 2 ) >= MIN_TILES_PER_THREAD * m_thread_num )
+		tile_size *= 2;
+	return tile_size;
+}
+
 // setup system from file
 bool System::Setup( const char* str )
 {
+    // the deadline of the frame is counted from now on
+    m_setupTime = std::chrono::steady_clock::now();
+
     // setup image sensor first of all
     if( g_bBlenderMode )
         m_imagesensor = new BlenderImage();
@@ -382,9 +862,29 @@ bool System::Setup( const char* str )
 	
 	// get the root of xml
 	TiXmlNode*	root = doc.RootElement();
+
+	// the thread pool is needed since loading the scene, number of cores is used by default
+	TiXmlElement* element = root->FirstChildElement("ThreadNum");
+	if( element )
+		m_thread_num = atoi(element->Attribute("name"));
+	// workers are pinned to cores of NUMA nodes if it is enabled
+	element = root->FirstChildElement("NumaAware");
+	if( element )
+		m_numaAware = ( atoi(element->Attribute("name")) != 0 );
+	// the memory bandwidth benchmark costs startup time and memory, it is off by default
+	element = root->FirstChildElement("NumaBenchmark");
+	if( element )
+		m_numaBenchmark = ( atoi(element->Attribute("name")) != 0 );
+	ThreadPool::GetSingleton().Init( m_thread_num , m_numaAware );
+	m_thread_num = ThreadPool::GetSingleton().GetThreadNum();
+
+	// meshes and acceleration structures are cached in the directory if it is specified
+	element = root->FirstChildElement("SceneCache");
+	if( element && element->Attribute("path") )
+		SceneCache::GetSingleton().SetDirectory( element->Attribute("path") );
 	
 	// try to load the scene , note: only the first node matters
-	TiXmlElement* element = root->FirstChildElement( "Scene" );
+	element = root->FirstChildElement( "Scene" );
 	if( element )
 	{
 		const char* str_scene = element->Attribute( "value" );
@@ -447,6 +947,66 @@ bool System::Setup( const char* str )
 		m_pSampler = new StratifiedSampler();
 		m_iSamplePerPixel = m_pSampler->RoundSize(16);
 	}
+
+	// samples are splatted on the pixels around them through a pixel filter
+	element = root->FirstChildElement( "Filter" );
+	if( element )
+	{
+		const char* str_type = element->Attribute("type");
+		const char* str_radius = element->Attribute("radius");
+		Filter* filter = str_type ? CREATE_TYPE( str_type , Filter ) : 0;
+		if( filter )
+		{
+			if( str_radius )
+				filter->SetRadius( (float)atof( str_radius ) );
+			m_filterType = str_type;
+			m_imagesensor->SetFilter( filter );
+		}
+		else
+			LOG_WARNING<<"Unknown pixel filter, samples are averaged in each pixel."<<ENDL;
+	}
+
+	// auxiliary output variables are written as layers of an exr file next to the output file
+	element = root->FirstChildElement( "AOV" );
+	if( element && element->Attribute("name") )
+	{
+		const unsigned mask = AovBuffer::MaskFromStr( element->Attribute("name") );
+		if( g_bBlenderMode )
+			LOG_WARNING<<"AOVs are not supported in blender mode."<<ENDL;
+		else if( mask == 0 )
+			LOG_WARNING<<"No valid AOV is specified."<<ENDL;
+		else
+			m_imagesensor->SetAov( mask );
+	}
+
+	// the final image is denoised with the guidance of albedo, normal, depth and variance
+	element = root->FirstChildElement( "Denoiser" );
+	if( element )
+	{
+		if( g_bBlenderMode )
+			LOG_WARNING<<"Denoising is not supported in blender mode."<<ENDL;
+		else
+		{
+			const char* str_iterations = element->Attribute("iterations");
+			const char* str_reference = element->Attribute("reference");
+			Denoiser* denoiser = new Denoiser();
+			if( str_iterations )
+				denoiser->SetIterations( (unsigned)atoi( str_iterations ) );
+			if( str_reference )
+				denoiser->SetReference( str_reference );
+			m_imagesensor->SetDenoiser( denoiser );
+		}
+	}
+
+	// adaptive sampling takes more rounds of samples in pixels whose relative error is above the threshold
+	element = root->FirstChildElement( "AdaptiveSampling" );
+	if( element )
+	{
+		const char* str_threshold = element->Attribute("threshold");
+		const char* str_max = element->Attribute("maxspp");
+		m_adaptiveThreshold = str_threshold ? (float)atof( str_threshold ) : 0.05f;
+		m_adaptiveMaxSpp = str_max ? (unsigned)atoi( str_max ) : 4 * m_iSamplePerPixel;
+	}
 	
 	element = root->FirstChildElement("Camera");
 	if( element )
@@ -471,13 +1031,65 @@ bool System::Setup( const char* str )
 		}
 	}
 
+	// progressive rendering takes one sample per pixel in each pass until the sample count is reached or the time budget runs out
+	element = root->FirstChildElement("Progressive");
+	if( element )
+		m_progressive = ( atoi(element->Attribute("name")) != 0 );
+	element = root->FirstChildElement("TimeBudget");
+	if( element )
+		m_timeBudget = (unsigned)( atof(element->Attribute("name")) * 1000.0f );
+	// with a deadline, passes are rendered until the time runs out and the image is written on time
+	element = root->FirstChildElement("Deadline");
+	if( element )
+		m_deadline = (unsigned)( atof(element->Attribute("name")) * 1000.0f );
+	if( m_deadline > 0 )
+		m_progressive = true;
+	m_imagesensor->SetProgressive( m_progressive );
+
+	// the rendering state is saved periodically so that it could be resumed after a crash
+	element = root->FirstChildElement("Checkpoint");
+	if( element )
+	{
+		const char* str_interval = element->Attribute("interval");
+		m_checkpointFile = element->Attribute("name");
+		m_checkpointInterval = (unsigned)( ( str_interval ? atof( str_interval ) : DEFAULT_CHECKPOINT_INTERVAL ) * 1000.0f );
+		if( g_bBlenderMode )
+		{
+			LOG_WARNING<<"Checkpoints are not supported in blender mode."<<ENDL;
+			m_checkpointFile.clear();
+		}
+		else
+			Checkpoint::GetSingleton().Reset( m_thread_num );
+	}
+
+	// memory usage of each category is dumped in a JSON file
+	element = root->FirstChildElement("MemoryReport");
+	if( element )
+		m_memoryReport = element->Attribute("name");
+
 	element = root->FirstChildElement("OutputFile");
 	if( element )
         m_imagesensor->SetProperty("filename", element->Attribute("name"));
 
-	element = root->FirstChildElement("ThreadNum");
-	if( element )
-		m_thread_num = atoi(element->Attribute("name"));
+	// finished tiles are written to the output file directly so that the image is never kept in memory as a whole
+	element = root->FirstChildElement("StreamingOutput");
+	if( element && atoi( element->Attribute("name") ) != 0 )
+	{
+		if( m_imagesensor->SupportStreaming() )
+			m_imagesensor->SetStreaming( true );
+		else
+			LOG_WARNING<<"Streaming output is only supported for exr files."<<ENDL;
+	}
+
+	// pixels of the render target and the shared memory with blender could be stored in a compact format
+	element = root->FirstChildElement("FramebufferFormat");
+	if( element && element->Attribute("name") )
+	{
+		const PIXEL_FORMAT format = PixelFormatFromStr( element->Attribute("name") );
+		if( format == PF_FLOAT && strcmp( element->Attribute("name") , "float" ) != 0 )
+			LOG_WARNING<<"Unknown framebuffer format, pixels are stored in float."<<ENDL;
+		m_imagesensor->SetFramebufferFormat( format );
+	}
 
 	// setup image sensor
     m_camera->SetImageSensor(m_imagesensor);
@@ -485,15 +1097,12 @@ bool System::Setup( const char* str )
     // preprocess camera
     m_camera->PreProcess();
     
-	// create shared memory
-	int x_tile = (int)(ceil(m_imagesensor->GetWidth() / (float)g_iTileSize));
-	int y_tile = (int)(ceil(m_imagesensor->GetHeight() / (float)g_iTileSize));
-	int header_size = x_tile * y_tile;
-	int size = header_size * g_iTileSize * g_iTileSize * 4 * sizeof(float) * 2	// image size
-			+ header_size								// header size
-			+ 2;										// progress data and final update flag
-
-	// create shared memory
+	// Blender relies on the fixed tile layout, otherwise the tile size depends on the resolution and the number of threads
+	if( !g_bBlenderMode )
+		g_iTileSize = _pickTileSize();
+
+	// create shared memory, its layout is defined by the blender image sensor
+	const int size = BlenderImage::SharedMemorySize( m_imagesensor->GetWidth() , m_imagesensor->GetHeight() , g_iTileSize , m_imagesensor->GetFramebufferFormat() );
 	const SharedMemory& sm = SMManager::GetSingleton().CreateSharedMemory("SORTBLEND_SHAREMEM", size, SharedMmeory_All);
 	// clear the memory first
 	if (sm.bytes)
@@ -502,7 +1111,7 @@ bool System::Setup( const char* str )
 		memset(sm.bytes, 0, sm.size);
 
 		// setup progess pointer
-		m_pProgress = sm.bytes + sm.size - 2;
+		m_pProgress = &((BlenderSharedHeader*)sm.bytes)->progress;
 	}
 
 	return true;
@@ -23,6 +23,8 @@
 #include "integrator/integrator.h"
 #include "imagesensor/blenderimage.h"
 #include "imagesensor/rendertargetimage.h"
+#include "utility/checkpoint.h"
+#include <chrono>
 
 // declare classes
 class Camera;
@@ -79,8 +81,8 @@ private:
 	Camera*			m_camera;
 
 	unsigned		m_totalTask;
-	bool*			m_taskDone;
-	char*			m_pProgress;
+	bool*			m_taskDone;		// only touched by the main thread
+	unsigned*		m_pProgress;
 
 	// the integrator type
 	string			m_integratorType;
@@ -91,6 +93,8 @@ private:
 		string _property;
 	};
 	vector<Property>	m_integratorProperty;
+	// the integrator, it is created during pre-processing
+	Integrator*		m_pIntegrator;
 	// the scene for rendering
 	Scene			m_Scene;
 	// the sampler
@@ -102,6 +106,8 @@ private:
 	unsigned		m_uRenderingTime;
 	// pre-processing time
 	unsigned		m_uPreProcessingTime;
+	// scene loading time
+	unsigned		m_uLoadingTime;
 
 	// path for the resource
 	string			m_ResourcePath;
@@ -109,6 +115,43 @@ private:
 
 	// number of thread to allocate
 	unsigned		m_thread_num;
+	// whether threads and their memory are bound to NUMA nodes
+	bool			m_numaAware;
+	// whether the memory bandwidth of local and remote NUMA nodes is measured before rendering
+	bool			m_numaBenchmark;
+	// whether progressive rendering is enabled
+	bool			m_progressive;
+	// time budget of rendering in milliseconds, zero means unlimited
+	unsigned		m_timeBudget;
+	// relative error threshold and maximum sample count per pixel of adaptive sampling
+	float			m_adaptiveThreshold;
+	unsigned		m_adaptiveMaxSpp;
+	// whether adaptive sampling is applied, it is not supported by progressive rendering or integrators splatting radiance
+	bool			m_adaptive;
+	// file keeping the rendering state and the minimum interval between two checkpoints in milliseconds
+	string			m_checkpointFile;
+	unsigned		m_checkpointInterval;
+	// whether the rendering is resumed from a checkpoint
+	bool			m_resumed;
+	// time when the last checkpoint is taken, its cost, the total cost of checkpoints in milliseconds and the number of them
+	std::chrono::steady_clock::time_point m_lastCheckpoint;
+	unsigned		m_lastCheckpointCost;
+	unsigned		m_checkpointCost;
+	unsigned		m_checkpointCount;
+	// type of the pixel filter, samples are averaged in each pixel if it is empty
+	string			m_filterType;
+	// JSON file holding the memory usage of each category, it is not written if empty
+	string			m_memoryReport;
+	// wall-clock deadline of the whole frame in milliseconds, zero means no deadline
+	unsigned		m_deadline;
+	// time when the system starts to setup, the deadline is counted from it
+	std::chrono::steady_clock::time_point m_setupTime;
+	// number of passes to render and passes done so far
+	unsigned		m_passNum;
+	unsigned		m_passDone;
+	// bandwidth of reading memory on local and remote NUMA nodes, in GB/s per thread
+	float			m_localBandwidth;
+	float			m_remoteBandwidth;
 
 	// pre-Initialize
 	void	_preInit();
@@ -120,10 +163,29 @@ private:
 	void	_uninit3rdParty();
 	// do ray tracing in a multithread enviroment
 	void	_executeRenderingTasks();
+	// render all tasks once, false is returned if the pass is aborted
+	bool	_executeRenderingPass();
+	// consume the tasks completed by render threads, it is the only place where tasks are marked as done
+	void	_consumeCompletedTasks();
+	// setup of the rendering saved in checkpoints
+	CheckpointHeader	_checkpointHeader() const;
+	// whether it is time to take a checkpoint
+	bool	_checkpointDue() const;
+	// save the rendering state in the checkpoint file
+	void	_saveCheckpoint();
+	// continue the rendering from the checkpoint file
+	void	_loadCheckpoint();
+	// time left for rendering before the deadline in milliseconds
+	unsigned	_timeBeforeDeadline() const;
 	// output preprocessing information
 	void	_outputPreprocess();
 	// push rendering task
 	void	_pushRenderTask();
+	// compare the bandwidth of local and remote memory traffic
+	// para 'arenas' : beginning of the arena of each thread
+	void	_benchmarkMemoryTraffic( const vector<const char*>& arenas );
+	// pick the size of tiles
+	int		_pickTileSize() const;
 	// allocate integrator
 	Integrator*	_allocateIntegrator();
 };
@@ -0,0 +1,280 @@
+/*
+    This file is a part of SORT(Simple Open Ray Tracing), an open-source cross
+    platform physically based renderer.
+ 
+    Copyright (c) 2011-2016 by Cao Jiayin - All rights reserved.
+ 
+    SORT is a free software written for educational purpose. Anyone can distribute
+    or modify it under the the terms of the GNU General Public License Version 3 as
+    published by the Free Software Foundation. However, there is NO warranty that
+    all components are functional in a perfect manner. Without even the implied
+    warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License along with
+    this program. If not, see <http://www.gnu.org/licenses/gpl-3.0.html>.
+ */
+
+
+#include "pixelformat.h"
+#include <half.h>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__SSE2__) || defined(_M_X64)
+    #define SORT_PIXEL_SSE2
+    #include <emmintrin.h>
+#endif
+
+// F16C is not part of the baseline instruction set, it is only used if the cpu reports it at runtime
+#if defined(SORT_PIXEL_SSE2) && defined(__GNUC__)
+    #define SORT_PIXEL_F16C
+    #include <immintrin.h>
+    #include <cpuid.h>
+#endif
+
+// pixels converted at once when an alpha channel has to be inserted or dropped
+static const unsigned CHUNK_SIZE = 64;
+// largest value representable by RGB9E5, (511/512) * 2^15
+static const float RGB9E5_MAX = 65408.0f;
+
+static const char* PIXEL_FORMAT_NAMES[PF_NUM] = { "float" , "half" , "rgb9e5" };
+
+PIXEL_FORMAT PixelFormatFromStr( const std::string& str )
+{
+    for( int i = 0 ; i < PF_NUM ; ++i )
+        if( str == PIXEL_FORMAT_NAMES[i] )
+            return (PIXEL_FORMAT)i;
+    return PF_FLOAT;
+}
+
+const char* PixelFormatName( PIXEL_FORMAT format )
+{
+    return PIXEL_FORMAT_NAMES[format];
+}
+
+unsigned PixelFormatSize( PIXEL_FORMAT format , bool alpha )
+{
+    switch( format ){
+    case PF_HALF:
+        return ( alpha ? 4 : 3 ) * sizeof( unsigned short );
+    case PF_RGB9E5:
+        return sizeof( unsigned );
+    default:
+        return ( alpha ? 4 : 3 ) * sizeof( float );
+    }
+}
+
+#if defined(SORT_PIXEL_F16C)
+static bool _hasF16C()
+{
+    unsigned a , b , c , d;
+    return __get_cpuid( 1 , &a , &b , &c , &d ) && ( c & bit_F16C );
+}
+static const bool g_F16C = _hasF16C();
+
+__attribute__((target("f16c"))) static unsigned _floatToHalfF16C( const float* src , unsigned n , unsigned short* dst )
+{
+    unsigned i = 0;
+    for( ; i + 4 <= n ; i += 4 )
+        _mm_storel_epi64( (__m128i*)( dst + i ) , _mm_cvtps_ph( _mm_loadu_ps( src + i ) , 0 ) );
+    return i;
+}
+
+__attribute__((target("f16c"))) static unsigned _halfToFloatF16C( const unsigned short* src , unsigned n , float* dst )
+{
+    unsigned i = 0;
+    for( ; i + 4 <= n ; i += 4 )
+        _mm_storeu_ps( dst + i , _mm_cvtph_ps( _mm_loadl_epi64( (const __m128i*)( src + i ) ) ) );
+    return i;
+}
+#endif
+
+// convert 'n' floats to half floats, the channels don't matter
+static void _floatToHalf( const float* src , unsigned n , unsigned short* dst )
+{
+    unsigned i = 0;
+#if defined(SORT_PIXEL_F16C)
+    if( g_F16C )
+        i = _floatToHalfF16C( src , n , dst );
+#endif
+    for( ; i < n ; ++i )
+        dst[i] = half( src[i] ).bits();
+}
+
+// convert 'n' half floats to floats
+static void _halfToFloat( const unsigned short* src , unsigned n , float* dst )
+{
+    unsigned i = 0;
+#if defined(SORT_PIXEL_F16C)
+    if( g_F16C )
+        i = _halfToFloatF16C( src , n , dst );
+#endif
+    for( ; i < n ; ++i ){
+        half h;
+        h.setBits( src[i] );
+        dst[i] = h;
+    }
+}
+
+// power of two from its exponent, it has to be in the range of normalized floats
+static inline float _exp2( int e )
+{
+    const unsigned bits = (unsigned)( e + 127 ) << 23;
+    float f;
+    memcpy( &f , &bits , sizeof( f ) );
+    return f;
+}
+
+// encode a single pixel in RGB9E5, please refer to the specification of EXT_texture_shared_exponent for details
+static inline unsigned _encodeRGB9E5( float r , float g , float b )
+{
+    // comparisons are written this way so that NaN ends up as zero
+    r = ( r > 0.0f ) ? std::min( r , RGB9E5_MAX ) : 0.0f;
+    g = ( g > 0.0f ) ? std::min( g , RGB9E5_MAX ) : 0.0f;
+    b = ( b > 0.0f ) ? std::min( b , RGB9E5_MAX ) : 0.0f;
+    const float m = std::max( r , std::max( g , b ) );
+
+    unsigned bits;
+    memcpy( &bits , &m , sizeof( bits ) );
+    int e = std::max( (int)( bits >> 23 ) - 127 , -16 ) + 16;
+    float scale = _exp2( 24 - e );
+    if( (int)( m * scale + 0.5f ) == 512 ){
+        ++e;
+        scale *= 0.5f;
+    }
+    return (unsigned)( r * scale + 0.5f ) | ( (unsigned)( g * scale + 0.5f ) << 9 ) | ( (unsigned)( b * scale + 0.5f ) << 18 ) | ( (unsigned)e << 27 );
+}
+
+// decode a single pixel in RGB9E5
+static inline void _decodeRGB9E5( unsigned v , float* rgb )
+{
+    const float scale = _exp2( (int)( v >> 27 ) - 24 );
+    rgb[0] = ( v & 511 ) * scale;
+    rgb[1] = ( ( v >> 9 ) & 511 ) * scale;
+    rgb[2] = ( ( v >> 18 ) & 511 ) * scale;
+}
+
+static void _encodeRGB9E5( const float* rgb , unsigned count , unsigned* dst )
+{
+    unsigned i = 0;
+#if defined(SORT_PIXEL_SSE2)
+    const __m128 zero = _mm_setzero_ps();
+    const __m128 max_value = _mm_set1_ps( RGB9E5_MAX );
+    const __m128 round = _mm_set1_ps( 0.5f );
+    const __m128i min_exp = _mm_set1_epi32( -16 );
+    for( ; i + 4 <= count ; i += 4 ){
+        const float* p = rgb + 3 * i;
+        // max returns the second operand for NaN
+        const __m128 r = _mm_min_ps( _mm_max_ps( _mm_setr_ps( p[0] , p[3] , p[6] , p[9] ) , zero ) , max_value );
+        const __m128 g = _mm_min_ps( _mm_max_ps( _mm_setr_ps( p[1] , p[4] , p[7] , p[10] ) , zero ) , max_value );
+        const __m128 b = _mm_min_ps( _mm_max_ps( _mm_setr_ps( p[2] , p[5] , p[8] , p[11] ) , zero ) , max_value );
+        const __m128 m = _mm_max_ps( r , _mm_max_ps( g , b ) );
+
+        // shared exponent, SSE2 has no integer max
+        __m128i e = _mm_sub_epi32( _mm_srli_epi32( _mm_castps_si128( m ) , 23 ) , _mm_set1_epi32( 127 ) );
+        const __m128i above = _mm_cmpgt_epi32( e , min_exp );
+        e = _mm_add_epi32( _mm_or_si128( _mm_and_si128( above , e ) , _mm_andnot_si128( above , min_exp ) ) , _mm_set1_epi32( 16 ) );
+        __m128 scale = _mm_castsi128_ps( _mm_slli_epi32( _mm_sub_epi32( _mm_set1_epi32( 151 ) , e ) , 23 ) );
+
+        // the largest channel may round up to 512, the exponent is bumped then
+        const __m128i overflow = _mm_cmpeq_epi32( _mm_cvttps_epi32( _mm_add_ps( _mm_mul_ps( m , scale ) , round ) ) , _mm_set1_epi32( 512 ) );
+        e = _mm_sub_epi32( e , overflow );
+        scale = _mm_castsi128_ps( _mm_slli_epi32( _mm_sub_epi32( _mm_set1_epi32( 151 ) , e ) , 23 ) );
+
+        const __m128i rm = _mm_cvttps_epi32( _mm_add_ps( _mm_mul_ps( r , scale ) , round ) );
+        const __m128i gm = _mm_cvttps_epi32( _mm_add_ps( _mm_mul_ps( g , scale ) , round ) );
+        const __m128i bm = _mm_cvttps_epi32( _mm_add_ps( _mm_mul_ps( b , scale ) , round ) );
+        const __m128i v = _mm_or_si128( _mm_or_si128( rm , _mm_slli_epi32( gm , 9 ) ) , _mm_or_si128( _mm_slli_epi32( bm , 18 ) , _mm_slli_epi32( e , 27 ) ) );
+        _mm_storeu_si128( (__m128i*)( dst + i ) , v );
+    }
+#endif
+    for( ; i < count ; ++i )
+        dst[i] = _encodeRGB9E5( rgb[3 * i] , rgb[3 * i + 1] , rgb[3 * i + 2] );
+}
+
+static void _decodeRGB9E5( const unsigned* src , unsigned count , float* rgb )
+{
+    unsigned i = 0;
+#if defined(SORT_PIXEL_SSE2)
+    const __m128i mask = _mm_set1_epi32( 511 );
+    for( ; i + 4 <= count ; i += 4 ){
+        const __m128i v = _mm_loadu_si128( (const __m128i*)( src + i ) );
+        const __m128 scale = _mm_castsi128_ps( _mm_slli_epi32( _mm_add_epi32( _mm_srli_epi32( v , 27 ) , _mm_set1_epi32( 103 ) ) , 23 ) );
+        float r[4] , g[4] , b[4];
+        _mm_storeu_ps( r , _mm_mul_ps( _mm_cvtepi32_ps( _mm_and_si128( v , mask ) ) , scale ) );
+        _mm_storeu_ps( g , _mm_mul_ps( _mm_cvtepi32_ps( _mm_and_si128( _mm_srli_epi32( v , 9 ) , mask ) ) , scale ) );
+        _mm_storeu_ps( b , _mm_mul_ps( _mm_cvtepi32_ps( _mm_and_si128( _mm_srli_epi32( v , 18 ) , mask ) ) , scale ) );
+        float* p = rgb + 3 * i;
+        for( int k = 0 ; k < 4 ; ++k ){
+            p[3 * k] = r[k];
+            p[3 * k + 1] = g[k];
+            p[3 * k + 2] = b[k];
+        }
+    }
+#endif
+    for( ; i < count ; ++i )
+        _decodeRGB9E5( src[i] , rgb + 3 * i );
+}
+
+void EncodePixels( PIXEL_FORMAT format , const float* rgb , unsigned count , void* dst , bool alpha )
+{
+    if( format == PF_RGB9E5 ){
+        _encodeRGB9E5( rgb , count , (unsigned*)dst );
+        return;
+    }
+
+    if( !alpha ){
+        if( format == PF_HALF )
+            _floatToHalf( rgb , 3 * count , (unsigned short*)dst );
+        else
+            memcpy( dst , rgb , 3 * count * sizeof( float ) );
+        return;
+    }
+
+    // insert the alpha channel chunk by chunk so that the conversion still works on contiguous memory
+    float rgba[4 * CHUNK_SIZE];
+    for( unsigned i = 0 ; i < count ; i += CHUNK_SIZE ){
+        const unsigned n = std::min( CHUNK_SIZE , count - i );
+        for( unsigned k = 0 ; k < n ; ++k ){
+            rgba[4 * k] = rgb[3 * ( i + k )];
+            rgba[4 * k + 1] = rgb[3 * ( i + k ) + 1];
+            rgba[4 * k + 2] = rgb[3 * ( i + k ) + 2];
+            rgba[4 * k + 3] = 1.0f;
+        }
+        if( format == PF_HALF )
+            _floatToHalf( rgba , 4 * n , (unsigned short*)dst + 4 * i );
+        else
+            memcpy( (float*)dst + 4 * i , rgba , 4 * n * sizeof( float ) );
+    }
+}
+
+void DecodePixels( PIXEL_FORMAT format , const void* src , unsigned count , float* rgb , bool alpha )
+{
+    if( format == PF_RGB9E5 ){
+        _decodeRGB9E5( (const unsigned*)src , count , rgb );
+        return;
+    }
+
+    if( !alpha ){
+        if( format == PF_HALF )
+            _halfToFloat( (const unsigned short*)src , 3 * count , rgb );
+        else
+            memcpy( rgb , src , 3 * count * sizeof( float ) );
+        return;
+    }
+
+    float rgba[4 * CHUNK_SIZE];
+    for( unsigned i = 0 ; i < count ; i += CHUNK_SIZE ){
+        const unsigned n = std::min( CHUNK_SIZE , count - i );
+        if( format == PF_HALF )
+            _halfToFloat( (const unsigned short*)src + 4 * i , 4 * n , rgba );
+        else
+            memcpy( rgba , (const float*)src + 4 * i , 4 * n * sizeof( float ) );
+        for( unsigned k = 0 ; k < n ; ++k ){
+            rgb[3 * ( i + k )] = rgba[4 * k];
+            rgb[3 * ( i + k ) + 1] = rgba[4 * k + 1];
+            rgb[3 * ( i + k ) + 2] = rgba[4 * k + 2];
+        }
+    }
+}
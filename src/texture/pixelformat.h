@@ -0,0 +1,63 @@
+/*
+    This file is a part of SORT(Simple Open Ray Tracing), an open-source cross
+    platform physically based renderer.
+ 
+    Copyright (c) 2011-2016 by Cao Jiayin - All rights reserved.
+ 
+    SORT is a free software written for educational purpose. Anyone can distribute
+    or modify it under the the terms of the GNU General Public License Version 3 as
+    published by the Free Software Foundation. However, there is NO warranty that
+    all components are functional in a perfect manner. Without even the implied
+    warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License along with
+    this program. If not, see <http://www.gnu.org/licenses/gpl-3.0.html>.
+ */
+
+
+#pragma once
+
+#include "sort.h"
+#include <string>
+
+//! @brief Storage format of the pixels of a frame buffer.
+enum PIXEL_FORMAT
+{
+    PF_FLOAT = 0,       /**< 32 bits float per channel. */
+    PF_HALF,            /**< 16 bits float per channel. */
+    PF_RGB9E5,          /**< Three 9 bits mantissas sharing a 5 bits exponent, 32 bits per pixel without alpha. */
+    PF_NUM
+};
+
+//! @brief Storage format from its name, 'float' is returned for an unknown name.
+PIXEL_FORMAT PixelFormatFromStr( const std::string& str );
+
+//! @brief Name of a storage format.
+const char* PixelFormatName( PIXEL_FORMAT format );
+
+//! @brief Number of bytes of a pixel.
+//! @param format   Storage format.
+//! @param alpha    Whether an alpha channel is stored, RGB9E5 never stores alpha.
+unsigned PixelFormatSize( PIXEL_FORMAT format , bool alpha = false );
+
+//! @brief Convert pixels to a storage format.
+/**
+ * Pixels are converted in batches, half floats are converted with F16C instructions if the
+ * cpu supports them and RGB9E5 is encoded four pixels at a time with SSE2.
+ * Negative values are clamped to zero by RGB9E5.
+ * @param format    Storage format of the destination.
+ * @param rgb       Source pixels, three floats per pixel.
+ * @param count     Number of pixels.
+ * @param dst       Destination memory, PixelFormatSize bytes per pixel.
+ * @param alpha     Whether an opaque alpha channel is appended to each pixel.
+ */
+void EncodePixels( PIXEL_FORMAT format , const float* rgb , unsigned count , void* dst , bool alpha = false );
+
+//! @brief Convert pixels from a storage format back to floats.
+//! @param format   Storage format of the source.
+//! @param src      Source memory, PixelFormatSize bytes per pixel.
+//! @param count    Number of pixels.
+//! @param rgb      Destination pixels, three floats per pixel.
+//! @param alpha    Whether the source pixels have an alpha channel, it is dropped.
+void DecodePixels( PIXEL_FORMAT format , const void* src , unsigned count , float* rgb , bool alpha = false );
@@ -23,7 +23,7 @@
 void RenderTarget::SetColor( int x , int y , float r , float g , float b )
 {
 	// check if there is memory
-	if( m_pData == 0 )
+	if( m_pData == 0 && m_packed.empty() )
 		LOG_ERROR<<"There is no data in the render target , can't set color."<<CRASH;
 
 	// use filter first
@@ -33,7 +33,82 @@ void RenderTarget::SetColor( int x , int y , float r , float g , float b )
 	unsigned offset = y * m_iTexWidth + x;
 
 	// set the color
-	m_pData[offset].SetColor( r , g , b );
+	if( m_pData )
+		m_pData[offset].SetColor( r , g , b );
+	else
+	{
+		const float rgb[3] = { r , g , b };
+		EncodePixels( m_format , rgb , 1 , &m_packed[offset * PixelFormatSize( m_format )] );
+	}
+}
+
+// get the color
+Spectrum RenderTarget::GetColor( int x , int y ) const
+{
+	if( m_pData )
+		return ComTexture::GetColor( x , y );
+	if( m_packed.empty() )
+		LOG_ERROR<<"No memory in the render target, can't get color."<<CRASH;
+
+	// filter the x y coordinate
+	_texCoordFilter( x , y );
+
+	float rgb[3];
+	DecodePixels( m_format , &m_packed[( y * m_iTexWidth + x ) * PixelFormatSize( m_format )] , 1 , rgb );
+	return Spectrum( rgb[0] , rgb[1] , rgb[2] );
+}
+
+// set the colors of a row
+void RenderTarget::SetRow( int y , const float* rgb )
+{
+	if( m_pData )
+	{
+		for( unsigned x = 0 ; x < m_iTexWidth ; ++x )
+			m_pData[y * m_iTexWidth + x].SetColor( rgb[3 * x] , rgb[3 * x + 1] , rgb[3 * x + 2] );
+		return;
+	}
+	EncodePixels( m_format , rgb , m_iTexWidth , &m_packed[y * m_iTexWidth * PixelFormatSize( m_format )] );
+}
+
+// get the colors of a row
+void RenderTarget::GetRow( int y , float* rgb ) const
+{
+	if( m_pData )
+	{
+		for( unsigned x = 0 ; x < m_iTexWidth ; ++x )
+		{
+			const Spectrum& c = m_pData[y * m_iTexWidth + x];
+			rgb[3 * x] = c.GetR();
+			rgb[3 * x + 1] = c.GetG();
+			rgb[3 * x + 2] = c.GetB();
+		}
+		return;
+	}
+	DecodePixels( m_format , &m_packed[y * m_iTexWidth * PixelFormatSize( m_format )] , m_iTexWidth , rgb );
+}
+
+// set the size
+void RenderTarget::SetSize( unsigned w , unsigned h )
+{
+	if( m_format == PF_FLOAT )
+	{
+		m_packed.clear();
+		ComTexture::SetSize( w , h );
+		return;
+	}
+
+	// the render target is stored in a packed format , the spectrum array is not needed at all
+	ComTexture::Release();
+	m_iTexWidth = w;
+	m_iTexHeight = h;
+	m_packed.assign( w * h * PixelFormatSize( m_format ) , 0 );
+}
+
+// release the memory
+void RenderTarget::Release()
+{
+	ComTexture::Release();
+	std::vector<unsigned char>().swap( m_packed );
 }
 
 
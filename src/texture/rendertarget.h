@@ -20,6 +20,8 @@
 
 // include the header file
 #include "compositetexture.h"
+#include "pixelformat.h"
+#include <vector>
 
 /////////////////////////////////////////////////////////////////////////
 //	definition of render target
@@ -46,6 +48,37 @@ public:
 	{
 		SetColor( x , y , c.GetR() , c.GetG() , c.GetB() );
 	}
+
+	// para 'y'   : y coordinate of the row
+	// para 'rgb' : colors of the whole row , three floats per pixel
+	// note       : pixels of a row are converted in batch if the render target is not stored in float.
+	void SetRow( int y , const float* rgb );
+
+	// para 'y'   : y coordinate of the row
+	// para 'rgb' : colors of the whole row , three floats per pixel
+	void GetRow( int y , float* rgb ) const;
+
+	// get color from render target
+	virtual Spectrum GetColor( int x , int y ) const;
+
+	// set the size for the render target , the memory is allocated in the current format
+	virtual void SetSize( unsigned w , unsigned h );
+
+	// release the memory
+	virtual void Release();
+
+	// para 'format' : storage format of the pixels , it takes effect once the size is set
+	void SetFormat( PIXEL_FORMAT format ) { m_format = format; }
+
+	// get the storage format of the pixels
+	PIXEL_FORMAT GetFormat() const { return m_format; }
+
+// private field
+private:
+	// storage format of the pixels
+	PIXEL_FORMAT				m_format = PF_FLOAT;
+	// pixels in half float or RGB9E5 , 'm_pData' is only used for float pixels
+	std::vector<unsigned char>	m_packed;
 };
 
 #endif
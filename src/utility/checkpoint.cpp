@@ -0,0 +1,136 @@
+/*
+    This file is a part of SORT(Simple Open Ray Tracing), an open-source cross
+    platform physically based renderer.
+ 
+    Copyright (c) 2011-2016 by Cao Jiayin - All rights reserved.
+ 
+    SORT is a free software written for educational purpose. Anyone can distribute
+    or modify it under the the terms of the GNU General Public License Version 3 as
+    published by the Free Software Foundation. However, there is NO warranty that
+    all components are functional in a perfect manner. Without even the implied
+    warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License along with
+    this program. If not, see <http://www.gnu.org/licenses/gpl-3.0.html>.
+ */
+
+#include "checkpoint.h"
+#include "rand.h"
+#include "imagesensor/imagesensor.h"
+#include "utility/multithread/multithread.h"
+#include <fstream>
+#include <algorithm>
+#include <cstdio>
+
+DEFINE_SINGLETON(Checkpoint);
+
+// identifier and version of checkpoint files
+static const char       CHECKPOINT_MAGIC[8] = { 'S' , 'O' , 'R' , 'T' , 'C' , 'K' , 'P' , 'T' };
+static const unsigned   CHECKPOINT_VERSION = 5;
+
+void Checkpoint::Reset( unsigned thread_num )
+{
+    m_threadNum = thread_num;
+    m_randomStates.assign( thread_num * SORT_RAND_STATE_SIZE , 0 );
+    m_mutex.reset( new std::mutex[thread_num] );
+
+    // the state of a thread that never captured its state is not restored
+    for( unsigned i = 0 ; i < thread_num ; ++i )
+        m_randomStates[ i * SORT_RAND_STATE_SIZE + SORT_RAND_STATE_SIZE - 1 ] = ~0u;
+}
+
+void Checkpoint::CaptureRandomState()
+{
+    const unsigned tid = ThreadId();
+    if( tid >= m_threadNum )
+        return;
+
+    std::lock_guard<std::mutex> lock( m_mutex[tid] );
+    sort_save_state( &m_randomStates[ tid * SORT_RAND_STATE_SIZE ] );
+}
+
+void Checkpoint::RestoreRandomState()
+{
+    const unsigned tid = ThreadId();
+    if( tid >= m_threadNum || m_randomStates[ tid * SORT_RAND_STATE_SIZE + SORT_RAND_STATE_SIZE - 1 ] == ~0u )
+        return;
+
+    sort_load_state( &m_randomStates[ tid * SORT_RAND_STATE_SIZE ] );
+}
+
+bool Checkpoint::Save( const string& filename , const CheckpointHeader& header , const bool* task_done , const ImageSensor& sensor )
+{
+    const string tmp_filename = filename + ".tmp";
+    std::ofstream file( tmp_filename.c_str() , std::ios::binary | std::ios::trunc );
+    if( !file )
+        return false;
+
+    file.write( CHECKPOINT_MAGIC , sizeof( CHECKPOINT_MAGIC ) );
+    file.write( (const char*)&CHECKPOINT_VERSION , sizeof( CHECKPOINT_VERSION ) );
+    file.write( (const char*)&header , sizeof( header ) );
+
+    // the flags are copied before the pixels, a tile finished in between is simply rendered again
+    std::vector<char> done( header.taskNum , 0 );
+    if( task_done )
+    {
+        for( unsigned i = 0 ; i < header.taskNum ; ++i )
+            done[i] = task_done[i];
+    }
+    file.write( done.data() , done.size() );
+
+    file.write( (const char*)&m_threadNum , sizeof( m_threadNum ) );
+    for( unsigned i = 0 ; i < m_threadNum ; ++i )
+    {
+        std::lock_guard<std::mutex> lock( m_mutex[i] );
+        file.write( (const char*)&m_randomStates[ i * SORT_RAND_STATE_SIZE ] , SORT_RAND_STATE_SIZE * sizeof( unsigned ) );
+    }
+
+    sensor.SaveState( file , task_done );
+
+    file.close();
+    if( !file )
+        return false;
+
+    // replace the old checkpoint
+    std::remove( filename.c_str() );
+    return std::rename( tmp_filename.c_str() , filename.c_str() ) == 0;
+}
+
+bool Checkpoint::Load( const string& filename , CheckpointHeader& header , bool* task_done , ImageSensor& sensor )
+{
+    std::ifstream file( filename.c_str() , std::ios::binary );
+    if( !file )
+        return false;
+
+    char magic[sizeof( CHECKPOINT_MAGIC )];
+    unsigned version = 0;
+    CheckpointHeader saved;
+    file.read( magic , sizeof( magic ) );
+    file.read( (char*)&version , sizeof( version ) );
+    file.read( (char*)&saved , sizeof( saved ) );
+    if( !file || memcmp( magic , CHECKPOINT_MAGIC , sizeof( magic ) ) != 0 || version != CHECKPOINT_VERSION )
+        return false;
+
+    if( saved.width != header.width || saved.height != header.height || saved.samplePerPixel != header.samplePerPixel ||
+        saved.taskNum != header.taskNum || saved.progressive != header.progressive )
+        return false;
+
+    std::vector<char> done( saved.taskNum , 0 );
+    file.read( done.data() , done.size() );
+
+    // random states are only restored for threads existing in both renderings
+    unsigned thread_num = 0;
+    file.read( (char*)&thread_num , sizeof( thread_num ) );
+    std::vector<unsigned> states( thread_num * SORT_RAND_STATE_SIZE );
+    file.read( (char*)states.data() , states.size() * sizeof( unsigned ) );
+    if( !file || !sensor.LoadState( file ) )
+        return false;
+
+    for( unsigned i = 0 ; i < saved.taskNum ; ++i )
+        task_done[i] = ( done[i] != 0 );
+    for( unsigned i = 0 ; i < std::min( thread_num , m_threadNum ) ; ++i )
+        std::copy( states.begin() + i * SORT_RAND_STATE_SIZE , states.begin() + ( i + 1 ) * SORT_RAND_STATE_SIZE , m_randomStates.begin() + i * SORT_RAND_STATE_SIZE );
+    header.passDone = saved.passDone;
+    return true;
+}
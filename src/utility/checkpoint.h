@@ -0,0 +1,88 @@
+/*
+    This file is a part of SORT(Simple Open Ray Tracing), an open-source cross
+    platform physically based renderer.
+ 
+    Copyright (c) 2011-2016 by Cao Jiayin - All rights reserved.
+ 
+    SORT is a free software written for educational purpose. Anyone can distribute
+    or modify it under the the terms of the GNU General Public License Version 3 as
+    published by the Free Software Foundation. However, there is NO warranty that
+    all components are functional in a perfect manner. Without even the implied
+    warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License along with
+    this program. If not, see <http://www.gnu.org/licenses/gpl-3.0.html>.
+ */
+
+#pragma once
+
+#include "sort.h"
+#include "utility/singleton.h"
+#include <vector>
+#include <mutex>
+#include <memory>
+
+class ImageSensor;
+
+//! @brief Setup of the rendering saved in a checkpoint.
+/**
+ * A checkpoint is only resumed if its setup matches the current one.
+ */
+struct CheckpointHeader
+{
+    unsigned    width = 0;              /**< Width of the image. */
+    unsigned    height = 0;             /**< Height of the image. */
+    unsigned    samplePerPixel = 0;     /**< Number of samples per pixel in a pass. */
+    unsigned    taskNum = 0;            /**< Number of tiles. */
+    unsigned    progressive = 0;        /**< Whether progressive rendering is enabled. */
+    unsigned    passDone = 0;           /**< Number of finished passes in progressive rendering. */
+};
+
+//! @brief Periodic snapshot of the rendering state so that a crashed rendering could be resumed.
+/**
+ * A checkpoint holds the radiance accumulated in the image sensor, the statistics of adaptive
+ * sampling, the list of finished tiles and the state of the random number generator of every
+ * render thread. Render threads capture their random state once they finish some rows, the
+ * main thread writes everything to a binary file while the threads keep rendering. The file is
+ * written to a temporary file first and renamed, a crash while saving never corrupts the last
+ * checkpoint.
+ */
+class Checkpoint : public Singleton<Checkpoint>
+{
+public:
+    //! @brief Reset the random states of all threads.
+    //! @param thread_num   Number of render threads.
+    void Reset( unsigned thread_num );
+
+    //! @brief Capture the random state of the calling render thread.
+    void CaptureRandomState();
+
+    //! @brief Restore the random state of the calling render thread from the loaded checkpoint.
+    void RestoreRandomState();
+
+    //! @brief Write a checkpoint.
+    //! @param filename     Name of the checkpoint file.
+    //! @param header       Setup of the rendering.
+    //! @param task_done    Whether each tile is finished, only pixels of finished tiles are saved. It is null
+    //!                     between passes of progressive rendering, all pixels are saved and all tiles are unfinished.
+    //! @param sensor       Image sensor holding the radiance.
+    //! @return             Whether the checkpoint is written.
+    bool Save( const string& filename , const CheckpointHeader& header , const bool* task_done , const ImageSensor& sensor );
+
+    //! @brief Read a checkpoint.
+    //! @param filename     Name of the checkpoint file.
+    //! @param header       Setup of the rendering, the number of finished passes is filled from the checkpoint.
+    //! @param task_done    Whether each tile is finished.
+    //! @param sensor       Image sensor to hold the radiance.
+    //! @return             Whether the checkpoint exists and matches the setup.
+    bool Load( const string& filename , CheckpointHeader& header , bool* task_done , ImageSensor& sensor );
+
+private:
+    std::vector<unsigned>           m_randomStates;     /**< Random states of all threads. */
+    std::unique_ptr<std::mutex[]>   m_mutex;            /**< Mutex protecting the random state of each thread. */
+    unsigned                        m_threadNum = 0;    /**< Number of render threads. */
+
+    Checkpoint() {}
+    friend class Singleton<Checkpoint>;
+};
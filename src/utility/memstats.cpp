@@ -0,0 +1,79 @@
+/*
+    This file is a part of SORT(Simple Open Ray Tracing), an open-source cross
+    platform physically based renderer.
+ 
+    Copyright (c) 2011-2016 by Cao Jiayin - All rights reserved.
+ 
+    SORT is a free software written for educational purpose. Anyone can distribute
+    or modify it under the the terms of the GNU General Public License Version 3 as
+    published by the Free Software Foundation. However, there is NO warranty that
+    all components are functional in a perfect manner. Without even the implied
+    warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License along with
+    this program. If not, see <http://www.gnu.org/licenses/gpl-3.0.html>.
+ */
+
+
+#include "memstats.h"
+#include "managers/logmanager.h"
+#include <fstream>
+#include <cstdio>
+
+std::atomic<size_t> MemStats::m_current[MEM_CATEGORY_NUM];
+std::atomic<size_t> MemStats::m_peak[MEM_CATEGORY_NUM];
+std::atomic<size_t> MemStats::m_total( 0 );
+std::atomic<size_t> MemStats::m_totalPeak( 0 );
+
+// names of the categories, they are used in both log and JSON
+static const char* g_MemCategoryNames[MEM_CATEGORY_NUM] = {
+    "Mesh",
+    "Texture",
+    "Bxdf Table",
+    "Accelerator",
+    "Framebuffer",
+    "Splat Buffer",
+    "Arena",
+    "Memory Block",
+};
+
+const char* MemStats::GetName( MEM_CATEGORY category )
+{
+    return g_MemCategoryNames[category];
+}
+
+void MemStats::OutputLog()
+{
+    char line[128];
+    LOG_HEADER( "Memory Usage" );
+    snprintf( line , sizeof( line ) , "%-18s%14s%14s" , "Category" , "Current(KB)" , "Peak(KB)" );
+    LOG<<line<<ENDL;
+    for( int i = 0 ; i < MEM_CATEGORY_NUM ; ++i ){
+        const MEM_CATEGORY category = (MEM_CATEGORY)i;
+        snprintf( line , sizeof( line ) , "%-18s%14u%14u" , GetName( category ) , (unsigned)( GetCurrent( category ) / 1024 ) , (unsigned)( GetPeak( category ) / 1024 ) );
+        LOG<<line<<ENDL;
+    }
+    snprintf( line , sizeof( line ) , "%-18s%14u%14u" , "Total" , (unsigned)( m_total.load( std::memory_order_relaxed ) / 1024 ) ,
+              (unsigned)( m_totalPeak.load( std::memory_order_relaxed ) / 1024 ) );
+    LOG<<line<<ENDL;
+}
+
+bool MemStats::WriteJson( const string& filename )
+{
+    std::ofstream file( filename.c_str() );
+    if( !file.is_open() )
+        return false;
+
+    // sizes are in bytes
+    file<<"{\n    \"categories\" : [\n";
+    for( int i = 0 ; i < MEM_CATEGORY_NUM ; ++i ){
+        const MEM_CATEGORY category = (MEM_CATEGORY)i;
+        file<<"        { \"name\" : \""<<GetName( category )<<"\" , \"current\" : "<<(unsigned long long)GetCurrent( category )
+            <<" , \"peak\" : "<<(unsigned long long)GetPeak( category )<<" }"<<( i + 1 < MEM_CATEGORY_NUM ? ",\n" : "\n" );
+    }
+    file<<"    ],\n";
+    file<<"    \"total\" : { \"current\" : "<<(unsigned long long)m_total.load( std::memory_order_relaxed )
+        <<" , \"peak\" : "<<(unsigned long long)m_totalPeak.load( std::memory_order_relaxed )<<" }\n}\n";
+    return (bool)file;
+}
@@ -0,0 +1,138 @@
+/*
+    This file is a part of SORT(Simple Open Ray Tracing), an open-source cross
+    platform physically based renderer.
+ 
+    Copyright (c) 2011-2016 by Cao Jiayin - All rights reserved.
+ 
+    SORT is a free software written for educational purpose. Anyone can distribute
+    or modify it under the the terms of the GNU General Public License Version 3 as
+    published by the Free Software Foundation. However, there is NO warranty that
+    all components are functional in a perfect manner. Without even the implied
+    warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License along with
+    this program. If not, see <http://www.gnu.org/licenses/gpl-3.0.html>.
+ */
+
+
+#pragma once
+
+#include "sort.h"
+#include <atomic>
+
+//! @brief Categories of memory that are accounted for.
+enum MEM_CATEGORY
+{
+    MEM_MESH = 0,       /**< Vertex and index buffers of meshes. */
+    MEM_TEXTURE,        /**< Image textures. */
+    MEM_BXDF_TABLE,     /**< Measured BRDF tables, like MERL and Fourier BSDF. */
+    MEM_ACCELERATOR,    /**< Nodes and primitive lists of spatial acceleration structures. */
+    MEM_FRAMEBUFFER,    /**< Render target and accumulation buffers of the image sensor. */
+    MEM_SPLAT,          /**< Splat buffer of the image sensor. */
+    MEM_ARENA,          /**< Chunks of the per-thread memory arenas. */
+    MEM_BLOCK,          /**< Memory blocks allocated with ids in memory manager. */
+    MEM_CATEGORY_NUM
+};
+
+//! @brief Statistics of memory usage of each category.
+/**
+ * Only big allocations are accounted for, like buffers of a whole mesh or chunks of arenas,
+ * so that the counters are touched rarely. Counters are updated with relaxed atomic operations,
+ * it is cheap enough to be always enabled. Peaks are tracked per category and for the total
+ * usage, the total peak is not the sum of the peaks of all categories.
+ */
+class MemStats
+{
+public:
+    //! @brief Account for allocated memory.
+    //! @param category     Category of the memory.
+    //! @param bytes        Size of the memory in bytes.
+    static void Allocate( MEM_CATEGORY category , size_t bytes ){
+        _updatePeak( m_peak[category] , m_current[category].fetch_add( bytes , std::memory_order_relaxed ) + bytes );
+        _updatePeak( m_totalPeak , m_total.fetch_add( bytes , std::memory_order_relaxed ) + bytes );
+    }
+
+    //! @brief Account for released memory.
+    //! @param category     Category of the memory.
+    //! @param bytes        Size of the memory in bytes, it has to be accounted for by Allocate before.
+    static void Release( MEM_CATEGORY category , size_t bytes ){
+        m_current[category].fetch_sub( bytes , std::memory_order_relaxed );
+        m_total.fetch_sub( bytes , std::memory_order_relaxed );
+    }
+
+    //! @brief Current usage of a category in bytes.
+    static size_t GetCurrent( MEM_CATEGORY category ){
+        return m_current[category].load( std::memory_order_relaxed );
+    }
+
+    //! @brief Peak usage of a category in bytes.
+    static size_t GetPeak( MEM_CATEGORY category ){
+        return m_peak[category].load( std::memory_order_relaxed );
+    }
+
+    //! @brief Name of a category.
+    static const char* GetName( MEM_CATEGORY category );
+
+    //! @brief Output the usage of all categories in log.
+    static void OutputLog();
+
+    //! @brief Write the usage of all categories in a JSON file.
+    //! @param filename     Name of the JSON file.
+    //! @return             Whether the file is written.
+    static bool WriteJson( const string& filename );
+
+private:
+    static std::atomic<size_t>  m_current[MEM_CATEGORY_NUM];    /**< Current usage of each category. */
+    static std::atomic<size_t>  m_peak[MEM_CATEGORY_NUM];       /**< Peak usage of each category. */
+    static std::atomic<size_t>  m_total;                        /**< Current usage of all categories. */
+    static std::atomic<size_t>  m_totalPeak;                    /**< Peak usage of all categories. */
+
+    //! @brief Raise a peak if the usage is higher.
+    static void _updatePeak( std::atomic<size_t>& peak , size_t usage ){
+        size_t old = peak.load( std::memory_order_relaxed );
+        while( usage > old && !peak.compare_exchange_weak( old , usage , std::memory_order_relaxed ) );
+    }
+};
+
+//! @brief Memory accounted for by an object.
+/**
+ * The memory is released from the statistics once the object is destroyed, so that an object
+ * owning some buffers only needs to report the allocation.
+ */
+class MemAccount
+{
+public:
+    //! @brief Constructor.
+    //! @param category     Category of the memory.
+    MemAccount( MEM_CATEGORY category ) : m_category( category ) {}
+
+    //! @brief Destructor, the accounted memory is released.
+    ~MemAccount(){
+        Release();
+    }
+
+    //! @brief Account for allocated memory.
+    void Allocate( size_t bytes ){
+        m_bytes += bytes;
+        MemStats::Allocate( m_category , bytes );
+    }
+
+    //! @brief Release all memory accounted for so far.
+    void Release(){
+        MemStats::Release( m_category , m_bytes );
+        m_bytes = 0;
+    }
+
+    //! @brief Number of bytes accounted for.
+    size_t GetBytes() const{
+        return m_bytes;
+    }
+
+private:
+    const MEM_CATEGORY  m_category;     /**< Category of the memory. */
+    size_t              m_bytes = 0;    /**< Number of bytes accounted for. */
+
+    MemAccount( const MemAccount& ) = delete;
+    MemAccount& operator=( const MemAccount& ) = delete;
+};
@@ -0,0 +1,112 @@
+/*
+    This file is a part of SORT(Simple Open Ray Tracing), an open-source cross
+    platform physically based renderer.
+ 
+    Copyright (c) 2011-2016 by Cao Jiayin - All rights reserved.
+ 
+    SORT is a free software written for educational purpose. Anyone can distribute
+    or modify it under the the terms of the GNU General Public License Version 3 as
+    published by the Free Software Foundation. However, there is NO warranty that
+    all components are functional in a perfect manner. Without even the implied
+    warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License along with
+    this program. If not, see <http://www.gnu.org/licenses/gpl-3.0.html>.
+ */
+
+#pragma once
+
+#include "sort.h"
+#include <atomic>
+#include <memory>
+
+//! @brief Lock-free bounded ring buffer with multiple producers and a single consumer.
+/**
+ * This is a simplified version of Dmitry Vyukov's bounded MPMC queue. Each slot carries a
+ * sequence number telling whether it is ready to be written or read, producers claim slots
+ * by advancing the tail with a CAS and the consumer reads them in order. Like the work
+ * stealing deque, it only holds indices and never allocates memory once it is created.
+ * Everything written by a producer before pushing an element is visible to the consumer
+ * once it pops the element.
+ */
+class CompletionRing
+{
+public:
+    //! @brief Constructor.
+    //! @param capacity     Maximum number of elements in the ring, it is rounded up to power of two.
+    CompletionRing( unsigned capacity = 1 ){
+        Reset( capacity );
+    }
+
+    //! @brief Drop all elements and resize the ring. No other thread is allowed to access the ring meanwhile.
+    //! @param capacity     Maximum number of elements in the ring, it is rounded up to power of two.
+    void Reset( unsigned capacity ){
+        m_capacity = 1;
+        while( m_capacity < capacity )
+            m_capacity <<= 1;
+        m_mask = m_capacity - 1;
+        m_slots.reset( new Slot[m_capacity] );
+        for( unsigned i = 0 ; i < m_capacity ; ++i )
+            m_slots[i].sequence.store( i , std::memory_order_relaxed );
+        m_head.store( 0 , std::memory_order_relaxed );
+        m_tail.store( 0 , std::memory_order_relaxed );
+    }
+
+    //! @brief Push an element at the tail of the ring. Any thread could call it.
+    //! @param v    The element to be pushed.
+    //! @return     False will be returned if the ring is full.
+    bool Push( unsigned v ){
+        unsigned pos = m_tail.load( std::memory_order_relaxed );
+        while( true ){
+            Slot& slot = m_slots[pos & m_mask];
+            const unsigned seq = slot.sequence.load( std::memory_order_acquire );
+            const int diff = (int)( seq - pos );
+            if( diff == 0 ){
+                // the slot is free, try to claim it
+                if( m_tail.compare_exchange_weak( pos , pos + 1 , std::memory_order_relaxed ) ){
+                    slot.value = v;
+                    slot.sequence.store( pos + 1 , std::memory_order_release );
+                    return true;
+                }
+            }else if( diff < 0 ){
+                // the consumer hasn't read the slot yet
+                return false;
+            }else{
+                // another producer took the slot first, try again
+                pos = m_tail.load( std::memory_order_relaxed );
+            }
+        }
+    }
+
+    //! @brief Pop an element from the head of the ring. Only the consumer thread could call it.
+    //! @param v    The popped element.
+    //! @return     False will be returned if the ring is empty.
+    bool Pop( unsigned& v ){
+        const unsigned pos = m_head.load( std::memory_order_relaxed );
+        Slot& slot = m_slots[pos & m_mask];
+        if( slot.sequence.load( std::memory_order_acquire ) != pos + 1 )
+            return false;
+        v = slot.value;
+        slot.sequence.store( pos + m_capacity , std::memory_order_release );
+        m_head.store( pos + 1 , std::memory_order_relaxed );
+        return true;
+    }
+
+private:
+    struct Slot
+    {
+        std::atomic<unsigned>   sequence;   /**< Sequence number of the slot. */
+        unsigned                value;      /**< The element. */
+    };
+
+    // head and tail are put in different cache lines to avoid false sharing between the consumer and producers
+    std::atomic<unsigned>   m_head = { 0 };
+    char                    m_padding0[64];
+    std::atomic<unsigned>   m_tail = { 0 };
+    char                    m_padding1[64];
+
+    std::unique_ptr<Slot[]> m_slots;
+    unsigned                m_capacity;
+    unsigned                m_mask;
+};
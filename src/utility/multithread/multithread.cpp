@@ -20,58 +20,358 @@
 #include "sampler/sampler.h"
 #include "camera/camera.h"
 #include "imagesensor/imagesensor.h"
+#include "imagesensor/aov.h"
+#include "geometry/scene.h"
+#include "geometry/intersection.h"
+#include "threadpool.h"
+#include "utility/sassert.h"
+#include <algorithm>
 
 // instance the singleton with tex manager
-DEFINE_SINGLETON(RenderTaskQueue);
+DEFINE_SINGLETON(RenderTaskScheduler);
 
-extern int g_iTileSize;
+// luminance added to the mean of a pixel when its relative error is evaluated, so that dark pixels don't take all the samples
+static const float ADAPTIVE_MIN_LUMINANCE = 0.01f;
 
-// execute the task
-void RenderTask::Execute( Integrator* integrator )
+// execute part of the task
+void RenderTask::Execute( Integrator* integrator , PixelSample* pixelSamples , int rowBegin , int rowEnd )
 {
     ImageSensor* is = camera->GetImageSensor();
     if( !is )
         return;
     
-    // request samples
-    integrator->RequestSample( sampler , pixelSamples , samplePerPixel );
-    
 	Vector2i rb = ori + size;
+
+    // samples are splatted on the film tile of the calling thread if there is a pixel filter
+    Film* film = is->GetFilm();
+    FilmTile* film_tile = film ? film->GetTile( ThreadId() , taskId , ori.x , ori.y , size.x , size.y ) : nullptr;
+
+    // auxiliary values are only collected if AOVs are enabled
+    AovBuffer* aov = is->GetAov();
+    AovSample aov_sample;
     
-    unsigned tid = ThreadId();
-    for( int i = ori.y ; i < rb.y ; i++ )
+    // the arena of the calling thread, it is reset after each pixel
+    MemArena& arena = MemManager::GetSingleton().GetArena();
+    for( int i = rowBegin ; i < rowEnd ; i++ )
     {
         for( int j = ori.x ; j < rb.x ; j++ )
         {
             // clear managed memory after each pixel
-            MemManager::GetSingleton().ClearMem(tid);
+            arena.Reset();
             
             // generate samples to be used later
             integrator->GenerateSample( sampler , pixelSamples, samplePerPixel , scene );
             
             // the radiance
             Spectrum radiance;
+            // running mean and sum of squared differences of the luminance of the samples
+            unsigned count = 0;
+            float mean = 0.0f , m2 = 0.0f;
+            // sum of auxiliary values, luminance and squared luminance of the samples
+            AovSample aov_sum;
+            float aov_lum = 0.0f , aov_lum2 = 0.0f;
 
-            for( unsigned k = 0 ; k < samplePerPixel ; ++k )
+            while( true )
             {
-                // generate rays
-                Ray r = camera->GenerateRay( (float)j , (float)i , pixelSamples[k] );
-                // accumulate the radiance
-                radiance += integrator->Li( r , pixelSamples[k] );
+                for( unsigned k = 0 ; k < samplePerPixel ; ++k )
+                {
+                    // generate rays
+                    Ray r = camera->GenerateRay( (float)j , (float)i , pixelSamples[k] );
+                    // accumulate the radiance
+                    if( aov )
+                    {
+                        aov_sample = AovSample();
+                        pixelSamples[k].aov = &aov_sample;
+                    }
+                    Spectrum li = integrator->Li( r , pixelSamples[k] );
+                    radiance += li;
+
+                    if( aov )
+                    {
+                        // values of the first hit are evaluated here if the integrator doesn't publish them
+                        if( !aov_sample.hitPublished )
+                        {
+                            Intersection inter;
+                            aov_sample.SetFirstHit( scene.GetIntersect( r , &inter ) ? &inter : nullptr , -r.m_Dir );
+                        }
+                        pixelSamples[k].aov = nullptr;
+                        aov_sum.Accumulate( aov_sample );
+                        aov_lum += li.GetIntensity();
+                        aov_lum2 += li.GetIntensity() * li.GetIntensity();
+                    }
+                    if( film_tile )
+                        film_tile->AddSample( (float)j + pixelSamples[k].img_u , (float)i + pixelSamples[k].img_v , li );
+
+                    const float delta = li.GetIntensity() - mean;
+                    mean += delta / (float)(++count);
+                    m2 += delta * ( li.GetIntensity() - mean );
+                }
+
+                // take another round of samples only if the relative error of the pixel is still too high
+                if( count + samplePerPixel > maxSamplePerPixel )
+                    break;
+                if( count > 1 && sqrt( m2 / (float)( count * ( count - 1 ) ) ) <= adaptiveThreshold * ( mean + ADAPTIVE_MIN_LUMINANCE ) )
+                    break;
+
+                arena.Reset();
+                integrator->GenerateSample( sampler , pixelSamples, samplePerPixel , scene );
             }
-            radiance /= (float)samplePerPixel;
+            radiance /= (float)count;
+
+            if( is->IsAdaptive() )
+                is->StorePixelStatistics( j , i , ( count > 1 ) ? m2 / (float)( count * ( count - 1 ) ) : 0.0f , count );
+            if( aov )
+                aov->AddPixel( j , i , aov_sum , aov_lum , aov_lum2 , count );
+
+            // the film tile already holds all samples of the pixel
+            if( film_tile )
+                continue;
             
-            // store the pixel
-            is->StorePixel( j , i , radiance , *this );
+            // store the pixel, it is accumulated with the other passes in progressive rendering
+            if( is->IsProgressive() )
+                is->AccumulatePixel( j , i , radiance );
+            else
+                is->StorePixel( j , i , radiance , *this );
         }
     }
-    
-	if( integrator->NeedRefreshTile() )
-	{
-		int x_off = ori.x / g_iTileSize;
-		int y_off = (is->GetHeight() - 1 - ori.y ) / g_iTileSize ;
-		is->FinishTile( x_off, y_off, *this );
-	}
-    
-    taskDone[taskId] = true;
+}
+
+// reset the scheduler
+void RenderTaskScheduler::Reset( unsigned thread_num , unsigned task_num )
+{
+    m_tasks.clear();
+    m_tasks.reserve( task_num );
+
+    // every deque should be able to hold all tasks in case there is only one thread
+    m_queues.clear();
+    for( unsigned i = 0 ; i < thread_num ; ++i )
+        m_queues.push_back( std::unique_ptr<WorkStealingQueue>( new WorkStealingQueue( task_num ) ) );
+
+    m_threadNodes.clear();
+    for( unsigned i = 0 ; i < thread_num ; ++i )
+        m_threadNodes.push_back( ThreadPool::GetSingleton().GetWorkerNode( i ) );
+
+    m_states.reset( new TaskState[task_num] );
+    m_current.assign( thread_num , -1 );
+    m_completionRing.Reset( task_num );
+
+    m_stolen = 0;
+    m_stolenRemote = 0;
+    m_shared = 0;
+    m_totalCost = 0;
+    m_totalRows = 0;
+    m_firstIdleTime = -1;
+    m_lastFinishTime = 0;
+}
+
+// deal the tasks to the deques of the threads
+void RenderTaskScheduler::DistributeTasks( const bool* taskDone )
+{
+    const unsigned thread_num = (unsigned)m_queues.size();
+    const unsigned task_num = (unsigned)m_tasks.size();
+    if( thread_num == 0 || task_num == 0 )
+        return;
+
+    for( unsigned i = 0 ; i < task_num ; ++i ){
+        TaskState& state = m_states[i];
+        state.nextRow = 0;
+        state.rowsLeft = m_tasks[i].size.y;
+        state.cost = 0;
+        state.inFlight = false;
+        state.shared = false;
+    }
+    for( auto& queue : m_queues )
+        queue->Clear();
+    m_current.assign( thread_num , -1 );
+    m_aborted = false;
+    m_completed = 0;
+    m_startTime = std::chrono::steady_clock::now();
+
+    // group the threads by their NUMA nodes
+    std::vector<unsigned> nodes( m_threadNodes );
+    std::sort( nodes.begin() , nodes.end() );
+    nodes.erase( std::unique( nodes.begin() , nodes.end() ) , nodes.end() );
+    std::vector<std::vector<unsigned>> node_threads( nodes.size() );
+    for( unsigned i = 0 ; i < thread_num ; ++i )
+        node_threads[ std::lower_bound( nodes.begin() , nodes.end() , m_threadNodes[i] ) - nodes.begin() ].push_back( i );
+
+    // neighbouring tiles stay on one node by splitting the image into horizontal bands
+    int min_y = m_tasks[0].ori.y , max_y = m_tasks[0].ori.y;
+    for( const auto& task : m_tasks ){
+        min_y = std::min( min_y , task.ori.y );
+        max_y = std::max( max_y , task.ori.y );
+    }
+    const unsigned node_num = (unsigned)nodes.size();
+    std::vector<unsigned> task_node( task_num ) , task_order( task_num ) , node_count( node_num , 0 );
+    for( unsigned i = 0 ; i < task_num ; ++i ){
+        task_node[i] = (unsigned)( m_tasks[i].ori.y - min_y ) * node_num / (unsigned)( max_y - min_y + 1 );
+        task_order[i] = node_count[task_node[i]]++;
+    }
+
+    // Tasks are dealt in a round robin way so that all threads start from the center of the image.
+    // Since the owner pops tasks from the bottom of its deque, tasks are pushed in reversed order
+    // to keep the spiral order, thieves will steal the tasks far from the center first.
+    for( int i = (int)task_num - 1 ; i >= 0 ; --i ){
+        if( taskDone && taskDone[i] ){
+            m_completed.fetch_add( 1 , std::memory_order_relaxed );
+            continue;
+        }
+        const std::vector<unsigned>& threads = node_threads[task_node[i]];
+        m_queues[threads[task_order[i] % threads.size()]]->Push( (unsigned)i );
+    }
+}
+
+// acquire rows to render for a specific thread
+bool RenderTaskScheduler::AcquireWork( unsigned tid , RenderWork& work )
+{
+    if( IsAborted() )
+        return false;
+
+    // keep working on the current task
+    const int current = m_current[tid];
+    if( current >= 0 && _claimRow( (unsigned)current , work ) )
+        return true;
+
+    // start a new task
+    unsigned task_id;
+    while( _acquireTask( tid , task_id ) ){
+        m_current[tid] = (int)task_id;
+        m_states[task_id].inFlight.store( true , std::memory_order_release );
+        if( _claimRow( task_id , work ) )
+            return true;
+    }
+
+    long long expected = -1;
+    m_firstIdleTime.compare_exchange_strong( expected , _elapsed() );
+
+    // there is no task left, help the task in flight with the highest remaining cost
+    const unsigned total_rows = m_totalRows.load( std::memory_order_relaxed );
+    const float avg_row_cost = ( total_rows > 0 ) ? (float)m_totalCost.load( std::memory_order_relaxed ) / total_rows : 1.0f;
+    while( true ){
+        int best = -1;
+        float best_cost = 0.0f;
+        for( unsigned i = 0 ; i < (unsigned)m_tasks.size() ; ++i ){
+            const TaskState& state = m_states[i];
+            if( !state.inFlight.load( std::memory_order_acquire ) )
+                continue;
+            const int rows = m_tasks[i].size.y;
+            const int remaining = rows - state.nextRow.load( std::memory_order_relaxed );
+            if( remaining <= 0 )
+                continue;
+            const int finished = rows - state.rowsLeft.load( std::memory_order_relaxed );
+            const float row_cost = ( finished > 0 ) ? (float)state.cost.load( std::memory_order_relaxed ) / finished : avg_row_cost;
+            if( remaining * row_cost > best_cost ){
+                best_cost = remaining * row_cost;
+                best = (int)i;
+            }
+        }
+        if( best < 0 )
+            return false;
+
+        if( _claimRow( (unsigned)best , work ) ){
+            if( m_current[tid] != best && !m_states[best].shared.exchange( true ) )
+                m_shared.fetch_add( 1 , std::memory_order_relaxed );
+            m_current[tid] = best;
+            return true;
+        }
+    }
+}
+
+// report rendered rows
+bool RenderTaskScheduler::FinishWork( const RenderWork& work , unsigned cost )
+{
+    const unsigned task_id = (unsigned)( work.task - &m_tasks[0] );
+    const int rows = work.rowEnd - work.rowBegin;
+    TaskState& state = m_states[task_id];
+    state.cost.fetch_add( cost , std::memory_order_relaxed );
+    m_totalCost.fetch_add( cost , std::memory_order_relaxed );
+    m_totalRows.fetch_add( rows , std::memory_order_relaxed );
+
+    if( state.rowsLeft.fetch_sub( rows , std::memory_order_acq_rel ) != rows )
+        return false;
+
+    // the ring never overflows since a task is completed only once in a pass and the ring holds all tasks
+    m_completed.fetch_add( 1 , std::memory_order_relaxed );
+    const bool pushed = m_completionRing.Push( task_id );
+    Sort_Assert( pushed );
+    (void)pushed;
+
+    // the last task to be finished defines the end of rendering
+    const long long now = _elapsed();
+    long long last = m_lastFinishTime.load( std::memory_order_relaxed );
+    while( now > last && !m_lastFinishTime.compare_exchange_weak( last , now ) );
+    return true;
+}
+
+// get the maximum and average time spent on a task
+void RenderTaskScheduler::GetTaskCost( float& max_cost , float& avg_cost ) const
+{
+    max_cost = 0.0f;
+    avg_cost = 0.0f;
+    if( m_tasks.empty() )
+        return;
+
+    for( unsigned i = 0 ; i < (unsigned)m_tasks.size() ; ++i ){
+        const float cost = m_states[i].cost.load( std::memory_order_relaxed ) * 0.001f;
+        max_cost = std::max( max_cost , cost );
+        avg_cost += cost;
+    }
+    avg_cost /= m_tasks.size();
+}
+
+// get the time between the first thread running out of tasks and the end of rendering
+unsigned RenderTaskScheduler::GetTailLatency() const
+{
+    const long long first_idle = m_firstIdleTime.load( std::memory_order_relaxed );
+    const long long last_finish = m_lastFinishTime.load( std::memory_order_relaxed );
+    if( first_idle < 0 || last_finish < first_idle )
+        return 0;
+    return (unsigned)( ( last_finish - first_idle ) / 1000 );
+}
+
+// claim the next row of a task
+bool RenderTaskScheduler::_claimRow( unsigned task_id , RenderWork& work )
+{
+    RenderTask& task = m_tasks[task_id];
+    const int row = m_states[task_id].nextRow.fetch_add( 1 , std::memory_order_relaxed );
+    if( row >= task.size.y )
+        return false;
+
+    work.task = &task;
+    work.rowBegin = task.ori.y + row;
+    work.rowEnd = work.rowBegin + 1;
+    return true;
+}
+
+// time since the tasks are distributed
+long long RenderTaskScheduler::_elapsed() const
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now() - m_startTime ).count();
+}
+
+// take a task out of the deques
+bool RenderTaskScheduler::_acquireTask( unsigned tid , unsigned& task_id )
+{
+    // pick a task from its own deque first
+    if( m_queues[tid]->Pop( task_id ) )
+        return true;
+
+    // steal task from the threads on the same node first, the remote ones are the last resort
+    const unsigned thread_num = (unsigned)m_queues.size();
+    for( int remote = 0 ; remote < 2 ; ++remote ){
+        for( unsigned i = 1 ; i < thread_num ; ++i ){
+            const unsigned victim = ( tid + i ) % thread_num;
+            if( ( m_threadNodes[victim] != m_threadNodes[tid] ) != ( remote != 0 ) )
+                continue;
+            if( m_queues[victim]->Steal( task_id ) ){
+                m_stolen.fetch_add( 1 , std::memory_order_relaxed );
+                if( remote )
+                    m_stolenRemote.fetch_add( 1 , std::memory_order_relaxed );
+                return true;
+            }
+        }
+    }
+
+    // no task left in any deque, tasks are never pushed during rendering
+    return false;
 }
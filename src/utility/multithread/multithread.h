@@ -26,10 +26,15 @@ unsigned NumSystemCores();
 // get the thread id
 int ThreadId();
 
-#include <list>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <chrono>
 #include "utility/singleton.h"
 #include "sampler/sample.h"
 #include "math/vector2.h"
+#include "workstealingqueue.h"
+#include "completionring.h"
 
 class Integrator;
 class Scene;
@@ -47,11 +52,13 @@ public:
     
     // the task id
     unsigned		taskId = 0;
-    bool*			taskDone = nullptr;	// used to show the progress
     
-    // the pixel sample
-    PixelSample*	pixelSamples = nullptr;
+    // sample per pixel
     unsigned		samplePerPixel = 0;
+    // maximum sample per pixel with adaptive sampling, zero means adaptive sampling is disabled
+    unsigned		maxSamplePerPixel = 0;
+    // relative error of a pixel below which no more samples are taken
+    float			adaptiveThreshold = 0.0f;
     
     // the sampler
     Sampler*		sampler = nullptr;
@@ -61,49 +68,164 @@ public:
     const Scene&	scene;
     
     // constructor
-    RenderTask( Scene& sc , Sampler* samp , Camera* cam , bool* td, unsigned spp )
-    :taskDone(td),samplePerPixel(spp),sampler(samp),camera(cam),scene(sc)
+    RenderTask( Scene& sc , Sampler* samp , Camera* cam , unsigned spp )
+    :samplePerPixel(spp),sampler(samp),camera(cam),scene(sc)
     {
     }
     
-    // execute the task
-    void Execute( Integrator* integrator );
-    
-    static void DestoryRenderTask( RenderTask& rt )
-    {
-        SAFE_DELETE_ARRAY(rt.pixelSamples);
-    }
+    // execute part of the task
+    // para 'integrator'   : the integrator to evaluate radiance
+    // para 'pixelSamples' : pixel samples owned by the calling thread, there are 'samplePerPixel' of them
+    // para 'rowBegin'     : the first row to be rendered
+    // para 'rowEnd'       : one past the last row to be rendered
+    void Execute( Integrator* integrator , PixelSample* pixelSamples , int rowBegin , int rowEnd );
 };
 
-class RenderTaskQueue : public Singleton<RenderTaskQueue>
+// A range of rows in a task to be rendered by a thread
+struct RenderWork
+{
+    RenderTask*     task = nullptr;
+    int             rowBegin = 0;
+    int             rowEnd = 0;
+};
+
+// Work stealing scheduler of render tasks
+// Each thread owns a lock-free deque of task indices. Tasks are dealt to the deques in
+// the order they are pushed, a thread pops its own tasks from the bottom of its deque
+// and steals tasks from the top of the others' deques once it runs out of its own work.
+// If the threads live on different NUMA nodes, the image is split into horizontal bands,
+// one for each node, and threads steal tasks from their own node before the others.
+// Tasks are rendered row by row. Once there is no task left in any deque, an idle thread
+// joins the task in flight with the highest estimated remaining cost, which is measured by
+// the time spent on its finished rows, so that an expensive tile is split among the threads
+// instead of keeping a single thread busy at the end of a frame.
+class RenderTaskScheduler : public Singleton<RenderTaskScheduler>
 {
 // public method
 public:
-    // Add Task
-    void PushTask( RenderTask task ){
-        m_taskList.push_back(task);
+    // reset the scheduler
+    // para 'thread_num' : number of threads consuming the tasks
+    // para 'task_num'   : number of tasks to be pushed
+    void Reset( unsigned thread_num , unsigned task_num );
+
+    // Add Task, it is not allowed to push task once the tasks are distributed
+    void PushTask( const RenderTask& task ){
+        m_tasks.push_back(task);
     }
-    
-    // Pop task
-    RenderTask PopTask(){
-        RenderTask t = m_taskList.front();
-        m_taskList.pop_front();
-        return t;
+
+    // Deal the tasks to the deques of the threads, tasks left by an aborted pass are dropped
+    // para 'taskDone' : tasks already finished, they are not dealt again, all tasks are dealt if it is null
+    void DistributeTasks( const bool* taskDone = nullptr );
+
+    // Stop dealing work, threads will quit once they finish their current rows
+    void Abort(){
+        m_aborted.store( true , std::memory_order_release );
     }
-    
-    // Is the queue empty
-    bool IsEmpty() const{
-        return m_taskList.empty();
+
+    // Whether the tasks are aborted
+    bool IsAborted() const{
+        return m_aborted.load( std::memory_order_acquire );
     }
-    
+
+    // Acquire rows to render for a specific thread
+    // para 'work' : rows to be rendered
+    // result      : false if there is nothing left to render
+    bool AcquireWork( unsigned tid , RenderWork& work );
+
+    // Report rendered rows, a task is pushed into the completion ring once all of its rows are rendered
+    // para 'work' : rows that are rendered
+    // para 'cost' : time spent on the rows in microseconds
+    // result      : true if all rows of the task are rendered
+    bool FinishWork( const RenderWork& work , unsigned cost );
+
+    // Pop a completed task, only one thread is allowed to consume the completed tasks
+    // para 'task_id' : id of the completed task
+    // result         : false if no more task is completed since the last call
+    bool PopCompletedTask( unsigned& task_id ){
+        return m_completionRing.Pop( task_id );
+    }
+
+    // Get the number of completed tasks in the current pass, including the ones skipped by DistributeTasks
+    unsigned GetCompletedTaskCount() const{
+        return m_completed.load( std::memory_order_relaxed );
+    }
+
+    // Get a task
+    const RenderTask& GetTask( unsigned task_id ) const{
+        return m_tasks[task_id];
+    }
+
+    // Get the number of tasks
+    unsigned GetTaskCount() const{
+        return (unsigned)m_tasks.size();
+    }
+
+    // Get the number of stolen tasks
+    unsigned GetStolenTaskCount() const{
+        return m_stolen.load( std::memory_order_relaxed );
+    }
+
+    // Get the number of tasks stolen from threads on the other NUMA nodes
+    unsigned GetRemoteStolenTaskCount() const{
+        return m_stolenRemote.load( std::memory_order_relaxed );
+    }
+
+    // Get the number of tasks rendered by more than one thread
+    unsigned GetSharedTaskCount() const{
+        return m_shared.load( std::memory_order_relaxed );
+    }
+
+    // Get the maximum and average time spent on a task in milliseconds
+    void GetTaskCost( float& max_cost , float& avg_cost ) const;
+
+    // Get the time between the first thread running out of tasks and the end of rendering in milliseconds
+    unsigned GetTailLatency() const;
+
     // private field
 private:
-    std::list<RenderTask> m_taskList;
+    std::vector<RenderTask>                         m_tasks;
+    std::vector<std::unique_ptr<WorkStealingQueue>> m_queues;
+    std::vector<unsigned>                           m_threadNodes;
+    std::atomic<unsigned>                           m_stolen;
+    std::atomic<unsigned>                           m_stolenRemote;
+    std::atomic<unsigned>                           m_shared;
+
+    // progress of a task
+    struct TaskState
+    {
+        std::atomic<int>            nextRow;    // the next row to be rendered
+        std::atomic<int>            rowsLeft;   // number of rows not finished yet
+        std::atomic<unsigned>       cost;       // time spent on finished rows in microseconds
+        std::atomic<bool>           inFlight;   // whether the task is taken out of the deques
+        std::atomic<bool>           shared;     // whether the task is rendered by more than one thread
+    };
+    std::unique_ptr<TaskState[]>                    m_states;
+    // the task each thread is working on, -1 for none
+    std::vector<int>                                m_current;
+    // total cost and number of finished rows, used to estimate the cost of tasks just started
+    std::atomic<unsigned long long>                 m_totalCost;
+    std::atomic<unsigned>                           m_totalRows;
+    // time when the tasks are distributed, when the first thread runs out of tasks and when the last task is done
+    std::chrono::steady_clock::time_point           m_startTime;
+    std::atomic<long long>                          m_firstIdleTime;
+    std::atomic<long long>                          m_lastFinishTime;
+    // whether the tasks are aborted
+    std::atomic<bool>                               m_aborted;
+    // number of completed tasks and the ids of the completed tasks not consumed yet
+    std::atomic<unsigned>                           m_completed;
+    CompletionRing                                  m_completionRing;
+
+    // take a task out of the deques
+    bool _acquireTask( unsigned tid , unsigned& task_id );
+    // claim the next row of a task
+    bool _claimRow( unsigned task_id , RenderWork& work );
+    // time since the tasks are distributed in microseconds
+    long long _elapsed() const;
     
     // private constructor
-    RenderTaskQueue(){}
+    RenderTaskScheduler():m_stolen(0),m_stolenRemote(0),m_shared(0),m_totalCost(0),m_totalRows(0),m_firstIdleTime(-1),m_lastFinishTime(0),m_aborted(false),m_completed(0){}
     
-    friend class Singleton<RenderTaskQueue>;
+    friend class Singleton<RenderTaskScheduler>;
 };
 
 #include "stdthread.h"
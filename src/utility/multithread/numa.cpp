@@ -0,0 +1,85 @@
+/*
+    This file is a part of SORT(Simple Open Ray Tracing), an open-source cross
+    platform physically based renderer.
+ 
+    Copyright (c) 2011-2016 by Cao Jiayin - All rights reserved.
+ 
+    SORT is a free software written for educational purpose. Anyone can distribute
+    or modify it under the the terms of the GNU General Public License Version 3 as
+    published by the Free Software Foundation. However, there is NO warranty that
+    all components are functional in a perfect manner. Without even the implied
+    warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License along with
+    this program. If not, see <http://www.gnu.org/licenses/gpl-3.0.html>.
+ */
+
+#include "numa.h"
+#include "multithread.h"
+#include <fstream>
+#include <sstream>
+
+#if defined(SORT_IN_LINUX)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+DEFINE_SINGLETON(NumaTopology);
+
+// parse cpu list like '0-3,8-11'
+static std::vector<unsigned> parseCpuList( const std::string& str )
+{
+    std::vector<unsigned> cpus;
+    std::stringstream ss( str );
+    std::string range;
+    while( std::getline( ss , range , ',' ) ){
+        if( range.empty() )
+            continue;
+        const size_t dash = range.find( '-' );
+        const unsigned first = (unsigned)atoi( range.substr( 0 , dash ).c_str() );
+        const unsigned last = ( dash == std::string::npos ) ? first : (unsigned)atoi( range.substr( dash + 1 ).c_str() );
+        for( unsigned cpu = first ; cpu <= last ; ++cpu )
+            cpus.push_back( cpu );
+    }
+    return cpus;
+}
+
+NumaTopology::NumaTopology()
+{
+#if defined(SORT_IN_LINUX)
+    for( unsigned node = 0 ; ; ++node ){
+        std::ifstream file( "/sys/devices/system/node/node" + std::to_string( node ) + "/cpulist" );
+        if( !file.is_open() )
+            break;
+
+        std::string line;
+        std::getline( file , line );
+        std::vector<unsigned> cpus = parseCpuList( line );
+
+        // memory-only nodes don't run any thread
+        if( !cpus.empty() )
+            m_nodes.push_back( cpus );
+    }
+#endif
+
+    if( m_nodes.empty() ){
+        const unsigned core_num = NumSystemCores();
+        std::vector<unsigned> cpus;
+        for( unsigned cpu = 0 ; cpu < core_num || cpus.empty() ; ++cpu )
+            cpus.push_back( cpu );
+        m_nodes.push_back( cpus );
+    }
+}
+
+bool NumaTopology::PinThread( unsigned cpu )
+{
+#if defined(SORT_IN_LINUX)
+    cpu_set_t cpuset;
+    CPU_ZERO( &cpuset );
+    CPU_SET( cpu , &cpuset );
+    return 0 == pthread_setaffinity_np( pthread_self() , sizeof( cpu_set_t ) , &cpuset );
+#else
+    return false;
+#endif
+}
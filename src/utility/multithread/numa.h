@@ -0,0 +1,52 @@
+/*
+    This file is a part of SORT(Simple Open Ray Tracing), an open-source cross
+    platform physically based renderer.
+ 
+    Copyright (c) 2011-2016 by Cao Jiayin - All rights reserved.
+ 
+    SORT is a free software written for educational purpose. Anyone can distribute
+    or modify it under the the terms of the GNU General Public License Version 3 as
+    published by the Free Software Foundation. However, there is NO warranty that
+    all components are functional in a perfect manner. Without even the implied
+    warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License along with
+    this program. If not, see <http://www.gnu.org/licenses/gpl-3.0.html>.
+ */
+
+#pragma once
+
+#include "sort.h"
+#include "utility/singleton.h"
+#include <vector>
+
+//! @brief Topology of NUMA nodes in the system.
+/**
+ * The topology is read from '/sys/devices/system/node' on Linux. On the other platforms, or if
+ * the information is not available, the whole system is treated as a single node with all cores.
+ */
+class NumaTopology : public Singleton<NumaTopology>
+{
+public:
+    //! @brief Number of NUMA nodes with cpu cores.
+    unsigned GetNodeCount() const{
+        return (unsigned)m_nodes.size();
+    }
+
+    //! @brief Cpu cores belonging to a specific node.
+    const std::vector<unsigned>& GetNodeCpus( unsigned node ) const{
+        return m_nodes[node];
+    }
+
+    //! @brief Bind the calling thread to a specific cpu core.
+    //! @param cpu  Index of the cpu core.
+    //! @return     Whether the thread is bound successfully.
+    static bool PinThread( unsigned cpu );
+
+private:
+    std::vector<std::vector<unsigned>>  m_nodes;    /**< Cpu cores of each node. */
+
+    NumaTopology();
+    friend class Singleton<NumaTopology>;
+};
@@ -18,9 +18,13 @@
 #include "stdthread.h"
 
 #include "managers/memmanager.h"
+#include "multithread.h"
+#include "integrator/integrator.h"
+#include "threadpool.h"
+#include "utility/checkpoint.h"
 
-// thread id
-static Thread_Local int g_ThreadId = 0;
+// thread id, it is setup by the thread pool for worker threads
+Thread_Local int g_ThreadId = 0;
 
 // get the thread id
 int ThreadId()
@@ -34,9 +38,6 @@ unsigned NumSystemCores()
 	return std::thread::hardware_concurrency();
 }
 
-// critical section
-MutexStd g_mutex;
-
 RenderThreadStd::RenderThreadStd(unsigned tid) :m_tid(tid)
 {
 	m_finished = false;
@@ -44,10 +45,7 @@ RenderThreadStd::RenderThreadStd(unsigned tid) :m_tid(tid)
 
 void RenderThreadStd::BeginThread()
 {
-	new std::thread([this]() {
-		// setup lts
-		g_ThreadId = GetThreadID();
-
+	ThreadPool::GetSingleton().Schedule([this]() {
 		// run the thread
 		RunThread();
 
@@ -59,29 +57,45 @@ void RenderThreadStd::BeginThread()
 void RenderThreadStd::EndThread()
 {
 	// the thread is finished
-	m_finished = true;
+	m_finished.store( true , std::memory_order_release );
+
+	// notify the waiting thread
+	if( m_pLatch )
+		m_pLatch->CountDown();
 }
 
 // Run the thread
 void RenderThreadStd::RunThread()
 {
-	while (true)
+	// pixel samples are allocated only once for each thread
+	std::unique_ptr<PixelSample[]> pixelSamples;
+
+	// the job may be picked by any worker of the pool, the deque and the NUMA node used by the
+	// scheduler belong to the worker actually running it rather than the index of the render thread
+	const unsigned tid = ThreadId();
+
+	RenderTaskScheduler& scheduler = RenderTaskScheduler::GetSingleton();
+	RenderWork work;
+	while (scheduler.AcquireWork(tid, work))
 	{
-		g_mutex.Lock();
-		if (RenderTaskQueue::GetSingleton().IsEmpty())
+		RenderTask* task = work.task;
+		if (!pixelSamples)
 		{
-			g_mutex.Unlock();
-			break;
+			pixelSamples.reset(new PixelSample[task->samplePerPixel]);
+			m_pIntegrator->RequestSample(task->sampler, pixelSamples.get(), task->samplePerPixel);
 		}
-		// Get a new task from the task queue
-		RenderTask task = RenderTaskQueue::GetSingleton().PopTask();
-		g_mutex.Unlock();
 
-		// execute the task
-		task.Execute(m_pIntegrator);
+		// execute the rows and feed the time spent on them back to the scheduler
+		auto start = std::chrono::steady_clock::now();
+		task->Execute(m_pIntegrator, pixelSamples.get(), work.rowBegin, work.rowEnd);
+		auto cost = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+		// the thread finishing the last row pushes the task into the completion ring
+		scheduler.FinishWork(work, (unsigned)cost);
 
-		// Destroy the task
-		RenderTask::DestoryRenderTask(task);
+		// keep the random state for the next checkpoint
+		if (Checkpoint* checkpoint = Checkpoint::GetSingletonPtr())
+			checkpoint->CaptureRandomState();
 	}
 }
 
@@ -94,3 +108,22 @@ void MutexStd::Unlock()
 {
 	m_mutex.unlock();
 }
+
+void LatchStd::CountDown()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if( m_count > 0 && --m_count == 0 )
+		m_cond.notify_all();
+}
+
+void LatchStd::Wait()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_cond.wait( lock , [this]() { return m_count == 0; } );
+}
+
+bool LatchStd::WaitFor( unsigned ms )
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	return m_cond.wait_for( lock , std::chrono::milliseconds(ms) , [this]() { return m_count == 0; } );
+}
@@ -22,12 +22,16 @@
 
 #include <thread>
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
 
 class Integrator;
+class LatchStd;
 
 // get the thread id
 int ThreadId();
 
+// a render thread is a job running on one of the workers of the thread pool
 class RenderThreadStd
 {
 	// public method
@@ -45,8 +49,8 @@ public:
 	void RunThread();
 
 	// Whether the thread is finished
-	bool IsFinished() {
-		return m_finished;
+	bool IsFinished() const {
+		return m_finished.load( std::memory_order_acquire );
 	}
 
 	// get thread id
@@ -59,11 +63,13 @@ private:
 	// the thread id
 	unsigned m_tid;
 	// whether the thread is finished
-	bool	m_finished;
+	std::atomic<bool>	m_finished;
 
 // the rendering data
 public:
 	Integrator*	m_pIntegrator = nullptr;
+	// the latch to be signaled once the thread is finished
+	LatchStd*	m_pLatch = nullptr;
 };
 
 class MutexStd
@@ -78,7 +84,32 @@ private:
 	std::mutex	m_mutex;
 };
 
+// a single-use barrier, waiting threads are blocked until the counter reaches zero
+class LatchStd
+{
+public:
+	// constructor
+	LatchStd( unsigned count ) : m_count(count) {}
+
+	// decrease the counter and wake up the waiting threads if it reaches zero
+	void CountDown();
+
+	// block until the counter reaches zero
+	void Wait();
+
+	// block until the counter reaches zero or the time runs out
+	// para 'ms' : maximum time to wait in milliseconds
+	// result    : true if the counter reaches zero
+	bool WaitFor( unsigned ms );
+
+private:
+	unsigned				m_count;
+	std::mutex				m_mutex;
+	std::condition_variable	m_cond;
+};
+
 #define PlatformThreadUnit	RenderThreadStd
 #define PlatformMutex		MutexStd
+#define PlatformLatch		LatchStd
 
 #endif
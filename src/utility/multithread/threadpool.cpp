@@ -0,0 +1,256 @@
+/*
+    This file is a part of SORT(Simple Open Ray Tracing), an open-source cross
+    platform physically based renderer.
+ 
+    Copyright (c) 2011-2016 by Cao Jiayin - All rights reserved.
+ 
+    SORT is a free software written for educational purpose. Anyone can distribute
+    or modify it under the the terms of the GNU General Public License Version 3 as
+    published by the Free Software Foundation. However, there is NO warranty that
+    all components are functional in a perfect manner. Without even the implied
+    warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License along with
+    this program. If not, see <http://www.gnu.org/licenses/gpl-3.0.html>.
+ */
+
+#include "threadpool.h"
+#include "multithread.h"
+#include "numa.h"
+#include "utility/sassert.h"
+
+DEFINE_SINGLETON(ThreadPool);
+
+// thread id defined in stdthread.cpp
+extern Thread_Local int g_ThreadId;
+
+// whether the current thread belongs to the pool
+static Thread_Local bool g_PoolWorker = false;
+
+void JobCounter::Done()
+{
+    // the counter is only decreased with the lock held so that the waiting thread can't
+    // destroy the counter before this function returns
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if( m_count.fetch_sub( 1 , std::memory_order_acq_rel ) == 1 )
+        m_cond.notify_all();
+}
+
+bool JobCounter::WaitFor( unsigned ms )
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    return m_cond.wait_for( lock , std::chrono::milliseconds(ms) , [this]() { return IsDone(); } );
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_quit = true;
+    }
+    m_cond.notify_all();
+
+    for( auto& worker : m_workers )
+        worker.join();
+}
+
+void ThreadPool::Init( unsigned thread_num , bool numa_aware )
+{
+    if( !m_workers.empty() )
+        return;
+
+    if( thread_num == 0 )
+        thread_num = NumSystemCores();
+    if( thread_num == 0 )
+        thread_num = 1;
+
+    m_numaAware = numa_aware;
+    if( m_numaAware ){
+        // consecutive workers stay on the same node, so do the tiles they render
+        const NumaTopology& topology = NumaTopology::GetSingleton();
+        const unsigned node_num = topology.GetNodeCount();
+        for( unsigned i = 0 ; i < thread_num ; ++i ){
+            const unsigned node = i * node_num / thread_num;
+            const unsigned first = ( node * thread_num + node_num - 1 ) / node_num;
+            const std::vector<unsigned>& cpus = topology.GetNodeCpus( node );
+            m_workerNodes.push_back( node );
+            m_workerCpus.push_back( cpus[ ( i - first ) % cpus.size() ] );
+        }
+    }
+
+    m_workers.reserve( thread_num );
+    for( unsigned i = 0 ; i < thread_num ; ++i )
+        m_workers.push_back( std::thread( [this,i]() { workerLoop(i); } ) );
+}
+
+void ThreadPool::Schedule( const std::function<void()>& job , JobCounter* counter )
+{
+    if( m_workers.empty() ){
+        job();
+        if( counter )
+            counter->Done();
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if( counter )
+            m_jobs.push_back( [job,counter]() { job(); counter->Done(); } );
+        else
+            m_jobs.push_back( job );
+    }
+    m_cond.notify_one();
+}
+
+void ThreadPool::Wait( JobCounter& counter )
+{
+    if( IsWorkerThread() ){
+        // help the others instead of sleeping, the jobs we are waiting for may be pending
+        while( !counter.IsDone() ){
+            if( !runPendingJob() && counter.WaitFor( 1 ) )
+                return;
+        }
+
+        // synchronize with the last job signaling the counter
+        counter.WaitFor( 0 );
+        return;
+    }
+
+    while( !counter.WaitFor( 100 ) );
+}
+
+void ThreadPool::ParallelFor( unsigned begin , unsigned end , unsigned grain , const std::function<void(unsigned,unsigned)>& func )
+{
+    if( begin >= end )
+        return;
+
+    // split the range so that every worker gets a few chunks for load balancing
+    const unsigned total = end - begin;
+    const unsigned thread_num = (unsigned)m_workers.size();
+    unsigned chunk = ( thread_num > 1 ) ? ( total + thread_num * 4 - 1 ) / ( thread_num * 4 ) : total;
+    if( chunk < grain )
+        chunk = grain;
+    if( chunk == 0 )
+        chunk = 1;
+
+    // there is no need to bother the workers for a single chunk issued by a worker
+    if( chunk >= total && IsWorkerThread() ){
+        func( begin , end );
+        return;
+    }
+
+    JobCounter counter( ( total + chunk - 1 ) / chunk );
+    for( unsigned b = begin ; b < end ; b += chunk ){
+        const unsigned e = ( end - b > chunk ) ? b + chunk : end;
+        Schedule( [&func,b,e]() { func( b , e ); } , &counter );
+    }
+    Wait( counter );
+}
+
+void ThreadPool::RunOnEachWorker( const std::function<void(unsigned)>& func )
+{
+    Sort_Assert( !IsWorkerThread() );
+
+    const unsigned thread_num = (unsigned)m_workers.size();
+    if( thread_num == 0 ){
+        func( ThreadId() );
+        return;
+    }
+
+    // a worker can't pick another job until all jobs are picked, so every worker gets exactly one
+    JobCounter arrived( thread_num );
+    JobCounter counter( thread_num );
+    for( unsigned i = 0 ; i < thread_num ; ++i ){
+        Schedule( [&]() {
+            arrived.Done();
+            while( !arrived.WaitFor( 100 ) );
+            func( ThreadId() );
+        } , &counter );
+    }
+    Wait( counter );
+}
+
+bool ThreadPool::IsWorkerThread()
+{
+    return g_PoolWorker;
+}
+
+void ThreadPool::workerLoop( unsigned tid )
+{
+    // setup lts
+    g_ThreadId = tid;
+    g_PoolWorker = true;
+
+    if( m_numaAware )
+        NumaTopology::PinThread( m_workerCpus[tid] );
+
+    while( true ){
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait( lock , [this]() { return m_quit || !m_jobs.empty(); } );
+            if( m_jobs.empty() )
+                return;
+            job = std::move( m_jobs.front() );
+            m_jobs.pop_front();
+        }
+        job();
+    }
+}
+
+bool ThreadPool::runPendingJob()
+{
+    std::function<void()> job;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if( m_jobs.empty() )
+            return false;
+        job = std::move( m_jobs.front() );
+        m_jobs.pop_front();
+    }
+    job();
+    return true;
+}
+
+TaskGraph::TaskId TaskGraph::AddTask( const std::function<void()>& func )
+{
+    std::unique_ptr<Task> task( new Task() );
+    task->func = func;
+    m_tasks.push_back( std::move( task ) );
+    return (TaskId)( m_tasks.size() - 1 );
+}
+
+void TaskGraph::AddDependency( TaskId before , TaskId after )
+{
+    m_tasks[before]->successors.push_back( after );
+    ++m_tasks[after]->dependencies;
+}
+
+void TaskGraph::Execute()
+{
+    for( auto& task : m_tasks )
+        task->pending.store( task->dependencies , std::memory_order_relaxed );
+
+    JobCounter counter( (unsigned)m_tasks.size() );
+    for( TaskId i = 0 ; i < (TaskId)m_tasks.size() ; ++i ){
+        if( m_tasks[i]->dependencies == 0 )
+            scheduleTask( i , counter );
+    }
+    ThreadPool::GetSingleton().Wait( counter );
+}
+
+void TaskGraph::scheduleTask( TaskId id , JobCounter& counter )
+{
+    ThreadPool::GetSingleton().Schedule( [this,id,&counter]() {
+        Task* task = m_tasks[id].get();
+        task->func();
+
+        // release the tasks depending on this one before the counter is signaled
+        for( auto successor : task->successors ){
+            if( m_tasks[successor]->pending.fetch_sub( 1 , std::memory_order_acq_rel ) == 1 )
+                scheduleTask( successor , counter );
+        }
+        counter.Done();
+    } );
+}
@@ -0,0 +1,173 @@
+/*
+    This file is a part of SORT(Simple Open Ray Tracing), an open-source cross
+    platform physically based renderer.
+ 
+    Copyright (c) 2011-2016 by Cao Jiayin - All rights reserved.
+ 
+    SORT is a free software written for educational purpose. Anyone can distribute
+    or modify it under the the terms of the GNU General Public License Version 3 as
+    published by the Free Software Foundation. However, there is NO warranty that
+    all components are functional in a perfect manner. Without even the implied
+    warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License along with
+    this program. If not, see <http://www.gnu.org/licenses/gpl-3.0.html>.
+ */
+
+#pragma once
+
+#include "sort.h"
+#include "utility/singleton.h"
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <vector>
+#include <memory>
+
+//! @brief Counter of unfinished jobs that a thread could wait for.
+class JobCounter
+{
+public:
+    //! @brief Constructor.
+    //! @param count    Number of jobs to wait for.
+    JobCounter( unsigned count = 0 ) : m_count(count) {}
+
+    //! @brief Mark one job as finished, waiting threads are waken up once all jobs are done.
+    void Done();
+
+    //! @brief Whether all jobs are done.
+    bool IsDone() const{
+        return m_count.load( std::memory_order_acquire ) == 0;
+    }
+
+    //! @brief Block until all jobs are done or the time runs out.
+    //! @param ms   Maximum time to wait in milliseconds.
+    //! @return     Whether all jobs are done.
+    bool WaitFor( unsigned ms );
+
+private:
+    std::atomic<unsigned>   m_count;
+    std::mutex              m_mutex;
+    std::condition_variable m_cond;
+};
+
+//! @brief Persistent pool of worker threads.
+/**
+ * Worker threads are created only once and they are shared by scene loading, acceleration
+ * structure construction, pre-processing of integrators and rendering. Thread id of a worker
+ * thread is its index in the pool so that per-thread resources, like the deques of the tile
+ * scheduler, keep working the same way as they did with dedicated render threads.
+ * A worker waiting for other jobs keeps executing pending jobs instead of sleeping, this
+ * makes it safe to issue nested ParallelFor or TaskGraph inside a job. The main thread never
+ * executes jobs, it only sleeps until the jobs are done.
+ */
+class ThreadPool : public Singleton<ThreadPool>
+{
+public:
+    //! @brief Destructor, all worker threads are joined.
+    ~ThreadPool();
+
+    //! @brief Spawn worker threads, it is only allowed to be called once.
+    //! @param thread_num   Number of worker threads, number of cpu cores is used if it is zero.
+    //! @param numa_aware   Pin workers to cpu cores, workers are distributed among NUMA nodes in contiguous blocks.
+    void Init( unsigned thread_num , bool numa_aware = false );
+
+    //! @brief Number of worker threads in the pool.
+    unsigned GetThreadNum() const{
+        return (unsigned)m_workers.size();
+    }
+
+    //! @brief Whether workers are pinned to cpu cores of specific NUMA nodes.
+    bool IsNumaAware() const{
+        return m_numaAware;
+    }
+
+    //! @brief NUMA node of a worker, it is always zero if the pool is not NUMA aware.
+    unsigned GetWorkerNode( unsigned tid ) const{
+        return m_workerNodes.empty() ? 0 : m_workerNodes[tid];
+    }
+
+    //! @brief Schedule a job, the job will be executed asynchronously by one of the workers.
+    //! If there is no worker in the pool, the job is executed immediately by the calling thread.
+    //! @param job      The job to be executed.
+    //! @param counter  Optional counter to be signaled once the job is done.
+    void Schedule( const std::function<void()>& job , JobCounter* counter = nullptr );
+
+    //! @brief Wait until all jobs tracked by the counter are done.
+    void Wait( JobCounter& counter );
+
+    //! @brief Execute a function exactly once on every worker and wait for them.
+    //! It is only allowed to be called by the main thread while the pool is idle, this is
+    //! useful to setup per-thread resources on the thread owning them.
+    //! @param func     Function to be executed, thread id of the worker is passed in.
+    void RunOnEachWorker( const std::function<void(unsigned)>& func );
+
+    //! @brief Run a function on all sub-ranges of [begin,end) in parallel and wait for them.
+    //! @param begin    First index of the range.
+    //! @param end      One past the last index of the range.
+    //! @param grain    Minimum number of indices processed in a single job.
+    //! @param func     Function to be executed on each sub-range [b,e).
+    void ParallelFor( unsigned begin , unsigned end , unsigned grain , const std::function<void(unsigned,unsigned)>& func );
+
+    //! @brief Whether the calling thread is a worker thread of the pool.
+    static bool IsWorkerThread();
+
+private:
+    std::vector<std::thread>            m_workers;      /**< Worker threads. */
+    std::deque<std::function<void()>>   m_jobs;         /**< Pending jobs. */
+    std::mutex                          m_mutex;        /**< Mutex protecting the pending jobs. */
+    std::condition_variable             m_cond;         /**< Signaled when a job is pushed or the pool quits. */
+    bool                                m_quit = false; /**< Whether the workers should quit. */
+    bool                                m_numaAware = false;    /**< Whether workers are pinned. */
+    std::vector<unsigned>               m_workerNodes;  /**< NUMA node of each worker. */
+    std::vector<unsigned>               m_workerCpus;   /**< Cpu core of each worker. */
+
+    //! @brief Main loop of the worker threads.
+    void workerLoop( unsigned tid );
+
+    //! @brief Execute one pending job if there is any.
+    //! @return Whether a job is executed.
+    bool runPendingJob();
+
+    ThreadPool() {}
+    friend class Singleton<ThreadPool>;
+};
+
+//! @brief A directed acyclic graph of tasks executed on the thread pool.
+/**
+ * A task is scheduled as soon as all of its dependencies are finished, independent tasks
+ * are executed in parallel.
+ */
+class TaskGraph
+{
+public:
+    typedef unsigned TaskId;
+
+    //! @brief Add a task in the graph.
+    //! @param func     Function to be executed.
+    //! @return         Id of the task.
+    TaskId AddTask( const std::function<void()>& func );
+
+    //! @brief Make sure task 'after' is not executed until task 'before' is finished.
+    void AddDependency( TaskId before , TaskId after );
+
+    //! @brief Execute all tasks in the graph and wait for them to be finished.
+    void Execute();
+
+private:
+    struct Task
+    {
+        std::function<void()>   func;                   /**< Function of the task. */
+        std::vector<TaskId>     successors;             /**< Tasks depending on this one. */
+        unsigned                dependencies = 0;       /**< Number of tasks this one depends on. */
+        std::atomic<unsigned>   pending;                /**< Number of unfinished dependencies. */
+    };
+    std::vector<std::unique_ptr<Task>>  m_tasks;
+
+    //! @brief Schedule a task whose dependencies are all finished.
+    void scheduleTask( TaskId id , JobCounter& counter );
+};
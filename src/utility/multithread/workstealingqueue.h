@@ -0,0 +1,127 @@
+/*
+    This file is a part of SORT(Simple Open Ray Tracing), an open-source cross
+    platform physically based renderer.
+ 
+    Copyright (c) 2011-2016 by Cao Jiayin - All rights reserved.
+ 
+    SORT is a free software written for educational purpose. Anyone can distribute
+    or modify it under the the terms of the GNU General Public License Version 3 as
+    published by the Free Software Foundation. However, there is NO warranty that
+    all components are functional in a perfect manner. Without even the implied
+    warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License along with
+    this program. If not, see <http://www.gnu.org/licenses/gpl-3.0.html>.
+ */
+
+#pragma once
+
+#include "sort.h"
+#include <atomic>
+#include <memory>
+
+//! @brief Lock-free work stealing deque.
+/**
+ * This is a fixed capacity version of the Chase-Lev deque. Please refer to this paper
+ * <a href="http://www.di.ens.fr/~zappa/readings/ppopp13.pdf">Correct and Efficient
+ * Work-Stealing for Weak Memory Models</a> for further details.
+ * Only the owner thread is allowed to push and pop at the bottom of the deque, while
+ * any other thread can steal elements from the top of it without taking any lock.
+ * The deque only holds indices, the real tasks are stored somewhere else so that there
+ * is no heap allocation at all once the deque is created.
+ */
+class WorkStealingQueue
+{
+public:
+    //! @brief Constructor.
+    //! @param capacity     Maximum number of elements in the deque, it is rounded up to power of two.
+    WorkStealingQueue( unsigned capacity ){
+        m_capacity = 1;
+        while( m_capacity < capacity )
+            m_capacity <<= 1;
+        m_mask = m_capacity - 1;
+        m_buffer.reset( new std::atomic<unsigned>[m_capacity] );
+    }
+
+    //! @brief Push an element at the bottom of the deque. Only the owner thread could call it.
+    //! @param v    The element to be pushed.
+    //! @return     False will be returned if the deque is full.
+    bool Push( unsigned v ){
+        const int b = m_bottom.load( std::memory_order_relaxed );
+        const int t = m_top.load( std::memory_order_acquire );
+        if( b - t >= (int)m_capacity )
+            return false;
+        m_buffer[b & m_mask].store( v , std::memory_order_relaxed );
+        std::atomic_thread_fence( std::memory_order_release );
+        m_bottom.store( b + 1 , std::memory_order_relaxed );
+        return true;
+    }
+
+    //! @brief Pop an element from the bottom of the deque. Only the owner thread could call it.
+    //! @param v    The popped element.
+    //! @return     False will be returned if the deque is empty.
+    bool Pop( unsigned& v ){
+        const int b = m_bottom.load( std::memory_order_relaxed ) - 1;
+        m_bottom.store( b , std::memory_order_relaxed );
+        std::atomic_thread_fence( std::memory_order_seq_cst );
+        int t = m_top.load( std::memory_order_relaxed );
+
+        if( t > b ){
+            // the deque is empty
+            m_bottom.store( b + 1 , std::memory_order_relaxed );
+            return false;
+        }
+
+        v = m_buffer[b & m_mask].load( std::memory_order_relaxed );
+        if( t == b ){
+            // this is the last element, race against thieves
+            bool won = m_top.compare_exchange_strong( t , t + 1 , std::memory_order_seq_cst , std::memory_order_relaxed );
+            m_bottom.store( b + 1 , std::memory_order_relaxed );
+            return won;
+        }
+        return true;
+    }
+
+    //! @brief Steal an element from the top of the deque. Any thread could call it.
+    //! @param v    The stolen element.
+    //! @return     False will be returned if the deque is empty.
+    bool Steal( unsigned& v ){
+        while( true ){
+            int t = m_top.load( std::memory_order_acquire );
+            std::atomic_thread_fence( std::memory_order_seq_cst );
+            const int b = m_bottom.load( std::memory_order_acquire );
+            if( t >= b )
+                return false;
+
+            v = m_buffer[t & m_mask].load( std::memory_order_relaxed );
+            if( m_top.compare_exchange_strong( t , t + 1 , std::memory_order_seq_cst , std::memory_order_relaxed ) )
+                return true;
+            // another thread took the element first, try again
+        }
+    }
+
+    //! @brief Remove all elements in the deque. No other thread is allowed to access the deque meanwhile.
+    void Clear(){
+        m_top.store( 0 , std::memory_order_relaxed );
+        m_bottom.store( 0 , std::memory_order_relaxed );
+    }
+
+    //! @brief Approximate number of elements in the deque.
+    unsigned Size() const{
+        const int b = m_bottom.load( std::memory_order_relaxed );
+        const int t = m_top.load( std::memory_order_relaxed );
+        return ( b > t ) ? (unsigned)( b - t ) : 0;
+    }
+
+private:
+    // top and bottom are put in different cache lines to avoid false sharing between the owner and thieves
+    std::atomic<int>    m_top = { 0 };
+    char                m_padding0[64];
+    std::atomic<int>    m_bottom = { 0 };
+    char                m_padding1[64];
+
+    std::unique_ptr<std::atomic<unsigned>[]>  m_buffer;
+    unsigned            m_capacity;
+    unsigned            m_mask;
+};
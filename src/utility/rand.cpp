@@ -104,3 +104,24 @@ float sort_canonical()
 {
 	return (sort_rand() & 0xffffff) / float(1 << 24);
 }
+
+// save the state of the random number generator of the current thread
+void sort_save_state( unsigned* state )
+{
+	if( seed_setup == false )
+		sort_seed();
+
+	for( int i = 0 ; i < N ; ++i )
+		state[i] = (unsigned)mt[i];
+	state[N] = (unsigned)mti;
+}
+
+// load the state of the random number generator of the current thread
+void sort_load_state( const unsigned* state )
+{
+	for( int i = 0 ; i < N ; ++i )
+		mt[i] = state[i];
+	mti = (int)state[N];
+
+	seed_setup = true;
+}
@@ -33,4 +33,15 @@ unsigned	sort_rand();
 // generate a canonical random number
 float		sort_canonical();
 
+// number of words in the state of the random number generator
+const unsigned SORT_RAND_STATE_SIZE = 625;
+
+// save the state of the random number generator of the current thread
+// para 'state' : buffer of SORT_RAND_STATE_SIZE words
+void		sort_save_state( unsigned* state );
+
+// load the state of the random number generator of the current thread
+// para 'state' : buffer of SORT_RAND_STATE_SIZE words
+void		sort_load_state( const unsigned* state );
+
 #endif
@@ -24,6 +24,7 @@
 #include "texture/texture.h"
 #include <vector>
 #include "sassert.h"
+#include "utility/multithread/threadpool.h"
 
 /*
 description :
@@ -314,8 +315,12 @@ private:
 	// initialize data
 	void _init( const float* data , unsigned nu , unsigned nv )
 	{
-		for( unsigned i = 0 ; i < nv ; i++ )
-			pConditions.push_back( new Distribution1D( &data[i*nu] , nu ) );
+		// conditional distributions of rows are independent of each other
+		pConditions.resize( nv );
+		ThreadPool::GetSingleton().ParallelFor( 0 , nv , 16 , [&]( unsigned b , unsigned e ){
+			for( unsigned i = b ; i < e ; i++ )
+				pConditions[i] = new Distribution1D( &data[i*nu] , nu );
+		});
 		float* m = new float[nv];
 		for( unsigned i = 0 ; i < nv ; i++ )
 			m[i] = pConditions[i]->GetSum();
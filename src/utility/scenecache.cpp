@@ -0,0 +1,182 @@
+/*
+    This file is a part of SORT(Simple Open Ray Tracing), an open-source cross
+    platform physically based renderer.
+ 
+    Copyright (c) 2011-2016 by Cao Jiayin - All rights reserved.
+ 
+    SORT is a free software written for educational purpose. Anyone can distribute
+    or modify it under the the terms of the GNU General Public License Version 3 as
+    published by the Free Software Foundation. However, there is NO warranty that
+    all components are functional in a perfect manner. Without even the implied
+    warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License along with
+    this program. If not, see <http://www.gnu.org/licenses/gpl-3.0.html>.
+ */
+
+
+#include "scenecache.h"
+#include <cstring>
+#include <cstdio>
+
+#if defined(SORT_IN_WINDOWS)
+    #include <direct.h>
+#else
+    #include <sys/stat.h>
+#endif
+
+DEFINE_SINGLETON(SceneCache);
+
+// entries are rejected if they are written by another version of the cache
+static const char       CACHE_MAGIC[8] = { 'S' , 'O' , 'R' , 'T' , 'C' , 'A' , 'C' , 'H' };
+static const unsigned   CACHE_VERSION = 1;
+
+// primes of the hash
+static const unsigned long long HASH_PRIME1 = 11400714785074694791ULL;
+static const unsigned long long HASH_PRIME2 = 14029467366897019727ULL;
+static const unsigned long long HASH_PRIME3 = 1609587929392839161ULL;
+static const unsigned long long HASH_PRIME4 = 9650029242287828579ULL;
+static const unsigned long long HASH_PRIME5 = 2870177450012600261ULL;
+
+static inline unsigned long long _rotl( unsigned long long v , int r )
+{
+    return ( v << r ) | ( v >> ( 64 - r ) );
+}
+
+static inline unsigned long long _read64( const unsigned char* p )
+{
+    unsigned long long v;
+    memcpy( &v , p , sizeof( v ) );
+    return v;
+}
+
+static inline unsigned long long _round( unsigned long long acc , unsigned long long v )
+{
+    return _rotl( acc + v * HASH_PRIME2 , 31 ) * HASH_PRIME1;
+}
+
+unsigned long long HashMemory( const void* data , size_t size , unsigned long long seed )
+{
+    const unsigned char* p = (const unsigned char*)data;
+    const unsigned char* end = p + size;
+    unsigned long long h;
+
+    if( size >= 32 ){
+        unsigned long long v1 = seed + HASH_PRIME1 + HASH_PRIME2;
+        unsigned long long v2 = seed + HASH_PRIME2;
+        unsigned long long v3 = seed;
+        unsigned long long v4 = seed - HASH_PRIME1;
+        for( ; p + 32 <= end ; p += 32 ){
+            v1 = _round( v1 , _read64( p ) );
+            v2 = _round( v2 , _read64( p + 8 ) );
+            v3 = _round( v3 , _read64( p + 16 ) );
+            v4 = _round( v4 , _read64( p + 24 ) );
+        }
+        h = _rotl( v1 , 1 ) + _rotl( v2 , 7 ) + _rotl( v3 , 12 ) + _rotl( v4 , 18 );
+        h = ( h ^ _round( 0 , v1 ) ) * HASH_PRIME1 + HASH_PRIME4;
+        h = ( h ^ _round( 0 , v2 ) ) * HASH_PRIME1 + HASH_PRIME4;
+        h = ( h ^ _round( 0 , v3 ) ) * HASH_PRIME1 + HASH_PRIME4;
+        h = ( h ^ _round( 0 , v4 ) ) * HASH_PRIME1 + HASH_PRIME4;
+    }else
+        h = seed + HASH_PRIME5;
+    h += (unsigned long long)size;
+
+    for( ; p + 8 <= end ; p += 8 )
+        h = _rotl( h ^ _round( 0 , _read64( p ) ) , 27 ) * HASH_PRIME1 + HASH_PRIME4;
+    for( ; p < end ; ++p )
+        h = _rotl( h ^ ( *p * HASH_PRIME5 ) , 11 ) * HASH_PRIME1;
+
+    // avalanche
+    h ^= h >> 33;
+    h *= HASH_PRIME2;
+    h ^= h >> 29;
+    h *= HASH_PRIME3;
+    h ^= h >> 32;
+    return h;
+}
+
+bool CacheReader::Open( const string& filename , unsigned long long key )
+{
+    m_offset = 0;
+    if( !m_file.Open( filename ) )
+        return false;
+
+    char magic[sizeof( CACHE_MAGIC )];
+    unsigned version = 0;
+    unsigned long long entry_key = 0;
+    if( !Read( magic , sizeof( magic ) ) || !Read( &version , sizeof( version ) ) || !Read( &entry_key , sizeof( entry_key ) ) ||
+        memcmp( magic , CACHE_MAGIC , sizeof( magic ) ) != 0 || version != CACHE_VERSION || entry_key != key ){
+        m_file.Close();
+        return false;
+    }
+    return true;
+}
+
+bool CacheReader::Read( void* dst , size_t size )
+{
+    if( size > m_file.GetSize() - m_offset )
+        return false;
+    memcpy( dst , m_file.GetData() + m_offset , size );
+    m_offset += size;
+    return true;
+}
+
+bool CacheReader::ReadString( string& str )
+{
+    unsigned long long n = 0;
+    if( !Read( &n , sizeof( n ) ) || n > m_file.GetSize() - m_offset )
+        return false;
+    str.assign( m_file.GetData() + m_offset , (size_t)n );
+    m_offset += (size_t)n;
+    return true;
+}
+
+bool CacheWriter::Open( const string& filename , unsigned long long key )
+{
+    m_filename = filename;
+    m_stream.open( ( filename + ".tmp" ).c_str() , std::ios::binary | std::ios::trunc );
+    if( !m_stream )
+        return false;
+    Write( CACHE_MAGIC , sizeof( CACHE_MAGIC ) );
+    Write( &CACHE_VERSION , sizeof( CACHE_VERSION ) );
+    Write( &key , sizeof( key ) );
+    return true;
+}
+
+bool CacheWriter::Close()
+{
+    const string tmp_filename = m_filename + ".tmp";
+    m_stream.close();
+    if( !m_stream ){
+        std::remove( tmp_filename.c_str() );
+        return false;
+    }
+
+    // another run may have written the same entry meanwhile, the content is the same anyway
+    std::remove( m_filename.c_str() );
+    return std::rename( tmp_filename.c_str() , m_filename.c_str() ) == 0;
+}
+
+void SceneCache::SetDirectory( const string& dir )
+{
+    m_dir = dir;
+    if( m_dir.empty() )
+        return;
+    if( m_dir[m_dir.size() - 1] != '/' && m_dir[m_dir.size() - 1] != '\\' )
+        m_dir += '/';
+
+    // the directory may exist already
+#if defined(SORT_IN_WINDOWS)
+    _mkdir( m_dir.c_str() );
+#else
+    mkdir( m_dir.c_str() , 0755 );
+#endif
+}
+
+string SceneCache::GetEntryPath( unsigned long long key , const char* ext ) const
+{
+    char name[32];
+    snprintf( name , sizeof( name ) , "%016llx." , key );
+    return m_dir + name + ext;
+}
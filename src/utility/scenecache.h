@@ -0,0 +1,175 @@
+/*
+    This file is a part of SORT(Simple Open Ray Tracing), an open-source cross
+    platform physically based renderer.
+ 
+    Copyright (c) 2011-2016 by Cao Jiayin - All rights reserved.
+ 
+    SORT is a free software written for educational purpose. Anyone can distribute
+    or modify it under the the terms of the GNU General Public License Version 3 as
+    published by the Free Software Foundation. However, there is NO warranty that
+    all components are functional in a perfect manner. Without even the implied
+    warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+    General Public License for more details.
+ 
+    You should have received a copy of the GNU General Public License along with
+    this program. If not, see <http://www.gnu.org/licenses/gpl-3.0.html>.
+ */
+
+
+#pragma once
+
+#include "sort.h"
+#include "utility/singleton.h"
+#include "platform/mappedfile/mappedfile.h"
+#include <vector>
+#include <fstream>
+#include <atomic>
+
+//! @brief 64 bits hash of a block of memory.
+/**
+ * The hash is in the style of xxHash, four lanes consume 32 bytes per round so that hashing a
+ * mesh file is much faster than parsing it.
+ * @param data  Memory to be hashed.
+ * @param size  Size of the memory in bytes.
+ * @param seed  Seed of the hash, it is used to chain hashes of several blocks.
+ * @return      Hash of the memory.
+ */
+unsigned long long HashMemory( const void* data , size_t size , unsigned long long seed = 0 );
+
+//! @brief Reader of an entry in the scene cache.
+/**
+ * The entry is mapped in memory, values are copied straight from the mapping without any parsing.
+ * Reading past the end of the entry fails instead of crashing, so a truncated entry is simply
+ * treated as a cache miss.
+ */
+class CacheReader
+{
+public:
+    //! @brief Map an entry of the cache.
+    //! @param filename Name of the entry.
+    //! @param key      Key of the content, the entry is rejected if it was written for another key or version.
+    //! @return         Whether the entry exists and matches the key.
+    bool Open( const string& filename , unsigned long long key );
+
+    //! @brief Copy raw bytes out of the entry.
+    bool Read( void* dst , size_t size );
+
+    //! @brief Read a vector of plain values written by CacheWriter::WriteVector.
+    template< typename T >
+    bool ReadVector( std::vector<T>& v ){
+        unsigned long long n = 0;
+        if( !Read( &n , sizeof( n ) ) || n > ( m_file.GetSize() - m_offset ) / sizeof( T ) )
+            return false;
+        v.resize( (size_t)n );
+        return n == 0 || Read( v.data() , (size_t)n * sizeof( T ) );
+    }
+
+    //! @brief Read a string written by CacheWriter::WriteString.
+    bool ReadString( string& str );
+
+    //! @brief Size of the entry in bytes.
+    size_t GetSize() const { return m_file.GetSize(); }
+
+private:
+    MappedFile  m_file;             /**< Mapped entry. */
+    size_t      m_offset = 0;       /**< Offset of the next value to be read. */
+};
+
+//! @brief Writer of an entry in the scene cache.
+/**
+ * The entry is written to a temporary file and renamed once it is complete, a crash while
+ * writing never leaves a corrupted entry behind.
+ */
+class CacheWriter
+{
+public:
+    //! @brief Start writing an entry.
+    //! @param filename Name of the entry.
+    //! @param key      Key of the content.
+    //! @return         Whether the temporary file could be created.
+    bool Open( const string& filename , unsigned long long key );
+
+    //! @brief Write raw bytes.
+    void Write( const void* data , size_t size ){
+        m_stream.write( (const char*)data , size );
+    }
+
+    //! @brief Write a vector of plain values.
+    template< typename T >
+    void WriteVector( const std::vector<T>& v ){
+        const unsigned long long n = v.size();
+        Write( &n , sizeof( n ) );
+        if( n )
+            Write( v.data() , (size_t)n * sizeof( T ) );
+    }
+
+    //! @brief Write a string.
+    void WriteString( const string& str ){
+        const unsigned long long n = str.size();
+        Write( &n , sizeof( n ) );
+        Write( str.data() , str.size() );
+    }
+
+    //! @brief Finish the entry and move it in place.
+    //! @return Whether the entry is written.
+    bool Close();
+
+private:
+    std::ofstream   m_stream;       /**< Stream of the temporary file. */
+    string          m_filename;     /**< Name of the entry. */
+};
+
+//! @brief Content hashed cache of processed meshes and acceleration structures.
+/**
+ * Re-rendering the same scene spends most of its startup time on parsing mesh files, generating
+ * normals and tangents and building the acceleration structure. With the cache enabled, the
+ * results are written to binary entries named after the hash of their input, the next run maps
+ * them and copies the buffers out instead of doing the work again. Keys depend on the content of
+ * the input rather than file names or time stamps, editing a mesh or its transform simply misses
+ * the cache. Stale entries are never deleted automatically.
+ */
+class SceneCache : public Singleton<SceneCache>
+{
+public:
+    //! @brief Setup the directory of the cache, it is created if it doesn't exist.
+    //! @param dir  Directory of the cache entries, the cache is disabled if it is empty.
+    void SetDirectory( const string& dir );
+
+    //! @brief Whether the cache is enabled.
+    bool IsEnabled() const { return !m_dir.empty(); }
+
+    //! @brief Directory of the cache entries.
+    const string& GetDirectory() const { return m_dir; }
+
+    //! @brief Name of the entry holding a specific content.
+    //! @param key  Hash of the input.
+    //! @param ext  Extension of the entry, it tells different kinds of entries apart.
+    string GetEntryPath( unsigned long long key , const char* ext ) const;
+
+    //! @brief Account for an entry loaded from the cache.
+    void AddHit( size_t bytes ){
+        m_hits.fetch_add( 1 , std::memory_order_relaxed );
+        m_hitBytes.fetch_add( bytes , std::memory_order_relaxed );
+    }
+
+    //! @brief Account for an entry that has to be generated.
+    void AddMiss(){ m_misses.fetch_add( 1 , std::memory_order_relaxed ); }
+
+    //! @brief Number of entries loaded from the cache.
+    unsigned GetHits() const { return m_hits.load( std::memory_order_relaxed ); }
+
+    //! @brief Number of entries missing in the cache.
+    unsigned GetMisses() const { return m_misses.load( std::memory_order_relaxed ); }
+
+    //! @brief Number of bytes loaded from the cache.
+    unsigned long long GetHitBytes() const { return m_hitBytes.load( std::memory_order_relaxed ); }
+
+private:
+    string                          m_dir;              /**< Directory of the cache, empty if disabled. */
+    std::atomic<unsigned>           m_hits{ 0 };        /**< Number of entries loaded from the cache. */
+    std::atomic<unsigned>           m_misses{ 0 };      /**< Number of entries missing in the cache. */
+    std::atomic<unsigned long long> m_hitBytes{ 0 };    /**< Number of bytes loaded from the cache. */
+
+    SceneCache() {}
+    friend class Singleton<SceneCache>;
+};